@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "llist.h"
+#include "str.h"
 #include "istream.h"
 #include "ostream.h"
 #include "master-service.h"
@@ -47,6 +48,7 @@ anvil_connection_request(struct anvil_connection *conn,
 			 const char *const *args, const char **error_r)
 {
 	const char *cmd = args[0];
+	string_t *str;
 	unsigned int value, checksum;
 	time_t stamp;
 	pid_t pid;
@@ -83,11 +85,14 @@ anvil_connection_request(struct anvil_connection *conn,
 			*error_r = "KILL sent by a non-master connection";
 			return -1;
 		}
-		if (str_to_pid(args[0], &pid) < 0) {
-			*error_r = "KILL: Invalid pid";
-			return -1;
+		/* multiple pids can be killed with a single command */
+		for (; *args != NULL; args++) {
+			if (str_to_pid(*args, &pid) < 0) {
+				*error_r = "KILL: Invalid pid";
+				return -1;
+			}
+			connect_limit_disconnect_pid(connect_limit, pid);
 		}
-		connect_limit_disconnect_pid(connect_limit, pid);
 	} else if (strcmp(cmd, "LOOKUP") == 0) {
 		if (args[0] == NULL) {
 			*error_r = "LOOKUP: Not enough parameters";
@@ -97,9 +102,17 @@ anvil_connection_request(struct anvil_connection *conn,
 			*error_r = "LOOKUP on a FIFO, can't send reply";
 			return -1;
 		}
-		value = connect_limit_lookup(connect_limit, args[0]);
-		o_stream_nsend_str(conn->output,
-				   t_strdup_printf("%u\n", value));
+		/* multiple idents can be looked up with a single command.
+		   the reply contains their counts separated by TABs. */
+		str = t_str_new(64);
+		for (; *args != NULL; args++) {
+			if (str_len(str) > 0)
+				str_append_c(str, '\t');
+			str_printfa(str, "%u",
+				    connect_limit_lookup(connect_limit, *args));
+		}
+		str_append_c(str, '\n');
+		o_stream_nsend(conn->output, str_data(str), str_len(str));
 	} else if (strcmp(cmd, "PENALTY-GET") == 0) {
 		if (args[0] == NULL) {
 			*error_r = "PENALTY-GET: Not enough parameters";
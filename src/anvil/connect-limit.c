@@ -1,39 +1,39 @@
 /* Copyright (c) 2009-2015 Dovecot authors, see the included COPYING file */
 
 #include "common.h"
-#include "hash.h"
+#include "array.h"
 #include "str.h"
 #include "strescape.h"
+#include "str-table.h"
 #include "ostream.h"
 #include "connect-limit.h"
 
+#define CONNECT_LIMIT_INITIAL_SIZE 64
+
 struct ident_pid {
-	/* ident string points to ident_hash keys */
+	/* ident string points to the connect_limit's str_table. NULL if this
+	   slot is unused. */
 	const char *ident;
 	pid_t pid;
 	unsigned int refcount;
 };
 
 struct connect_limit {
-	/* ident => unsigned int refcount */
-	HASH_TABLE(char *, void *) ident_hash;
-	/* struct ident_pid => struct ident_pid */
-	HASH_TABLE(struct ident_pid *, struct ident_pid *) ident_pid_hash;
+	/* All the idents are interned here. Each connection holds one
+	   reference, so the refcount is also the ident's connection count. */
+	struct str_table *idents;
+	/* Open addressing hash table for (ident, pid) pairs with linear
+	   probing. Since the idents are interned, they can be compared by
+	   their pointers. The size is always a power of 2. */
+	struct ident_pid *ident_pids;
+	unsigned int ident_pids_size, ident_pids_count;
 };
 
-static unsigned int ident_pid_hash(const struct ident_pid *i)
+static unsigned int ident_pid_hash(const char *ident, pid_t pid)
 {
-	return str_hash(i->ident) ^ i->pid;
-}
+	uintptr_t ptr = POINTER_CAST_TO(ident, uintptr_t);
 
-static int ident_pid_cmp(const struct ident_pid *i1, const struct ident_pid *i2)
-{
-	if (i1->pid < i2->pid)
-		return -1;
-	else if (i1->pid > i2->pid)
-		return 1;
-	else
-		return strcmp(i1->ident, i2->ident);
+	return (unsigned int)(ptr >> 4) * 2654435761U ^ (unsigned int)pid;
 }
 
 struct connect_limit *connect_limit_init(void)
@@ -41,9 +41,9 @@ struct connect_limit *connect_limit_init(void)
 	struct connect_limit *limit;
 
 	limit = i_new(struct connect_limit, 1);
-	hash_table_create(&limit->ident_hash, default_pool, 0, str_hash, strcmp);
-	hash_table_create(&limit->ident_pid_hash, default_pool, 0,
-			  ident_pid_hash, ident_pid_cmp);
+	limit->idents = str_table_init();
+	limit->ident_pids_size = CONNECT_LIMIT_INITIAL_SIZE;
+	limit->ident_pids = i_new(struct ident_pid, limit->ident_pids_size);
 	return limit;
 }
 
@@ -52,127 +52,171 @@ void connect_limit_deinit(struct connect_limit **_limit)
 	struct connect_limit *limit = *_limit;
 
 	*_limit = NULL;
-	hash_table_destroy(&limit->ident_hash);
-	hash_table_destroy(&limit->ident_pid_hash);
+	str_table_deinit(&limit->idents);
+	i_free(limit->ident_pids);
 	i_free(limit);
 }
 
+static struct ident_pid *
+connect_limit_ident_pid_find(struct connect_limit *limit,
+			     const char *ident, pid_t pid)
+{
+	unsigned int mask = limit->ident_pids_size - 1;
+	unsigned int idx = ident_pid_hash(ident, pid) & mask;
+	struct ident_pid *i;
+
+	for (;; idx = (idx + 1) & mask) {
+		i = &limit->ident_pids[idx];
+		if (i->ident == NULL)
+			return i;
+		if (i->ident == ident && i->pid == pid)
+			return i;
+	}
+}
+
+static void connect_limit_ident_pids_grow(struct connect_limit *limit)
+{
+	struct ident_pid *old_ident_pids = limit->ident_pids;
+	unsigned int i, old_size = limit->ident_pids_size;
+
+	limit->ident_pids_size *= 2;
+	limit->ident_pids = i_new(struct ident_pid, limit->ident_pids_size);
+	for (i = 0; i < old_size; i++) {
+		if (old_ident_pids[i].ident != NULL) {
+			*connect_limit_ident_pid_find(limit,
+				old_ident_pids[i].ident,
+				old_ident_pids[i].pid) = old_ident_pids[i];
+		}
+	}
+	i_free(old_ident_pids);
+}
+
+static void
+connect_limit_ident_pid_remove(struct connect_limit *limit,
+			       struct ident_pid *i)
+{
+	unsigned int mask = limit->ident_pids_size - 1;
+	unsigned int hole = i - limit->ident_pids, idx, home;
+	struct ident_pid *next;
+
+	/* backward shift deletion: move the following entries in the same
+	   probe sequence to fill the hole, so lookups don't need tombstones */
+	for (idx = (hole + 1) & mask;; idx = (idx + 1) & mask) {
+		next = &limit->ident_pids[idx];
+		if (next->ident == NULL)
+			break;
+		home = ident_pid_hash(next->ident, next->pid) & mask;
+		if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+			limit->ident_pids[hole] = *next;
+			hole = idx;
+		}
+	}
+	memset(&limit->ident_pids[hole], 0, sizeof(limit->ident_pids[hole]));
+	limit->ident_pids_count--;
+}
+
 unsigned int connect_limit_lookup(struct connect_limit *limit,
 				  const char *ident)
 {
-	void *value;
+	unsigned int refcount;
 
-	value = hash_table_lookup(limit->ident_hash, ident);
-	return POINTER_CAST_TO(value, unsigned int);
+	(void)str_table_lookup(limit->idents, ident, &refcount);
+	return refcount;
 }
 
 void connect_limit_connect(struct connect_limit *limit, pid_t pid,
 			   const char *ident)
 {
-	struct ident_pid *i, lookup_i;
-	char *key;
-	void *value;
-
-	if (!hash_table_lookup_full(limit->ident_hash, ident,
-				    &key, &value)) {
-		key = i_strdup(ident);
-		value = POINTER_CAST(1);
-		hash_table_insert(limit->ident_hash, key, value);
-	} else {
-		value = POINTER_CAST(POINTER_CAST_TO(value, unsigned int) + 1);
-		hash_table_update(limit->ident_hash, key, value);
-	}
+	struct ident_pid *i;
+	const char *key;
 
-	lookup_i.ident = ident;
-	lookup_i.pid = pid;
-	i = hash_table_lookup(limit->ident_pid_hash, &lookup_i);
-	if (i == NULL) {
-		i = i_new(struct ident_pid, 1);
-		i->ident = key;
-		i->pid = pid;
-		i->refcount = 1;
-		hash_table_insert(limit->ident_pid_hash, i, i);
-	} else {
+	key = str_table_ref(limit->idents, ident);
+	i = connect_limit_ident_pid_find(limit, key, pid);
+	if (i->ident != NULL) {
 		i->refcount++;
+		return;
 	}
+
+	if ((limit->ident_pids_count + 1) * 4 > limit->ident_pids_size * 3) {
+		connect_limit_ident_pids_grow(limit);
+		i = connect_limit_ident_pid_find(limit, key, pid);
+	}
+	i->ident = key;
+	i->pid = pid;
+	i->refcount = 1;
+	limit->ident_pids_count++;
 }
 
 static void
-connect_limit_ident_hash_unref(struct connect_limit *limit, const char *ident)
+connect_limit_ident_pid_unref(struct connect_limit *limit,
+			      struct ident_pid *i)
 {
-	char *key;
-	void *value;
-	unsigned int new_refcount;
-
-	if (!hash_table_lookup_full(limit->ident_hash, ident, &key, &value))
-		i_panic("connect limit hash tables are inconsistent");
-
-	new_refcount = POINTER_CAST_TO(value, unsigned int) - 1;
-	if (new_refcount > 0) {
-		value = POINTER_CAST(new_refcount);
-		hash_table_update(limit->ident_hash, key, value);
-	} else {
-		hash_table_remove(limit->ident_hash, key);
-		i_free(key);
-	}
+	const char *key = i->ident;
+
+	str_table_unref(limit->idents, &key);
+	if (--i->refcount == 0)
+		connect_limit_ident_pid_remove(limit, i);
 }
 
 void connect_limit_disconnect(struct connect_limit *limit, pid_t pid,
 			      const char *ident)
 {
-	struct ident_pid *i, lookup_i;
-
-	lookup_i.ident = ident;
-	lookup_i.pid = pid;
+	struct ident_pid *i;
+	const char *key;
+	unsigned int refcount;
 
-	i = hash_table_lookup(limit->ident_pid_hash, &lookup_i);
-	if (i == NULL) {
+	key = str_table_lookup(limit->idents, ident, &refcount);
+	i = key == NULL ? NULL :
+		connect_limit_ident_pid_find(limit, key, pid);
+	if (i == NULL || i->ident == NULL) {
 		i_error("connect limit: disconnection for unknown "
 			"pid %s + ident %s", dec2str(pid), ident);
 		return;
 	}
-
-	if (--i->refcount == 0) {
-		hash_table_remove(limit->ident_pid_hash, i);
-		i_free(i);
-	}
-
-	connect_limit_ident_hash_unref(limit, ident);
+	connect_limit_ident_pid_unref(limit, i);
 }
 
 void connect_limit_disconnect_pid(struct connect_limit *limit, pid_t pid)
 {
-	struct hash_iterate_context *iter;
-	struct ident_pid *i, *value;
-
-	/* this should happen rarely (or never), so this slow implementation
-	   should be fine. */
-	iter = hash_table_iterate_init(limit->ident_pid_hash);
-	while (hash_table_iterate(iter, limit->ident_pid_hash, &i, &value)) {
-		if (i->pid == pid) {
-			hash_table_remove(limit->ident_pid_hash, i);
-			for (; i->refcount > 0; i->refcount--)
-				connect_limit_ident_hash_unref(limit, i->ident);
-			i_free(i);
-		}
+	ARRAY(struct ident_pid) pid_idents;
+	const struct ident_pid *pi;
+	struct ident_pid *i;
+	unsigned int idx, refcount;
+
+	/* this should happen rarely (or never), so scanning through the
+	   whole table is fine. removing shifts the entries, so collect
+	   them first. */
+	t_array_init(&pid_idents, 32);
+	for (idx = 0; idx < limit->ident_pids_size; idx++) {
+		if (limit->ident_pids[idx].ident != NULL &&
+		    limit->ident_pids[idx].pid == pid)
+			array_append(&pid_idents, &limit->ident_pids[idx], 1);
+	}
+	array_foreach(&pid_idents, pi) {
+		i = connect_limit_ident_pid_find(limit, pi->ident, pid);
+		i_assert(i->ident != NULL);
+		/* the last unref removes the entry */
+		for (refcount = i->refcount; refcount > 0; refcount--)
+			connect_limit_ident_pid_unref(limit, i);
 	}
-	hash_table_iterate_deinit(&iter);
 }
 
 void connect_limit_dump(struct connect_limit *limit, struct ostream *output)
 {
-	struct hash_iterate_context *iter;
-	struct ident_pid *i, *value;
+	const struct ident_pid *i;
 	string_t *str = t_str_new(256);
+	unsigned int idx;
+
+	for (idx = 0; idx < limit->ident_pids_size; idx++) {
+		i = &limit->ident_pids[idx];
+		if (i->ident == NULL)
+			continue;
 
-	iter = hash_table_iterate_init(limit->ident_pid_hash);
-	while (hash_table_iterate(iter, limit->ident_pid_hash, &i, &value)) {
 		str_truncate(str, 0);
 		str_append_tabescaped(str, i->ident);
 		str_printfa(str, "\t%ld\t%u\n", (long)i->pid, i->refcount);
 		if (o_stream_send(output, str_data(str), str_len(str)) < 0)
 			break;
 	}
-	hash_table_iterate_deinit(&iter);
 	o_stream_nsend(output, "\n", 1);
 }
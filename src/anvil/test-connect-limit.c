@@ -0,0 +1,107 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "connect-limit.h"
+#include "test-common.h"
+
+#define TEST_IDENT_COUNT 50
+#define TEST_PID_COUNT 20
+
+static const char *test_ident(unsigned int i)
+{
+	return t_strdup_printf("imap/127.0.0.%u/user%u", i % 7, i);
+}
+
+static void test_connect_limit_basic(void)
+{
+	struct connect_limit *limit;
+
+	test_begin("connect limit");
+	limit = connect_limit_init();
+
+	test_assert(connect_limit_lookup(limit, "foo") == 0);
+	connect_limit_connect(limit, 100, "foo");
+	connect_limit_connect(limit, 100, "foo");
+	connect_limit_connect(limit, 101, "foo");
+	connect_limit_connect(limit, 101, "bar");
+	test_assert(connect_limit_lookup(limit, "foo") == 3);
+	test_assert(connect_limit_lookup(limit, "bar") == 1);
+
+	connect_limit_disconnect(limit, 100, "foo");
+	test_assert(connect_limit_lookup(limit, "foo") == 2);
+	connect_limit_disconnect_pid(limit, 101);
+	test_assert(connect_limit_lookup(limit, "foo") == 1);
+	test_assert(connect_limit_lookup(limit, "bar") == 0);
+	connect_limit_disconnect(limit, 100, "foo");
+	test_assert(connect_limit_lookup(limit, "foo") == 0);
+
+	connect_limit_deinit(&limit);
+	test_end();
+}
+
+static void test_connect_limit_trace(void)
+{
+	struct connect_limit *limit;
+	unsigned int counts[TEST_IDENT_COUNT][TEST_PID_COUNT];
+	unsigned int i, j, n, ident_idx, pid_idx, total;
+
+	test_begin("connect limit trace");
+	limit = connect_limit_init();
+	memset(counts, 0, sizeof(counts));
+
+	/* replay a random connect/disconnect trace and compare the results
+	   to a simple model. this grows the table and removes entries in
+	   the middle of probe sequences. */
+	for (n = 0; n < 20000; n++) T_BEGIN {
+		ident_idx = rand() % TEST_IDENT_COUNT;
+		pid_idx = rand() % TEST_PID_COUNT;
+
+		if (rand() % 3 != 0) {
+			connect_limit_connect(limit, pid_idx + 1,
+					      test_ident(ident_idx));
+			counts[ident_idx][pid_idx]++;
+		} else if (counts[ident_idx][pid_idx] > 0) {
+			connect_limit_disconnect(limit, pid_idx + 1,
+						 test_ident(ident_idx));
+			counts[ident_idx][pid_idx]--;
+		}
+		if (rand() % 1000 == 0) {
+			connect_limit_disconnect_pid(limit, pid_idx + 1);
+			for (i = 0; i < TEST_IDENT_COUNT; i++)
+				counts[i][pid_idx] = 0;
+		}
+
+		total = 0;
+		for (j = 0; j < TEST_PID_COUNT; j++)
+			total += counts[ident_idx][j];
+		test_assert(connect_limit_lookup(limit,
+				test_ident(ident_idx)) == total);
+	} T_END;
+
+	for (i = 0; i < TEST_IDENT_COUNT; i++) T_BEGIN {
+		total = 0;
+		for (j = 0; j < TEST_PID_COUNT; j++)
+			total += counts[i][j];
+		test_assert(connect_limit_lookup(limit,
+				test_ident(i)) == total);
+	} T_END;
+
+	for (j = 0; j < TEST_PID_COUNT; j++)
+		connect_limit_disconnect_pid(limit, j + 1);
+	for (i = 0; i < TEST_IDENT_COUNT; i++) T_BEGIN {
+		test_assert(connect_limit_lookup(limit, test_ident(i)) == 0);
+	} T_END;
+
+	connect_limit_deinit(&limit);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_connect_limit_basic,
+		test_connect_limit_trace,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -5,18 +5,31 @@
 #include "hash.h"
 #include "str.h"
 #include "strescape.h"
+#include "istream.h"
+#include "ostream.h"
 #include "var-expand.h"
 #include "auth-request.h"
 #include "auth-cache.h"
 
 #include <time.h>
+#include <unistd.h>
+
+#define AUTH_CACHE_FILE_HEADER "AUTH-CACHE\t1"
+
+struct auth_cache_list {
+	/* head is the most recently used node */
+	struct auth_cache_node *head, *tail;
+	size_t max_size, size_left;
+};
 
 struct auth_cache {
 	HASH_TABLE(char *, struct auth_cache_node *) hash;
-	struct auth_cache_node *head, *tail;
+	struct auth_cache_list pos;
+	/* negative entries, if they have their own size limit. otherwise
+	   they're in the pos list as well. */
+	struct auth_cache_list neg;
 
-	size_t max_size, size_left;
-	unsigned int ttl_secs, neg_ttl_secs;
+	unsigned int ttl_secs, neg_ttl_secs, stale_ttl_secs;
 
 	unsigned int hit_count, miss_count;
 	unsigned int pos_entries, neg_entries;
@@ -143,46 +156,66 @@ char *auth_cache_parse_key(pool_t pool, const char *query)
 	return p_strdup(pool, str_c(str));
 }
 
+static const char *auth_cache_node_value(const struct auth_cache_node *node)
+{
+	return node->data + strlen(node->data) + 1;
+}
+
+static struct auth_cache_list *
+auth_cache_get_list(struct auth_cache *cache, bool negative)
+{
+	return negative && cache->neg.max_size > 0 ? &cache->neg : &cache->pos;
+}
+
+static struct auth_cache_list *
+auth_cache_node_get_list(struct auth_cache *cache,
+			 const struct auth_cache_node *node)
+{
+	return auth_cache_get_list(cache, *auth_cache_node_value(node) == '\0');
+}
+
 static void
-auth_cache_node_unlink(struct auth_cache *cache, struct auth_cache_node *node)
+auth_cache_node_unlink(struct auth_cache_list *list,
+		       struct auth_cache_node *node)
 {
 	if (node->prev != NULL)
 		node->prev->next = node->next;
 	else {
 		/* unlinking tail */
-		cache->tail = node->next;
+		list->tail = node->next;
 	}
 
 	if (node->next != NULL)
 		node->next->prev = node->prev;
 	else {
 		/* unlinking head */
-		cache->head = node->prev;
+		list->head = node->prev;
 	}
 }
 
 static void
-auth_cache_node_link_head(struct auth_cache *cache,
+auth_cache_node_link_head(struct auth_cache_list *list,
 			  struct auth_cache_node *node)
 {
-	node->prev = cache->head;
+	node->prev = list->head;
 	node->next = NULL;
 
-	cache->head = node;
+	list->head = node;
 	if (node->prev != NULL)
 		node->prev->next = node;
 	else
-		cache->tail = node;
+		list->tail = node;
 }
 
 static void
 auth_cache_node_destroy(struct auth_cache *cache, struct auth_cache_node *node)
 {
+	struct auth_cache_list *list = auth_cache_node_get_list(cache, node);
 	char *key = node->data;
 
-	auth_cache_node_unlink(cache, node);
+	auth_cache_node_unlink(list, node);
 
-	cache->size_left += node->alloc_size;
+	list->size_left += node->alloc_size;
 	hash_table_remove(cache->hash, key);
 	i_free(node);
 }
@@ -212,11 +245,19 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 	       cache->pos_entries, cache->pos_size,
 	       cache->neg_entries, cache->neg_size);
 
-	cache_used = cache->max_size - cache->size_left;
+	cache_used = cache->pos.max_size - cache->pos.size_left;
 	i_info("Authentication cache current size: "
 	       "%"PRIuSIZE_T" bytes used of %"PRIuSIZE_T" bytes (%u%%)",
-	       cache_used, cache->max_size,
-	       (unsigned int)(cache_used * 100ULL / cache->max_size));
+	       cache_used, cache->pos.max_size,
+	       (unsigned int)(cache_used * 100ULL / cache->pos.max_size));
+	if (cache->neg.max_size > 0) {
+		cache_used = cache->neg.max_size - cache->neg.size_left;
+		i_info("Authentication cache current negative size: "
+		       "%"PRIuSIZE_T" bytes used of %"PRIuSIZE_T" bytes (%u%%)",
+		       cache_used, cache->neg.max_size,
+		       (unsigned int)(cache_used * 100ULL /
+				      cache->neg.max_size));
+	}
 
 	/* reset counters */
 	cache->hit_count = cache->miss_count = 0;
@@ -224,18 +265,22 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 	cache->pos_size = cache->neg_size = 0;
 }
 
-struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
-				  unsigned int neg_ttl_secs
-)
+struct auth_cache *auth_cache_new(size_t max_size, size_t neg_max_size,
+				  unsigned int ttl_secs,
+				  unsigned int neg_ttl_secs,
+				  unsigned int stale_ttl_secs)
 {
 	struct auth_cache *cache;
 
 	cache = i_new(struct auth_cache, 1);
 	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
-	cache->max_size = max_size;
-	cache->size_left = max_size;
+	cache->pos.max_size = max_size;
+	cache->pos.size_left = max_size;
+	cache->neg.max_size = neg_max_size;
+	cache->neg.size_left = neg_max_size;
 	cache->ttl_secs = ttl_secs;
 	cache->neg_ttl_secs = neg_ttl_secs;
+	cache->stale_ttl_secs = stale_ttl_secs;
 
 	lib_signals_set_handler(SIGHUP, LIBSIG_FLAGS_SAFE,
 				sig_auth_cache_clear, cache);
@@ -261,8 +306,10 @@ unsigned int auth_cache_clear(struct auth_cache *cache)
 {
 	unsigned int ret = hash_table_count(cache->hash);
 
-	while (cache->tail != NULL)
-		auth_cache_node_destroy(cache, cache->tail);
+	while (cache->pos.tail != NULL)
+		auth_cache_node_destroy(cache, cache->pos.tail);
+	while (cache->neg.tail != NULL)
+		auth_cache_node_destroy(cache, cache->neg.tail);
 	hash_table_clear(cache->hash, FALSE);
 	return ret;
 }
@@ -311,13 +358,15 @@ static bool auth_cache_node_is_one_of_users(struct auth_cache_node *node,
 	return FALSE;
 }
 
-unsigned int auth_cache_clear_users(struct auth_cache *cache,
-				    const char *const *usernames)
+static unsigned int
+auth_cache_list_clear_users(struct auth_cache *cache,
+			    struct auth_cache_list *list,
+			    const char *const *usernames)
 {
 	struct auth_cache_node *node, *next;
 	unsigned int ret = 0;
 
-	for (node = cache->tail; node != NULL; node = next) {
+	for (node = list->tail; node != NULL; node = next) {
 		next = node->next;
 		if (auth_cache_node_is_one_of_users(node, usernames)) {
 			auth_cache_node_destroy(cache, node);
@@ -327,6 +376,13 @@ unsigned int auth_cache_clear_users(struct auth_cache *cache,
 	return ret;
 }
 
+unsigned int auth_cache_clear_users(struct auth_cache *cache,
+				    const char *const *usernames)
+{
+	return auth_cache_list_clear_users(cache, &cache->pos, usernames) +
+		auth_cache_list_clear_users(cache, &cache->neg, usernames);
+}
+
 static const char *
 auth_cache_escape(const char *string,
 		  const struct auth_request *auth_request ATTR_UNUSED)
@@ -354,6 +410,26 @@ auth_request_expand_cache_key(const struct auth_request *request,
 	return str_c(str);
 }
 
+static const char *
+auth_request_expand_cache_insert_key(struct auth_request *request,
+				     const char *key)
+{
+	char *current_username;
+
+	/* store into cache using the translated username, except if we're doing
+	   a master user login */
+	current_username = request->user;
+	if (request->translated_username != NULL &&
+	    request->requested_login_user == NULL &&
+	    request->master_user == NULL)
+		request->user = t_strdup_noconst(request->translated_username);
+
+	key = auth_request_expand_cache_key(request, key);
+
+	request->user = current_username;
+	return key;
+}
+
 const char *
 auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		  const char *key, struct auth_cache_node **node_r,
@@ -375,7 +451,7 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	}
 	cache->hit_count++;
 
-	value = node->data + strlen(node->data) + 1;
+	value = auth_cache_node_value(node);
 	ttl_secs = *value == '\0' ? cache->neg_ttl_secs : cache->ttl_secs;
 
 	now = time(NULL);
@@ -384,9 +460,12 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		*expired_r = TRUE;
 	} else {
 		/* move to head */
-		if (node != cache->head) {
-			auth_cache_node_unlink(cache, node);
-			auth_cache_node_link_head(cache, node);
+		struct auth_cache_list *list =
+			auth_cache_node_get_list(cache, node);
+
+		if (node != list->head) {
+			auth_cache_node_unlink(list, node);
+			auth_cache_node_link_head(list, node);
 		}
 	}
 	if (node->created < now - (time_t)cache->neg_ttl_secs)
@@ -398,58 +477,94 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	return value;
 }
 
-void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
-		       const char *key, const char *value, bool last_success)
+bool auth_cache_node_use_stale(struct auth_cache *cache,
+			       const struct auth_cache_node *node)
 {
-        struct auth_cache_node *node;
-	size_t data_size, alloc_size, key_len, value_len = strlen(value);
-	char *hash_key, *current_username;
-
-	if (*value == '\0' && cache->neg_ttl_secs == 0) {
-		/* we're not caching negative entries */
-		return;
+	if (*auth_cache_node_value(node) == '\0') {
+		/* negative entries are never used after their TTL */
+		return FALSE;
 	}
+	return node->created >= time(NULL) - (time_t)cache->ttl_secs -
+		(time_t)cache->stale_ttl_secs;
+}
 
-	/* store into cache using the translated username, except if we're doing
-	   a master user login */
-	current_username = request->user;
-	if (request->translated_username != NULL &&
-	    request->requested_login_user == NULL &&
-	    request->master_user == NULL)
-		request->user = t_strdup_noconst(request->translated_username);
+void auth_cache_refresh_failed(struct auth_cache *cache,
+			       struct auth_request *request, const char *key)
+{
+	struct auth_cache_node *node;
 
-	key = auth_request_expand_cache_key(request, key);
-	key_len = strlen(key);
+	/* the entry was inserted with the translated username */
+	key = auth_request_expand_cache_insert_key(request, key);
+	node = hash_table_lookup(cache->hash, key);
+	if (node != NULL) {
+		/* allow trying again */
+		node->refreshing = FALSE;
+	}
+}
 
-	request->user = current_username;
+/* Returns the number of bytes used by the inserted node, or 0 if it was
+   too large to be inserted. */
+static size_t
+auth_cache_insert_expanded(struct auth_cache *cache, const char *key,
+			   const char *value, time_t created,
+			   bool last_success)
+{
+	struct auth_cache_list *list;
+        struct auth_cache_node *node;
+	size_t data_size, alloc_size, key_len, value_len = strlen(value);
+	char *hash_key;
 
+	key_len = strlen(key);
 	data_size = key_len + 1 + value_len + 1;
 	alloc_size = sizeof(struct auth_cache_node) -
 		sizeof(node->data) + data_size;
 
-	/* make sure we have enough space */
-	while (cache->size_left < alloc_size && cache->tail != NULL)
-		auth_cache_node_destroy(cache, cache->tail);
-
 	node = hash_table_lookup(cache->hash, key);
 	if (node != NULL) {
 		/* key is already in cache (probably expired), remove it */
 		auth_cache_node_destroy(cache, node);
 	}
 
+	/* make sure we have enough space */
+	list = auth_cache_get_list(cache, value_len == 0);
+	while (list->size_left < alloc_size && list->tail != NULL)
+		auth_cache_node_destroy(cache, list->tail);
+	if (list->size_left < alloc_size) {
+		/* larger than the whole cache */
+		return 0;
+	}
+
 	/* @UNSAFE */
 	node = i_malloc(alloc_size);
-	node->created = time(NULL);
+	node->created = created;
 	node->alloc_size = alloc_size;
 	node->last_success = last_success;
 	memcpy(node->data, key, key_len);
 	memcpy(node->data + key_len + 1, value, value_len);
 
-	auth_cache_node_link_head(cache, node);
+	auth_cache_node_link_head(list, node);
 
-	cache->size_left -= alloc_size;
+	list->size_left -= alloc_size;
 	hash_key = node->data;
 	hash_table_insert(cache->hash, hash_key, node);
+	return alloc_size;
+}
+
+void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
+		       const char *key, const char *value, bool last_success)
+{
+	size_t alloc_size;
+
+	if (*value == '\0' && cache->neg_ttl_secs == 0) {
+		/* we're not caching negative entries */
+		return;
+	}
+
+	key = auth_request_expand_cache_insert_key(request, key);
+	alloc_size = auth_cache_insert_expanded(cache, key, value, time(NULL),
+						last_success);
+	if (alloc_size == 0)
+		return;
 
 	if (*value != '\0') {
 		cache->pos_entries++;
@@ -472,3 +587,125 @@ void auth_cache_remove(struct auth_cache *cache,
 
 	auth_cache_node_destroy(cache, node);
 }
+
+static bool
+auth_cache_is_usable(struct auth_cache *cache, bool negative, time_t created,
+		     time_t now)
+{
+	unsigned int ttl_secs = negative ? cache->neg_ttl_secs :
+		cache->ttl_secs + cache->stale_ttl_secs;
+
+	return created >= now - (time_t)ttl_secs;
+}
+
+static void
+auth_cache_list_save(struct auth_cache *cache, struct auth_cache_list *list,
+		     struct ostream *output, time_t now)
+{
+	struct auth_cache_node *node;
+	const char *value;
+	string_t *str = t_str_new(256);
+
+	/* write the oldest nodes first, so the LRU order is preserved when
+	   the file is loaded */
+	for (node = list->tail; node != NULL; node = node->next) {
+		value = auth_cache_node_value(node);
+		if (!auth_cache_is_usable(cache, *value == '\0',
+					  node->created, now))
+			continue;
+
+		str_truncate(str, 0);
+		str_printfa(str, "%ld\t%d\t", (long)node->created,
+			    node->last_success ? 1 : 0);
+		str_append_tabescaped(str, node->data);
+		str_append_c(str, '\t');
+		str_append_tabescaped(str, value);
+		str_append_c(str, '\n');
+		o_stream_nsend(output, str_data(str), str_len(str));
+	}
+}
+
+int auth_cache_save(struct auth_cache *cache, int fd, const char *path,
+		    const char *dbhash)
+{
+	struct ostream *output;
+	time_t now = time(NULL);
+	int ret = 0;
+
+	if (ftruncate(fd, 0) < 0) {
+		i_error("ftruncate(%s) failed: %m", path);
+		return -1;
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		i_error("lseek(%s) failed: %m", path);
+		return -1;
+	}
+
+	output = o_stream_create_fd(fd, 0, FALSE);
+	o_stream_cork(output);
+	o_stream_nsend_str(output, t_strdup_printf(
+		AUTH_CACHE_FILE_HEADER"\t%s\n", dbhash));
+	auth_cache_list_save(cache, &cache->pos, output, now);
+	auth_cache_list_save(cache, &cache->neg, output, now);
+	if (o_stream_nfinish(output) < 0) {
+		i_error("write(%s) failed: %s", path,
+			o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+	return ret;
+}
+
+static bool
+auth_cache_load_line(struct auth_cache *cache, const char *line, time_t now)
+{
+	const char *const *args = t_strsplit_tabescaped(line);
+	time_t created;
+
+	/* <created> <last_success> <key> <value> */
+	if (str_array_length(args) != 4 || str_to_time(args[0], &created) < 0)
+		return FALSE;
+	if (!auth_cache_is_usable(cache, *args[3] == '\0', created, now))
+		return TRUE;
+	if (*args[3] == '\0' && cache->neg_ttl_secs == 0)
+		return TRUE;
+
+	(void)auth_cache_insert_expanded(cache, args[2], args[3], created,
+					 args[1][0] == '1');
+	return TRUE;
+}
+
+int auth_cache_load(struct auth_cache *cache, int fd, const char *path,
+		    const char *dbhash)
+{
+	struct istream *input;
+	const char *line;
+	time_t now = time(NULL);
+	int ret = 0;
+
+	input = i_stream_create_fd(fd, (size_t)-1, FALSE);
+	line = i_stream_read_next_line(input);
+	if (line == NULL) {
+		/* empty file */
+	} else if (strcmp(line, t_strdup_printf(
+			AUTH_CACHE_FILE_HEADER"\t%s", dbhash)) != 0) {
+		/* passdbs or userdbs have changed. the cached keys may not
+		   match the same databases anymore. */
+	} else {
+		while ((line = i_stream_read_next_line(input)) != NULL) {
+			if (!auth_cache_load_line(cache, line, now)) {
+				i_error("Corrupted auth cache file %s: "
+					"Invalid line: %s", path, line);
+				ret = -1;
+				break;
+			}
+		}
+	}
+	if (input->stream_errno != 0) {
+		i_error("read(%s) failed: %s", path,
+			i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+	return ret < 0 ? -1 : (int)hash_table_count(cache->hash);
+}
@@ -6,9 +6,11 @@ struct auth_cache_node {
 
 	time_t created;
 	/* Total number of bytes used by this node */
-	uint32_t alloc_size:31;
+	uint32_t alloc_size:30;
 	/* TRUE if the user gave the correct password the last time. */
 	uint32_t last_success:1;
+	/* TRUE if the expired node is being refreshed in the background. */
+	uint32_t refreshing:1;
 
 	char data[4]; /* key \0 value \0 */
 };
@@ -23,9 +25,15 @@ char *auth_cache_parse_key(pool_t pool, const char *query);
 /* Create a new cache. max_size specifies the maximum amount of memory in
    bytes to use for cache (it's not fully exact). ttl_secs specifies time to
    live for cache record, requests older than that are not used.
-   neg_ttl_secs specifies the TTL for negative entries. */
-struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
-				  unsigned int neg_ttl_secs);
+   neg_ttl_secs specifies the TTL for negative entries. If neg_max_size is
+   non-zero, negative entries use their own memory limit instead of sharing
+   max_size with the positive entries. stale_ttl_secs specifies how long
+   after ttl_secs the positive entries can still be used while they're
+   being refreshed. */
+struct auth_cache *auth_cache_new(size_t max_size, size_t neg_max_size,
+				  unsigned int ttl_secs,
+				  unsigned int neg_ttl_secs,
+				  unsigned int stale_ttl_secs);
 void auth_cache_free(struct auth_cache **cache);
 
 /* Clear the cache. Returns how many entries were removed. */
@@ -41,6 +49,16 @@ const char *
 auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		  const char *key, struct auth_cache_node **node_r,
 		  bool *expired_r, bool *neg_expired_r);
+/* Returns TRUE if the expired node returned by auth_cache_lookup() can
+   still be used while it's being refreshed, because it's within the stale
+   TTL. The caller is expected to start the refresh unless node->refreshing
+   is already set. */
+bool auth_cache_node_use_stale(struct auth_cache *cache,
+			       const struct auth_cache_node *node);
+/* Refreshing the key failed. Allow the next lookup to try again. */
+void auth_cache_refresh_failed(struct auth_cache *cache,
+			       struct auth_request *request, const char *key);
+
 /* Insert key => value into cache. "" value means negative cache entry. */
 void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 		       const char *key, const char *value, bool last_success);
@@ -50,4 +68,14 @@ void auth_cache_remove(struct auth_cache *cache,
 		       const struct auth_request *request,
 		       const char *key);
 
+/* Save the cache to the file, so it can be loaded by the next auth process.
+   dbhash identifies the passdb/userdb configuration. Returns 0 if ok,
+   -1 if failed. */
+int auth_cache_save(struct auth_cache *cache, int fd, const char *path,
+		    const char *dbhash);
+/* Load the cache entries from the file, unless its dbhash is different.
+   Returns the number of entries in the cache, or -1 if failed. */
+int auth_cache_load(struct auth_cache *cache, int fd, const char *path,
+		    const char *dbhash);
+
 #endif
@@ -17,6 +17,7 @@
 #include "auth-request-handler.h"
 #include "auth-client-connection.h"
 #include "auth-master-connection.h"
+#include "auth-worker-server.h"
 #include "passdb.h"
 #include "passdb-blocking.h"
 #include "passdb-cache.h"
@@ -688,6 +689,27 @@ auth_request_verify_plain_callback_finish(enum passdb_result result,
 	}
 }
 
+static void
+auth_request_passdb_cache_refresh_finish(struct auth_request *request,
+					 enum passdb_result result)
+{
+	struct passdb_module *passdb = request->passdb->passdb;
+
+	if (passdb_cache == NULL) {
+		/* deinitializing */
+	} else if (result == PASSDB_RESULT_INTERNAL_FAILURE) {
+		auth_cache_refresh_failed(passdb_cache, request,
+					  passdb->cache_key);
+	} else {
+		passdb_template_export(passdb->override_fields_tmpl, request);
+		/* remove the stale entry also when the new result can't
+		   be cached */
+		auth_cache_remove(passdb_cache, request, passdb->cache_key);
+		auth_request_save_cache(request, result);
+	}
+	auth_request_unref(&request);
+}
+
 void auth_request_verify_plain_callback(enum passdb_result result,
 					struct auth_request *request)
 {
@@ -697,6 +719,11 @@ void auth_request_verify_plain_callback(enum passdb_result result,
 
 	auth_request_set_state(request, AUTH_REQUEST_STATE_MECH_CONTINUE);
 
+	if (request->cache_refresh) {
+		auth_request_passdb_cache_refresh_finish(request, result);
+		return;
+	}
+
 	if (result != PASSDB_RESULT_INTERNAL_FAILURE) {
 		passdb_template_export(passdb->override_fields_tmpl, request);
 		auth_request_save_cache(request, result);
@@ -862,6 +889,11 @@ void auth_request_lookup_credentials_callback(enum passdb_result result,
 
 	auth_request_set_state(request, AUTH_REQUEST_STATE_MECH_CONTINUE);
 
+	if (request->cache_refresh) {
+		auth_request_passdb_cache_refresh_finish(request, result);
+		return;
+	}
+
 	if (result != PASSDB_RESULT_INTERNAL_FAILURE) {
 		passdb_template_export(passdb->override_fields_tmpl, request);
 		auth_request_save_cache(request, result);
@@ -1006,11 +1038,13 @@ static bool auth_request_lookup_user_cache(struct auth_request *request,
 {
 	const char *value;
 	struct auth_cache_node *node;
-	bool expired, neg_expired;
+	bool expired, neg_expired, stale = FALSE;
 
 	value = auth_cache_lookup(passdb_cache, request, key, &node,
 				  &expired, &neg_expired);
-	if (value == NULL || (expired && !use_expired)) {
+	if (value != NULL && expired && !use_expired)
+		stale = auth_cache_node_use_stale(passdb_cache, node);
+	if (value == NULL || (expired && !use_expired && !stale)) {
 		auth_request_log_debug(request, AUTH_SUBSYS_DB,
 				       value == NULL ? "userdb cache miss" :
 				       "userdb cache expired");
@@ -1035,9 +1069,36 @@ static bool auth_request_lookup_user_cache(struct auth_request *request,
 		request->userdb_reply = auth_fields_init(request->pool);
 	auth_request_userdb_import(request, value);
 	*result_r = USERDB_RESULT_OK;
+	if (stale && !node->refreshing) {
+		node->refreshing = TRUE;
+		auth_request_cache_refresh_lookup_user(request);
+	}
 	return TRUE;
 }
 
+static void
+auth_request_userdb_cache_refresh_finish(struct auth_request *request,
+					 enum userdb_result result)
+{
+	struct userdb_module *userdb = request->userdb->userdb;
+
+	if (passdb_cache == NULL) {
+		/* deinitializing */
+	} else if (result == USERDB_RESULT_INTERNAL_FAILURE ||
+		   request->userdb_lookup_tempfailed) {
+		auth_cache_refresh_failed(passdb_cache, request,
+					  userdb->cache_key);
+	} else {
+		if (result == USERDB_RESULT_OK) {
+			userdb_template_export(userdb->override_fields_tmpl,
+					       request);
+		}
+		auth_cache_remove(passdb_cache, request, userdb->cache_key);
+		auth_request_userdb_save_cache(request, result);
+	}
+	auth_request_unref(&request);
+}
+
 void auth_request_userdb_callback(enum userdb_result result,
 				  struct auth_request *request)
 {
@@ -1046,6 +1107,11 @@ void auth_request_userdb_callback(enum userdb_result result,
 	enum auth_db_rule result_rule;
 	bool userdb_continue = FALSE;
 
+	if (request->cache_refresh) {
+		auth_request_userdb_cache_refresh_finish(request, result);
+		return;
+	}
+
 	switch (result) {
 	case USERDB_RESULT_OK:
 		result_rule = request->userdb->result_success;
@@ -1185,6 +1251,104 @@ void auth_request_lookup_user(struct auth_request *request,
 		userdb->iface->lookup(request, auth_request_userdb_callback);
 }
 
+static struct auth_request *
+auth_request_cache_refresh_new(struct auth_request *request)
+{
+	struct auth_request *refresh;
+	const char *const *args, *key, *value;
+	string_t *str;
+
+	auth_request_log_debug(request, AUTH_SUBSYS_DB,
+			       "Using stale data from cache, refreshing it");
+
+	refresh = auth_request_new_dummy();
+	str = t_str_new(256);
+	auth_request_export(request, str);
+	args = t_strsplit_tabescaped(str_c(str));
+	for (; *args != NULL; args++) {
+		value = strchr(*args, '=');
+		if (value == NULL)
+			(void)auth_request_import(refresh, *args, NULL);
+		else {
+			key = t_strdup_until(*args, value++);
+			(void)auth_request_import(refresh, key, value);
+		}
+	}
+	auth_request_init(refresh);
+
+	/* the password check or the lookup must actually be done */
+	refresh->successful = FALSE;
+	refresh->skip_password_check = FALSE;
+	refresh->original_username =
+		p_strdup(refresh->pool, request->original_username);
+	refresh->translated_username =
+		p_strdup(refresh->pool, request->translated_username);
+	refresh->passdb = request->passdb;
+	refresh->userdb = request->userdb;
+	refresh->cache_refresh = TRUE;
+	return refresh;
+}
+
+void auth_request_cache_refresh_verify_plain(struct auth_request *request)
+{
+	struct auth_request *refresh;
+	struct passdb_module *passdb = request->passdb->passdb;
+
+	if (passdb->iface.verify_plain == NULL)
+		return;
+
+	refresh = auth_request_cache_refresh_new(request);
+	refresh->mech_password = p_strdup(refresh->pool,
+					  request->mech_password);
+	auth_request_set_state(refresh, AUTH_REQUEST_STATE_PASSDB);
+	if (passdb->blocking)
+		passdb_blocking_verify_plain(refresh);
+	else {
+		passdb_template_export(passdb->default_fields_tmpl, refresh);
+		passdb->iface.verify_plain(refresh, refresh->mech_password,
+					   auth_request_verify_plain_callback);
+	}
+}
+
+void auth_request_cache_refresh_lookup_credentials(struct auth_request *request)
+{
+	struct auth_request *refresh;
+	struct passdb_module *passdb = request->passdb->passdb;
+
+	if (passdb->iface.lookup_credentials == NULL)
+		return;
+
+	refresh = auth_request_cache_refresh_new(request);
+	refresh->credentials_scheme =
+		p_strdup(refresh->pool, request->credentials_scheme);
+	auth_request_set_state(refresh, AUTH_REQUEST_STATE_PASSDB);
+	if (passdb->blocking)
+		passdb_blocking_lookup_credentials(refresh);
+	else {
+		passdb_template_export(passdb->default_fields_tmpl, refresh);
+		passdb->iface.lookup_credentials(refresh,
+			auth_request_lookup_credentials_callback);
+	}
+}
+
+void auth_request_cache_refresh_lookup_user(struct auth_request *request)
+{
+	struct auth_request *refresh;
+	struct userdb_module *userdb = request->userdb->userdb;
+
+	if (userdb->iface->lookup == NULL)
+		return;
+
+	refresh = auth_request_cache_refresh_new(request);
+	refresh->userdb_lookup = TRUE;
+	auth_request_init_userdb_reply(refresh);
+	auth_request_set_state(refresh, AUTH_REQUEST_STATE_USERDB);
+	if (userdb->blocking)
+		userdb_blocking_lookup(refresh);
+	else
+		userdb->iface->lookup(refresh, auth_request_userdb_callback);
+}
+
 static char *
 auth_request_fix_username(struct auth_request *request, const char *username,
                           const char **error_r)
@@ -2005,13 +2169,16 @@ void auth_request_log_unknown_user(struct auth_request *request,
 	i_info("%s", str_c(str));
 }
 
-int auth_request_password_verify(struct auth_request *request,
-				 const char *plain_password,
+/* Returns 1 or 0 if the password check can be skipped (success/failure),
+   -1 if the password data is invalid, 2 if the raw password needs to be
+   verified. */
+static int
+auth_request_password_verify_pre(struct auth_request *request,
 				 const char *crypted_password,
-				 const char *scheme, const char *subsystem)
+				 const char *scheme, const char *subsystem,
+				 const unsigned char **raw_password_r,
+				 size_t *raw_password_size_r)
 {
-	const unsigned char *raw_password;
-	size_t raw_password_size;
 	const char *error;
 	int ret;
 
@@ -2032,7 +2199,7 @@ int auth_request_password_verify(struct auth_request *request,
 	}
 
 	ret = password_decode(crypted_password, scheme,
-			      &raw_password, &raw_password_size, &error);
+			      raw_password_r, raw_password_size_r, &error);
 	if (ret <= 0) {
 		if (ret < 0) {
 			auth_request_log_error(request, subsystem,
@@ -2044,12 +2211,16 @@ int auth_request_password_verify(struct auth_request *request,
 		}
 		return -1;
 	}
+	return 2;
+}
 
-	/* Use original_username since it may be important for some
-	   password schemes (eg. digest-md5). Otherwise the username is used
-	   only for logging purposes. */
-	ret = password_verify(plain_password, request->original_username,
-			      scheme, raw_password, raw_password_size, &error);
+static void
+auth_request_password_verify_post(struct auth_request *request, int ret,
+				  const char *error,
+				  const char *plain_password,
+				  const char *crypted_password,
+				  const char *scheme, const char *subsystem)
+{
 	if (ret < 0) {
 		const char *password_str = request->set->debug_passwords ?
 			t_strdup_printf(" '%s'", crypted_password) : "";
@@ -2065,9 +2236,153 @@ int auth_request_password_verify(struct auth_request *request,
 				     request->original_username,
 				     subsystem);
 	} T_END;
+}
+
+int auth_request_password_verify(struct auth_request *request,
+				 const char *plain_password,
+				 const char *crypted_password,
+				 const char *scheme, const char *subsystem)
+{
+	const unsigned char *raw_password;
+	size_t raw_password_size;
+	const char *error;
+	int ret;
+
+	ret = auth_request_password_verify_pre(request, crypted_password,
+					       scheme, subsystem, &raw_password,
+					       &raw_password_size);
+	if (ret != 2)
+		return ret;
+
+	/* Use original_username since it may be important for some
+	   password schemes (eg. digest-md5). Otherwise the username is used
+	   only for logging purposes. */
+	ret = password_verify(plain_password, request->original_username,
+			      scheme, raw_password, raw_password_size, &error);
+	auth_request_password_verify_post(request, ret, error, plain_password,
+					  crypted_password, scheme, subsystem);
 	return ret;
 }
 
+struct auth_request_verify_ctx {
+	struct auth_request *request;
+	const char *plain_password;
+	const char *crypted_password;
+	const char *scheme;
+	const char *subsystem;
+	verify_plain_callback_t *callback;
+};
+
+static bool
+auth_request_password_verify_worker_callback(const char *reply, void *context)
+{
+	struct auth_request_verify_ctx *ctx = context;
+	struct auth_request *request = ctx->request;
+	const char *const *args = t_strsplit_tabescaped(reply);
+	enum passdb_result result;
+	int ret, worker_result;
+
+	/* OK | FAIL <passdb result> [<tab-escaped error>] */
+	if (strcmp(args[0], "OK") == 0) {
+		ret = 1;
+		result = PASSDB_RESULT_OK;
+	} else if (strcmp(args[0], "FAIL") == 0 && args[1] != NULL &&
+		   str_to_int(args[1], &worker_result) == 0 &&
+		   worker_result == PASSDB_RESULT_PASSWORD_MISMATCH) {
+		ret = 0;
+		result = PASSDB_RESULT_PASSWORD_MISMATCH;
+	} else if (strcmp(args[0], "FAIL") == 0 && args[1] != NULL &&
+		   args[2] != NULL) {
+		/* the password data was invalid for the scheme */
+		ret = -1;
+		result = PASSDB_RESULT_PASSWORD_MISMATCH;
+	} else {
+		/* worker failed or timed out */
+		auth_request_log_error(request, ctx->subsystem,
+			"Password verification in auth worker failed: %s",
+			reply);
+		ctx->callback(PASSDB_RESULT_INTERNAL_FAILURE, request);
+		auth_request_unref(&request);
+		return TRUE;
+	}
+
+	auth_request_password_verify_post(request, ret,
+					  ret < 0 ? args[2] : NULL,
+					  ctx->plain_password,
+					  ctx->crypted_password,
+					  ctx->scheme, ctx->subsystem);
+	ctx->callback(result, request);
+	auth_request_unref(&request);
+	return TRUE;
+}
+
+static bool
+auth_request_password_verify_in_worker(struct auth_request *request,
+				       const char *scheme)
+{
+	const char *const *schemes = request->set->worker_verify_schemes_arr;
+
+	/* auth workers verify the passwords themselves */
+	if (worker || schemes[0] == NULL)
+		return FALSE;
+	return str_array_icase_find(schemes, t_strcut(scheme, '.'));
+}
+
+void auth_request_password_verify_async(struct auth_request *request,
+					const char *plain_password,
+					const char *crypted_password,
+					const char *scheme,
+					const char *subsystem,
+					verify_plain_callback_t *callback)
+{
+	struct auth_request_verify_ctx *ctx;
+	const unsigned char *raw_password;
+	size_t raw_password_size;
+	string_t *str;
+	int ret;
+
+	if (!auth_request_password_verify_in_worker(request, scheme)) {
+		ret = auth_request_password_verify(request, plain_password,
+						   crypted_password, scheme,
+						   subsystem);
+		callback(ret > 0 ? PASSDB_RESULT_OK :
+			 PASSDB_RESULT_PASSWORD_MISMATCH, request);
+		return;
+	}
+
+	ret = auth_request_password_verify_pre(request, crypted_password,
+					       scheme, subsystem, &raw_password,
+					       &raw_password_size);
+	if (ret != 2) {
+		callback(ret > 0 ? PASSDB_RESULT_OK :
+			 PASSDB_RESULT_PASSWORD_MISMATCH, request);
+		return;
+	}
+
+	ctx = p_new(request->pool, struct auth_request_verify_ctx, 1);
+	ctx->request = request;
+	ctx->plain_password = p_strdup(request->pool, plain_password);
+	ctx->crypted_password = p_strdup(request->pool, crypted_password);
+	ctx->scheme = p_strdup(request->pool, scheme);
+	ctx->subsystem = subsystem;
+	ctx->callback = callback;
+
+	/* VERIFY <scheme> <crypted password> <plain password> <username> */
+	str = t_str_new(128);
+	str_append(str, "VERIFY\t");
+	str_append_tabescaped(str, scheme);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, crypted_password);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, plain_password);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, request->original_username);
+
+	auth_request_ref(request);
+	auth_worker_call(request->pool, request->user, str_c(str),
+			 auth_request_password_verify_worker_callback, ctx);
+}
+
 static void get_log_prefix(string_t *str, struct auth_request *auth_request,
 			   const char *subsystem)
 {
@@ -138,6 +138,8 @@ struct auth_request {
 	/* userdb_* fields have been set by the passdb lookup, userdb prefetch
 	   will work. */
 	unsigned int userdb_prefetch_set:1;
+	/* this is a background lookup for refreshing a stale cache entry */
+	unsigned int cache_refresh:1;
 
 	/* ... mechanism specific data ... */
 };
@@ -190,6 +192,12 @@ void auth_request_lookup_credentials(struct auth_request *request,
 void auth_request_lookup_user(struct auth_request *request,
 			      userdb_callback_t *callback);
 
+/* Refresh the request's stale passdb/userdb cache entry in the background
+   using a copy of the request. The request itself isn't modified. */
+void auth_request_cache_refresh_verify_plain(struct auth_request *request);
+void auth_request_cache_refresh_lookup_credentials(struct auth_request *request);
+void auth_request_cache_refresh_lookup_user(struct auth_request *request);
+
 bool auth_request_set_username(struct auth_request *request,
 			       const char *username, const char **error_r);
 bool auth_request_set_login_username(struct auth_request *request,
@@ -224,6 +232,16 @@ int auth_request_password_verify(struct auth_request *request,
 				 const char *plain_password,
 				 const char *crypted_password,
 				 const char *scheme, const char *subsystem);
+/* Like auth_request_password_verify(), but call the callback with the result.
+   If the scheme is listed in auth_worker_verify_schemes, the CPU intensive
+   verification is done by an auth worker process and the callback is
+   called later. */
+void auth_request_password_verify_async(struct auth_request *request,
+					const char *plain_password,
+					const char *crypted_password,
+					const char *scheme,
+					const char *subsystem,
+					verify_plain_callback_t *callback);
 
 void auth_request_log_debug(struct auth_request *auth_request,
 			    const char *subsystem,
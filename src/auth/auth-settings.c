@@ -219,6 +219,9 @@ static const struct setting_define auth_setting_defines[] = {
 	DEF(SET_SIZE, cache_size),
 	DEF(SET_TIME, cache_ttl),
 	DEF(SET_TIME, cache_negative_ttl),
+	DEF(SET_SIZE, cache_negative_size),
+	DEF(SET_TIME, cache_stale_ttl),
+	DEF(SET_BOOL, cache_persistent),
 	DEF(SET_STR, username_chars),
 	DEF(SET_STR, username_translation),
 	DEF(SET_STR, username_format),
@@ -239,6 +242,8 @@ static const struct setting_define auth_setting_defines[] = {
 	DEF(SET_BOOL, use_winbind),
 
 	DEF(SET_UINT, worker_max_count),
+	DEF(SET_UINT, worker_max_pending),
+	DEF(SET_STR, worker_verify_schemes),
 
 	DEFLIST(passdbs, "passdb", &auth_passdb_setting_parser_info),
 	DEFLIST(userdbs, "userdb", &auth_userdb_setting_parser_info),
@@ -258,6 +263,9 @@ static const struct auth_settings auth_default_settings = {
 	.cache_size = 0,
 	.cache_ttl = 60*60,
 	.cache_negative_ttl = 60*60,
+	.cache_negative_size = 0,
+	.cache_stale_ttl = 0,
+	.cache_persistent = FALSE,
 	.username_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890.-_@",
 	.username_translation = "",
 	.username_format = "%Lu",
@@ -278,6 +286,8 @@ static const struct auth_settings auth_default_settings = {
 	.use_winbind = FALSE,
 
 	.worker_max_count = 30,
+	.worker_max_pending = 1,
+	.worker_verify_schemes = "",
 
 	.passdbs = ARRAY_INIT,
 	.userdbs = ARRAY_INIT,
@@ -380,6 +390,10 @@ static bool auth_settings_check(void *_set, pool_t pool,
 		*error_r = "auth_worker_max_count must be above zero";
 		return FALSE;
 	}
+	if (set->worker_max_pending == 0) {
+		*error_r = "auth_worker_max_pending must be above zero";
+		return FALSE;
+	}
 
 	if (set->cache_size > 0 && set->cache_size < 1024) {
 		/* probably a configuration error.
@@ -389,6 +403,12 @@ static bool auth_settings_check(void *_set, pool_t pool,
 					   set->cache_size);
 		return FALSE;
 	}
+	if (set->cache_negative_size > 0 && set->cache_negative_size < 1024) {
+		*error_r = t_strdup_printf("auth_cache_negative_size value is "
+					   "too small (%"PRIuUOFF_T" bytes)",
+					   set->cache_negative_size);
+		return FALSE;
+	}
 
 	if (!auth_verify_verbose_password(set, error_r))
 		return FALSE;
@@ -409,6 +429,8 @@ static bool auth_settings_check(void *_set, pool_t pool,
 	}
 	set->realms_arr =
 		(const char *const *)p_strsplit_spaces(pool, set->realms, " ");
+	set->worker_verify_schemes_arr = (const char *const *)
+		p_strsplit_spaces(pool, set->worker_verify_schemes, " ,");
 
 	if (!auth_settings_set_self_ips(set, pool, error_r))
 		return FALSE;
@@ -40,6 +40,9 @@ struct auth_settings {
 	uoff_t cache_size;
 	unsigned int cache_ttl;
 	unsigned int cache_negative_ttl;
+	uoff_t cache_negative_size;
+	unsigned int cache_stale_ttl;
+	bool cache_persistent;
 	const char *username_chars;
 	const char *username_translation;
 	const char *username_format;
@@ -58,6 +61,8 @@ struct auth_settings {
 	bool use_winbind;
 
 	unsigned int worker_max_count;
+	unsigned int worker_max_pending;
+	const char *worker_verify_schemes;
 
 	/* settings that don't have auth_ prefix: */
 	ARRAY(struct auth_passdb_settings *) passdbs;
@@ -72,6 +77,7 @@ struct auth_settings {
 	char username_chars_map[256];
 	char username_translation_map[256];
 	const char *const *realms_arr;
+	const char *const *worker_verify_schemes_arr;
 	const struct ip_addr *proxy_self_ips;
 };
 
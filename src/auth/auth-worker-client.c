@@ -11,6 +11,7 @@
 #include "strescape.h"
 #include "process-title.h"
 #include "master-service.h"
+#include "password-scheme.h"
 #include "auth-request.h"
 #include "auth-worker-client.h"
 
@@ -221,6 +222,56 @@ auth_worker_handle_passv(struct auth_worker_client *client,
 	return TRUE;
 }
 
+static bool
+auth_worker_handle_verify(struct auth_worker_client *client,
+			  unsigned int id, const char *const *args)
+{
+	/* verify plaintext password against the given crypted password.
+	   the auth process uses this to get CPU intensive password schemes
+	   out of its ioloop. */
+	const char *scheme, *crypted_password, *plain_password, *user;
+	const unsigned char *raw_password;
+	size_t raw_password_size;
+	const char *error;
+	string_t *str;
+	int ret;
+
+	/* <scheme> <crypted password> <plain password> <username> */
+	if (str_array_length(args) < 4) {
+		i_error("BUG: Auth worker server sent us invalid VERIFY");
+		return FALSE;
+	}
+	scheme = str_tabunescape(t_strdup_noconst(args[0]));
+	crypted_password = str_tabunescape(t_strdup_noconst(args[1]));
+	plain_password = str_tabunescape(t_strdup_noconst(args[2]));
+	user = str_tabunescape(t_strdup_noconst(args[3]));
+
+	ret = password_decode(crypted_password, scheme,
+			      &raw_password, &raw_password_size, &error);
+	if (ret == 0) {
+		error = t_strdup_printf("Unknown scheme %s", scheme);
+		ret = -1;
+	} else if (ret > 0) {
+		ret = password_verify(plain_password, user, scheme,
+				      raw_password, raw_password_size, &error);
+	}
+
+	str = t_str_new(128);
+	str_printfa(str, "%u\t", id);
+	if (ret > 0)
+		str_append(str, "OK");
+	else if (ret == 0)
+		str_printfa(str, "FAIL\t%d", PASSDB_RESULT_PASSWORD_MISMATCH);
+	else {
+		str_printfa(str, "FAIL\t%d\t", PASSDB_RESULT_INTERNAL_FAILURE);
+		str_append_tabescaped(str, error);
+	}
+	str_append_c(str, '\n');
+	auth_worker_send_reply(client, NULL, str);
+	auth_worker_client_check_throttle(client);
+	return TRUE;
+}
+
 static void
 lookup_credentials_callback(enum passdb_result result,
 			    const unsigned char *credentials, size_t size,
@@ -611,6 +662,8 @@ auth_worker_handle_line(struct auth_worker_client *client, const char *line)
 	auth_worker_refresh_proctitle(args[1]);
 	if (strcmp(args[1], "PASSV") == 0)
 		ret = auth_worker_handle_passv(client, id, args + 2);
+	else if (strcmp(args[1], "VERIFY") == 0)
+		ret = auth_worker_handle_verify(client, id, args + 2);
 	else if (strcmp(args[1], "PASSL") == 0)
 		ret = auth_worker_handle_passl(client, id, args + 2);
 	else if (strcmp(args[1], "SETCRED") == 0)
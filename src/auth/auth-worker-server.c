@@ -9,6 +9,7 @@
 #include "ostream.h"
 #include "hex-binary.h"
 #include "str.h"
+#include "time-util.h"
 #include "eacces-error.h"
 #include "auth-request.h"
 #include "auth-worker-client.h"
@@ -30,11 +31,17 @@
 
 struct auth_worker_request {
 	unsigned int id;
-	time_t created;
+	struct timeval created;
+	/* when the request was sent to the worker */
+	struct timeval sent;
 	const char *username;
 	const char *data;
 	auth_worker_callback_t *callback;
 	void *context;
+
+	/* request may have a multi-line reply, which needs to be the only
+	   request in the connection */
+	unsigned int exclusive:1;
 };
 
 struct auth_worker_connection {
@@ -45,7 +52,8 @@ struct auth_worker_connection {
 	struct ostream *output;
 	struct timeout *to;
 
-	struct auth_worker_request *request;
+	/* requests sent to the worker, waiting for a reply */
+	ARRAY(struct auth_worker_request *) requests;
 	unsigned int id_counter;
 
 	unsigned int received_error:1;
@@ -61,6 +69,9 @@ static ARRAY(struct auth_worker_request *) worker_request_array;
 static struct aqueue *worker_request_queue;
 static time_t auth_worker_last_warn;
 static unsigned int auth_workers_throttle_count;
+static unsigned int auth_worker_pending_count;
+static uint64_t auth_worker_sent_count, auth_worker_wait_msecs_total;
+static unsigned int auth_worker_max_wait_msecs;
 
 static const char *worker_socket_path;
 
@@ -70,7 +81,7 @@ static void auth_worker_destroy(struct auth_worker_connection **conn,
 
 static void auth_worker_idle_timeout(struct auth_worker_connection *conn)
 {
-	i_assert(conn->request == NULL);
+	i_assert(array_count(&conn->requests) == 0);
 
 	if (idle_count > 1)
 		auth_worker_destroy(&conn, NULL, FALSE);
@@ -80,16 +91,34 @@ static void auth_worker_idle_timeout(struct auth_worker_connection *conn)
 
 static void auth_worker_call_timeout(struct auth_worker_connection *conn)
 {
-	i_assert(conn->request != NULL);
+	i_assert(array_count(&conn->requests) > 0);
 
 	auth_worker_destroy(&conn, "Lookup timed out", TRUE);
 }
 
+static void
+auth_worker_lookup_timeout_update(struct auth_worker_connection *conn)
+{
+	struct auth_worker_request *const *requestp;
+	int msecs;
+
+	/* the requests are in the order they were sent, so the first one is
+	   the oldest. the timeout must not be reset by replies to the
+	   other requests, or a stuck request would never time out. */
+	requestp = array_idx(&conn->requests, 0);
+	msecs = AUTH_WORKER_LOOKUP_TIMEOUT_SECS * 1000 -
+		timeval_diff_msecs(&ioloop_timeval, &(*requestp)->sent);
+	timeout_remove(&conn->to);
+	conn->to = timeout_add(msecs < 0 ? 0 : msecs,
+			       auth_worker_call_timeout, conn);
+}
+
 static bool auth_worker_request_send(struct auth_worker_connection *conn,
 				     struct auth_worker_request *request)
 {
 	struct const_iovec iov[3];
-	unsigned int age_secs = ioloop_time - request->created;
+	unsigned int age_secs = ioloop_time - request->created.tv_sec;
+	int wait_msecs;
 
 	i_assert(conn->to != NULL);
 
@@ -112,7 +141,16 @@ static bool auth_worker_request_send(struct auth_worker_connection *conn,
 			  age_secs, aqueue_count(worker_request_queue));
 	}
 
+	wait_msecs = timeval_diff_msecs(&ioloop_timeval, &request->created);
+	if (wait_msecs > 0) {
+		auth_worker_wait_msecs_total += wait_msecs;
+		if ((unsigned int)wait_msecs > auth_worker_max_wait_msecs)
+			auth_worker_max_wait_msecs = wait_msecs;
+	}
+	auth_worker_sent_count++;
+
 	request->id = ++conn->id_counter;
+	request->sent = ioloop_timeval;
 
 	iov[0].iov_base = t_strdup_printf("%d\t", request->id);
 	iov[0].iov_len = strlen(iov[0].iov_base);
@@ -123,29 +161,46 @@ static bool auth_worker_request_send(struct auth_worker_connection *conn,
 
 	o_stream_nsendv(conn->output, iov, 3);
 
-	i_assert(conn->request == NULL);
-	conn->request = request;
-
-	timeout_remove(&conn->to);
-	conn->to = timeout_add(AUTH_WORKER_LOOKUP_TIMEOUT_SECS * 1000,
-			       auth_worker_call_timeout, conn);
-	idle_count--;
+	array_append(&conn->requests, &request, 1);
+	auth_worker_pending_count++;
+	if (array_count(&conn->requests) == 1) {
+		auth_worker_lookup_timeout_update(conn);
+		idle_count--;
+	}
 	return TRUE;
 }
 
+static bool
+auth_worker_can_pipeline(struct auth_worker_connection *conn,
+			 struct auth_worker_request *request)
+{
+	struct auth_worker_request *const *requestp;
+	unsigned int count = array_count(&conn->requests);
+
+	if (count == 0)
+		return TRUE;
+	if (count >= global_auth_settings->worker_max_pending ||
+	    request->exclusive || conn->restart || conn->shutdown ||
+	    conn->received_error)
+		return FALSE;
+
+	requestp = array_idx(&conn->requests, 0);
+	return !(*requestp)->exclusive;
+}
+
 static void auth_worker_request_send_next(struct auth_worker_connection *conn)
 {
 	struct auth_worker_request *request, *const *requestp;
 
-	do {
-		if (aqueue_count(worker_request_queue) == 0)
-			return;
-
+	while (aqueue_count(worker_request_queue) > 0) {
 		requestp = array_idx(&worker_request_array,
 				     aqueue_idx(worker_request_queue, 0));
 		request = *requestp;
+		if (!auth_worker_can_pipeline(conn, request))
+			break;
 		aqueue_delete_tail(worker_request_queue);
-	} while (!auth_worker_request_send(conn, request));
+		(void)auth_worker_request_send(conn, request);
+	}
 }
 
 static void auth_worker_send_handshake(struct auth_worker_connection *conn)
@@ -192,6 +247,7 @@ static struct auth_worker_connection *auth_worker_create(void)
 
 	conn = i_new(struct auth_worker_connection, 1);
 	conn->fd = fd;
+	i_array_init(&conn->requests, 8);
 	conn->input = i_stream_create_fd(fd, AUTH_WORKER_MAX_LINE_LENGTH,
 					 FALSE);
 	conn->output = o_stream_create_fd(fd, (size_t)-1, FALSE);
@@ -211,7 +267,8 @@ static void auth_worker_destroy(struct auth_worker_connection **_conn,
 {
 	struct auth_worker_connection *conn = *_conn;
 	struct auth_worker_connection *const *conns;
-	unsigned int idx;
+	struct auth_worker_request *const *requests, *request;
+	unsigned int i, idx, count;
 
 	*_conn = NULL;
 
@@ -229,16 +286,25 @@ static void auth_worker_destroy(struct auth_worker_connection **_conn,
 		}
 	}
 
-	if (conn->request == NULL)
+	requests = array_get(&conn->requests, &count);
+	if (count == 0)
 		idle_count--;
-
-	if (conn->request != NULL) {
+	i_assert(auth_worker_pending_count >= count);
+	auth_worker_pending_count -= count;
+
+	/* the callbacks may free the requests */
+	requests = count == 0 ? NULL :
+		p_memdup(unsafe_data_stack_pool, requests,
+			 sizeof(*requests) * count);
+	array_clear(&conn->requests);
+	for (i = 0; i < count; i++) {
+		request = requests[i];
 		i_error("auth worker: Aborted %s request for %s: %s",
-			t_strcut(conn->request->data, '\t'),
-			conn->request->username, reason);
-		conn->request->callback(t_strdup_printf(
+			t_strcut(request->data, '\t'),
+			request->username, reason);
+		request->callback(t_strdup_printf(
 				"FAIL\t%d", PASSDB_RESULT_INTERNAL_FAILURE),
-				conn->request->context);
+				request->context);
 	}
 
 	if (conn->io != NULL)
@@ -250,6 +316,7 @@ static void auth_worker_destroy(struct auth_worker_connection **_conn,
 
 	if (close(conn->fd) < 0)
 		i_error("close(auth worker) failed: %m");
+	array_free(&conn->requests);
 	i_free(conn);
 
 	if (idle_count == 0 && restart) {
@@ -269,17 +336,43 @@ static struct auth_worker_connection *auth_worker_find_free(void)
 	array_foreach_modifiable(&connections, conns) {
 		struct auth_worker_connection *conn = *conns;
 
-		if (conn->request == NULL)
+		if (array_count(&conn->requests) == 0)
 			return conn;
 	}
 	i_unreached();
 	return NULL;
 }
 
+static struct auth_worker_connection *
+auth_worker_find_pipeline(struct auth_worker_request *request)
+{
+	struct auth_worker_connection **conns, *best_conn = NULL;
+
+	if (global_auth_settings->worker_max_pending <= 1)
+		return NULL;
+
+	/* all workers are busy and no more can be created. send the request
+	   to the worker with the fewest pending requests, so it can be
+	   handled as soon as the worker has finished the previous ones. */
+	array_foreach_modifiable(&connections, conns) {
+		struct auth_worker_connection *conn = *conns;
+
+		if (auth_worker_can_pipeline(conn, request) &&
+		    (best_conn == NULL ||
+		     array_count(&conn->requests) <
+		     array_count(&best_conn->requests)))
+			best_conn = conn;
+	}
+	return best_conn;
+}
+
 static bool auth_worker_request_handle(struct auth_worker_connection *conn,
-				       struct auth_worker_request *request,
-				       const char *line)
+				       unsigned int idx, const char *line)
 {
+	struct auth_worker_request *const *requestp =
+		array_idx(&conn->requests, idx);
+	struct auth_worker_request *request = *requestp;
+
 	if (strncmp(line, "*\t", 2) == 0) {
 		/* multi-line reply, not finished yet */
 		if (conn->resuming)
@@ -292,12 +385,18 @@ static bool auth_worker_request_handle(struct auth_worker_connection *conn,
 		}
 	} else {
 		conn->resuming = FALSE;
-		conn->request = NULL;
 		conn->timeout_pending_resume = FALSE;
-		timeout_remove(&conn->to);
-		conn->to = timeout_add(AUTH_WORKER_MAX_IDLE_SECS * 1000,
-				       auth_worker_idle_timeout, conn);
-		idle_count++;
+		array_delete(&conn->requests, idx, 1);
+		i_assert(auth_worker_pending_count > 0);
+		auth_worker_pending_count--;
+		if (array_count(&conn->requests) > 0)
+			auth_worker_lookup_timeout_update(conn);
+		else {
+			timeout_remove(&conn->to);
+			conn->to = timeout_add(AUTH_WORKER_MAX_IDLE_SECS * 1000,
+					       auth_worker_idle_timeout, conn);
+			idle_count++;
+		}
 	}
 
 	if (!request->callback(line, request->context) && conn->io != NULL) {
@@ -354,10 +453,27 @@ static void auth_worker_success(struct auth_worker_connection *conn)
 	conn->received_error = FALSE;
 }
 
+static bool
+auth_worker_request_find(struct auth_worker_connection *conn, unsigned int id,
+			 unsigned int *idx_r)
+{
+	struct auth_worker_request *const *requests;
+	unsigned int i, count;
+
+	requests = array_get(&conn->requests, &count);
+	for (i = 0; i < count; i++) {
+		if (requests[i]->id == id) {
+			*idx_r = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 static void worker_input(struct auth_worker_connection *conn)
 {
 	const char *line, *id_str;
-	unsigned int id;
+	unsigned int id, idx;
 
 	switch (i_stream_read(conn->input)) {
 	case 0:
@@ -399,25 +515,21 @@ static void worker_input(struct auth_worker_connection *conn)
 		    str_to_uint(t_strdup_until(id_str, line), &id) < 0)
 			continue;
 
-		if (conn->request != NULL && id == conn->request->id) {
-			if (!auth_worker_request_handle(conn, conn->request,
-							line + 1))
+		if (auth_worker_request_find(conn, id, &idx)) {
+			if (!auth_worker_request_handle(conn, idx, line + 1))
 				break;
 		} else {
-			if (conn->request != NULL) {
-				i_error("BUG: Worker sent reply with id %u, "
-					"expected %u", id, conn->request->id);
-			} else {
-				i_error("BUG: Worker sent reply with id %u, "
-					"none was expected", id);
-			}
+			i_error("BUG: Worker sent reply with id %u, "
+				"none was expected", id);
 			auth_worker_destroy(&conn, "Worker is buggy", TRUE);
 			return;
 		}
 	}
 
-	if (conn->request != NULL) {
-		/* there's still a pending request */
+	if (array_count(&conn->requests) > 0) {
+		/* there are still pending requests */
+		if (conn->io != NULL)
+			auth_worker_request_send_next(conn);
 	} else if (conn->restart)
 		auth_worker_destroy(&conn, "Max requests limit", TRUE);
 	else if (conn->shutdown)
@@ -443,11 +555,13 @@ auth_worker_call(pool_t pool, const char *username, const char *data,
 	struct auth_worker_request *request;
 
 	request = p_new(pool, struct auth_worker_request, 1);
-	request->created = ioloop_time;
+	request->created = ioloop_timeval;
 	request->username = p_strdup(pool, username);
 	request->data = p_strdup(pool, data);
 	request->callback = callback;
 	request->context = context;
+	/* user listing is the only command with a multi-line reply */
+	request->exclusive = strncmp(data, "LIST\t", 5) == 0;
 
 	if (aqueue_count(worker_request_queue) > 0) {
 		/* requests are already being queued, no chance of
@@ -459,6 +573,8 @@ auth_worker_call(pool_t pool, const char *username, const char *data,
 			/* no free connections, create a new one */
 			conn = auth_worker_create();
 		}
+		if (conn == NULL)
+			conn = auth_worker_find_pipeline(request);
 	}
 	if (conn != NULL) {
 		if (!auth_worker_request_send(conn, request))
@@ -472,7 +588,7 @@ auth_worker_call(pool_t pool, const char *username, const char *data,
 
 void auth_worker_server_resume_input(struct auth_worker_connection *conn)
 {
-	if (conn->request == NULL) {
+	if (array_count(&conn->requests) == 0) {
 		/* request was just finished, don't try to resume it */
 		return;
 	}
@@ -487,6 +603,18 @@ void auth_worker_server_resume_input(struct auth_worker_connection *conn)
 	}
 }
 
+void auth_worker_server_get_stats(struct auth_worker_stats *stats_r)
+{
+	memset(stats_r, 0, sizeof(*stats_r));
+	if (worker_request_queue != NULL)
+		stats_r->queued = aqueue_count(worker_request_queue);
+	stats_r->pending = auth_worker_pending_count;
+	stats_r->sent = auth_worker_sent_count;
+	stats_r->avg_wait_msecs = auth_worker_sent_count == 0 ? 0 :
+		auth_worker_wait_msecs_total / auth_worker_sent_count;
+	stats_r->max_wait_msecs = auth_worker_max_wait_msecs;
+}
+
 void auth_worker_server_init(void)
 {
 	worker_socket_path = "auth-worker";
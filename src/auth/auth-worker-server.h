@@ -6,11 +6,24 @@ struct auth_stream_reply;
 
 typedef bool auth_worker_callback_t(const char *reply, void *context);
 
+struct auth_worker_stats {
+	/* number of requests waiting for an available auth worker */
+	unsigned int queued;
+	/* number of requests sent to auth workers, waiting for a reply */
+	unsigned int pending;
+	/* number of requests sent to auth workers since startup */
+	uint64_t sent;
+	/* how long the requests have waited before being sent */
+	unsigned int avg_wait_msecs, max_wait_msecs;
+};
+
 struct auth_worker_connection * ATTR_NOWARN_UNUSED_RESULT
 auth_worker_call(pool_t pool, const char *username, const char *data,
 		 auth_worker_callback_t *callback, void *context);
 void auth_worker_server_resume_input(struct auth_worker_connection *conn);
 
+void auth_worker_server_get_stats(struct auth_worker_stats *stats_r);
+
 void auth_worker_server_init(void);
 void auth_worker_server_deinit(void);
 
@@ -120,6 +120,8 @@ static struct setting_def setting_defs[] = {
 	DEF_STR(default_pass_scheme),
 	DEF_BOOL(userdb_warning_disable),
 	DEF_BOOL(blocking),
+	DEF_INT(connection_count),
+	DEF_INT(max_pending_requests),
 
 	{ 0, NULL, 0 }
 };
@@ -156,7 +158,9 @@ static struct ldap_settings default_ldap_settings = {
 	.iterate_filter = "(objectClass=posixAccount)",
 	.default_pass_scheme = "crypt",
 	.userdb_warning_disable = FALSE,
-	.blocking = FALSE
+	.blocking = FALSE,
+	.connection_count = 1,
+	.max_pending_requests = DB_LDAP_MAX_PENDING_REQUESTS
 };
 
 static struct ldap_connection *ldap_connections = NULL;
@@ -362,7 +366,7 @@ static bool db_ldap_request_queue_next(struct ldap_connection *conn)
 		/* no non-pending requests */
 		return FALSE;
 	}
-	if (conn->pending_count > DB_LDAP_MAX_PENDING_REQUESTS) {
+	if (conn->pending_count > conn->set.max_pending_requests) {
 		/* wait until server has replied to some requests */
 		return FALSE;
 	}
@@ -421,6 +425,107 @@ static bool db_ldap_request_queue_next(struct ldap_connection *conn)
 	}
 }
 
+static void db_ldap_conn_set_failed(struct ldap_connection *conn)
+{
+	conn->connect_failures++;
+	conn->last_connect_failure = ioloop_time;
+}
+
+static bool db_ldap_conn_is_healthy(struct ldap_connection *conn)
+{
+	return conn->connect_failures == 0 ||
+		ioloop_time - conn->last_connect_failure >=
+		DB_LDAP_FAILED_CONN_RETRY_SECS;
+}
+
+static unsigned int db_ldap_conn_get_load(struct ldap_connection *conn)
+{
+	unsigned int load = aqueue_count(conn->request_queue);
+
+	if (conn->io == NULL && conn->fd != -1) {
+		/* input is disabled while iterating users. the other
+		   requests would have to wait for the iteration. */
+		load += conn->set.max_pending_requests;
+	}
+	return load;
+}
+
+static struct ldap_connection *
+db_ldap_pool_get_conn(struct ldap_connection *parent,
+		      struct ldap_connection *skip_conn, bool require_connected)
+{
+	struct ldap_connection *const *children, *conn;
+	struct ldap_connection *best = NULL, *failed = NULL;
+	struct ldap_connection *disconnected = NULL;
+	unsigned int i, count, load, best_load = 0;
+
+	i_assert(parent->parent == NULL);
+
+	if (!array_is_created(&parent->children))
+		return parent == skip_conn ? NULL : parent;
+
+	children = array_get(&parent->children, &count);
+	for (i = 0; i <= count; i++) {
+		conn = i == 0 ? parent : children[i-1];
+		if (conn == skip_conn)
+			continue;
+		if (conn->conn_state == LDAP_CONN_STATE_DISCONNECTED) {
+			if (require_connected)
+				continue;
+			if (db_ldap_conn_is_healthy(conn)) {
+				/* use it only if none of the connections
+				   are connected. the parent is preferred. */
+				if (disconnected == NULL)
+					disconnected = conn;
+				continue;
+			}
+		}
+
+		if (!db_ldap_conn_is_healthy(conn)) {
+			if (failed == NULL || conn->last_connect_failure <
+			    failed->last_connect_failure)
+				failed = conn;
+			continue;
+		}
+		load = db_ldap_conn_get_load(conn);
+		if (best == NULL || load < best_load) {
+			best = conn;
+			best_load = load;
+		}
+	}
+	if (best == NULL && !require_connected) {
+		/* nothing is connected. connect a healthy connection or
+		   retry the one that failed the longest time ago. */
+		best = disconnected != NULL ? disconnected : failed;
+	}
+	return best;
+}
+
+static void db_ldap_requests_move(struct ldap_connection *conn)
+{
+	struct ldap_connection *parent, *dest;
+	struct ldap_request *const *requestp, *request;
+
+	parent = conn->parent != NULL ? conn->parent : conn;
+	if (!array_is_created(&parent->children))
+		return;
+
+	while (aqueue_count(conn->request_queue) > 0) {
+		dest = db_ldap_pool_get_conn(parent, conn, TRUE);
+		if (dest == NULL)
+			break;
+
+		requestp = array_idx(&conn->request_array,
+				     aqueue_idx(conn->request_queue, 0));
+		request = *requestp;
+		i_assert(request->msgid == -1);
+		aqueue_delete_tail(conn->request_queue);
+
+		aqueue_append(dest->request_queue, &request);
+		(void)db_ldap_request_queue_next(dest);
+	}
+}
+
 static bool
 db_ldap_check_limits(struct ldap_connection *conn, struct ldap_request *request)
 {
@@ -438,12 +543,35 @@ db_ldap_check_limits(struct ldap_connection *conn, struct ldap_request *request)
 	if (secs_diff > DB_LDAP_REQUEST_LOST_TIMEOUT_SECS) {
 		auth_request_log_error(request->auth_request, AUTH_SUBSYS_DB,
 			"Connection appears to be hanging, reconnecting");
+		db_ldap_conn_set_failed(conn);
 		ldap_conn_reconnect(conn);
 		return TRUE;
 	}
 	return TRUE;
 }
 
+static void db_ldap_pool_reconnect(struct ldap_connection *parent)
+{
+	struct ldap_connection *const *childp;
+
+	if (!array_is_created(&parent->children))
+		return;
+
+	/* disconnected connections aren't given requests, so they wouldn't
+	   otherwise get reconnected while the others are connected */
+	array_foreach(&parent->children, childp) {
+		struct ldap_connection *child = *childp;
+
+		if (child->conn_state == LDAP_CONN_STATE_DISCONNECTED &&
+		    child->to == NULL && !child->delayed_connect &&
+		    db_ldap_conn_is_healthy(child)) {
+			if (db_ldap_connect(child) < 0)
+				db_ldap_conn_close(child);
+			break;
+		}
+	}
+}
+
 void db_ldap_request(struct ldap_connection *conn,
 		     struct ldap_request *request)
 {
@@ -452,6 +580,11 @@ void db_ldap_request(struct ldap_connection *conn,
 	request->msgid = -1;
 	request->create_time = ioloop_time;
 
+	if (conn->parent != NULL)
+		conn = conn->parent;
+	db_ldap_pool_reconnect(conn);
+	conn = db_ldap_pool_get_conn(conn, NULL, FALSE);
+
 	if (!db_ldap_check_limits(conn, request)) {
 		request->callback(conn, request, NULL);
 		return;
@@ -467,15 +600,18 @@ static int db_ldap_connect_finish(struct ldap_connection *conn, int ret)
 		i_error("LDAP: Can't connect to server: %s",
 			conn->set.uris != NULL ?
 			conn->set.uris : conn->set.hosts);
+		db_ldap_conn_set_failed(conn);
 		return -1;
 	}
 	if (ret != LDAP_SUCCESS) {
 		i_error("LDAP: binding failed (dn %s): %s",
 			conn->set.dn == NULL ? "(none)" : conn->set.dn,
 			ldap_get_error(conn));
+		db_ldap_conn_set_failed(conn);
 		return -1;
 	}
 
+	conn->connect_failures = 0;
 	if (conn->to != NULL)
 		timeout_remove(&conn->to);
 	conn->conn_state = LDAP_CONN_STATE_BOUND_DEFAULT;
@@ -990,6 +1126,7 @@ static void ldap_connection_timeout(struct ldap_connection *conn)
 
 	i_error("LDAP %s: Initial binding to LDAP server timed out",
 		conn->config_path);
+	db_ldap_conn_set_failed(conn);
 	db_ldap_conn_close(conn);
 }
 
@@ -1187,6 +1324,7 @@ int db_ldap_connect(struct ldap_connection *conn)
 			}
 			i_error("LDAP %s: ldap_start_tls_s() failed: %s",
 				conn->config_path, ldap_err2string(ret));
+			db_ldap_conn_set_failed(conn);
 			return -1;
 		}
 #else
@@ -1232,6 +1370,26 @@ int db_ldap_connect(struct ldap_connection *conn)
 	return 0;
 }
 
+int db_ldap_connect_any(struct ldap_connection *conn)
+{
+	struct ldap_connection *parent;
+	bool healthy;
+
+	parent = conn->parent != NULL ? conn->parent : conn;
+	for (;;) {
+		/* a failed connect marks the connection unhealthy, so the
+		   next one gets tried */
+		conn = db_ldap_pool_get_conn(parent, NULL, FALSE);
+		healthy = db_ldap_conn_is_healthy(conn);
+		if (db_ldap_connect(conn) == 0)
+			return 0;
+		if (!healthy) {
+			/* all of the connections have failed */
+			return -1;
+		}
+	}
+}
+
 static void db_ldap_connect_callback(struct ldap_connection *conn)
 {
 	i_assert(conn->conn_state == LDAP_CONN_STATE_DISCONNECTED);
@@ -1240,6 +1398,12 @@ static void db_ldap_connect_callback(struct ldap_connection *conn)
 
 void db_ldap_connect_delayed(struct ldap_connection *conn)
 {
+	struct ldap_connection *const *childp;
+
+	if (array_is_created(&conn->children)) {
+		array_foreach(&conn->children, childp)
+			db_ldap_connect_delayed(*childp);
+	}
 	if (conn->delayed_connect)
 		return;
 	conn->delayed_connect = TRUE;
@@ -1263,6 +1427,9 @@ void db_ldap_enable_input(struct ldap_connection *conn, bool enable)
 
 static void db_ldap_disconnect_timeout(struct ldap_connection *conn)
 {
+	/* let the other connections in the pool handle the requests */
+	db_ldap_requests_move(conn);
+
 	db_ldap_abort_requests(conn, UINT_MAX,
 		DB_LDAP_REQUEST_DISCONNECT_TIMEOUT_SECS, FALSE,
 		"Aborting (timeout), we're not connected to LDAP server");
@@ -1783,6 +1950,33 @@ static struct ldap_connection *ldap_conn_find(const char *config_path)
 	return NULL;
 }
 
+static struct ldap_connection *
+db_ldap_init_child(struct ldap_connection *parent)
+{
+	struct ldap_connection *conn;
+	pool_t pool;
+
+	pool = pool_alloconly_create("ldap_connection child", 512);
+	conn = p_new(pool, struct ldap_connection, 1);
+	conn->pool = pool;
+	conn->refcount = 1;
+	conn->parent = parent;
+
+	conn->userdb_used = parent->userdb_used;
+	conn->conn_state = LDAP_CONN_STATE_DISCONNECTED;
+	conn->default_bind_msgid = -1;
+	conn->fd = -1;
+	/* the settings are allocated from parent's pool */
+	conn->config_path = parent->config_path;
+	conn->set = parent->set;
+
+	i_array_init(&conn->request_array, 512);
+	conn->request_queue = aqueue_init(&conn->request_array.arr);
+
+	db_ldap_init_ld(conn);
+	return conn;
+}
+
 struct ldap_connection *db_ldap_init(const char *config_path, bool userdb)
 {
 	struct ldap_connection *conn;
@@ -1863,6 +2057,10 @@ struct ldap_connection *db_ldap_init(const char *config_path, bool userdb)
 		i_fatal("LDAP %s: Unknown deref option '%s'", config_path, conn->set.deref);
 	if (scope2str(conn->set.scope, &conn->set.ldap_scope) < 0)
 		i_fatal("LDAP %s: Unknown scope option '%s'", config_path, conn->set.scope);
+	if (conn->set.connection_count == 0)
+		i_fatal("LDAP %s: connection_count must be above zero", config_path);
+	if (conn->set.max_pending_requests == 0)
+		i_fatal("LDAP %s: max_pending_requests must be above zero", config_path);
 
 	i_array_init(&conn->request_array, 512);
 	conn->request_queue = aqueue_init(&conn->request_array.arr);
@@ -1871,13 +2069,37 @@ struct ldap_connection *db_ldap_init(const char *config_path, bool userdb)
         ldap_connections = conn;
 
 	db_ldap_init_ld(conn);
+
+	if (conn->set.connection_count > 1) {
+		unsigned int i;
+
+		i_array_init(&conn->children, conn->set.connection_count - 1);
+		for (i = 1; i < conn->set.connection_count; i++) {
+			struct ldap_connection *child =
+				db_ldap_init_child(conn);
+			array_append(&conn->children, &child, 1);
+		}
+	}
 	return conn;
 }
 
+static void db_ldap_conn_free(struct ldap_connection *conn)
+{
+	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
+	i_assert(conn->pending_count == 0);
+	db_ldap_conn_close(conn);
+	i_assert(conn->to == NULL);
+
+	array_free(&conn->request_array);
+	aqueue_deinit(&conn->request_queue);
+
+	pool_unref(&conn->pool);
+}
+
 void db_ldap_unref(struct ldap_connection **_conn)
 {
         struct ldap_connection *conn = *_conn;
-	struct ldap_connection **p;
+	struct ldap_connection **p, *const *childp;
 
 	*_conn = NULL;
 	i_assert(conn->refcount >= 0);
@@ -1891,15 +2113,12 @@ void db_ldap_unref(struct ldap_connection **_conn)
 		}
 	}
 
-	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
-	i_assert(conn->pending_count == 0);
-	db_ldap_conn_close(conn);
-	i_assert(conn->to == NULL);
-
-	array_free(&conn->request_array);
-	aqueue_deinit(&conn->request_queue);
-
-	pool_unref(&conn->pool);
+	if (array_is_created(&conn->children)) {
+		array_foreach(&conn->children, childp)
+			db_ldap_conn_free(*childp);
+		array_free(&conn->children);
+	}
+	db_ldap_conn_free(conn);
 }
 
 #ifndef BUILTIN_LDAP
@@ -5,8 +5,12 @@
    This define enables them until the code here can be refactored */
 #define LDAP_DEPRECATED 1
 
-/* Maximum number of pending requests before delaying new requests. */
+/* Default maximum number of pending requests per connection before delaying
+   new requests. */
 #define DB_LDAP_MAX_PENDING_REQUESTS 8
+/* Don't send new requests to a connection whose connect or bind failed
+   within this many seconds, if there are other connections available. */
+#define DB_LDAP_FAILED_CONN_RETRY_SECS 10
 /* connect() timeout to LDAP */
 #define DB_LDAP_CONNECT_TIMEOUT_SECS 5
 /* If LDAP connection is down, fail requests after waiting for this long. */
@@ -68,6 +72,9 @@ struct ldap_settings {
 	bool userdb_warning_disable; /* deprecated for now at least */
 	bool blocking;
 
+	unsigned int connection_count;
+	unsigned int max_pending_requests;
+
 	/* ... */
 	int ldap_deref, ldap_scope, ldap_tls_require_cert_parsed;
 	uid_t uid;
@@ -175,6 +182,15 @@ struct ldap_connection {
 	/* Timestamp when we last received a reply */
 	time_t last_reply_stamp;
 
+	/* With connection_count > 1 the first connection is the parent, which
+	   owns the settings and the attribute maps. Requests are distributed
+	   between it and its children. */
+	struct ldap_connection *parent;
+	ARRAY(struct ldap_connection *) children;
+	/* Number of connect/bind failures since the last successful one */
+	unsigned int connect_failures;
+	time_t last_connect_failure;
+
 	char **pass_attr_names, **user_attr_names, **iterate_attr_names;
 	ARRAY_TYPE(ldap_field) pass_attr_map, user_attr_map, iterate_attr_map;
 	bool userdb_used;
@@ -193,6 +209,9 @@ struct ldap_connection *db_ldap_init(const char *config_path, bool userdb);
 void db_ldap_unref(struct ldap_connection **conn);
 
 int db_ldap_connect(struct ldap_connection *conn);
+/* Connect one of the connections in the pool, preferring the least loaded
+   healthy one. Returns 0 if ok, -1 if all of them failed. */
+int db_ldap_connect_any(struct ldap_connection *conn);
 void db_ldap_connect_delayed(struct ldap_connection *conn);
 
 void db_ldap_enable_input(struct ldap_connection *conn, bool enable);
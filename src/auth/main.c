@@ -63,16 +63,22 @@ static ARRAY(struct auth_socket_listener) listeners;
 
 void auth_refresh_proctitle(void)
 {
+	struct auth_worker_stats worker_stats;
+
 	if (!global_auth_settings->verbose_proctitle || worker)
 		return;
 
+	auth_worker_server_get_stats(&worker_stats);
 	process_title_set(t_strdup_printf(
-		"[%u wait, %u passdb, %u userdb]",
+		"[%u wait, %u passdb, %u userdb, "
+		"%u+%u worker requests, %ums avg worker wait]",
 		auth_request_state_count[AUTH_REQUEST_STATE_NEW] +
 		auth_request_state_count[AUTH_REQUEST_STATE_MECH_CONTINUE] +
 		auth_request_state_count[AUTH_REQUEST_STATE_FINISHED],
 		auth_request_state_count[AUTH_REQUEST_STATE_PASSDB],
-		auth_request_state_count[AUTH_REQUEST_STATE_USERDB]));
+		auth_request_state_count[AUTH_REQUEST_STATE_USERDB],
+		worker_stats.queued, worker_stats.pending,
+		worker_stats.avg_wait_msecs));
 }
 
 static const char *const *read_global_settings(void)
@@ -205,8 +211,10 @@ static void main_preinit(void)
 		      mech_reg, services);
 
 	listeners_init();
-	if (!worker)
+	if (!worker) {
 		auth_token_init();
+		passdb_cache_preinit(global_auth_settings);
+	}
 
 	/* Password lookups etc. may require roots, allow it. */
 	restrict_access_by_env(NULL, FALSE);
@@ -1,14 +1,28 @@
 /* Copyright (c) 2004-2015 Dovecot authors, see the included COPYING file */
 
 #include "auth-common.h"
+#include "str.h"
+#include "hex-binary.h"
+#include "md5.h"
 #include "restrict-process-size.h"
 #include "password-scheme.h"
 #include "passdb.h"
+#include "userdb.h"
 #include "passdb-cache.h"
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define PASSDB_CACHE_FNAME "auth-cache.dat"
 
 struct auth_cache *passdb_cache = NULL;
 
+/* opened while we still have root privileges */
+static int passdb_cache_fd = -1;
+static const char *passdb_cache_path;
+static char *passdb_cache_dbhash;
+
 static void
 passdb_cache_log_hit(struct auth_request *request, const char *value)
 {
@@ -30,7 +44,7 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 	const char *value, *cached_pw, *scheme, *const *list;
 	struct auth_cache_node *node;
 	int ret;
-	bool expired, neg_expired;
+	bool expired, neg_expired, stale = FALSE;
 
 	if (passdb_cache == NULL || key == NULL)
 		return FALSE;
@@ -38,7 +52,9 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 	/* value = password \t ... */
 	value = auth_cache_lookup(passdb_cache, request, key, &node,
 				  &expired, &neg_expired);
-	if (value == NULL || (expired && !use_expired)) {
+	if (value != NULL && expired && !use_expired)
+		stale = auth_cache_node_use_stale(passdb_cache, node);
+	if (value == NULL || (expired && !use_expired && !stale)) {
 		auth_request_log_debug(request, AUTH_SUBSYS_DB,
 				       value == NULL ? "cache miss" :
 				       "cache expired");
@@ -68,6 +84,11 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 		ret = auth_request_password_verify(request, password, cached_pw,
 						   scheme, AUTH_SUBSYS_DB);
 
+		if (ret <= 0 && stale) {
+			/* only successful logins are done with stale
+			   data. look up the current password. */
+			return FALSE;
+		}
 		if (ret == 0 && (node->last_success || neg_expired)) {
 			/* a) the last authentication was successful. assume
 			   that the password was changed and cache is expired.
@@ -85,6 +106,10 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 
 	*result_r = ret > 0 ? PASSDB_RESULT_OK :
 		PASSDB_RESULT_PASSWORD_MISMATCH;
+	if (stale && !node->refreshing) {
+		node->refreshing = TRUE;
+		auth_request_cache_refresh_verify_plain(request);
+	}
 	return TRUE;
 }
 
@@ -96,14 +121,16 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 {
 	const char *value, *const *list;
 	struct auth_cache_node *node;
-	bool expired, neg_expired;
+	bool expired, neg_expired, stale = FALSE;
 
 	if (passdb_cache == NULL)
 		return FALSE;
 
 	value = auth_cache_lookup(passdb_cache, request, key, &node,
 				  &expired, &neg_expired);
-	if (value == NULL || (expired && !use_expired)) {
+	if (value != NULL && expired && !use_expired)
+		stale = auth_cache_node_use_stale(passdb_cache, node);
+	if (value == NULL || (expired && !use_expired && !stale)) {
 		auth_request_log_debug(request, AUTH_SUBSYS_DB,
 				       value == NULL ? "cache miss" :
 				       "cache expired");
@@ -126,12 +153,67 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 	*password_r = *list[0] == '\0' ? NULL : list[0];
 	*scheme_r = password_get_scheme(password_r);
 	i_assert(*scheme_r != NULL || *password_r == NULL);
+	if (stale && !node->refreshing) {
+		node->refreshing = TRUE;
+		auth_request_cache_refresh_lookup_credentials(request);
+	}
 	return TRUE;
 }
 
+void passdb_cache_preinit(const struct auth_settings *set)
+{
+	struct stat st;
+	mode_t old_mask;
+	int fd;
+
+	if (set->cache_size == 0 || set->cache_ttl == 0 ||
+	    !set->cache_persistent)
+		return;
+
+	passdb_cache_path = p_strconcat(default_pool, set->base_dir, "/",
+					PASSDB_CACHE_FNAME, NULL);
+	old_mask = umask(0);
+	fd = open(passdb_cache_path, O_RDWR | O_CREAT, 0600);
+	umask(old_mask);
+	if (fd == -1) {
+		i_error("open(%s) failed: %m", passdb_cache_path);
+		return;
+	}
+	/* the file contains password hashes. make sure nobody else
+	   can read or write it. */
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", passdb_cache_path);
+		i_close_fd(&fd);
+		return;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & 0077) != 0 || st.st_nlink > 1) {
+		i_error("Compromised auth cache file: %s", passdb_cache_path);
+		i_close_fd(&fd);
+		i_unlink(passdb_cache_path);
+		return;
+	}
+	passdb_cache_fd = fd;
+}
+
+static char *passdb_cache_get_dbhash(void)
+{
+	unsigned char passdb_md5[MD5_RESULTLEN];
+	unsigned char userdb_md5[MD5_RESULTLEN];
+	string_t *str = t_str_new(MD5_RESULTLEN*4 + 1);
+
+	passdbs_generate_md5(passdb_md5);
+	userdbs_generate_md5(userdb_md5);
+	binary_to_hex_append(str, passdb_md5, sizeof(passdb_md5));
+	str_append_c(str, '\t');
+	binary_to_hex_append(str, userdb_md5, sizeof(userdb_md5));
+	return i_strdup(str_c(str));
+}
+
 void passdb_cache_init(const struct auth_settings *set)
 {
 	rlim_t limit;
+	int ret;
 
 	if (set->cache_size == 0 || set->cache_ttl == 0)
 		return;
@@ -143,12 +225,35 @@ void passdb_cache_init(const struct auth_settings *set)
 			  (unsigned long)(set->cache_size/1024/1024),
 			  (unsigned long)(limit/1024/1024));
 	}
-	passdb_cache = auth_cache_new(set->cache_size, set->cache_ttl,
-				      set->cache_negative_ttl);
+	passdb_cache = auth_cache_new(set->cache_size,
+				      set->cache_negative_size,
+				      set->cache_ttl,
+				      set->cache_negative_ttl,
+				      set->cache_stale_ttl);
+
+	if (passdb_cache_fd != -1) {
+		passdb_cache_dbhash = passdb_cache_get_dbhash();
+		ret = auth_cache_load(passdb_cache, passdb_cache_fd,
+				      passdb_cache_path, passdb_cache_dbhash);
+		if (ret >= 0 && set->debug) {
+			i_debug("Loaded %d auth cache entries from %s",
+				ret, passdb_cache_path);
+		}
+	}
 }
 
 void passdb_cache_deinit(void)
 {
+	if (passdb_cache != NULL && passdb_cache_fd != -1) {
+		(void)auth_cache_save(passdb_cache, passdb_cache_fd,
+				      passdb_cache_path, passdb_cache_dbhash);
+	}
+	if (passdb_cache_fd != -1) {
+		if (close(passdb_cache_fd) < 0)
+			i_error("close(%s) failed: %m", passdb_cache_path);
+		passdb_cache_fd = -1;
+	}
+	i_free_and_null(passdb_cache_dbhash);
 	if (passdb_cache != NULL)
 		auth_cache_free(&passdb_cache);
 }
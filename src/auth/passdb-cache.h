@@ -15,6 +15,9 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 				     enum passdb_result *result_r,
 				     bool use_expired);
 
+/* Open the persistent cache file. This needs to be called while the
+   process still has root privileges. */
+void passdb_cache_preinit(const struct auth_settings *set);
 void passdb_cache_init(const struct auth_settings *set);
 void passdb_cache_deinit(void);
 
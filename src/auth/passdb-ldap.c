@@ -70,7 +70,6 @@ ldap_lookup_finish(struct auth_request *auth_request,
 {
 	enum passdb_result passdb_result;
 	const char *password = NULL, *scheme;
-	int ret;
 
 	if (res == NULL) {
 		passdb_result = PASSDB_RESULT_INTERNAL_FAILURE;
@@ -104,15 +103,13 @@ ldap_lookup_finish(struct auth_request *auth_request,
 			auth_request);
 	} else {
 		if (password != NULL) {
-			ret = auth_request_password_verify(auth_request,
-					auth_request->mech_password,
-					password, scheme, AUTH_SUBSYS_DB);
-			passdb_result = ret > 0 ? PASSDB_RESULT_OK :
-				PASSDB_RESULT_PASSWORD_MISMATCH;
+			auth_request_password_verify_async(auth_request,
+				auth_request->mech_password, password, scheme,
+				AUTH_SUBSYS_DB, ldap_request->callback.verify_plain);
+		} else {
+			ldap_request->callback.verify_plain(passdb_result,
+							    auth_request);
 		}
-
-		ldap_request->callback.verify_plain(passdb_result,
-						    auth_request);
 	}
 }
 
@@ -382,7 +379,7 @@ ldap_verify_plain(struct auth_request *request,
 
 	/* reconnect if needed. this is also done by db_ldap_search(), but
 	   with auth binds we'll have to do it ourself */
-	if (db_ldap_connect(conn)< 0) {
+	if (db_ldap_connect_any(conn) < 0) {
 		callback(PASSDB_RESULT_INTERNAL_FAILURE, request);
 		return;
 	}
@@ -39,7 +39,6 @@ static_verify_plain(struct auth_request *request, const char *password,
 {
 	enum passdb_result result;
 	const char *static_password;
-	int ret;
 
 	result = static_save_fields(request, &static_password);
 	if (result != PASSDB_RESULT_OK) {
@@ -47,14 +46,9 @@ static_verify_plain(struct auth_request *request, const char *password,
 		return;
 	}
 
-	ret = auth_request_password_verify(request, password, static_password,
-					   STATIC_PASS_SCHEME, AUTH_SUBSYS_DB);
-	if (ret <= 0) {
-		callback(PASSDB_RESULT_PASSWORD_MISMATCH, request);
-		return;
-	}
-
-	callback(PASSDB_RESULT_OK, request);
+	auth_request_password_verify_async(request, password, static_password,
+					   STATIC_PASS_SCHEME, AUTH_SUBSYS_DB,
+					   callback);
 }
 
 static void
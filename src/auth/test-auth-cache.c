@@ -5,6 +5,10 @@
 #include "auth-cache.h"
 #include "test-common.h"
 
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
 const struct var_expand_table auth_request_var_expand_static_tab[] = {
 	/* these 3 must be in this order */
 	{ 'u', NULL, "user" },
@@ -18,10 +22,38 @@ const struct var_expand_table auth_request_var_expand_static_tab[] = {
 };
 
 const struct var_expand_table *
-auth_request_get_var_expand_table(const struct auth_request *auth_request ATTR_UNUSED,
+auth_request_get_var_expand_table(const struct auth_request *auth_request,
 				  auth_request_escape_func_t *escape_func ATTR_UNUSED)
 {
-	return auth_request_var_expand_static_tab;
+	struct var_expand_table *tab;
+
+	tab = t_malloc(sizeof(auth_request_var_expand_static_tab));
+	memcpy(tab, auth_request_var_expand_static_tab,
+	       sizeof(auth_request_var_expand_static_tab));
+	tab[0].value = auth_request->user;
+	return tab;
+}
+
+#define TEST_CACHE_PATH ".test-auth-cache.dat"
+
+static void test_request_init(struct auth_request *request, const char *user)
+{
+	memset(request, 0, sizeof(*request));
+	request->user = t_strdup_noconst(user);
+}
+
+static int test_cache_file_write(const char *contents)
+{
+	int fd;
+
+	fd = open(TEST_CACHE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_CACHE_PATH);
+	if (write(fd, contents, strlen(contents)) != (ssize_t)strlen(contents))
+		i_fatal("write(%s) failed: %m", TEST_CACHE_PATH);
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		i_fatal("lseek(%s) failed: %m", TEST_CACHE_PATH);
+	return fd;
 }
 
 static void test_auth_cache_parse_key(void)
@@ -59,10 +91,164 @@ static void test_auth_cache_parse_key(void)
 	test_end();
 }
 
+static void test_auth_cache_stale(void)
+{
+	struct auth_cache *cache;
+	struct auth_cache_node *node;
+	struct auth_request request;
+	bool expired, neg_expired;
+	const char *value;
+	long now = time(NULL);
+	int fd;
+
+	test_begin("auth cache stale");
+	/* ttl=10, stale_ttl=1000 */
+	cache = auth_cache_new(1024*1024, 0, 10, 10, 1000);
+	fd = test_cache_file_write(t_strdup_printf(
+		"AUTH-CACHE\t1\thash\n"
+		"%ld\t1\tP\001tstale\tpw\n"
+		"%ld\t1\tP\001ttoo-old\tpw\n"
+		"%ld\t0\tP\001tneg\t\n"
+		"%ld\t1\tP\001tfresh\tpw\n",
+		now - 100, now - 2000, now - 100, now));
+	test_assert(auth_cache_load(cache, fd, TEST_CACHE_PATH, "hash") == 2);
+	i_close_fd(&fd);
+
+	/* expired, but still usable while it's refreshed */
+	test_request_init(&request, "stale");
+	value = auth_cache_lookup(cache, &request, "%u", &node,
+				  &expired, &neg_expired);
+	test_assert(null_strcmp(value, "pw") == 0 && expired);
+	test_assert(auth_cache_node_use_stale(cache, node));
+	test_assert(!node->refreshing);
+	node->refreshing = TRUE;
+
+	/* the refresh failed - the next lookup may try again */
+	auth_cache_refresh_failed(cache, &request, "%u");
+	value = auth_cache_lookup(cache, &request, "%u", &node,
+				  &expired, &neg_expired);
+	test_assert(value != NULL && !node->refreshing);
+
+	/* a successful refresh replaces the entry */
+	node->refreshing = TRUE;
+	auth_cache_insert(cache, &request, "%u", "newpw", TRUE);
+	value = auth_cache_lookup(cache, &request, "%u", &node,
+				  &expired, &neg_expired);
+	test_assert(null_strcmp(value, "newpw") == 0 && !expired &&
+		    !node->refreshing);
+
+	test_request_init(&request, "fresh");
+	value = auth_cache_lookup(cache, &request, "%u", &node,
+				  &expired, &neg_expired);
+	test_assert(null_strcmp(value, "pw") == 0 && !expired);
+
+	/* past the stale TTL or a negative entry past its TTL */
+	test_request_init(&request, "too-old");
+	test_assert(auth_cache_lookup(cache, &request, "%u", &node,
+				      &expired, &neg_expired) == NULL);
+	test_request_init(&request, "neg");
+	test_assert(auth_cache_lookup(cache, &request, "%u", &node,
+				      &expired, &neg_expired) == NULL);
+	auth_cache_free(&cache);
+	i_unlink(TEST_CACHE_PATH);
+	test_end();
+}
+
+static void test_auth_cache_refresh_failed_translated(void)
+{
+	struct auth_cache *cache;
+	struct auth_cache_node *node;
+	struct auth_request request;
+	bool expired, neg_expired;
+
+	test_begin("auth cache refresh failed with translated username");
+	cache = auth_cache_new(1024*1024, 0, 10, 10, 1000);
+	test_request_init(&request, "alias");
+	request.translated_username = "real";
+	auth_cache_insert(cache, &request, "%u", "pw", TRUE);
+
+	/* the entry is found with the translated name */
+	test_request_init(&request, "real");
+	test_assert(auth_cache_lookup(cache, &request, "%u", &node,
+				      &expired, &neg_expired) != NULL);
+	node->refreshing = TRUE;
+
+	test_request_init(&request, "alias");
+	request.translated_username = "real";
+	auth_cache_refresh_failed(cache, &request, "%u");
+	test_assert(!node->refreshing);
+	test_assert(strcmp(request.user, "alias") == 0);
+	auth_cache_free(&cache);
+	test_end();
+}
+
+static void test_auth_cache_save_load(void)
+{
+	struct auth_cache *cache;
+	struct auth_cache_node *node;
+	struct auth_request request;
+	bool expired, neg_expired;
+	int fd;
+
+	test_begin("auth cache save and load");
+	cache = auth_cache_new(1024*1024, 0, 3600, 3600, 0);
+	test_request_init(&request, "user1");
+	auth_cache_insert(cache, &request, "%u", "pw\twith tab", TRUE);
+	test_request_init(&request, "user2");
+	auth_cache_insert(cache, &request, "%u", "", FALSE);
+
+	fd = test_cache_file_write("");
+	test_assert(auth_cache_save(cache, fd, TEST_CACHE_PATH, "hash1") == 0);
+	auth_cache_free(&cache);
+
+	/* the same passdb/userdb configuration */
+	cache = auth_cache_new(1024*1024, 0, 3600, 3600, 0);
+	test_assert(lseek(fd, 0, SEEK_SET) == 0);
+	test_assert(auth_cache_load(cache, fd, TEST_CACHE_PATH, "hash1") == 2);
+	test_request_init(&request, "user1");
+	test_assert(null_strcmp(auth_cache_lookup(cache, &request, "%u", &node,
+						  &expired, &neg_expired),
+				"pw\twith tab") == 0);
+	test_assert(node->last_success);
+	test_request_init(&request, "user2");
+	test_assert(null_strcmp(auth_cache_lookup(cache, &request, "%u", &node,
+						  &expired, &neg_expired),
+				"") == 0);
+	test_assert(!node->last_success);
+	auth_cache_free(&cache);
+
+	/* the configuration has changed */
+	cache = auth_cache_new(1024*1024, 0, 3600, 3600, 0);
+	test_assert(lseek(fd, 0, SEEK_SET) == 0);
+	test_assert(auth_cache_load(cache, fd, TEST_CACHE_PATH, "hash2") == 0);
+	auth_cache_free(&cache);
+
+	/* negative entries aren't loaded if they're not wanted */
+	cache = auth_cache_new(1024*1024, 0, 3600, 0, 0);
+	test_assert(lseek(fd, 0, SEEK_SET) == 0);
+	test_assert(auth_cache_load(cache, fd, TEST_CACHE_PATH, "hash1") == 1);
+	auth_cache_free(&cache);
+
+	/* corrupted file */
+	i_close_fd(&fd);
+	fd = test_cache_file_write("AUTH-CACHE\t1\thash1\nfoo\n");
+	cache = auth_cache_new(1024*1024, 0, 3600, 3600, 0);
+	test_expect_errors(1);
+	test_assert(auth_cache_load(cache, fd, TEST_CACHE_PATH, "hash1") < 0);
+	test_expect_no_more_errors();
+	auth_cache_free(&cache);
+	i_close_fd(&fd);
+	i_unlink(TEST_CACHE_PATH);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_auth_cache_parse_key,
+		test_auth_cache_stale,
+		test_auth_cache_refresh_failed_translated,
+		test_auth_cache_save_load,
 		NULL
 	};
 	return test_run(test_functions);
@@ -159,6 +159,8 @@ static void userdb_ldap_iterate_callback(struct ldap_connection *conn,
 	/* the iteration can take a while. reset the request's create time so
 	   it won't be aborted while it's still running */
 	request->create_time = ioloop_time;
+	/* the request may have been sent via any of the pooled connections */
+	ctx->conn = conn;
 
 	ctx->in_callback = TRUE;
 	ldap_iter = db_ldap_result_iterate_init(conn, &urequest->request,
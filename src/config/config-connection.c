@@ -3,9 +3,14 @@
 #include "lib.h"
 #include "array.h"
 #include "llist.h"
+#include "str.h"
+#include "hostpid.h"
 #include "istream.h"
 #include "ostream.h"
+#include "write-full.h"
+#include "sha1.h"
 #include "settings-parser.h"
+#include "master-interface.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "config-request.h"
@@ -13,6 +18,8 @@
 #include "config-connection.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
 
 #define MAX_INBUF_SIZE 1024
 
@@ -63,13 +70,64 @@ config_request_output(const char *key, const char *value,
 	o_stream_nsend_str(output, "\n");
 }
 
+static bool config_snapshot_key_is_valid(const char *key)
+{
+	unsigned int i;
+
+	for (i = 0; key[i] != '\0'; i++) {
+		if (!i_isxdigit(key[i]))
+			return FALSE;
+	}
+	return i == SHA1_RESULTLEN*2;
+}
+
+static void
+config_snapshot_write(const char *key, const char *generation,
+		      const string_t *reply)
+{
+	const char *dir, *path, *temp_path;
+	string_t *str;
+	int fd;
+
+	dir = getenv(MASTER_CONFIG_SNAPSHOT_DIR_ENV);
+	if (dir == NULL)
+		return;
+
+	path = t_strdup_printf("%s/%s", dir, key);
+	temp_path = t_strdup_printf("%s.%s", path, my_pid);
+	fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		if (errno != EACCES && errno != ENOENT)
+			i_error("creat(%s) failed: %m", temp_path);
+		return;
+	}
+
+	str = t_str_new(str_len(reply) + 64);
+	str_printfa(str, MASTER_CONFIG_SNAPSHOT_HEADER"\t%s\n", generation);
+	str_append_str(str, reply);
+	if (write_full(fd, str_data(str), str_len(str)) < 0) {
+		i_error("write(%s) failed: %m", temp_path);
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return;
+	}
+	i_close_fd(&fd);
+	if (rename(temp_path, path) < 0) {
+		i_error("rename(%s, %s) failed: %m", temp_path, path);
+		i_unlink(temp_path);
+	}
+}
+
 static int config_connection_request(struct config_connection *conn,
 				     const char *const *args)
 {
 	struct config_export_context *ctx;
 	struct master_service_settings_output output;
 	struct config_filter filter;
+	struct ostream *reply_output;
+	string_t *reply = NULL;
 	const char *path, *error, *module, *const *wanted_modules;
+	const char *snapshot_key = NULL, *generation = NULL;
 	ARRAY(const char *) modules;
 	bool is_master = FALSE;
 
@@ -98,7 +156,11 @@ static int config_connection_request(struct config_connection *conn,
 					IPADDR_IS_V4(&filter.remote_net) ?
 					32 : 128;
 			}
-		}
+		} else if (strncmp(*args, "snapshot=", 9) == 0) {
+			if (config_snapshot_key_is_valid(*args + 9))
+				snapshot_key = *args + 9;
+		} else if (strncmp(*args, "generation=", 11) == 0)
+			generation = *args + 11;
 	}
 	array_append_zero(&modules);
 	wanted_modules = array_count(&modules) == 1 ? NULL :
@@ -115,10 +177,23 @@ static int config_connection_request(struct config_connection *conn,
 		}
 	}
 
-	o_stream_cork(conn->output);
+	if (snapshot_key != NULL && generation != NULL && !is_master &&
+	    filter.local_bits == 0 && filter.remote_bits == 0 &&
+	    filter.local_name == NULL) {
+		/* the reply doesn't depend on the connection, so write it
+		   also to a snapshot that the processes can read directly
+		   without asking us. */
+		reply = str_new(default_pool, 8192);
+		reply_output = o_stream_create_buffer(reply);
+		o_stream_set_no_error_handling(reply_output, TRUE);
+	} else {
+		reply_output = conn->output;
+		o_stream_ref(reply_output);
+	}
+	o_stream_cork(reply_output);
 
 	ctx = config_export_init(wanted_modules, CONFIG_DUMP_SCOPE_SET, 0,
-				 config_request_output, conn->output);
+				 config_request_output, reply_output);
 	config_export_by_filter(ctx, &filter);
 	config_export_get_output(ctx, &output);
 
@@ -126,26 +201,36 @@ static int config_connection_request(struct config_connection *conn,
 		const char *const *s;
 
 		for (s = output.specific_services; *s != NULL; s++) {
-			o_stream_nsend_str(conn->output,
+			o_stream_nsend_str(reply_output,
 				t_strdup_printf("service=%s\t", *s));
 		}
 	}
 	if (output.service_uses_local)
-		o_stream_nsend_str(conn->output, "service-uses-local\t");
+		o_stream_nsend_str(reply_output, "service-uses-local\t");
 	if (output.service_uses_remote)
-		o_stream_nsend_str(conn->output, "service-uses-remote\t");
+		o_stream_nsend_str(reply_output, "service-uses-remote\t");
 	if (output.used_local)
-		o_stream_nsend_str(conn->output, "used-local\t");
+		o_stream_nsend_str(reply_output, "used-local\t");
 	if (output.used_remote)
-		o_stream_nsend_str(conn->output, "used-remote\t");
-	o_stream_nsend_str(conn->output, "\n");
+		o_stream_nsend_str(reply_output, "used-remote\t");
+	o_stream_nsend_str(reply_output, "\n");
 
 	if (config_export_finish(&ctx) < 0) {
+		o_stream_unref(&reply_output);
+		if (reply != NULL)
+			str_free(&reply);
 		config_connection_destroy(conn);
 		return -1;
 	}
-	o_stream_nsend_str(conn->output, "\n");
-	o_stream_uncork(conn->output);
+	o_stream_nsend_str(reply_output, "\n");
+	o_stream_uncork(reply_output);
+	o_stream_unref(&reply_output);
+
+	if (reply != NULL) {
+		config_snapshot_write(snapshot_key, generation, reply);
+		o_stream_nsend(conn->output, str_data(reply), str_len(reply));
+		str_free(&reply);
+	}
 	return 0;
 }
 
@@ -3,9 +3,9 @@
 /*
    Handshaking:
 
-   Incoming director connections send:
+   Incoming director connections send after receiving the remote's ME:
 
-   VERSION
+   VERSION (with users-since=<timestamp>)
    ME
    <wait for DONE from remote handshake>
    DONE
@@ -20,7 +20,8 @@
    HOST-HAND-START
    [0..n] HOST
    HOST-HAND-END
-   [0..n] USER
+   <wait for VERSION from remote>
+   [0..n] USER or USERS-BIN (only users updated since users-since)
    <possibly other non-handshake commands between USERs>
    DONE
    <wait for DONE from remote>
@@ -36,6 +37,8 @@
 #include "ostream.h"
 #include "str.h"
 #include "strescape.h"
+#include "base64.h"
+#include "numpack.h"
 #include "master-service.h"
 #include "mail-host.h"
 #include "director.h"
@@ -46,7 +49,8 @@
 
 #include <unistd.h>
 
-#define MAX_INBUF_SIZE 1024
+/* USERS-BIN lines are longer than the other lines */
+#define MAX_INBUF_SIZE (1024*16)
 #define MAX_OUTBUF_SIZE (1024*1024*10)
 #define OUTBUF_FLUSH_THRESHOLD (1024*128)
 /* Max idling time before "ME" command must have been received,
@@ -79,6 +83,10 @@
    notification and reset the last_sync_seq */
 #define DIRECTOR_SYNC_STALE_TIMESTAMP_RESET_SECS (60*2)
 #define DIRECTOR_MAX_CLOCK_DIFF_WARN_SECS 1
+/* Flush USERS-BIN line when its packed user data or host list gets this
+   large. The resulting line must fit into MAX_INBUF_SIZE. */
+#define DIRECTOR_USERS_BIN_MAX_DATA_SIZE 4096
+#define DIRECTOR_USERS_BIN_MAX_HOSTS 64
 
 #if DIRECTOR_CONNECTION_DONE_TIMEOUT_MSECS <= DIRECTOR_CONNECTION_PING_TIMEOUT_MSECS
 #  error DIRECTOR_CONNECTION_DONE_TIMEOUT_MSECS is too low
@@ -92,6 +100,7 @@
 	(str_array_length(args) > 2)
 
 #define DIRECTOR_OPT_CONSISTENT_HASHING "consistent-hashing"
+#define DIRECTOR_OPT_MAX_HOST_LOAD "max-host-load="
 
 struct director_connection {
 	struct director *dir;
@@ -112,6 +121,14 @@ struct director_connection {
 	struct timeout *to_disconnect, *to_ping, *to_pong;
 
 	struct user_directory_iter *user_iter;
+	/* send only users whose timestamp is at least this */
+	unsigned int users_since;
+	/* USERS-BIN line being built: packed users and the hosts they use */
+	buffer_t *users_bin_data;
+	ARRAY(struct ip_addr) users_bin_hosts;
+	unsigned int users_bin_prev_timestamp;
+	/* number of users received in handshake */
+	unsigned int handshake_users_count;
 
 	/* set during command execution */
 	const char *cur_cmd, *cur_line;
@@ -127,8 +144,8 @@ struct director_connection {
 	unsigned int synced:1;
 	unsigned int wrong_host:1;
 	unsigned int verifying_left:1;
-	unsigned int users_unsorted:1;
 	unsigned int done_pending:1;
+	unsigned int users_bin:1;
 };
 
 static void director_connection_disconnected(struct director_connection **conn,
@@ -139,6 +156,9 @@ static void
 director_connection_log_disconnect(struct director_connection *conn, int err,
 				   const char *errstr);
 static int director_connection_send_done(struct director_connection *conn);
+static void director_connection_send_handshake(struct director_connection *conn);
+static void
+director_connection_send_users_start(struct director_connection *conn);
 
 static void ATTR_FORMAT(2, 3)
 director_cmd_error(struct director_connection *conn, const char *fmt, ...)
@@ -275,6 +295,7 @@ static bool director_connection_assign_left(struct director_connection *conn)
 		return TRUE;
 	}
 	dir->left = conn;
+	director_left_sync_set(&dir->left_sync, conn->host);
 	i_free(conn->name);
 	conn->name = i_strdup_printf("%s/left", conn->host->name);
 	director_connection_assigned(conn);
@@ -445,7 +466,12 @@ static bool director_cmd_me(struct director_connection *conn,
 			"waiting %u secs before allowing further communication",
 			conn->name, (unsigned int)(next_comm_attempt-ioloop_time));
 		return FALSE;
-	} else if (dir->left == NULL) {
+	}
+	/* now that we know who the remote is, we can tell it which users
+	   we're still missing */
+	director_connection_send_handshake(conn);
+
+	if (dir->left == NULL) {
 		/* a) - just in case the left is also our right side reset
 		   its failed state, so we can connect to it */
 		conn->host->last_network_failure = 0;
@@ -595,6 +621,20 @@ director_user_refresh(struct director_connection *conn,
 	return ret;
 }
 
+static void
+director_handshake_user(struct director_connection *conn,
+			unsigned int username_hash, struct mail_host *host,
+			unsigned int timestamp, bool weak)
+{
+	struct user *user;
+
+	(void)director_user_refresh(conn, username_hash, host,
+				    timestamp, weak, &user);
+	if (user->timestamp < timestamp)
+		user_directory_set_timestamp(conn->dir->users, user, timestamp);
+	conn->handshake_users_count++;
+}
+
 static bool
 director_handshake_cmd_user(struct director_connection *conn,
 			    const char *const *args)
@@ -602,7 +642,6 @@ director_handshake_cmd_user(struct director_connection *conn,
 	unsigned int username_hash, timestamp;
 	struct ip_addr ip;
 	struct mail_host *host;
-	struct user *user;
 	bool weak;
 
 	if (str_array_length(args) < 3 ||
@@ -621,11 +660,76 @@ director_handshake_cmd_user(struct director_connection *conn,
 		return FALSE;
 	}
 
-	(void)director_user_refresh(conn, username_hash, host,
-				    timestamp, weak, &user);
-	if (user->timestamp < timestamp) {
-		conn->users_unsorted = TRUE;
-		user->timestamp = timestamp;
+	director_handshake_user(conn, username_hash, host, timestamp, weak);
+	return TRUE;
+}
+
+static bool
+director_handshake_cmd_users_bin(struct director_connection *conn,
+				 const char *const *args)
+{
+	ARRAY(struct mail_host *) hosts;
+	struct mail_host *host, *const *hostp;
+	struct ip_addr ip;
+	buffer_t *data;
+	const uint8_t *p, *end;
+	uint64_t diff, num;
+	unsigned int i, username_hash, timestamp = 0;
+	size_t len;
+
+	/* USERS-BIN <base64 packed users> [<host ip> ..] */
+	if (args[0] == NULL) {
+		director_cmd_error(conn, "Invalid parameters");
+		return FALSE;
+	}
+	t_array_init(&hosts, 8);
+	for (i = 1; args[i] != NULL; i++) {
+		if (net_addr2ip(args[i], &ip) < 0) {
+			director_cmd_error(conn, "Invalid host IP");
+			return FALSE;
+		}
+		host = mail_host_lookup(conn->dir->mail_hosts, &ip);
+		if (host == NULL) {
+			i_error("director(%s): USERS-BIN used unknown host %s "
+				"in handshake", conn->name, args[i]);
+			return FALSE;
+		}
+		array_append(&hosts, &host, 1);
+	}
+
+	len = strlen(args[0]);
+	data = buffer_create_dynamic(pool_datastack_create(),
+				     MAX_BASE64_DECODED_SIZE(len));
+	if (base64_decode(args[0], len, NULL, data) < 0) {
+		director_cmd_error(conn, "Invalid base64 data");
+		return FALSE;
+	}
+
+	/* each user is: <timestamp difference to previous user, with the
+	   lowest bit being the sign> <32bit username hash>
+	   <host index << 1 | weak> */
+	p = data->data; end = p + data->used;
+	while (p < end) {
+		if (numpack_decode(&p, end, &diff) < 0 || end - p < 4) {
+			director_cmd_error(conn, "Truncated user data");
+			return FALSE;
+		}
+		if ((diff & 1) != 0)
+			timestamp -= diff >> 1;
+		else
+			timestamp += diff >> 1;
+		username_hash = ((unsigned int)p[0] << 24) |
+			((unsigned int)p[1] << 16) |
+			((unsigned int)p[2] << 8) | p[3];
+		p += 4;
+		if (numpack_decode(&p, end, &num) < 0 ||
+		    (num >> 1) >= array_count(&hosts)) {
+			director_cmd_error(conn, "Invalid user host index");
+			return FALSE;
+		}
+		hostp = array_idx(&hosts, num >> 1);
+		director_handshake_user(conn, username_hash, *hostp,
+					timestamp, (num & 1) != 0);
 	}
 	return TRUE;
 }
@@ -1130,17 +1234,20 @@ static bool director_handshake_cmd_done(struct director_connection *conn)
 	unsigned int handshake_secs = time(NULL) - conn->created;
 	string_t *str;
 
-	if (conn->users_unsorted && conn->user_iter == NULL) {
-		/* we sent our user list before receiving remote's */
-		conn->users_unsorted = FALSE;
-		user_directory_sort(conn->dir->users);
+	if (conn->in && conn->handshake_users_count > 0) {
+		/* these users didn't go through the ring, so their
+		   timestamps don't tell when we learned about them */
+		dir->last_users_merge_time = ioloop_time;
 	}
 
 	str = t_str_new(128);
 	str_printfa(str, "director(%s): Handshake finished in %u secs "
-		    "(bytes in=%"PRIuUOFF_T" out=%"PRIuUOFF_T")",
+		    "(bytes in=%"PRIuUOFF_T" out=%"PRIuUOFF_T,
 		    conn->name, handshake_secs, conn->input->v_offset,
 		    conn->output->offset);
+	if (conn->in)
+		str_printfa(str, " users=%u", conn->handshake_users_count);
+	str_append_c(str, ')');
 	if (handshake_secs >= DIRECTOR_HANDSHAKE_WARN_SECS)
 		i_warning("%s", str_c(str));
 	else
@@ -1174,20 +1281,59 @@ director_handshake_cmd_options(struct director_connection *conn,
 			       const char *const *args)
 {
 	bool consistent_hashing = FALSE;
-	unsigned int i;
+	unsigned int i, max_host_load = 0;
 
 	for (i = 0; args[i] != NULL; i++) {
 		if (strcmp(args[i], DIRECTOR_OPT_CONSISTENT_HASHING) == 0)
 			consistent_hashing = TRUE;
+		else if (strncmp(args[i], DIRECTOR_OPT_MAX_HOST_LOAD,
+				 strlen(DIRECTOR_OPT_MAX_HOST_LOAD)) == 0) {
+			if (str_to_uint(args[i] + strlen(DIRECTOR_OPT_MAX_HOST_LOAD),
+					&max_host_load) < 0) {
+				director_cmd_error(conn, "Invalid max-host-load");
+				return -1;
+			}
+		}
 	}
 	if (consistent_hashing != conn->dir->set->director_consistent_hashing) {
 		i_error("director(%s): director_consistent_hashing settings differ between directors",
 			conn->name);
 		return -1;
 	}
+	if (max_host_load != conn->dir->set->director_max_host_load) {
+		i_error("director(%s): director_max_host_load settings differ between directors",
+			conn->name);
+		return -1;
+	}
 	return 1;
 }
 
+static int
+director_handshake_version_args(struct director_connection *conn,
+				const char *const *args)
+{
+	struct director *dir = conn->dir;
+	unsigned int since = 0;
+
+	for (; *args != NULL; args++) {
+		if (strncmp(*args, "users-since=", 12) == 0 &&
+		    str_to_uint(*args + 12, &since) < 0) {
+			director_cmd_error(conn, "Invalid users-since");
+			return -1;
+		}
+	}
+	if (since != 0 && dir->last_users_merge_time +
+	    DIRECTOR_USERS_SINCE_MARGIN_SECS >= (time_t)since) {
+		/* we may have received users with old timestamps in a
+		   handshake after the remote lost its connection to us.
+		   send everything. */
+		since = 0;
+	}
+	conn->users_since = since;
+	conn->users_bin = conn->minor_version >= DIRECTOR_VERSION_USERS_BIN;
+	return 0;
+}
+
 static int
 director_connection_handle_handshake(struct director_connection *conn,
 				     const char *cmd, const char *const *args)
@@ -1218,6 +1364,13 @@ director_connection_handle_handshake(struct director_connection *conn,
 			return FALSE;
 		}
 		conn->version_received = TRUE;
+		if (!conn->in) {
+			/* now that we know what the remote wants,
+			   start sending our users to it */
+			if (director_handshake_version_args(conn, args + 3) < 0)
+				return -1;
+			director_connection_send_users_start(conn);
+		}
 		if (conn->done_pending) {
 			if (director_connection_send_done(conn) < 0)
 				return -1;
@@ -1261,6 +1414,8 @@ director_connection_handle_handshake(struct director_connection *conn,
 
 	if (conn->in && strcmp(cmd, "USER") == 0 && CMD_IS_USER_HANDHAKE(args))
 		return director_handshake_cmd_user(conn, args) ? 1 : -1;
+	if (conn->in && strcmp(cmd, "USERS-BIN") == 0)
+		return director_handshake_cmd_users_bin(conn, args) ? 1 : -1;
 
 	/* both get DONE */
 	if (strcmp(cmd, "DONE") == 0)
@@ -1725,15 +1880,27 @@ director_connection_send_hosts(struct director_connection *conn, string_t *str)
 
 static int director_connection_send_done(struct director_connection *conn)
 {
+	const struct director_settings *set = conn->dir->set;
+
 	i_assert(conn->version_received);
 
-	if (!conn->dir->set->director_consistent_hashing)
+	if (!set->director_consistent_hashing &&
+	    set->director_max_host_load == 0)
 		;
 	else if (conn->minor_version >= DIRECTOR_VERSION_OPTIONS) {
-		director_connection_send(conn,
-			"OPTIONS\t"DIRECTOR_OPT_CONSISTENT_HASHING"\n");
+		string_t *str = t_str_new(64);
+
+		str_append(str, "OPTIONS");
+		if (set->director_consistent_hashing)
+			str_append(str, "\t"DIRECTOR_OPT_CONSISTENT_HASHING);
+		if (set->director_max_host_load != 0) {
+			str_printfa(str, "\t"DIRECTOR_OPT_MAX_HOST_LOAD"%u",
+				    set->director_max_host_load);
+		}
+		str_append_c(str, '\n');
+		director_connection_send(conn, str_c(str));
 	} else {
-		i_error("director(%s): Director version is too old for supporting director_consistent_hashing=yes",
+		i_error("director(%s): Director version is too old for supporting director_consistent_hashing or director_max_host_load",
 			conn->name);
 		return -1;
 	}
@@ -1742,23 +1909,105 @@ static int director_connection_send_done(struct director_connection *conn)
 	return 0;
 }
 
+static void
+director_connection_users_bin_flush(struct director_connection *conn)
+{
+	const struct ip_addr *ip;
+	string_t *str;
+
+	if (conn->users_bin_data->used == 0)
+		return;
+
+	str = t_str_new(MAX_BASE64_ENCODED_SIZE(conn->users_bin_data->used) +
+			array_count(&conn->users_bin_hosts) * 16 + 16);
+	str_append(str, "USERS-BIN\t");
+	base64_encode(conn->users_bin_data->data, conn->users_bin_data->used,
+		      str);
+	array_foreach(&conn->users_bin_hosts, ip) {
+		str_append_c(str, '\t');
+		str_append(str, net_ip2addr(ip));
+	}
+	str_append_c(str, '\n');
+	director_connection_send(conn, str_c(str));
+
+	buffer_set_used_size(conn->users_bin_data, 0);
+	array_clear(&conn->users_bin_hosts);
+	conn->users_bin_prev_timestamp = 0;
+}
+
+static void
+director_connection_users_bin_add(struct director_connection *conn,
+				  const struct user *user)
+{
+	const struct ip_addr *ips;
+	unsigned char hash[4];
+	unsigned int idx, count;
+
+	ips = array_get(&conn->users_bin_hosts, &count);
+	for (idx = 0; idx < count; idx++) {
+		if (net_ip_compare(&ips[idx], &user->host->ip))
+			break;
+	}
+	if (idx == count) {
+		if (count == DIRECTOR_USERS_BIN_MAX_HOSTS) {
+			director_connection_users_bin_flush(conn);
+			idx = 0;
+		}
+		array_append(&conn->users_bin_hosts, &user->host->ip, 1);
+	}
+
+	/* users are sorted by timestamp, so the differences are small */
+	if (user->timestamp >= conn->users_bin_prev_timestamp) {
+		numpack_encode(conn->users_bin_data,
+			(uint64_t)(user->timestamp -
+				   conn->users_bin_prev_timestamp) << 1);
+	} else {
+		numpack_encode(conn->users_bin_data,
+			((uint64_t)(conn->users_bin_prev_timestamp -
+				    user->timestamp) << 1) | 1);
+	}
+	hash[0] = user->username_hash >> 24;
+	hash[1] = user->username_hash >> 16;
+	hash[2] = user->username_hash >> 8;
+	hash[3] = user->username_hash;
+	buffer_append(conn->users_bin_data, hash, sizeof(hash));
+	numpack_encode(conn->users_bin_data,
+		       (idx << 1) | (user->weak ? 1 : 0));
+	conn->users_bin_prev_timestamp = user->timestamp;
+
+	if (conn->users_bin_data->used >= DIRECTOR_USERS_BIN_MAX_DATA_SIZE)
+		director_connection_users_bin_flush(conn);
+}
+
+static void
+director_connection_send_user(struct director_connection *conn,
+			      const struct user *user)
+{
+	string_t *str = t_str_new(128);
+
+	str_printfa(str, "USER\t%u\t%s\t%u", user->username_hash,
+		    net_ip2addr(&user->host->ip), user->timestamp);
+	if (user->weak)
+		str_append(str, "\tw");
+	str_append_c(str, '\n');
+	director_connection_send(conn, str_c(str));
+}
+
 static int director_connection_send_users(struct director_connection *conn)
 {
 	struct user *user;
 	int ret;
 
 	while ((user = user_directory_iter_next(conn->user_iter)) != NULL) {
+		if (user->timestamp < conn->users_since) {
+			/* remote already has this */
+			continue;
+		}
 		T_BEGIN {
-			string_t *str = t_str_new(128);
-
-			str_printfa(str, "USER\t%u\t%s\t%u",
-				    user->username_hash,
-				    net_ip2addr(&user->host->ip),
-				    user->timestamp);
-			if (user->weak)
-				str_append(str, "\tw");
-			str_append_c(str, '\n');
-			director_connection_send(conn, str_c(str));
+			if (conn->users_bin)
+				director_connection_users_bin_add(conn, user);
+			else
+				director_connection_send_user(conn, user);
 		} T_END;
 
 		if (o_stream_get_buffer_used_size(conn->output) >= OUTBUF_FLUSH_THRESHOLD) {
@@ -1769,6 +2018,9 @@ static int director_connection_send_users(struct director_connection *conn)
 			}
 		}
 	}
+	if (conn->users_bin) T_BEGIN {
+		director_connection_users_bin_flush(conn);
+	} T_END;
 	user_directory_iter_deinit(&conn->user_iter);
 	if (!conn->version_received)
 		conn->done_pending = TRUE;
@@ -1777,12 +2029,6 @@ static int director_connection_send_users(struct director_connection *conn)
 			return -1;
 	}
 
-	if (conn->users_unsorted && conn->handshake_received) {
-		/* we received remote's list of users before sending ours */
-		conn->users_unsorted = FALSE;
-		user_directory_sort(conn->dir->users);
-	}
-
 	ret = o_stream_flush(conn->output);
 	timeout_reset(conn->to_ping);
 	return ret;
@@ -1828,12 +2074,40 @@ director_connection_init_common(struct director *dir, int fd)
 
 static void director_connection_send_handshake(struct director_connection *conn)
 {
-	director_connection_send(conn, t_strdup_printf(
-		"VERSION\t"DIRECTOR_VERSION_NAME"\t%u\t%u\n"
-		"ME\t%s\t%u\t%lld\n",
-		DIRECTOR_VERSION_MAJOR, DIRECTOR_VERSION_MINOR,
-		net_ip2addr(&conn->dir->self_ip), conn->dir->self_port,
-		(long long)time(NULL)));
+	string_t *str = t_str_new(128);
+
+	str_printfa(str, "VERSION\t"DIRECTOR_VERSION_NAME"\t%u\t%u",
+		    DIRECTOR_VERSION_MAJOR, DIRECTOR_VERSION_MINOR);
+	if (conn->in) {
+		/* we'll receive the remote's users. older versions ignore
+		   the extra parameter and send everything. */
+		str_printfa(str, "\tusers-since=%u",
+			    director_left_sync_get_users_since(
+				&conn->dir->left_sync, conn->host,
+				ioloop_time));
+	}
+	str_printfa(str, "\nME\t%s\t%u\t%lld\n",
+		    net_ip2addr(&conn->dir->self_ip), conn->dir->self_port,
+		    (long long)time(NULL));
+	director_connection_send(conn, str_c(str));
+}
+
+static void
+director_connection_send_users_start(struct director_connection *conn)
+{
+	i_assert(conn->user_iter == NULL);
+
+	if (conn->users_bin) {
+		conn->users_bin_data =
+			buffer_create_dynamic(default_pool,
+					      DIRECTOR_USERS_BIN_MAX_DATA_SIZE + 32);
+		i_array_init(&conn->users_bin_hosts, 16);
+	}
+	conn->user_iter = user_directory_iter_init(conn->dir->users);
+	o_stream_cork(conn->output);
+	if (director_connection_send_users(conn) == 0)
+		o_stream_set_flush_pending(conn->output, TRUE);
+	o_stream_uncork(conn->output);
 }
 
 struct director_connection *
@@ -1847,14 +2121,12 @@ director_connection_init_in(struct director *dir, int fd,
 	conn->connected = TRUE;
 	conn->name = i_strdup_printf("%s/in", net_ip2addr(ip));
 	conn->io = io_add(conn->fd, IO_READ, director_connection_input, conn);
-
-	director_connection_send_handshake(conn);
+	/* the handshake is sent after we know who the remote is */
 	return conn;
 }
 
 static void director_connection_connected(struct director_connection *conn)
 {
-	struct director *dir = conn->dir;
 	string_t *str = t_str_new(1024);
 	int err;
 
@@ -1880,10 +2152,7 @@ static void director_connection_connected(struct director_connection *conn)
 	director_connection_send_directors(conn, str);
 	director_connection_send_hosts(conn, str);
 	director_connection_send(conn, str_c(str));
-
-	conn->user_iter = user_directory_iter_init(dir->users);
-	if (director_connection_send_users(conn) == 0)
-		o_stream_set_flush_pending(conn->output, TRUE);
+	/* users are sent after we know the remote's version */
 	o_stream_uncork(conn->output);
 }
 
@@ -1936,6 +2205,12 @@ void director_connection_deinit(struct director_connection **_conn,
 	i_assert(i < count);
 	if (dir->left == conn) {
 		dir->left = NULL;
+		if (dir->ring_synced)
+			dir->left_sync.disconnect_time = ioloop_time;
+		else {
+			/* we may not have received all of its users */
+			director_left_sync_set(&dir->left_sync, NULL);
+		}
 		/* if there is already another handshaked incoming connection,
 		   use it as the new "left" */
 		director_assign_left(dir);
@@ -1949,6 +2224,10 @@ void director_connection_deinit(struct director_connection **_conn,
 		director_host_unref(conn->connect_request_to);
 	if (conn->user_iter != NULL)
 		user_directory_iter_deinit(&conn->user_iter);
+	if (conn->users_bin_data != NULL) {
+		buffer_free(&conn->users_bin_data);
+		array_free(&conn->users_bin_hosts);
+	}
 	if (conn->to_disconnect != NULL)
 		timeout_remove(&conn->to_disconnect);
 	if (conn->to_pong != NULL)
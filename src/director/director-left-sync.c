@@ -0,0 +1,34 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "director-host.h"
+#include "director-left-sync.h"
+
+void director_left_sync_set(struct director_left_sync *sync,
+			    const struct director_host *host)
+{
+	memset(sync, 0, sizeof(*sync));
+	if (host != NULL) {
+		sync->ip = host->ip;
+		sync->port = host->port;
+	}
+}
+
+unsigned int
+director_left_sync_get_users_since(const struct director_left_sync *sync,
+				   const struct director_host *remote,
+				   time_t now)
+{
+	time_t since;
+
+	if (sync->port == 0 || sync->port != remote->port ||
+	    !net_ip_compare(&sync->ip, &remote->ip))
+		return 0;
+
+	/* we've been receiving the user updates from the remote until it
+	   disconnected (or still are) */
+	since = sync->disconnect_time != 0 ? sync->disconnect_time : now;
+	if (since <= DIRECTOR_USERS_SINCE_MARGIN_SECS)
+		return 0;
+	return since - DIRECTOR_USERS_SINCE_MARGIN_SECS;
+}
@@ -0,0 +1,38 @@
+#ifndef DIRECTOR_LEFT_SYNC_H
+#define DIRECTOR_LEFT_SYNC_H
+
+#include "net.h"
+
+struct director_host;
+
+/* Some extra time to ask for in users-since, in case the remote's clock
+   differs from ours or the user updates were delayed in the ring. */
+#define DIRECTOR_USERS_SINCE_MARGIN_SECS 60
+
+/* Tracks the director whose user updates we have been receiving from our
+   left side. If the same director connects to us again, it only needs to
+   send us the users that have changed since we lost the connection. */
+struct director_left_sync {
+	/* Our current or last left director. The port is 0 if we don't
+	   know that we have all of its users (e.g. the ring wasn't synced
+	   when the connection was lost). */
+	struct ip_addr ip;
+	in_port_t port;
+	/* When the connection to it was lost, 0 if it's still our left. */
+	time_t disconnect_time;
+};
+
+/* Remember host as our left director, or forget it if host is NULL. */
+void director_left_sync_set(struct director_left_sync *sync,
+			    const struct director_host *host);
+
+/* Returns the users-since timestamp that we can ask in the handshake from
+   the remote director connecting to us, or 0 if it must send all its
+   users. A different director than our last left may have been in a
+   separate ring, so it may have users that we've never seen. */
+unsigned int
+director_left_sync_get_users_since(const struct director_left_sync *sync,
+				   const struct director_host *remote,
+				   time_t now);
+
+#endif
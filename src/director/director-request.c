@@ -297,8 +297,8 @@ bool director_request_continue(struct director_request *request)
 				  request->username_hash);
 			return FALSE;
 		}
-		host = mail_host_get_by_hash(dir->mail_hosts,
-					     request->username_hash, tag);
+		host = mail_host_get_for_new_user(dir->mail_hosts,
+						  request->username_hash, tag);
 		if (host == NULL) {
 			/* all hosts have been removed */
 			request->delay_reason = REQUEST_DELAY_NOHOSTS;
@@ -74,6 +74,7 @@ static const struct setting_define director_setting_defines[] = {
 	DEF(SET_TIME, director_user_expire),
 	DEF(SET_TIME, director_user_kick_delay),
 	DEF(SET_IN_PORT, director_doveadm_port),
+	DEF(SET_UINT, director_max_host_load),
 	DEF(SET_BOOL, director_consistent_hashing),
 
 	SETTING_DEFINE_LIST_END
@@ -87,7 +88,8 @@ const struct director_settings director_default_settings = {
 	.director_username_hash = "%Lu",
 	.director_user_expire = 60*15,
 	.director_user_kick_delay = 2,
-	.director_doveadm_port = 0
+	.director_doveadm_port = 0,
+	.director_max_host_load = 0
 };
 
 const struct setting_parser_info director_setting_parser_info = {
@@ -113,6 +115,11 @@ director_settings_verify(void *_set, pool_t pool ATTR_UNUSED, const char **error
 		*error_r = "director_user_expire is too low";
 		return FALSE;
 	}
+	if (set->director_max_host_load != 0 &&
+	    set->director_max_host_load <= 100) {
+		*error_r = "director_max_host_load must be over 100";
+		return FALSE;
+	}
 	return TRUE;
 }
 /* </settings checks> */
@@ -12,6 +12,7 @@ struct director_settings {
 	unsigned int director_user_expire;
 	unsigned int director_user_kick_delay;
 	in_port_t director_doveadm_port;
+	unsigned int director_max_host_load;
 	bool director_consistent_hashing;
 };
 
@@ -13,6 +13,15 @@
 
    Finally, this program connects to director-admin socket where it adds
    and removes mail hosts.
+
+   The time it takes for the connecting director to send its handshake
+   (including the user list) is logged for each director connection, which
+   can be used to compare resync times with different numbers of users.
+
+   The number of IMAP connections in each host is logged periodically
+   together with the most loaded host compared to its share of the
+   connections, which can be used to compare the load balancing with
+   different director_max_host_load settings.
 */
 
 #include "lib.h"
@@ -22,6 +31,7 @@
 #include "write-full.h"
 #include "hash.h"
 #include "llist.h"
+#include "time-util.h"
 #include "imap-parser.h"
 #include "master-service.h"
 #include "master-service-settings.h"
@@ -36,12 +46,15 @@
 #define ADMIN_RANDOM_TIMEOUT_MSECS 500
 #define DIRECTOR_CONN_MAX_DELAY_MSECS 100
 #define DIRECTOR_DISCONNECT_TIMEOUT_SECS 10
+#define HOST_LOAD_LOG_INTERVAL_MSECS (1000*10)
 
 struct host {
 	int refcount;
 
 	struct ip_addr ip;
 	unsigned int vhost_count;
+	/* number of IMAP connections currently logged into this host */
+	unsigned int connections;
 };
 
 struct user {
@@ -63,6 +76,7 @@ struct imap_client {
 	struct ostream *output;
 	struct imap_parser *parser;
 	struct user *user;
+	struct host *host;
 
 	char *username;
 };
@@ -75,6 +89,12 @@ struct director_connection {
 	struct istream *in_input, *out_input;
 	struct ostream *in_output, *out_output;
 	struct timeout *to_delay;
+
+	/* for finding the handshake's DONE line from the connecting side */
+	struct timeval created;
+	char in_line_prefix[4];
+	unsigned int in_line_len;
+	bool in_handshake_done;
 };
 
 struct admin_connection {
@@ -93,6 +113,7 @@ static HASH_TABLE(struct ip_addr *, struct host *) hosts;
 static ARRAY(struct host *) hosts_array;
 static struct admin_connection *admin;
 static struct timeout *to_disconnect;
+static struct timeout *to_host_load;
 
 static void imap_client_destroy(struct imap_client **client);
 static void director_connection_destroy(struct director_connection **conn);
@@ -151,6 +172,10 @@ static void client_username_check(struct imap_client *client)
 	user->last_seen = ioloop_time;
 	user->host->refcount++;
 
+	client->host = host;
+	host->refcount++;
+	host->connections++;
+
 	if (user->to != NULL)
 		timeout_remove(&user->to);
 }
@@ -273,6 +298,11 @@ static void imap_client_destroy(struct imap_client **_client)
 		}
 		user->last_seen = ioloop_time;
 	}
+	if (client->host != NULL) {
+		i_assert(client->host->connections > 0);
+		client->host->connections--;
+		host_unref(&client->host);
+	}
 
 	DLLIST_REMOVE(&imap_clients, client);
 	imap_parser_unref(&client->parser);
@@ -286,6 +316,33 @@ static void imap_client_destroy(struct imap_client **_client)
 	master_service_client_connection_destroyed(master_service);
 }
 
+static void
+director_connection_find_done(struct director_connection *conn,
+			      const unsigned char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size && !conn->in_handshake_done; i++) {
+		if (data[i] != '\n') {
+			if (conn->in_line_len < sizeof(conn->in_line_prefix))
+				conn->in_line_prefix[conn->in_line_len] = data[i];
+			conn->in_line_len++;
+			continue;
+		}
+		if (conn->in_line_len == 4 &&
+		    memcmp(conn->in_line_prefix, "DONE", 4) == 0) {
+			conn->in_handshake_done = TRUE;
+			i_info("Director handshake sent in %d msecs "
+			       "(%"PRIuUOFF_T" bytes, %u test users)",
+			       timeval_diff_msecs(&ioloop_timeval,
+						  &conn->created),
+			       conn->in_input->v_offset + i + 1,
+			       hash_table_count(users));
+		}
+		conn->in_line_len = 0;
+	}
+}
+
 static void
 director_connection_input(struct director_connection *conn,
 			  struct istream *input, struct ostream *output)
@@ -298,6 +355,8 @@ director_connection_input(struct director_connection *conn,
 		return;
 	}
 
+	if (input == conn->in_input && !conn->in_handshake_done)
+		director_connection_find_done(conn, data, size);
 	o_stream_nsend(output, data, size);
 	i_stream_skip(input, size);
 
@@ -343,6 +402,7 @@ director_connection_create(int in_fd, const struct ip_addr *local_ip,
 	}
 
 	conn = i_new(struct director_connection, 1);
+	conn->created = ioloop_timeval;
 	conn->in_fd = in_fd;
 	conn->in_input = i_stream_create_fd(conn->in_fd, (size_t)-1, FALSE);
 	conn->in_output = o_stream_create_fd(conn->in_fd, (size_t)-1, FALSE);
@@ -534,6 +594,39 @@ director_connection_disconnect_timeout(void *context ATTR_UNUSED)
 	}
 }
 
+static void ATTR_NULL(1)
+host_load_log(void *context ATTR_UNUSED)
+{
+	struct host *const *hostp, *max_host = NULL;
+	uint64_t connections = 0, vhosts = 0, load, max_load = 0;
+
+	array_foreach(&hosts_array, hostp) {
+		connections += (*hostp)->connections;
+		vhosts += (*hostp)->vhost_count;
+	}
+	if (connections == 0 || vhosts == 0)
+		return;
+
+	/* host's load as percentage of its share of the connections */
+	array_foreach(&hosts_array, hostp) {
+		if ((*hostp)->vhost_count == 0)
+			continue;
+		load = (*hostp)->connections * vhosts * 100 /
+			(connections * (*hostp)->vhost_count);
+		if (max_host == NULL || load > max_load) {
+			max_host = *hostp;
+			max_load = load;
+		}
+	}
+	if (max_host == NULL)
+		return;
+	i_info("Host load: %u connections in %u hosts, "
+	       "max %u%% of share in %s (%u connections)",
+	       (unsigned int)connections, array_count(&hosts_array),
+	       (unsigned int)max_load, net_ip2addr(&max_host->ip),
+	       max_host->connections);
+}
+
 static void main_init(const char *admin_path)
 {
 	hash_table_create(&users, default_pool, 0, str_hash, strcmp);
@@ -547,6 +640,8 @@ static void main_init(const char *admin_path)
 	to_disconnect =
 		timeout_add(1000*(5 + rand()%DIRECTOR_DISCONNECT_TIMEOUT_SECS),
 			    director_connection_disconnect_timeout, (void *)NULL);
+	to_host_load = timeout_add(HOST_LOAD_LOG_INTERVAL_MSECS,
+				   host_load_log, (void *)NULL);
 }
 
 static void main_deinit(void)
@@ -563,6 +658,7 @@ static void main_deinit(void)
 	}
 
 	timeout_remove(&to_disconnect);
+	timeout_remove(&to_host_load);
 	while (director_connections != NULL) {
 		struct director_connection *conn = director_connections;
 		director_connection_destroy(&conn);
@@ -3,10 +3,11 @@
 
 #include "net.h"
 #include "director-settings.h"
+#include "director-left-sync.h"
 
 #define DIRECTOR_VERSION_NAME "director"
 #define DIRECTOR_VERSION_MAJOR 1
-#define DIRECTOR_VERSION_MINOR 7
+#define DIRECTOR_VERSION_MINOR 8
 
 /* weak users supported in protocol */
 #define DIRECTOR_VERSION_WEAK_USERS 1
@@ -24,6 +25,8 @@
 #define DIRECTOR_VERSION_UPDOWN 6
 /* user tag version 2 supported */
 #define DIRECTOR_VERSION_TAGS_V2 7
+/* handshake USERS-BIN and VERSION users-since supported */
+#define DIRECTOR_VERSION_USERS_BIN 8
 
 /* Minimum time between even attempting to communicate with a director that
    failed due to a protocol error. */
@@ -80,6 +83,10 @@ struct director {
 	/* the lowest minor version supported by the ring */
 	unsigned int ring_min_version;
 	time_t ring_last_sync_time;
+	/* whose user updates we've been receiving from our left side */
+	struct director_left_sync left_sync;
+	/* when we last received users in a handshake from our left side */
+	time_t last_users_merge_time;
 
 	time_t ring_first_alone;
 
@@ -67,7 +67,8 @@ static void doveadm_cmd_host_list_removed(struct doveadm_connection *conn)
 	string_t *str = t_str_new(1024);
 	int ret;
 
-	orig_hosts_list = mail_hosts_init(conn->dir->set->director_consistent_hashing);
+	orig_hosts_list = mail_hosts_init(conn->dir->set->director_consistent_hashing,
+					  conn->dir->set->director_max_host_load);
 	(void)mail_hosts_parse_and_add(orig_hosts_list,
 				       conn->dir->set->director_mail_servers);
 
@@ -503,7 +504,8 @@ doveadm_cmd_user_lookup(struct doveadm_connection *conn, const char *line)
 	}
 
 	/* get host if it wasn't in user directory */
-	host = mail_host_get_by_hash(conn->dir->mail_hosts, username_hash, tag);
+	host = mail_host_get_for_new_user(conn->dir->mail_hosts,
+					  username_hash, tag);
 	if (host == NULL)
 		str_append(str, "\t");
 	else
@@ -24,6 +24,9 @@ struct mail_host_list {
 	ARRAY(struct mail_tag *) tags;
 	ARRAY_TYPE(mail_host) hosts;
 	unsigned int hosts_hash;
+	/* Maximum number of users in a host as percentage of its share of
+	   the users (based on vhost count). 0 = unlimited. */
+	unsigned int max_host_load;
 	bool consistent_hashing;
 	bool vhosts_unsorted;
 	bool have_vhosts;
@@ -419,53 +422,112 @@ mail_host_lookup(struct mail_host_list *list, const struct ip_addr *ip)
 	return NULL;
 }
 
-static struct mail_host *
+static unsigned int
 mail_host_get_by_hash_ring(struct mail_tag *tag, unsigned int hash)
 {
-	const struct mail_vhost *vhosts;
 	unsigned int count, idx;
 
-	vhosts = array_get(&tag->vhosts, &count);
+	count = array_count(&tag->vhosts);
 	array_bsearch_insert_pos(&tag->vhosts, &hash,
 				 mail_vhost_hash_cmp, &idx);
 	i_assert(idx <= count);
-	if (idx == count) {
-		if (count == 0)
-			return NULL;
-		idx = 0;
-	}
-	return vhosts[idx % count].host;
+	return idx == count ? 0 : idx;
+}
+
+static bool
+mail_host_is_overloaded(struct mail_host *host, unsigned int max_host_load,
+			uint64_t users_count, uint64_t vhosts_count)
+{
+	/* host's share of the users (including the one being added) is
+	   users_count * vhost_count / vhosts_count */
+	return (uint64_t)host->user_count * vhosts_count * 100 >=
+		(users_count + 1) * host->vhost_count * max_host_load;
 }
 
 static struct mail_host *
-mail_host_get_by_hash_direct(struct mail_tag *tag, unsigned int hash)
+mail_host_get_bounded(struct mail_host_list *list, struct mail_tag *tag,
+		      unsigned int idx)
 {
 	const struct mail_vhost *vhosts;
-	unsigned int count;
+	struct mail_host *const *hostp;
+	uint64_t users_count = 0, vhosts_count = 0;
+	unsigned int i, count;
+
+	array_foreach(&list->hosts, hostp) {
+		if ((*hostp)->down || (*hostp)->tag != tag)
+			continue;
+		users_count += (*hostp)->user_count;
+		vhosts_count += (*hostp)->vhost_count;
+	}
 
+	/* Consistent hashing with bounded loads: continue walking the vhosts
+	   until we find a host that isn't over its limit. The limits add up
+	   to more than the total number of users, so there is always one. */
 	vhosts = array_get(&tag->vhosts, &count);
-	if (count == 0)
-		return NULL;
-	return vhosts[hash % count].host;
+	for (i = 0; i < count; i++) {
+		struct mail_host *host = vhosts[(idx + i) % count].host;
+
+		if (!mail_host_is_overloaded(host, list->max_host_load,
+					     users_count, vhosts_count))
+			return host;
+	}
+	return vhosts[idx].host;
 }
 
-struct mail_host *
-mail_host_get_by_hash(struct mail_host_list *list, unsigned int hash,
-		      const char *tag_name)
+static bool
+mail_host_get_vhost_idx(struct mail_host_list *list, unsigned int hash,
+			const char *tag_name, struct mail_tag **tag_r,
+			unsigned int *idx_r)
 {
 	struct mail_tag *tag;
+	unsigned int count;
 
 	if (list->vhosts_unsorted)
 		mail_hosts_sort(list);
 
 	tag = mail_tag_find(list, tag_name);
 	if (tag == NULL)
-		return NULL;
+		return FALSE;
 
+	count = array_count(&tag->vhosts);
+	if (count == 0)
+		return FALSE;
 	if (list->consistent_hashing)
-		return mail_host_get_by_hash_ring(tag, hash);
+		*idx_r = mail_host_get_by_hash_ring(tag, hash);
 	else
-		return mail_host_get_by_hash_direct(tag, hash);
+		*idx_r = hash % count;
+	*tag_r = tag;
+	return TRUE;
+}
+
+struct mail_host *
+mail_host_get_by_hash(struct mail_host_list *list, unsigned int hash,
+		      const char *tag_name)
+{
+	struct mail_tag *tag;
+	const struct mail_vhost *vhost;
+	unsigned int idx;
+
+	if (!mail_host_get_vhost_idx(list, hash, tag_name, &tag, &idx))
+		return NULL;
+	vhost = array_idx(&tag->vhosts, idx);
+	return vhost->host;
+}
+
+struct mail_host *
+mail_host_get_for_new_user(struct mail_host_list *list, unsigned int hash,
+			   const char *tag_name)
+{
+	struct mail_tag *tag;
+	const struct mail_vhost *vhost;
+	unsigned int idx;
+
+	if (!mail_host_get_vhost_idx(list, hash, tag_name, &tag, &idx))
+		return NULL;
+	if (list->max_host_load != 0)
+		return mail_host_get_bounded(list, tag, idx);
+	vhost = array_idx(&tag->vhosts, idx);
+	return vhost->host;
 }
 
 void mail_hosts_set_synced(struct mail_host_list *list)
@@ -513,12 +575,16 @@ bool mail_hosts_have_tags(struct mail_host_list *list)
 	return FALSE;
 }
 
-struct mail_host_list *mail_hosts_init(bool consistent_hashing)
+struct mail_host_list *
+mail_hosts_init(bool consistent_hashing, unsigned int max_host_load)
 {
 	struct mail_host_list *list;
 
+	i_assert(max_host_load == 0 || max_host_load > 100);
+
 	list = i_new(struct mail_host_list, 1);
 	list->consistent_hashing = consistent_hashing;
+	list->max_host_load = max_host_load;
 	i_array_init(&list->hosts, 16);
 	i_array_init(&list->tags, 4);
 	return list;
@@ -556,7 +622,7 @@ struct mail_host_list *mail_hosts_dup(const struct mail_host_list *src)
 	struct mail_host_list *dest;
 	struct mail_host *const *hostp, *dest_host;
 
-	dest = mail_hosts_init(src->consistent_hashing);
+	dest = mail_hosts_init(src->consistent_hashing, src->max_host_load);
 	array_foreach(&src->hosts, hostp) {
 		dest_host = mail_host_dup(*hostp);
 		array_append(&dest->hosts, &dest_host, 1);
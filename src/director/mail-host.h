@@ -32,9 +32,18 @@ mail_host_add_hostname(struct mail_host_list *list, const char *hostname,
 		       const struct ip_addr *ip, const char *tag_name);
 struct mail_host *
 mail_host_lookup(struct mail_host_list *list, const struct ip_addr *ip);
+/* Returns the host where the hash belongs to, regardless of the hosts'
+   loads. All directors with the same hosts return the same host. */
 struct mail_host *
 mail_host_get_by_hash(struct mail_host_list *list, unsigned int hash,
 		      const char *tag_name);
+/* Returns the host for a new user. This is the same as
+   mail_host_get_by_hash(), except with max_host_load the following hosts are
+   used if the host is overloaded. The result depends on this director's user
+   counts, so it must not be used for existing users. */
+struct mail_host *
+mail_host_get_for_new_user(struct mail_host_list *list, unsigned int hash,
+			   const char *tag_name);
 
 int mail_hosts_parse_and_add(struct mail_host_list *list,
 			     const char *hosts_string);
@@ -51,7 +60,10 @@ bool mail_hosts_have_usable(struct mail_host_list *list);
 const ARRAY_TYPE(mail_host) *mail_hosts_get(struct mail_host_list *list);
 bool mail_hosts_have_tags(struct mail_host_list *list);
 
-struct mail_host_list *mail_hosts_init(bool consistent_hashing);
+/* If max_host_load isn't 0, new users aren't assigned to hosts that already
+   have more than max_host_load% of their share of the users. */
+struct mail_host_list *
+mail_hosts_init(bool consistent_hashing, unsigned int max_host_load);
 void mail_hosts_deinit(struct mail_host_list **list);
 
 struct mail_host_list *mail_hosts_dup(const struct mail_host_list *src);
@@ -0,0 +1,83 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "director-host.h"
+#include "director-left-sync.h"
+#include "test-common.h"
+
+static void test_host_init(struct director_host *host, const char *ip)
+{
+	memset(host, 0, sizeof(*host));
+	if (net_addr2ip(ip, &host->ip) < 0)
+		i_unreached();
+	host->port = 9090;
+}
+
+static void test_director_left_sync_reconnect(void)
+{
+	struct director_left_sync sync;
+	struct director_host host_a, host_b;
+
+	test_begin("director left sync reconnect");
+	test_host_init(&host_a, "10.0.0.1");
+	test_host_init(&host_b, "10.0.0.2");
+
+	/* nothing is known yet */
+	director_left_sync_set(&sync, NULL);
+	test_assert(director_left_sync_get_users_since(&sync, &host_a, 1000) == 0);
+
+	/* A is our left. if it connects again while the old connection is
+	   still alive, we've been receiving all its updates */
+	director_left_sync_set(&sync, &host_a);
+	test_assert(director_left_sync_get_users_since(&sync, &host_a, 1000) ==
+		    1000 - DIRECTOR_USERS_SINCE_MARGIN_SECS);
+	test_assert(director_left_sync_get_users_since(&sync, &host_b, 1000) == 0);
+
+	/* A disconnected, but the ring was synced until then */
+	sync.disconnect_time = 900;
+	test_assert(director_left_sync_get_users_since(&sync, &host_a, 1000) ==
+		    900 - DIRECTOR_USERS_SINCE_MARGIN_SECS);
+	test_assert(director_left_sync_get_users_since(&sync, &host_b, 1000) == 0);
+
+	/* A disconnected while the ring wasn't synced */
+	director_left_sync_set(&sync, NULL);
+	test_assert(director_left_sync_get_users_since(&sync, &host_a, 1000) == 0);
+	test_end();
+}
+
+static void test_director_left_sync_split_merge(void)
+{
+	struct director_left_sync sync;
+	struct director_host host_a, host_c;
+
+	test_begin("director left sync split and merge");
+	test_host_init(&host_a, "10.0.0.1");
+	test_host_init(&host_c, "10.0.0.3");
+
+	/* ring A -> B -> C -> A as seen by B: C is our left. */
+	director_left_sync_set(&sync, &host_c);
+	/* the ring splits at 1000 into A -> B and C. A becomes our left. */
+	sync.disconnect_time = 1000;
+	director_left_sync_set(&sync, &host_a);
+	/* users are assigned on both sides during the split. when the ring
+	   heals at 5000, C connects to us while A is still our left. C must
+	   send us all its users, not only the recently changed ones. */
+	test_assert(director_left_sync_get_users_since(&sync, &host_c, 5000) == 0);
+	/* same when A has already disconnected */
+	sync.disconnect_time = 4990;
+	test_assert(director_left_sync_get_users_since(&sync, &host_c, 5000) == 0);
+	/* but A itself can still send only the changes */
+	test_assert(director_left_sync_get_users_since(&sync, &host_a, 5000) ==
+		    4990 - DIRECTOR_USERS_SINCE_MARGIN_SECS);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_director_left_sync_reconnect,
+		test_director_left_sync_split_merge,
+		NULL
+	};
+	return test_run(test_functions);
+}
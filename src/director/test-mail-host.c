@@ -0,0 +1,81 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "mail-host.h"
+#include "test-common.h"
+
+#define TEST_USER_HASH 12345
+
+static struct mail_host *
+test_host_add(struct mail_host_list *list, const char *ip_str)
+{
+	struct ip_addr ip;
+
+	if (net_addr2ip(ip_str, &ip) < 0)
+		i_unreached();
+	return mail_host_add_ip(list, &ip, "");
+}
+
+static void test_mail_host_get_bounded(void)
+{
+	struct mail_host_list *list;
+	struct mail_host *host, *host_a, *host_b, *hash_host, *other_host;
+
+	test_begin("mail host get bounded");
+	list = mail_hosts_init(TRUE, 150);
+	host_a = test_host_add(list, "10.0.0.1");
+	host_b = test_host_add(list, "10.0.0.2");
+
+	/* without any load the user goes where the hash says */
+	hash_host = mail_host_get_by_hash(list, TEST_USER_HASH, "");
+	test_assert(hash_host != NULL);
+	test_assert(mail_host_get_for_new_user(list, TEST_USER_HASH, "") ==
+		    hash_host);
+	other_host = hash_host == host_a ? host_b : host_a;
+
+	/* 10 users, each host's share is 5.5 with the new user. the limit
+	   is 150% of it. */
+	hash_host->user_count = 8;
+	other_host->user_count = 2;
+	test_assert(mail_host_get_for_new_user(list, TEST_USER_HASH, "") ==
+		    hash_host);
+	hash_host->user_count = 9;
+	other_host->user_count = 1;
+	test_assert(mail_host_get_for_new_user(list, TEST_USER_HASH, "") ==
+		    other_host);
+	/* the existing users' host doesn't depend on the load */
+	test_assert(mail_host_get_by_hash(list, TEST_USER_HASH, "") ==
+		    hash_host);
+
+	/* a host with more vhosts gets a larger share */
+	mail_host_set_vhost_count(hash_host, 200);
+	test_assert(mail_host_get_for_new_user(list, TEST_USER_HASH, "") ==
+		    hash_host);
+
+	/* down hosts aren't used */
+	mail_host_set_vhost_count(hash_host, 100);
+	mail_host_set_down(other_host, TRUE, 0);
+	test_assert(mail_host_get_for_new_user(list, TEST_USER_HASH, "") ==
+		    hash_host);
+	mail_hosts_deinit(&list);
+
+	/* without max_host_load the load is ignored */
+	list = mail_hosts_init(TRUE, 0);
+	host_a = test_host_add(list, "10.0.0.1");
+	host_b = test_host_add(list, "10.0.0.2");
+	hash_host = mail_host_get_by_hash(list, TEST_USER_HASH, "");
+	hash_host->user_count = 1000;
+	host = mail_host_get_for_new_user(list, TEST_USER_HASH, "");
+	test_assert(host == hash_host);
+	mail_hosts_deinit(&list);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_host_get_bounded,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -2,11 +2,14 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "time-util.h"
 #include "mail-user-hash.h"
 #include "mail-host.h"
 #include "user-directory.h"
 #include "test-common.h"
 
+#include <stdio.h>
+
 
 #define USER_DIR_TIMEOUT 1000000
 
@@ -17,21 +20,20 @@ static void
 verify_user_directory(struct user_directory *dir, unsigned int user_count)
 {
 	struct user_directory_iter *iter;
-	struct user *user, *prev = NULL;
+	struct user *user;
 	unsigned int prev_stamp = 0, iter_count = 0;
 
 	iter = user_directory_iter_init(dir);
 	while ((user = user_directory_iter_next(iter)) != NULL) {
 		test_assert(prev_stamp <= user->timestamp);
-		test_assert(user->prev == prev);
-		test_assert(prev == NULL || user->prev->next == user);
+		test_assert(user_directory_lookup(dir, user->username_hash) == user);
 
 		iter_count++;
-		prev = user;
+		prev_stamp = user->timestamp;
 	}
-	test_assert(prev == NULL || prev->next == NULL);
 	user_directory_iter_deinit(&iter);
 	test_assert(iter_count == user_count);
+	test_assert(user_directory_count(dir) == user_count);
 }
 
 static void test_user_directory_ascending(void)
@@ -90,14 +92,146 @@ static void test_user_directory_random(void)
 	test_end();
 }
 
-int main(void)
+static void test_user_directory_expire(void)
+{
+	const unsigned int timeout = 100, count = 10000;
+	struct user_directory *dir;
+	struct mail_host *host = t_new(struct mail_host, 1);
+	struct user *user;
+	unsigned int i;
+
+	test_begin("user directory expire");
+	dir = user_directory_init(timeout, "%u");
+	for (i = 0; i < count; i++)
+		(void)user_directory_add(dir, i+1, host,
+					 ioloop_time - i % (timeout/4));
+	test_assert(host->user_count == count);
+
+	/* refresh half of the users */
+	ioloop_time += timeout/2;
+	for (i = 0; i < count; i += 2) {
+		user = user_directory_lookup(dir, i+1);
+		test_assert(user != NULL);
+		if (user != NULL)
+			user_directory_refresh(dir, user);
+	}
+	/* a user being killed is kept even after it has expired */
+	user = user_directory_lookup(dir, 2);
+	user->kill_state = USER_KILL_STATE_KILLING;
+
+	/* all the non-refreshed users have expired */
+	ioloop_time += timeout/2;
+	test_assert(user_directory_lookup(dir, 4) == NULL);
+	verify_user_directory(dir, count/2 + 1);
+	test_assert(host->user_count == count/2 + 1);
+	test_assert(user_directory_lookup(dir, 1) != NULL);
+
+	/* old timestamps are expired as well */
+	user = user_directory_add(dir, count+1, host, ioloop_time - timeout*2);
+	user_directory_set_timestamp(dir, user, ioloop_time - timeout*3);
+	ioloop_time += timeout/2 + 1;
+	verify_user_directory(dir, 1);
+	test_assert(user_directory_lookup(dir, 2) != NULL);
+
+	user = user_directory_lookup(dir, 2);
+	user->kill_state = USER_KILL_STATE_NONE;
+	test_assert(user_directory_lookup(dir, 2) == NULL);
+	verify_user_directory(dir, 0);
+	test_assert(host->user_count == 0);
+	user_directory_deinit(&dir);
+	test_end();
+}
+
+static void test_user_directory_remove_host(void)
+{
+	const unsigned int count = 3000;
+	struct user_directory *dir;
+	struct mail_host *host1 = t_new(struct mail_host, 1);
+	struct mail_host *host2 = t_new(struct mail_host, 1);
+	unsigned int i;
+
+	test_begin("user directory remove host");
+	dir = user_directory_init(USER_DIR_TIMEOUT, "%u");
+	for (i = 0; i < count; i++) {
+		(void)user_directory_add(dir, i+1, i % 3 == 0 ? host1 : host2,
+					 ioloop_time - i);
+	}
+	user_directory_remove_host(dir, host1);
+	test_assert(host1->user_count == 0);
+	test_assert(host2->user_count == count*2/3);
+	verify_user_directory(dir, count*2/3);
+
+	/* freed users get reused */
+	for (i = 0; i < count; i += 3)
+		(void)user_directory_add(dir, i+1, host1, ioloop_time);
+	verify_user_directory(dir, count);
+	user_directory_deinit(&dir);
+	test_assert(host1->user_count == 0 && host2->user_count == 0);
+	test_end();
+}
+
+static unsigned int benchmark_msecs(const struct timeval *start)
+{
+	struct timeval now;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_diff_msecs(&now, start);
+}
+
+static void test_user_directory_benchmark(void)
+{
+	const unsigned int count = 5000000, timeout = 900;
+	struct user_directory *dir;
+	struct mail_host *host = t_new(struct mail_host, 1);
+	struct user *user;
+	struct timeval start;
+	unsigned int i;
+
+	dir = user_directory_init(timeout, "%u");
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < count; i++) {
+		(void)user_directory_add(dir, i * 2654435761U, host,
+					 ioloop_time - i % timeout);
+	}
+	printf("add %u users: %u msecs\n", count, benchmark_msecs(&start));
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < count; i++) {
+		user = user_directory_lookup(dir, i * 2654435761U);
+		if (i % 2 == 0)
+			user_directory_refresh(dir, user);
+	}
+	printf("lookup %u users, refresh half: %u msecs\n",
+	       count, benchmark_msecs(&start));
+
+	ioloop_time += timeout;
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	(void)user_directory_lookup(dir, 0);
+	printf("expire %u users: %u msecs\n",
+	       count - user_directory_count(dir), benchmark_msecs(&start));
+	user_directory_deinit(&dir);
+}
+
+int main(int argc, char *argv[])
 {
 	static void (*test_functions[])(void) = {
 		test_user_directory_ascending,
 		test_user_directory_descending,
 		test_user_directory_random,
+		test_user_directory_expire,
+		test_user_directory_remove_host,
 		NULL
 	};
 	ioloop_time = 1234567890;
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+		lib_init();
+		test_user_directory_benchmark();
+		lib_deinit();
+		return 0;
+	}
 	return test_run(test_functions);
 }
@@ -3,8 +3,6 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "array.h"
-#include "hash.h"
-#include "llist.h"
 #include "mail-user-hash.h"
 #include "mail-host.h"
 #include "user-directory.h"
@@ -15,17 +13,42 @@
 #define USER_NEAR_EXPIRING_MIN 3
 #define USER_NEAR_EXPIRING_MAX 30
 
+/* Users are allocated in blocks of this many users. The blocks are never
+   moved, so the struct user pointers stay valid. */
+#define USER_BLOCK_SIZE 1024
+#define USER_HASH_INITIAL_SIZE 1024
+
+#define USER_IDX_NONE ((uint32_t)-1)
+
 struct user_directory_iter {
 	struct user_directory *dir;
-	struct user *pos;
+	/* timestamp of the bucket currently being iterated */
+	time_t bucket_time;
+	uint32_t next_idx;
 };
 
 struct user_directory {
-	/* unsigned int username_hash => user */
-	HASH_TABLE(void *, struct user *) hash;
-	/* sorted by time */
-	struct user *head, *tail;
-	struct user *prev_insert_pos;
+	/* all users, USER_BLOCK_SIZE users per block. unused users have
+	   host=NULL and they're linked via next_idx to free_idx list. */
+	ARRAY(struct user *) blocks;
+	unsigned int users_count, users_alloc_count;
+	uint32_t free_idx;
+
+	/* username_hash => user index + 1 (0 = unused) with open addressing
+	   and linear probing. The size is always a power of 2. */
+	uint32_t *hash;
+	unsigned int hash_size;
+
+	/* Timing wheel: users are in a doubly linked list of
+	   buckets[timestamp % buckets_count]. Since buckets_count is larger
+	   than timeout_secs, a bucket contains only users with the same
+	   timestamp, except for users that are kept after they have
+	   expired (killing, weak). */
+	uint32_t *buckets;
+	unsigned int buckets_count;
+	/* the oldest timestamp whose bucket hasn't been checked for expired
+	   users yet */
+	time_t expire_pos;
 
 	ARRAY(struct user_directory_iter *) iters;
 
@@ -36,29 +59,142 @@ struct user_directory {
 	unsigned int user_near_expiring_secs;
 };
 
-static void user_move_iters(struct user_directory *dir, struct user *user)
+static inline struct user *
+user_directory_idx(struct user_directory *dir, uint32_t idx)
+{
+	struct user *const *blockp;
+
+	blockp = array_idx(&dir->blocks, idx / USER_BLOCK_SIZE);
+	return &(*blockp)[idx % USER_BLOCK_SIZE];
+}
+
+static inline unsigned int username_hash_pos(unsigned int username_hash)
+{
+	/* username_hash is already a hash, but with a poor distribution in
+	   the lowest bits it would cause long probe sequences */
+	return username_hash * 2654435761U;
+}
+
+static inline uint32_t *
+user_directory_bucket(struct user_directory *dir, time_t timestamp)
+{
+	return &dir->buckets[(unsigned int)timestamp % dir->buckets_count];
+}
+
+static uint32_t *
+user_directory_hash_find(struct user_directory *dir,
+			 unsigned int username_hash)
+{
+	unsigned int mask = dir->hash_size - 1;
+	unsigned int pos = username_hash_pos(username_hash) & mask;
+	uint32_t *slot;
+
+	for (;; pos = (pos + 1) & mask) {
+		slot = &dir->hash[pos];
+		if (*slot == 0 ||
+		    user_directory_idx(dir, *slot - 1)->username_hash ==
+		    username_hash)
+			return slot;
+	}
+}
+
+static void user_directory_hash_grow(struct user_directory *dir)
+{
+	uint32_t *old_hash = dir->hash;
+	unsigned int i, old_size = dir->hash_size;
+	struct user *user;
+
+	dir->hash_size *= 2;
+	dir->hash = i_new(uint32_t, dir->hash_size);
+	for (i = 0; i < old_size; i++) {
+		if (old_hash[i] != 0) {
+			user = user_directory_idx(dir, old_hash[i] - 1);
+			*user_directory_hash_find(dir, user->username_hash) =
+				old_hash[i];
+		}
+	}
+	i_free(old_hash);
+}
+
+static void
+user_directory_hash_remove(struct user_directory *dir, uint32_t *slot)
+{
+	unsigned int mask = dir->hash_size - 1;
+	unsigned int hole = slot - dir->hash, pos, home;
+	struct user *user;
+
+	/* backward shift deletion, so that lookups don't need tombstones */
+	for (pos = (hole + 1) & mask; dir->hash[pos] != 0;
+	     pos = (pos + 1) & mask) {
+		user = user_directory_idx(dir, dir->hash[pos] - 1);
+		home = username_hash_pos(user->username_hash) & mask;
+		if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+			dir->hash[hole] = dir->hash[pos];
+			hole = pos;
+		}
+	}
+	dir->hash[hole] = 0;
+}
+
+static void
+user_directory_bucket_link(struct user_directory *dir, struct user *user,
+			   uint32_t idx)
+{
+	uint32_t *head = user_directory_bucket(dir, user->timestamp);
+
+	if ((time_t)user->timestamp < dir->expire_pos) {
+		/* the bucket was already checked. make sure the user gets
+		   expired in the next check. */
+		dir->expire_pos = user->timestamp;
+	}
+	user->prev_idx = USER_IDX_NONE;
+	user->next_idx = *head;
+	if (*head != USER_IDX_NONE)
+		user_directory_idx(dir, *head)->prev_idx = idx;
+	*head = idx;
+}
+
+static void
+user_directory_bucket_unlink(struct user_directory *dir, struct user *user)
+{
+	if (user->prev_idx != USER_IDX_NONE)
+		user_directory_idx(dir, user->prev_idx)->next_idx = user->next_idx;
+	else
+		*user_directory_bucket(dir, user->timestamp) = user->next_idx;
+	if (user->next_idx != USER_IDX_NONE)
+		user_directory_idx(dir, user->next_idx)->prev_idx = user->prev_idx;
+}
+
+static void user_move_iters(struct user_directory *dir, struct user *user,
+			    uint32_t idx)
 {
 	struct user_directory_iter *const *iterp;
 
 	array_foreach(&dir->iters, iterp) {
-		if ((*iterp)->pos == user)
-			(*iterp)->pos = user->next;
+		if ((*iterp)->next_idx == idx)
+			(*iterp)->next_idx = user->next_idx;
 	}
-
-	if (dir->prev_insert_pos == user)
-		dir->prev_insert_pos = user->next;
 }
 
 static void user_free(struct user_directory *dir, struct user *user)
 {
+	uint32_t *slot, idx;
+
 	i_assert(user->host->user_count > 0);
 	user->host->user_count--;
 
-	user_move_iters(dir, user);
+	slot = user_directory_hash_find(dir, user->username_hash);
+	i_assert(*slot != 0);
+	idx = *slot - 1;
+	user_directory_hash_remove(dir, slot);
+
+	user_move_iters(dir, user, idx);
+	user_directory_bucket_unlink(dir, user);
 
-	hash_table_remove(dir->hash, POINTER_CAST(user->username_hash));
-	DLLIST2_REMOVE(&dir->head, &dir->tail, user);
-	i_free(user);
+	memset(user, 0, sizeof(*user));
+	user->next_idx = dir->free_idx;
+	dir->free_idx = idx;
+	dir->users_count--;
 }
 
 static bool user_directory_user_has_connections(struct user_directory *dir,
@@ -84,72 +220,75 @@ static bool user_directory_user_has_connections(struct user_directory *dir,
 	return FALSE;
 }
 
+static void
+user_directory_drop_expired_bucket(struct user_directory *dir, time_t stamp)
+{
+	struct user *user;
+	uint32_t idx;
+
+	idx = *user_directory_bucket(dir, stamp);
+	while (idx != USER_IDX_NONE) {
+		user = user_directory_idx(dir, idx);
+		idx = user->next_idx;
+		if (!user_directory_user_has_connections(dir, user))
+			user_free(dir, user);
+	}
+}
+
 static void user_directory_drop_expired(struct user_directory *dir)
 {
-	while (dir->head != NULL &&
-	       !user_directory_user_has_connections(dir, dir->head))
-		user_free(dir, dir->head);
+	time_t stamp, last_expired = ioloop_time - dir->timeout_secs;
+
+	if (dir->expire_pos > last_expired)
+		return;
+	if (last_expired - dir->expire_pos >= (time_t)dir->buckets_count) {
+		/* we haven't been called for a long time. each bucket needs
+		   to be checked only once. */
+		dir->expire_pos = last_expired - dir->buckets_count + 1;
+	}
+	for (stamp = dir->expire_pos; stamp <= last_expired; stamp++)
+		user_directory_drop_expired_bucket(dir, stamp);
+	dir->expire_pos = last_expired + 1;
 }
 
 unsigned int user_directory_count(struct user_directory *dir)
 {
-	return hash_table_count(dir->hash);
+	return dir->users_count;
 }
 
 struct user *user_directory_lookup(struct user_directory *dir,
 				   unsigned int username_hash)
 {
 	struct user *user;
+	uint32_t *slot;
 
 	user_directory_drop_expired(dir);
-	user = hash_table_lookup(dir->hash, POINTER_CAST(username_hash));
-	if (user != NULL && !user_directory_user_has_connections(dir, user)) {
+	slot = user_directory_hash_find(dir, username_hash);
+	if (*slot == 0)
+		return NULL;
+	user = user_directory_idx(dir, *slot - 1);
+	if (!user_directory_user_has_connections(dir, user)) {
 		user_free(dir, user);
 		user = NULL;
 	}
 	return user;
 }
 
-static void
-user_directory_insert_backwards(struct user_directory *dir,
-				struct user *pos, struct user *user)
+static uint32_t user_directory_alloc(struct user_directory *dir)
 {
-	for (; pos != NULL; pos = pos->prev) {
-		if (pos->timestamp <= user->timestamp)
-			break;
-	}
-	if (pos == NULL)
-		DLLIST2_PREPEND(&dir->head, &dir->tail, user);
-	else {
-		user->prev = pos;
-		user->next = pos->next;
-		user->prev->next = user;
-		if (user->next != NULL)
-			user->next->prev = user;
-		else
-			dir->tail = user;
-	}
-}
+	struct user *block;
+	uint32_t idx;
 
-static void
-user_directory_insert_forwards(struct user_directory *dir,
-			       struct user *pos, struct user *user)
-{
-	for (; pos != NULL; pos = pos->next) {
-		if (pos->timestamp >= user->timestamp)
-			break;
+	if (dir->free_idx != USER_IDX_NONE) {
+		idx = dir->free_idx;
+		dir->free_idx = user_directory_idx(dir, idx)->next_idx;
+		return idx;
 	}
-	if (pos == NULL)
-		DLLIST2_APPEND(&dir->head, &dir->tail, user);
-	else {
-		user->prev = pos->prev;
-		user->next = pos;
-		if (user->prev != NULL)
-			user->prev->next = user;
-		else
-			dir->head = user;
-		user->next->prev = user;
+	if (dir->users_alloc_count % USER_BLOCK_SIZE == 0) {
+		block = i_new(struct user, USER_BLOCK_SIZE);
+		array_append(&dir->blocks, &block, 1);
 	}
+	return dir->users_alloc_count++;
 }
 
 struct user *
@@ -157,100 +296,68 @@ user_directory_add(struct user_directory *dir, unsigned int username_hash,
 		   struct mail_host *host, time_t timestamp)
 {
 	struct user *user;
+	uint32_t *slot, idx;
 
 	/* make sure we don't add timestamps higher than ioloop time */
 	if (timestamp > ioloop_time)
 		timestamp = ioloop_time;
 
-	user = i_new(struct user, 1);
+	if ((dir->users_count + 1) * 4 > dir->hash_size * 3)
+		user_directory_hash_grow(dir);
+	slot = user_directory_hash_find(dir, username_hash);
+	i_assert(*slot == 0);
+
+	idx = user_directory_alloc(dir);
+	*slot = idx + 1;
+	dir->users_count++;
+
+	user = user_directory_idx(dir, idx);
+	memset(user, 0, sizeof(*user));
 	user->username_hash = username_hash;
 	user->host = host;
 	user->host->user_count++;
 	user->timestamp = timestamp;
-
-	if (dir->tail == NULL || (time_t)dir->tail->timestamp <= timestamp)
-		DLLIST2_APPEND(&dir->head, &dir->tail, user);
-	else {
-		/* need to insert to correct position. we should get here
-		   only when handshaking. the handshaking USER requests should
-		   come sorted by timestamp. so keep track of the previous
-		   insert position, the next USER should be inserted after
-		   it. */
-		if (dir->prev_insert_pos == NULL) {
-			/* find the position starting from tail */
-			user_directory_insert_backwards(dir, dir->tail, user);
-		} else if (timestamp < (time_t)dir->prev_insert_pos->timestamp) {
-			user_directory_insert_backwards(dir, dir->prev_insert_pos,
-							user);
-		} else {
-			user_directory_insert_forwards(dir, dir->prev_insert_pos,
-						       user);
-		}
-	}
-
-	dir->prev_insert_pos = user;
-	hash_table_insert(dir->hash, POINTER_CAST(user->username_hash), user);
+	user_directory_bucket_link(dir, user, idx);
 	return user;
 }
 
-void user_directory_refresh(struct user_directory *dir, struct user *user)
+void user_directory_set_timestamp(struct user_directory *dir,
+				  struct user *user, time_t timestamp)
 {
-	user_move_iters(dir, user);
-
-	user->timestamp = ioloop_time;
-	DLLIST2_REMOVE(&dir->head, &dir->tail, user);
-	DLLIST2_APPEND(&dir->head, &dir->tail, user);
-}
+	uint32_t idx;
 
-void user_directory_remove_host(struct user_directory *dir,
-				struct mail_host *host)
-{
-	struct user *user, *next;
-
-	for (user = dir->head; user != NULL; user = next) {
-		next = user->next;
+	if (timestamp > ioloop_time)
+		timestamp = ioloop_time;
+	if ((time_t)user->timestamp == timestamp)
+		return;
 
-		if (user->host == host)
-			user_free(dir, user);
-	}
+	idx = *user_directory_hash_find(dir, user->username_hash) - 1;
+	user_move_iters(dir, user, idx);
+	user_directory_bucket_unlink(dir, user);
+	user->timestamp = timestamp;
+	user_directory_bucket_link(dir, user, idx);
 }
 
-static int user_timestamp_cmp(struct user *const *user1,
-			      struct user *const *user2)
+void user_directory_refresh(struct user_directory *dir, struct user *user)
 {
-	if ((*user1)->timestamp < (*user2)->timestamp)
-		return -1;
-	if ((*user1)->timestamp > (*user2)->timestamp)
-		return 1;
-	return 0;
+	user_directory_set_timestamp(dir, user, ioloop_time);
 }
 
-void user_directory_sort(struct user_directory *dir)
+void user_directory_remove_host(struct user_directory *dir,
+				struct mail_host *host)
 {
-	ARRAY(struct user *) users;
-	struct user *user, *const *userp;
-	unsigned int i, users_count = hash_table_count(dir->hash);
+	struct user *const *blockp;
+	unsigned int i, count;
 
-	if (users_count == 0) {
-		i_assert(dir->head == NULL);
-		return;
+	array_foreach(&dir->blocks, blockp) {
+		count = I_MIN(USER_BLOCK_SIZE, dir->users_alloc_count -
+			      array_foreach_idx(&dir->blocks, blockp) *
+			      USER_BLOCK_SIZE);
+		for (i = 0; i < count; i++) {
+			if ((*blockp)[i].host == host)
+				user_free(dir, &(*blockp)[i]);
+		}
 	}
-
-	/* place all users into array and sort it */
-	i_array_init(&users, users_count);
-	user = dir->head;
-	for (i = 0; i < users_count; i++, user = user->next)
-		array_append(&users, &user, 1);
-	i_assert(user == NULL);
-	array_sort(&users, user_timestamp_cmp);
-
-	/* recreate the linked list */
-	dir->head = dir->tail = NULL;
-	array_foreach(&users, userp)
-		DLLIST2_APPEND(&dir->head, &dir->tail, *userp);
-	i_assert(dir->head != NULL &&
-		 dir->head->timestamp <= dir->tail->timestamp);
-	array_free(&users);
 }
 
 unsigned int user_directory_get_username_hash(struct user_directory *dir,
@@ -279,6 +386,7 @@ struct user_directory *
 user_directory_init(unsigned int timeout_secs, const char *username_hash_fmt)
 {
 	struct user_directory *dir;
+	unsigned int i;
 
 	i_assert(timeout_secs > USER_NEAR_EXPIRING_MIN);
 
@@ -293,7 +401,18 @@ user_directory_init(unsigned int timeout_secs, const char *username_hash_fmt)
 	i_assert(dir->timeout_secs/2 > dir->user_near_expiring_secs);
 
 	dir->username_hash_fmt = i_strdup(username_hash_fmt);
-	hash_table_create_direct(&dir->hash, default_pool, 0);
+	i_array_init(&dir->blocks, 64);
+	dir->free_idx = USER_IDX_NONE;
+	dir->hash_size = USER_HASH_INITIAL_SIZE;
+	dir->hash = i_new(uint32_t, dir->hash_size);
+
+	/* weak users are kept a bit longer than timeout_secs. with this
+	   they're still alone in their bucket when they're checked. */
+	dir->buckets_count = timeout_secs + USER_NEAR_EXPIRING_MAX + 1;
+	dir->buckets = i_new(uint32_t, dir->buckets_count);
+	for (i = 0; i < dir->buckets_count; i++)
+		dir->buckets[i] = USER_IDX_NONE;
+	dir->expire_pos = ioloop_time - timeout_secs;
 	i_array_init(&dir->iters, 8);
 	return dir;
 }
@@ -301,14 +420,26 @@ user_directory_init(unsigned int timeout_secs, const char *username_hash_fmt)
 void user_directory_deinit(struct user_directory **_dir)
 {
 	struct user_directory *dir = *_dir;
+	struct user **blockp;
+	unsigned int i, count;
 
 	*_dir = NULL;
 
 	i_assert(array_count(&dir->iters) == 0);
 
-	while (dir->head != NULL)
-		user_free(dir, dir->head);
-	hash_table_destroy(&dir->hash);
+	array_foreach_modifiable(&dir->blocks, blockp) {
+		count = I_MIN(USER_BLOCK_SIZE, dir->users_alloc_count -
+			      array_foreach_idx(&dir->blocks, blockp) *
+			      USER_BLOCK_SIZE);
+		for (i = 0; i < count; i++) {
+			if ((*blockp)[i].host != NULL)
+				(*blockp)[i].host->user_count--;
+		}
+		i_free(*blockp);
+	}
+	array_free(&dir->blocks);
+	i_free(dir->hash);
+	i_free(dir->buckets);
 	array_free(&dir->iters);
 	i_free(dir->username_hash_fmt);
 	i_free(dir);
@@ -319,11 +450,15 @@ user_directory_iter_init(struct user_directory *dir)
 {
 	struct user_directory_iter *iter;
 
+	user_directory_drop_expired(dir);
+
 	iter = i_new(struct user_directory_iter, 1);
 	iter->dir = dir;
-	iter->pos = dir->head;
+	/* go through the buckets from the oldest to the newest, so the
+	   users are returned sorted by their timestamp */
+	iter->bucket_time = ioloop_time - dir->buckets_count + 1;
+	iter->next_idx = *user_directory_bucket(dir, iter->bucket_time);
 	array_append(&dir->iters, &iter, 1);
-	user_directory_drop_expired(dir);
 	return iter;
 }
 
@@ -331,11 +466,17 @@ struct user *user_directory_iter_next(struct user_directory_iter *iter)
 {
 	struct user *user;
 
-	user = iter->pos;
-	if (user == NULL)
-		return NULL;
-
-	iter->pos = user->next;
+	while (iter->next_idx == USER_IDX_NONE) {
+		/* refreshed users are moved to the newest bucket, so keep
+		   going until the current time */
+		if (iter->bucket_time >= ioloop_time)
+			return NULL;
+		iter->bucket_time++;
+		iter->next_idx = *user_directory_bucket(iter->dir,
+							iter->bucket_time);
+	}
+	user = user_directory_idx(iter->dir, iter->next_idx);
+	iter->next_idx = user->next_idx;
 	return user;
 }
 
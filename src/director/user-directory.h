@@ -24,8 +24,9 @@ enum user_kill_state {
 };
 
 struct user {
-	/* sorted by time */
-	struct user *prev, *next;
+	/* linked list of users with the same timestamp bucket. These are
+	   indexes to user_directory's internal user storage. */
+	uint32_t prev_idx, next_idx;
 
 	/* first 32 bits of MD5(username). collisions are quite unlikely, but
 	   even if they happen it doesn't matter - the users are just
@@ -65,14 +66,14 @@ user_directory_add(struct user_directory *dir, unsigned int username_hash,
 		   struct mail_host *host, time_t timestamp);
 /* Refresh user's timestamp */
 void user_directory_refresh(struct user_directory *dir, struct user *user);
+/* Set user's timestamp. Timestamps higher than ioloop time are changed to
+   ioloop time. */
+void user_directory_set_timestamp(struct user_directory *dir,
+				  struct user *user, time_t timestamp);
 
 /* Remove all users that have pointers to given host */
 void user_directory_remove_host(struct user_directory *dir,
 				struct mail_host *host);
-/* Sort users based on the timestamp. This is called only after updating
-   timestamps based on remote director's user list after handshake. */
-void user_directory_sort(struct user_directory *dir);
-
 unsigned int user_directory_get_username_hash(struct user_directory *dir,
 					      const char *username);
 
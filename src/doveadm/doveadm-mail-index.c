@@ -163,6 +163,9 @@ static void cmd_index_queue(struct index_cmd_context *ctx,
 		str_append_tabescaped(str, user->username);
 		str_append_c(str, '\t');
 		str_append_tabescaped(str, mailbox);
+		/* the cost isn't sent, because estimating it would require
+		   opening the mailbox. indexer handles requests with unknown
+		   cost after the user's other requests. */
 		str_printfa(str, "\t%u\n", ctx->max_recent_msgs);
 		if (write_full(ctx->queue_fd, str_data(str), str_len(str)) < 0)
 			i_fatal("write(indexer) failed: %m");
@@ -387,14 +387,14 @@ static void client_default_destroy(struct client *client, const char *reason)
 
 	/* Free the user after client is already disconnected. It may start
 	   some background work like autoexpunging. */
-	mail_user_unref(&client->user);
+	mail_storage_service_user_release(&client->service_user,
+					  &client->user);
 
 	if (array_is_created(&client->search_saved_uidset))
 		array_free(&client->search_saved_uidset);
 	if (array_is_created(&client->search_updates))
 		array_free(&client->search_updates);
 	pool_unref(&client->command_pool);
-	mail_storage_service_user_free(&client->service_user);
 
 	imap_client_count--;
 	DLLIST_REMOVE(&imap_clients, client);
@@ -7,6 +7,7 @@
 #include "abspath.h"
 #include "str.h"
 #include "base64.h"
+#include "time-util.h"
 #include "process-title.h"
 #include "randgen.h"
 #include "restrict-access.h"
@@ -282,6 +283,19 @@ static void main_stdio_run(const char *username)
 	}
 }
 
+static void
+login_client_log_latency(const struct master_login_client *login_client)
+{
+	io_loop_time_refresh();
+	i_debug("Login handoff took %d msecs "
+		"(auth lookup %d msecs, user initialization %d msecs)",
+		timeval_diff_msecs(&ioloop_timeval, &login_client->create_time),
+		timeval_diff_msecs(&login_client->auth_finished_time,
+				   &login_client->create_time),
+		timeval_diff_msecs(&ioloop_timeval,
+				   &login_client->auth_finished_time));
+}
+
 static void
 login_client_connected(const struct master_login_client *login_client,
 		       const char *username, const char *const *extra_fields)
@@ -314,6 +328,8 @@ login_client_connected(const struct master_login_client *login_client,
 		master_service_client_connection_destroyed(master_service);
 		return;
 	}
+	if (client->user->mail_debug)
+		login_client_log_latency(login_client);
 	client_add_input(client, login_client->data,
 			 login_client->auth_req.data_size);
 
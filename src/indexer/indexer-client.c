@@ -4,6 +4,7 @@
 #include "llist.h"
 #include "istream.h"
 #include "ostream.h"
+#include "str.h"
 #include "strescape.h"
 #include "master-service.h"
 #include "indexer-queue.h"
@@ -62,14 +63,16 @@ indexer_client_next_line(struct indexer_client *client)
 }
 
 static int
-indexer_client_request_queue(struct indexer_client *client, bool append,
+indexer_client_request_queue(struct indexer_client *client,
+			     enum indexer_request_priority priority,
 			     const char *const *args, const char **error_r)
 {
 	struct indexer_client_request *ctx = NULL;
 	const char *session_id = NULL;
-	unsigned int tag, max_recent_msgs;
+	unsigned int tag, max_recent_msgs, cost = 0;
 
-	/* <tag> <user> <mailbox> [<max_recent_msgs> [<session ID>]] */
+	/* <tag> <user> <mailbox> [<max_recent_msgs> [<session ID> [<cost>]]]
+	   <cost> is the estimated number of messages to index, 0 = unknown */
 	if (str_array_length(args) < 3) {
 		*error_r = "Wrong parameter count";
 		return -1;
@@ -83,8 +86,12 @@ indexer_client_request_queue(struct indexer_client *client, bool append,
 	else if (str_to_uint(args[3], &max_recent_msgs) < 0) {
 		*error_r = "Invalid max_recent_msgs";
 		return -1;
-	} else {
+	} else if (args[4] != NULL) {
 		session_id = args[4];
+		if (args[5] != NULL && str_to_uint(args[5], &cost) < 0) {
+			*error_r = "Invalid cost";
+			return -1;
+		}
 	}
 
 	if (tag != 0) {
@@ -94,8 +101,8 @@ indexer_client_request_queue(struct indexer_client *client, bool append,
 		indexer_client_ref(client);
 	}
 
-	indexer_queue_append(client->queue, append, args[1], args[2],
-			     session_id, max_recent_msgs, ctx);
+	indexer_queue_append(client->queue, priority, args[1], args[2],
+			     session_id, max_recent_msgs, cost, ctx);
 	o_stream_nsend_str(client->output, t_strdup_printf("%u\tOK\n", tag));
 	return 0;
 }
@@ -129,6 +136,39 @@ indexer_client_request_optimize(struct indexer_client *client,
 	return 0;
 }
 
+static int
+indexer_client_request_stats(struct indexer_client *client,
+			     const char *const *args, const char **error_r)
+{
+	struct indexer_queue_stats stats;
+	string_t *str;
+	unsigned int tag, i;
+
+	/* <tag> */
+	if (str_array_length(args) != 1) {
+		*error_r = "Wrong parameter count";
+		return -1;
+	}
+	if (str_to_uint(args[0], &tag) < 0) {
+		*error_r = "Invalid tag";
+		return -1;
+	}
+
+	/* <tag> <priority> <queued> <started> <wait msecs total>
+	   <wait msecs max> for each priority class, followed by <tag> OK */
+	str = t_str_new(256);
+	for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++) {
+		indexer_queue_get_stats(client->queue, i, &stats);
+		str_printfa(str, "%u\t%s\t%u\t%u\t%llu\t%u\n", tag,
+			    indexer_request_priority_to_str(i),
+			    stats.queued, stats.started,
+			    stats.wait_msecs_total, stats.wait_msecs_max);
+	}
+	str_printfa(str, "%u\tOK\n", tag);
+	o_stream_nsend(client->output, str_data(str), str_len(str));
+	return 0;
+}
+
 static int
 indexer_client_request(struct indexer_client *client,
 		       const char *const *args, const char **error_r)
@@ -137,12 +177,16 @@ indexer_client_request(struct indexer_client *client,
 
 	args++;
 
-	if (strcmp(cmd, "APPEND") == 0)
-		return indexer_client_request_queue(client, TRUE, args, error_r);
-	else if (strcmp(cmd, "PREPEND") == 0)
-		return indexer_client_request_queue(client, FALSE, args, error_r);
-	else if (strcmp(cmd, "OPTIMIZE") == 0)
+	if (strcmp(cmd, "APPEND") == 0) {
+		return indexer_client_request_queue(client,
+				INDEXER_REQUEST_PRIORITY_NORMAL, args, error_r);
+	} else if (strcmp(cmd, "PREPEND") == 0) {
+		return indexer_client_request_queue(client,
+				INDEXER_REQUEST_PRIORITY_HIGH, args, error_r);
+	} else if (strcmp(cmd, "OPTIMIZE") == 0)
 		return indexer_client_request_optimize(client, args, error_r);
+	else if (strcmp(cmd, "STATS") == 0)
+		return indexer_client_request_stats(client, args, error_r);
 	else {
 		*error_r = t_strconcat("Unknown command: ", cmd, NULL);
 		return -1;
@@ -2,17 +2,46 @@
 
 #include "lib.h"
 #include "array.h"
+#include "ioloop.h"
 #include "llist.h"
 #include "hash.h"
+#include "time-util.h"
 #include "indexer-queue.h"
 
+struct indexer_queue_user_class {
+	/* users with queued requests in this priority class,
+	   served round-robin */
+	struct indexer_queue_user_class *prev, *next;
+	struct indexer_queue_user *user;
+
+	/* this user's queued requests, cheapest first */
+	struct indexer_request *head, *tail;
+};
+
+struct indexer_queue_user {
+	char *username;
+	/* number of requests for this user, queued or working */
+	unsigned int request_count;
+
+	struct indexer_queue_user_class classes[INDEXER_REQUEST_PRIORITY_COUNT];
+};
+
 struct indexer_queue {
 	indexer_status_callback_t *callback;
 	void (*listen_callback)(struct indexer_queue *);
 
 	/* username+mailbox -> indexer_request */
 	HASH_TABLE(struct indexer_request *, struct indexer_request *) requests;
-	struct indexer_request *head, *tail;
+	/* username -> indexer_queue_user */
+	HASH_TABLE(char *, struct indexer_queue_user *) users;
+
+	struct indexer_queue_user_class *head[INDEXER_REQUEST_PRIORITY_COUNT];
+	struct indexer_queue_user_class *tail[INDEXER_REQUEST_PRIORITY_COUNT];
+	struct indexer_queue_stats stats[INDEXER_REQUEST_PRIORITY_COUNT];
+};
+
+static const char *const indexer_request_priority_names[] = {
+	"high", "normal", "low"
 };
 
 static unsigned int
@@ -37,6 +66,7 @@ indexer_queue_init(indexer_status_callback_t *callback)
 	queue->callback = callback;
 	hash_table_create(&queue->requests, default_pool, 0,
 			  indexer_request_hash, indexer_request_cmp);
+	hash_table_create(&queue->users, default_pool, 0, str_hash, strcmp);
 	return queue;
 }
 
@@ -49,6 +79,7 @@ void indexer_queue_deinit(struct indexer_queue **_queue)
 	i_assert(indexer_queue_is_empty(queue));
 
 	hash_table_destroy(&queue->requests);
+	hash_table_destroy(&queue->users);
 	i_free(queue);
 }
 
@@ -79,47 +110,150 @@ static void request_add_context(struct indexer_request *request, void *context)
 	array_append(&request->contexts, &context, 1);
 }
 
+static struct indexer_queue_user *
+indexer_queue_user_get(struct indexer_queue *queue, const char *username)
+{
+	struct indexer_queue_user *user;
+	unsigned int i;
+
+	user = hash_table_lookup(queue->users, username);
+	if (user == NULL) {
+		user = i_new(struct indexer_queue_user, 1);
+		user->username = i_strdup(username);
+		for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+			user->classes[i].user = user;
+		hash_table_insert(queue->users, user->username, user);
+	}
+	user->request_count++;
+	return user;
+}
+
+static void
+indexer_queue_user_unref(struct indexer_queue *queue,
+			 struct indexer_queue_user *user)
+{
+	i_assert(user->request_count > 0);
+
+	if (--user->request_count > 0)
+		return;
+
+	hash_table_remove(queue->users, user->username);
+	i_free(user->username);
+	i_free(user);
+}
+
+static unsigned int indexer_request_sort_cost(struct indexer_request *request)
+{
+	/* requests with unknown cost are handled after the known ones */
+	return request->cost == 0 ? UINT_MAX : request->cost;
+}
+
+static void
+indexer_queue_request_link(struct indexer_queue *queue,
+			   struct indexer_request *request)
+{
+	struct indexer_queue_user_class *uclass =
+		&request->user->classes[request->priority];
+	struct indexer_request *pos;
+	unsigned int cost = indexer_request_sort_cost(request);
+	bool was_empty = uclass->head == NULL;
+
+	/* keep the requests with the same cost in FIFO order */
+	for (pos = uclass->head; pos != NULL; pos = pos->next) {
+		if (indexer_request_sort_cost(pos) > cost)
+			break;
+	}
+	if (pos == NULL)
+		DLLIST2_APPEND(&uclass->head, &uclass->tail, request);
+	else if (pos->prev == NULL)
+		DLLIST2_PREPEND(&uclass->head, &uclass->tail, request);
+	else {
+		request->prev = pos->prev;
+		request->next = pos;
+		pos->prev->next = request;
+		pos->prev = request;
+	}
+
+	if (was_empty) {
+		DLLIST2_APPEND(&queue->head[request->priority],
+			       &queue->tail[request->priority], uclass);
+	}
+	queue->stats[request->priority].queued++;
+}
+
+static void
+indexer_queue_request_unlink(struct indexer_queue *queue,
+			     struct indexer_request *request)
+{
+	struct indexer_queue_user_class *uclass =
+		&request->user->classes[request->priority];
+
+	DLLIST2_REMOVE(&uclass->head, &uclass->tail, request);
+	if (uclass->head == NULL) {
+		DLLIST2_REMOVE(&queue->head[request->priority],
+			       &queue->tail[request->priority], uclass);
+	}
+	i_assert(queue->stats[request->priority].queued > 0);
+	queue->stats[request->priority].queued--;
+}
+
 static struct indexer_request *
-indexer_queue_append_request(struct indexer_queue *queue, bool append,
+indexer_queue_append_request(struct indexer_queue *queue,
+			     enum indexer_request_priority priority,
 			     const char *username, const char *mailbox,
 			     const char *session_id,
-			     unsigned int max_recent_msgs, void *context)
+			     unsigned int max_recent_msgs,
+			     unsigned int cost, void *context)
 {
 	struct indexer_request *request;
 
+	i_assert(priority < INDEXER_REQUEST_PRIORITY_COUNT);
+
 	request = indexer_queue_lookup(queue, username, mailbox);
 	if (request == NULL) {
 		request = i_new(struct indexer_request, 1);
+		request->user = indexer_queue_user_get(queue, username);
 		request->username = i_strdup(username);
 		request->mailbox = i_strdup(mailbox);
 		request->session_id = i_strdup(session_id);
 		request->max_recent_msgs = max_recent_msgs;
+		request->cost = cost;
+		request->priority = priority;
+		request->queued_time = ioloop_timeval;
 		request_add_context(request, context);
 		hash_table_insert(queue->requests, request, request);
-	} else {
-		if (request->max_recent_msgs > max_recent_msgs)
-			request->max_recent_msgs = max_recent_msgs;
-		request_add_context(request, context);
-		if (request->working) {
-			/* we're already indexing this mailbox. */
-			if (append)
-				request->reindex_tail = TRUE;
-			else
-				request->reindex_head = TRUE;
-			return request;
-		}
-		if (append) {
-			/* keep the request in its old position */
-			return request;
-		}
-		/* move request to beginning of the queue */
-		DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+		indexer_queue_request_link(queue, request);
+		return request;
 	}
 
-	if (append)
-		DLLIST2_APPEND(&queue->head, &queue->tail, request);
-	else
-		DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+	if (request->max_recent_msgs > max_recent_msgs)
+		request->max_recent_msgs = max_recent_msgs;
+	request_add_context(request, context);
+	if (request->working) {
+		/* we're already indexing this mailbox. */
+		if (!request->reindex) {
+			request->reindex_priority = priority;
+			request->queued_time = ioloop_timeval;
+		} else if (priority < request->reindex_priority)
+			request->reindex_priority = priority;
+		request->reindex = TRUE;
+		if (cost != 0)
+			request->cost = cost;
+		return request;
+	}
+	if (priority >= request->priority &&
+	    (cost == 0 || cost == request->cost)) {
+		/* keep the request in its old position */
+		return request;
+	}
+	/* move the request to a higher priority class and/or to its new
+	   position based on the updated cost */
+	indexer_queue_request_unlink(queue, request);
+	if (priority < request->priority)
+		request->priority = priority;
+	if (cost != 0)
+		request->cost = cost;
+	indexer_queue_request_link(queue, request);
 	return request;
 }
 
@@ -130,16 +264,17 @@ static void indexer_queue_append_finish(struct indexer_queue *queue)
 	indexer_refresh_proctitle();
 }
 
-void indexer_queue_append(struct indexer_queue *queue, bool append,
+void indexer_queue_append(struct indexer_queue *queue,
+			  enum indexer_request_priority priority,
 			  const char *username, const char *mailbox,
 			  const char *session_id, unsigned int max_recent_msgs,
-			  void *context)
+			  unsigned int cost, void *context)
 {
 	struct indexer_request *request;
 
-	request = indexer_queue_append_request(queue, append, username, mailbox,
-					       session_id, max_recent_msgs,
-					       context);
+	request = indexer_queue_append_request(queue, priority,
+					       username, mailbox, session_id,
+					       max_recent_msgs, cost, context);
 	request->index = TRUE;
 	indexer_queue_append_finish(queue);
 }
@@ -150,24 +285,46 @@ void indexer_queue_append_optimize(struct indexer_queue *queue,
 {
 	struct indexer_request *request;
 
-	request = indexer_queue_append_request(queue, TRUE, username, mailbox,
-					       NULL, 0, context);
+	request = indexer_queue_append_request(queue,
+					       INDEXER_REQUEST_PRIORITY_LOW,
+					       username, mailbox,
+					       NULL, 0, 0, context);
 	request->optimize = TRUE;
 	indexer_queue_append_finish(queue);
 }
 
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue)
 {
-	return queue->head;
+	unsigned int i;
+
+	for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++) {
+		if (queue->head[i] != NULL)
+			return queue->head[i]->head;
+	}
+	return NULL;
 }
 
 void indexer_queue_request_remove(struct indexer_queue *queue)
 {
-	struct indexer_request *request = queue->head;
+	struct indexer_request *request = indexer_queue_request_peek(queue);
+	struct indexer_queue_user_class *uclass;
+	enum indexer_request_priority priority;
 
 	i_assert(request != NULL);
 
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+	priority = request->priority;
+	uclass = &request->user->classes[priority];
+	indexer_queue_request_unlink(queue, request);
+
+	if (uclass->head != NULL) {
+		/* the user still has more requests in this class. move the
+		   user to the end of the list, so other users get their turn
+		   before this user's next request. */
+		DLLIST2_REMOVE(&queue->head[priority],
+			       &queue->tail[priority], uclass);
+		DLLIST2_APPEND(&queue->head[priority],
+			       &queue->tail[priority], uclass);
+	}
 }
 
 static void indexer_queue_request_status_int(struct indexer_queue *queue,
@@ -192,8 +349,20 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 	indexer_queue_request_status_int(queue, request, percentage);
 }
 
-void indexer_queue_request_work(struct indexer_request *request)
+void indexer_queue_request_work(struct indexer_queue *queue,
+				struct indexer_request *request)
 {
+	struct indexer_queue_stats *stats = &queue->stats[request->priority];
+	int wait_msecs;
+
+	wait_msecs = timeval_diff_msecs(&ioloop_timeval, &request->queued_time);
+	if (wait_msecs < 0)
+		wait_msecs = 0;
+	stats->started++;
+	stats->wait_msecs_total += wait_msecs;
+	if (stats->wait_msecs_max < (unsigned int)wait_msecs)
+		stats->wait_msecs_max = wait_msecs;
+
 	request->working = TRUE;
 	request->working_context_idx =
 		!array_is_created(&request->contexts) ? 0 :
@@ -210,27 +379,26 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 
 	indexer_queue_request_status_int(queue, request, success ? 100 : -1);
 
-	if (request->reindex_head || request->reindex_tail) {
+	if (request->reindex) {
 		i_assert(request->working);
 		request->working = FALSE;
-		request->reindex_head = FALSE;
-		request->reindex_tail = FALSE;
+		request->reindex = FALSE;
+		request->priority = request->reindex_priority;
 		if (request->working_context_idx > 0) {
 			array_delete(&request->contexts, 0,
 				     request->working_context_idx);
 		}
-		if (request->reindex_head)
-			DLLIST2_PREPEND(&queue->head, &queue->tail, request);
-		else
-			DLLIST2_APPEND(&queue->head, &queue->tail, request);
+		indexer_queue_request_link(queue, request);
 		return;
 	}
 
 	hash_table_remove(queue->requests, request);
+	indexer_queue_user_unref(queue, request->user);
 	if (array_is_created(&request->contexts))
 		array_free(&request->contexts);
 	i_free(request->username);
 	i_free(request->mailbox);
+	i_free(request->session_id);
 	i_free(request);
 
 	indexer_refresh_proctitle();
@@ -246,7 +414,7 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 	   deinit where it crashes) */
 	iter = hash_table_iterate_init(queue->requests);
 	while (hash_table_iterate(iter, queue->requests, &request, &request))
-		request->reindex_head = request->reindex_tail = FALSE;
+		request->reindex = FALSE;
 	hash_table_iterate_deinit(&iter);
 
 	while ((request = indexer_queue_request_peek(queue)) != NULL) {
@@ -257,10 +425,27 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 
 bool indexer_queue_is_empty(struct indexer_queue *queue)
 {
-	return queue->head == NULL;
+	return indexer_queue_request_peek(queue) == NULL;
 }
 
 unsigned int indexer_queue_count(struct indexer_queue *queue)
 {
 	return hash_table_count(queue->requests);
 }
+
+void indexer_queue_get_stats(struct indexer_queue *queue,
+			     enum indexer_request_priority priority,
+			     struct indexer_queue_stats *stats_r)
+{
+	i_assert(priority < INDEXER_REQUEST_PRIORITY_COUNT);
+
+	*stats_r = queue->stats[priority];
+}
+
+const char *
+indexer_request_priority_to_str(enum indexer_request_priority priority)
+{
+	i_assert(priority < N_ELEMENTS(indexer_request_priority_names));
+
+	return indexer_request_priority_names[priority];
+}
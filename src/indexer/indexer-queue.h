@@ -3,13 +3,43 @@
 
 #include "indexer.h"
 
+enum indexer_request_priority {
+	/* Someone is waiting for the indexing to finish (e.g. SEARCH) */
+	INDEXER_REQUEST_PRIORITY_HIGH = 0,
+	/* Background indexing (e.g. after mail delivery) */
+	INDEXER_REQUEST_PRIORITY_NORMAL,
+	/* Optimizing, nobody is waiting for it */
+	INDEXER_REQUEST_PRIORITY_LOW,
+
+	INDEXER_REQUEST_PRIORITY_COUNT
+};
+
+struct indexer_queue_stats {
+	/* number of requests currently waiting in the queue */
+	unsigned int queued;
+	/* number of requests that have been sent to workers */
+	unsigned int started;
+	/* how long the started requests waited in the queue */
+	unsigned long long wait_msecs_total;
+	unsigned int wait_msecs_max;
+};
+
 struct indexer_request {
 	struct indexer_request *prev, *next;
+	struct indexer_queue_user *user;
 
 	char *username;
 	char *mailbox;
 	char *session_id;
 	unsigned int max_recent_msgs;
+	/* estimated number of messages that need to be indexed,
+	   0 = unknown. The message sizes aren't included, because getting
+	   them would require reading the unindexed mails. */
+	unsigned int cost;
+	enum indexer_request_priority priority;
+	/* when the request was added to the queue, or when the reindexing
+	   was requested. Moving it within the queue doesn't change this. */
+	struct timeval queued_time;
 
 	/* index messages in this mailbox */
 	unsigned int index:1;
@@ -20,8 +50,8 @@ struct indexer_request {
 	/* after indexing is finished, add this request back to the queue and
 	   reindex it (i.e. a new indexing request came while we were
 	   working.) */
-	unsigned int reindex_head:1;
-	unsigned int reindex_tail:1;
+	unsigned int reindex:1;
+	enum indexer_request_priority reindex_priority;
 
 	/* when working finished, call this number of contexts and leave the
 	   rest to the reindexing. */
@@ -36,11 +66,16 @@ void indexer_queue_deinit(struct indexer_queue **queue);
 /* The callback is called whenever a new request is added to the queue. */
 void indexer_queue_set_listen_callback(struct indexer_queue *queue,
 				       void (*callback)(struct indexer_queue *));
-	
-void indexer_queue_append(struct indexer_queue *queue, bool append,
+
+/* Add a new indexing request to the queue. Requests are handled in priority
+   order. Within the same priority users are served round-robin, and each
+   user's requests are ordered by their estimated cost (cheapest first).
+   If the mailbox is already queued, its priority may only be raised. */
+void indexer_queue_append(struct indexer_queue *queue,
+			  enum indexer_request_priority priority,
 			  const char *username, const char *mailbox,
 			  const char *session_id, unsigned int max_recent_msgs,
-			  void *context);
+			  unsigned int cost, void *context);
 void indexer_queue_append_optimize(struct indexer_queue *queue,
 				   const char *username, const char *mailbox,
 				   void *context);
@@ -48,6 +83,11 @@ void indexer_queue_cancel_all(struct indexer_queue *queue);
 
 bool indexer_queue_is_empty(struct indexer_queue *queue);
 unsigned int indexer_queue_count(struct indexer_queue *queue);
+void indexer_queue_get_stats(struct indexer_queue *queue,
+			     enum indexer_request_priority priority,
+			     struct indexer_queue_stats *stats_r);
+const char *
+indexer_request_priority_to_str(enum indexer_request_priority priority);
 
 /* Return the next request from the queue, without removing it. */
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue);
@@ -59,7 +99,8 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 				  struct indexer_request *request,
 				  int percentage);
 /* Start working on a request */
-void indexer_queue_request_work(struct indexer_request *request);
+void indexer_queue_request_work(struct indexer_queue *queue,
+				struct indexer_request *request);
 /* Finish the request and free its memory. */
 void indexer_queue_request_finish(struct indexer_queue *queue,
 				  struct indexer_request **request,
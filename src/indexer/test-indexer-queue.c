@@ -0,0 +1,159 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "indexer-queue.h"
+#include "test-common.h"
+
+void indexer_refresh_proctitle(void) { }
+
+static void test_status_callback(int percentage ATTR_UNUSED,
+				 void *context ATTR_UNUSED)
+{
+}
+
+static const char *
+test_queue_next(struct indexer_queue *queue)
+{
+	struct indexer_request *request;
+	const char *name;
+
+	request = indexer_queue_request_peek(queue);
+	if (request == NULL)
+		return NULL;
+	name = t_strconcat(request->username, "/", request->mailbox, NULL);
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(queue, request);
+	indexer_queue_request_finish(queue, &request, TRUE);
+	return name;
+}
+
+static void test_indexer_queue_priority(void)
+{
+	struct indexer_queue *queue;
+
+	test_begin("indexer queue priority");
+	queue = indexer_queue_init(test_status_callback);
+	indexer_queue_append_optimize(queue, "u1", "opt", NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "normal", NULL, 0, 0, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_HIGH,
+			     "u1", "high", NULL, 0, 0, NULL);
+	/* requeueing can only raise the priority */
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_LOW,
+			     "u1", "normal", NULL, 0, 0, NULL);
+	test_assert(indexer_queue_count(queue) == 3);
+
+	test_assert(null_strcmp(test_queue_next(queue), "u1/high") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u1/normal") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u1/opt") == 0);
+	test_assert(test_queue_next(queue) == NULL);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_fairness(void)
+{
+	struct indexer_queue *queue;
+
+	test_begin("indexer queue fairness");
+	queue = indexer_queue_init(test_status_callback);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "a", NULL, 0, 0, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "b", NULL, 0, 0, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "c", NULL, 0, 0, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u2", "a", NULL, 0, 0, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u3", "a", NULL, 0, 0, NULL);
+
+	test_assert(null_strcmp(test_queue_next(queue), "u1/a") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u2/a") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u3/a") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u1/b") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u1/c") == 0);
+	test_assert(test_queue_next(queue) == NULL);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_cost(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+	struct timeval queued_time;
+
+	test_begin("indexer queue cost");
+	queue = indexer_queue_init(test_status_callback);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "unknown", NULL, 0, 0, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "big", NULL, 0, 1000, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "small", NULL, 0, 10, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "medium", NULL, 0, 100, NULL);
+
+	/* updating the cost moves the request, but it keeps its
+	   original queueing time */
+	request = indexer_queue_request_peek(queue);
+	test_assert(strcmp(request->mailbox, "small") == 0);
+	request = NULL;
+	queued_time = ioloop_timeval;
+	ioloop_timeval.tv_sec += 10;
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "big", NULL, 0, 1, NULL);
+	request = indexer_queue_request_peek(queue);
+	test_assert(strcmp(request->mailbox, "big") == 0);
+	test_assert(request->queued_time.tv_sec == queued_time.tv_sec &&
+		    request->queued_time.tv_usec == queued_time.tv_usec);
+
+	test_assert(null_strcmp(test_queue_next(queue), "u1/big") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u1/small") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u1/medium") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u1/unknown") == 0);
+	test_assert(test_queue_next(queue) == NULL);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_reindex(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue reindex");
+	queue = indexer_queue_init(test_status_callback);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u1", "a", NULL, 0, 0, NULL);
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_NORMAL,
+			     "u2", "a", NULL, 0, 0, NULL);
+
+	request = indexer_queue_request_peek(queue);
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(queue, request);
+	/* a new request comes while the mailbox is being indexed */
+	indexer_queue_append(queue, INDEXER_REQUEST_PRIORITY_HIGH,
+			     "u1", "a", NULL, 0, 0, NULL);
+	indexer_queue_request_finish(queue, &request, TRUE);
+
+	test_assert(null_strcmp(test_queue_next(queue), "u1/a") == 0);
+	test_assert(null_strcmp(test_queue_next(queue), "u2/a") == 0);
+	test_assert(test_queue_next(queue) == NULL);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_indexer_queue_priority,
+		test_indexer_queue_fairness,
+		test_indexer_queue_cost,
+		test_indexer_queue_reindex,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "istream.h"
 #include "hex-binary.h"
 #include "str.h"
@@ -29,6 +30,8 @@ struct sql_dict {
 	struct sql_db *db;
 	const char *username;
 	const struct dict_sql_settings *set;
+	/* query template => prepared lookup statement */
+	HASH_TABLE(char *, struct sql_prepared_statement *) prep_stmts;
 
 	unsigned int has_on_duplicate_key:1;
 };
@@ -99,6 +102,7 @@ sql_dict_init(struct dict *driver, const char *uri,
 
 	dict->db = sql_db_cache_new(dict_sql_db_cache, driver->name,
 				    dict->set->connect);
+	hash_table_create(&dict->prep_stmts, pool, 0, str_hash, strcmp);
 	*dict_r = &dict->dict;
 	return 0;
 }
@@ -106,6 +110,15 @@ sql_dict_init(struct dict *driver, const char *uri,
 static void sql_dict_deinit(struct dict *_dict)
 {
 	struct sql_dict *dict = (struct sql_dict *)_dict;
+	struct hash_iterate_context *iter;
+	struct sql_prepared_statement *prep_stmt;
+	char *query;
+
+	iter = hash_table_iterate_init(dict->prep_stmts);
+	while (hash_table_iterate(iter, dict->prep_stmts, &query, &prep_stmt))
+		sql_prepared_statement_deinit(&prep_stmt);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&dict->prep_stmts);
 
 	sql_deinit(&dict->db);
 	pool_unref(&dict->pool);
@@ -336,14 +349,87 @@ sql_dict_where_build(struct sql_dict *dict, const struct dict_sql_map *map,
 	return 0;
 }
 
+static struct sql_prepared_statement *
+sql_dict_prepared_statement_get(struct sql_dict *dict, const char *query)
+{
+	struct sql_prepared_statement *prep_stmt;
+
+	prep_stmt = hash_table_lookup(dict->prep_stmts, query);
+	if (prep_stmt == NULL) {
+		prep_stmt = sql_prepared_statement_init(dict->db, query);
+		hash_table_insert(dict->prep_stmts,
+				  p_strdup(dict->pool, query), prep_stmt);
+	}
+	return prep_stmt;
+}
+
+static int
+sql_lookup_get_statement(struct sql_dict *dict, const char *key,
+			 const struct dict_sql_map *map,
+			 const ARRAY_TYPE(const_string) *values_arr,
+			 struct sql_statement **stmt_r, const char **error_r)
+{
+	const struct dict_sql_field *sql_fields;
+	const char *const *values;
+	struct sql_statement *stmt;
+	string_t *query;
+	unsigned int i, count, num;
+	bool priv = key[0] == DICT_PATH_PRIVATE[0];
+
+	sql_fields = array_get(&map->sql_fields, &count);
+	values = array_get(values_arr, &count);
+	for (i = 0; i < count; i++) {
+		if (sql_fields[i].value_type == DICT_SQL_TYPE_HEXBLOB) {
+			/* blobs are escaped differently by each driver,
+			   use a plain query */
+			return 0;
+		}
+	}
+
+	query = t_str_new(256);
+	str_printfa(query, "SELECT %s FROM %s", map->value_field, map->table);
+	for (i = 0; i < count; i++) {
+		str_append(query, i == 0 ? " WHERE" : " AND");
+		str_printfa(query, " %s = ?", sql_fields[i].name);
+	}
+	if (priv) {
+		str_append(query, count == 0 ? " WHERE" : " AND");
+		str_printfa(query, " %s = ?", map->username_field);
+	}
+
+	stmt = sql_statement_init_prepared(
+		sql_dict_prepared_statement_get(dict, str_c(query)));
+	for (i = 0; i < count; i++) {
+		if (sql_fields[i].value_type == DICT_SQL_TYPE_STRING)
+			sql_statement_bind_str(stmt, i, values[i]);
+		else if (str_to_uint(values[i], &num) == 0)
+			sql_statement_bind_int64(stmt, i, num);
+		else {
+			*error_r = t_strdup_printf("sql dict lookup: "
+				"Failed to lookup key %s: field %s value "
+				"isn't unsigned integer: %s", key,
+				sql_fields[i].name, values[i]);
+			sql_statement_abort(&stmt);
+			return -1;
+		}
+	}
+	if (priv)
+		sql_statement_bind_str(stmt, i, dict->username);
+	*stmt_r = stmt;
+	return 1;
+}
+
+/* Returns 1 if the lookup can be done with the returned prepared statement,
+   0 if the query was written to query string, -1 on error. */
 static int
 sql_lookup_get_query(struct sql_dict *dict, const char *key,
-		     string_t *query, const struct dict_sql_map **map_r,
-		     const char **error_r)
+		     string_t *query, struct sql_statement **stmt_r,
+		     const struct dict_sql_map **map_r, const char **error_r)
 {
 	const struct dict_sql_map *map;
 	ARRAY_TYPE(const_string) values;
 	const char *error;
+	int ret;
 
 	map = *map_r = sql_dict_find_map(dict, key, &values);
 	if (map == NULL) {
@@ -351,6 +437,10 @@ sql_lookup_get_query(struct sql_dict *dict, const char *key,
 			"sql dict lookup: Invalid/unmapped key: %s", key);
 		return -1;
 	}
+	if ((ret = sql_lookup_get_statement(dict, key, map, &values,
+					    stmt_r, error_r)) != 0)
+		return ret;
+
 	str_printfa(query, "SELECT %s FROM %s",
 		    map->value_field, map->table);
 	if (sql_dict_where_build(dict, map, &values, key[0],
@@ -428,11 +518,15 @@ static int sql_dict_lookup(struct dict *_dict, pool_t pool,
 
 	T_BEGIN {
 		string_t *query = t_str_new(256);
+		struct sql_statement *stmt;
 		const char *error;
 
-		ret = sql_lookup_get_query(dict, key, query, &map, &error);
+		ret = sql_lookup_get_query(dict, key, query, &stmt,
+					   &map, &error);
 		if (ret < 0)
 			i_error("%s", error);
+		else if (ret > 0)
+			result = sql_statement_query_s(&stmt);
 		else
 			result = sql_query_s(dict->db, str_c(query));
 	} T_END;
@@ -492,9 +586,13 @@ sql_dict_lookup_async(struct dict *_dict, const char *key,
 
 	T_BEGIN {
 		string_t *query = t_str_new(256);
+		struct sql_statement *stmt;
 		const char *error;
+		int ret;
 
-		if (sql_lookup_get_query(dict, key, query, &map, &error) < 0) {
+		ret = sql_lookup_get_query(dict, key, query, &stmt,
+					   &map, &error);
+		if (ret < 0) {
 			struct dict_lookup_result result;
 
 			memset(&result, 0, sizeof(result));
@@ -506,8 +604,13 @@ sql_dict_lookup_async(struct dict *_dict, const char *key,
 			ctx->callback = callback;
 			ctx->context = context;
 			ctx->map = map;
-			sql_query(dict->db, str_c(query),
-				  sql_dict_lookup_async_callback, ctx);
+			if (ret > 0) {
+				sql_statement_query(&stmt,
+					sql_dict_lookup_async_callback, ctx);
+			} else {
+				sql_query(dict->db, str_c(query),
+					  sql_dict_lookup_async_callback, ctx);
+			}
 		}
 	} T_END;
 }
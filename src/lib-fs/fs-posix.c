@@ -648,7 +648,8 @@ static int fs_posix_stat(struct fs_file *_file, struct stat *st_r)
 {
 	struct posix_fs_file *file = (struct posix_fs_file *)_file;
 
-	if (file->fd != -1) {
+	/* while writing the fd points to the temp file, not to the path */
+	if (file->fd != -1 && file->temp_path == NULL) {
 		if (fstat(file->fd, st_r) < 0) {
 			fs_set_error(_file->fs, "fstat(%s) failed: %m", file->full_path);
 			return -1;
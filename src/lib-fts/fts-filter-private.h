@@ -29,6 +29,7 @@ struct fts_filter {
 	int refcount;
 	struct fts_filter *parent;
 	string_t *token;
+	struct fts_filter_cache *cache;
 };
 
 #endif
@@ -3,6 +3,8 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "hash.h"
+#include "llist.h"
 #include "fts-language.h"
 #include "fts-filter-private.h"
 
@@ -10,6 +12,23 @@
 #  include "fts-icu.h"
 #endif
 
+struct fts_filter_cache_entry {
+	struct fts_filter_cache_entry *prev, *next;
+
+	char *input;
+	/* NULL if the token was filtered out */
+	char *output;
+};
+
+struct fts_filter_cache {
+	HASH_TABLE(char *, struct fts_filter_cache_entry *) hash;
+	/* head is the most recently used entry */
+	struct fts_filter_cache_entry *head, *tail;
+	unsigned int count, max_count;
+
+	struct fts_filter_cache_stats stats;
+};
+
 static ARRAY(const struct fts_filter *) fts_filter_classes;
 
 void fts_filters_init(void)
@@ -94,6 +113,53 @@ void fts_filter_ref(struct fts_filter *fp)
 	fp->refcount++;
 }
 
+static void
+fts_filter_cache_entry_destroy(struct fts_filter_cache *cache,
+			       struct fts_filter_cache_entry *entry)
+{
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	hash_table_remove(cache->hash, entry->input);
+	cache->count--;
+
+	i_free(entry->input);
+	i_free(entry->output);
+	i_free(entry);
+}
+
+static void fts_filter_cache_free(struct fts_filter_cache **_cache)
+{
+	struct fts_filter_cache *cache = *_cache;
+
+	*_cache = NULL;
+	while (cache->tail != NULL)
+		fts_filter_cache_entry_destroy(cache, cache->tail);
+	hash_table_destroy(&cache->hash);
+	i_free(cache);
+}
+
+void fts_filter_set_cache_size(struct fts_filter *filter,
+			       unsigned int max_tokens)
+{
+	if (filter->cache != NULL)
+		fts_filter_cache_free(&filter->cache);
+	if (max_tokens == 0)
+		return;
+
+	filter->cache = i_new(struct fts_filter_cache, 1);
+	filter->cache->max_count = max_tokens;
+	hash_table_create(&filter->cache->hash, default_pool, 0,
+			  str_hash, strcmp);
+}
+
+void fts_filter_get_cache_stats(const struct fts_filter *filter,
+				struct fts_filter_cache_stats *stats_r)
+{
+	if (filter->cache == NULL)
+		memset(stats_r, 0, sizeof(*stats_r));
+	else
+		*stats_r = filter->cache->stats;
+}
+
 void fts_filter_unref(struct fts_filter **_fpp)
 {
 	struct fts_filter *fp = *_fpp;
@@ -106,6 +172,8 @@ void fts_filter_unref(struct fts_filter **_fpp)
 
 	if (fp->parent != NULL)
 		fts_filter_unref(&fp->parent);
+	if (fp->cache != NULL)
+		fts_filter_cache_free(&fp->cache);
 	if (fp->v.destroy != NULL)
 		fp->v.destroy(fp);
 	else {
@@ -116,8 +184,9 @@ void fts_filter_unref(struct fts_filter **_fpp)
 	}
 }
 
-int fts_filter_filter(struct fts_filter *filter, const char **token,
-		      const char **error_r)
+static int
+fts_filter_filter_chain(struct fts_filter *filter, const char **token,
+			const char **error_r)
 {
 	int ret = 0;
 
@@ -139,3 +208,49 @@ int fts_filter_filter(struct fts_filter *filter, const char **token,
 	}
 	return ret;
 }
+
+static int
+fts_filter_filter_cached(struct fts_filter *filter, const char **token,
+			 const char **error_r)
+{
+	struct fts_filter_cache *cache = filter->cache;
+	struct fts_filter_cache_entry *entry;
+	char *input;
+	int ret;
+
+	entry = hash_table_lookup(cache->hash, *token);
+	if (entry != NULL) {
+		cache->stats.hits++;
+		DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+		DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+		*token = entry->output;
+		return entry->output != NULL ? 1 : 0;
+	}
+	cache->stats.misses++;
+
+	input = i_strdup(*token);
+	if ((ret = fts_filter_filter_chain(filter, token, error_r)) < 0) {
+		i_free(input);
+		return -1;
+	}
+
+	if (cache->count >= cache->max_count)
+		fts_filter_cache_entry_destroy(cache, cache->tail);
+	entry = i_new(struct fts_filter_cache_entry, 1);
+	entry->input = input;
+	entry->output = i_strdup(*token);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	hash_table_insert(cache->hash, entry->input, entry);
+	cache->count++;
+	return ret;
+}
+
+int fts_filter_filter(struct fts_filter *filter, const char **token,
+		      const char **error_r)
+{
+	i_assert((*token)[0] != '\0');
+
+	if (filter->cache != NULL)
+		return fts_filter_filter_cached(filter, token, error_r);
+	return fts_filter_filter_chain(filter, token, error_r);
+}
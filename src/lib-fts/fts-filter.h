@@ -46,6 +46,10 @@ void fts_filters_deinit(void);
    registered. */
 void fts_filter_register(const struct fts_filter *filter_class);
 
+struct fts_filter_cache_stats {
+	unsigned int hits, misses;
+};
+
 /*
  Filtering workflow, find --> create --> filter --> destroy.
  */
@@ -66,4 +70,14 @@ void fts_filter_unref(struct fts_filter **filter);
 int fts_filter_filter(struct fts_filter *filter, const char **token,
 		      const char **error_r);
 
+/* Remember the results of the last max_tokens different tokens given to
+   fts_filter_filter(). The same words repeat a lot in mails, so this avoids
+   running the whole filter chain (stemming, ICU normalization) for them
+   again. max_tokens=0 disables the cache. */
+void fts_filter_set_cache_size(struct fts_filter *filter,
+			       unsigned int max_tokens);
+/* Get the cache statistics. They're zero if the cache isn't enabled. */
+void fts_filter_get_cache_stats(const struct fts_filter *filter,
+				struct fts_filter_cache_stats *stats_r);
+
 #endif
@@ -875,6 +875,58 @@ static void test_fts_filter_english_possessive(void)
 	test_end();
 }
 
+static void test_fts_filter_cache(void)
+{
+	struct {
+		const char *input;
+		const char *output;
+	} tests[] = {
+		{ "The", NULL },
+		{ "FOO", "foo" },
+		{ "the", NULL },
+		{ "The", NULL },
+		{ "Foo", "foo" },
+		{ "FOO", "foo" },
+		{ "bar", "bar" },
+		{ "Baz", "baz" },
+		{ "The", NULL }
+	};
+	struct fts_filter *lowercase, *filter;
+	struct fts_filter_cache_stats stats;
+	const char *error;
+	const char *token;
+	unsigned int i;
+	int ret;
+
+	test_begin("fts filter cache");
+	test_assert(fts_filter_create(fts_filter_lowercase, NULL, &english_language, NULL, &lowercase, &error) == 0);
+	test_assert(fts_filter_create(fts_filter_stopwords, lowercase, &english_language, stopword_settings, &filter, &error) == 0);
+	fts_filter_unref(&lowercase);
+	fts_filter_set_cache_size(filter, 3);
+
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		token = tests[i].input;
+		ret = fts_filter_filter(filter, &token, &error);
+		if (tests[i].output == NULL)
+			test_assert_idx(ret == 0 && token == NULL, i);
+		else {
+			test_assert_idx(ret > 0 &&
+					strcmp(token, tests[i].output) == 0, i);
+		}
+	}
+	/* only the second "The" was found from the cache, the last one
+	   had already been evicted */
+	fts_filter_get_cache_stats(filter, &stats);
+	test_assert(stats.hits == 1);
+	test_assert(stats.misses == 8);
+
+	fts_filter_set_cache_size(filter, 0);
+	fts_filter_get_cache_stats(filter, &stats);
+	test_assert(stats.hits == 0 && stats.misses == 0);
+	fts_filter_unref(&filter);
+	test_end();
+}
+
 /* TODO: Functions to test 1. ref-unref pairs 2. multiple registers +
   an unregister + find */
 
@@ -912,6 +964,7 @@ int main(void)
 #endif
 #endif
 		test_fts_filter_english_possessive,
+		test_fts_filter_cache,
 		NULL
 	};
 	int ret;
@@ -34,7 +34,10 @@ enum mail_index_open_flags {
 	MAIL_INDEX_OPEN_FLAG_NEVER_IN_MEMORY	= 0x200,
 	/* We're only going to save new messages to the index.
 	   Avoid unnecessary reads. */
-	MAIL_INDEX_OPEN_FLAG_SAVEONLY		= 0x400
+	MAIL_INDEX_OPEN_FLAG_SAVEONLY		= 0x400,
+	/* fsync() the transaction log immediately even while a fsync batch
+	   is open. Used when other indexes refer to this index's records. */
+	MAIL_INDEX_OPEN_FLAG_NO_FSYNC_BATCH	= 0x800
 };
 
 enum mail_index_header_compat_flags {
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "write-full.h"
+#include "fsync-batch.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
 
@@ -58,6 +59,14 @@ log_buffer_move_to_memory(struct mail_transaction_log_append_ctx *ctx)
 	return 0;
 }
 
+static int log_file_fdatasync(struct mail_transaction_log_file *file)
+{
+	if ((file->log->index->flags &
+	     MAIL_INDEX_OPEN_FLAG_NO_FSYNC_BATCH) != 0)
+		return fdatasync(file->fd);
+	return fsync_batch_fdatasync(file->fd, file->filepath);
+}
+
 static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 {
 	struct mail_transaction_log_file *file = ctx->log->head;
@@ -90,7 +99,7 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 	if ((ctx->want_fsync &&
 	     file->log->index->fsync_mode != FSYNC_MODE_NEVER) ||
 	    file->log->index->fsync_mode == FSYNC_MODE_ALWAYS) {
-		if (fdatasync(file->fd) < 0) {
+		if (log_file_fdatasync(file) < 0) {
 			mail_index_file_set_syscall_error(ctx->log->index,
 							  file->filepath,
 							  "fdatasync()");
@@ -343,6 +343,10 @@ int mail_deliver_save(struct mail_deliver_context *ctx, const char *mailbox,
 	if (ctx->src_envelope_sender != NULL)
 		mailbox_save_set_from_envelope(save_ctx, ctx->src_envelope_sender);
 	mailbox_save_set_flags(save_ctx, flags, kw);
+	if (ctx->body_attachment_min_size > 0) {
+		mailbox_save_set_body_attachment_min_size(save_ctx,
+			ctx->body_attachment_min_size);
+	}
 
 	headers_ctx = mailbox_header_lookup_init(box, lda_log_wanted_headers);
 	ctx->dest_mail = mail_alloc(t, lda_log_wanted_fetch_fields, NULL);
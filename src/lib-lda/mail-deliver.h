@@ -49,6 +49,9 @@ struct mail_deliver_context {
 	/* Mailbox where mail should be saved, unless e.g. Sieve does
 	   something to it. */
 	const char *dest_mailbox_name;
+	/* If non-zero, save the body parts at least this large as attachments
+	   so they can be shared with other recipients' mails. */
+	uoff_t body_attachment_min_size;
 
 	/* Filled with destination mail, if save_dest_mail=TRUE.
 	   The caller must free the mail, its transaction and close
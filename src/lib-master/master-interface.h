@@ -63,6 +63,15 @@ enum master_login_state {
 /* getenv(MASTER_CONFIG_FILE_ENV) provides path to configuration file/socket */
 #define MASTER_CONFIG_FILE_ENV "CONFIG_FILE"
 
+/* getenv(MASTER_CONFIG_SNAPSHOT_DIR_ENV) provides the directory where the
+   config process writes snapshots of its replies, and
+   getenv(MASTER_CONFIG_GENERATION_ENV) the generation of the currently used
+   configuration. Snapshots from other generations are ignored. */
+#define MASTER_CONFIG_SNAPSHOT_DIR_ENV "CONFIG_SNAPSHOT_DIR"
+#define MASTER_CONFIG_GENERATION_ENV "CONFIG_GENERATION"
+/* First line of a config snapshot file, followed by TAB and generation */
+#define MASTER_CONFIG_SNAPSHOT_HEADER "DOVECOT-CONFIG-SNAPSHOT\t1"
+
 /* getenv(MASTER_DOVECOT_VERSION_ENV) provides master's version number
    (unset if version_ignore=yes) */
 #define MASTER_DOVECOT_VERSION_ENV "DOVECOT_VERSION"
@@ -207,6 +207,7 @@ static void master_login_auth_finish(struct master_login_client *client,
 		service->service_count_left == 1;
 
 	client->conn->login_success = TRUE;
+	client->auth_finished_time = ioloop_timeval;
 	login->callback(client, auth_args[0], auth_args+1);
 
 	if (close_sockets) {
@@ -428,6 +429,7 @@ static void master_login_conn_input(struct master_login_connection *conn)
 	client->fd = client_fd;
 	client->auth_req = req;
 	client->session_id = i_strndup(data, session_len);
+	client->create_time = ioloop_timeval;
 	memcpy(client->data, data+i, req.data_size);
 	conn->refcount++;
 
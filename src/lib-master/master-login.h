@@ -11,6 +11,10 @@ struct master_login_client {
 
 	struct master_auth_request auth_req;
 	char *session_id;
+	/* when the login process handed over the client, and when the auth
+	   lookup (and post-login scripts) finished. these can be used to
+	   measure the login latency. */
+	struct timeval create_time, auth_finished_time;
 	unsigned char data[FLEXIBLE_ARRAY_MEMBER];
 };
 
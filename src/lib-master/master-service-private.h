@@ -31,6 +31,7 @@ struct master_service {
 
 	const char *version_string;
 	char *config_path;
+	char *config_snapshot_dir, *config_generation;
 	ARRAY_TYPE(const_string) config_overrides;
 	int config_fd;
 	int syslog_facility;
@@ -6,6 +6,8 @@
 #include "istream.h"
 #include "write-full.h"
 #include "str.h"
+#include "sha1.h"
+#include "hex-binary.h"
 #include "eacces-error.h"
 #include "env-util.h"
 #include "execv-const.h"
@@ -17,6 +19,7 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #define DOVECOT_CONFIG_BIN_PATH BINDIR"/doveconf"
@@ -233,7 +236,8 @@ master_service_open_config(struct master_service *service,
 
 static void
 config_build_request(struct master_service *service, string_t *str,
-		     const struct master_service_settings_input *input)
+		     const struct master_service_settings_input *input,
+		     const char *snapshot_key)
 {
 	str_append(str, "REQ");
 	if (input->module != NULL) {
@@ -251,13 +255,75 @@ config_build_request(struct master_service *service, string_t *str,
 		str_printfa(str, "\trip=%s", net_ip2addr(&input->remote_ip));
 	if (input->local_name != NULL)
 		str_printfa(str, "\tlname=%s", input->local_name);
+	if (snapshot_key != NULL) {
+		/* ask config process to write a snapshot of the reply */
+		str_printfa(str, "\tsnapshot=%s\tgeneration=%s",
+			    snapshot_key, service->config_generation);
+	}
 	str_append_c(str, '\n');
 }
 
+static const char *
+config_snapshot_get_key(struct master_service *service,
+			const struct master_service_settings_input *input)
+{
+	unsigned char digest[SHA1_RESULTLEN];
+	string_t *str;
+
+	if (service->config_snapshot_dir == NULL ||
+	    service->config_generation == NULL ||
+	    service->config_path_changed_with_param ||
+	    input->config_path != NULL)
+		return NULL;
+	/* the snapshots are shared by all the processes, so only replies
+	   that don't depend on the connection can be used */
+	if (input->username != NULL || input->local_ip.family != 0 ||
+	    input->remote_ip.family != 0 || input->local_name != NULL)
+		return NULL;
+
+	str = t_str_new(128);
+	config_build_request(service, str, input, NULL);
+	sha1_get_digest(str_data(str), str_len(str), digest);
+	return binary_to_hex(digest, sizeof(digest));
+}
+
+static struct istream *
+config_snapshot_open(struct master_service *service, const char *key,
+		     const char **path_r)
+{
+	struct istream *input;
+	const char *path, *line;
+	int fd;
+
+	path = t_strdup_printf("%s/%s", service->config_snapshot_dir, key);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT && errno != EACCES)
+			i_error("open(%s) failed: %m", path);
+		return NULL;
+	}
+
+	input = i_stream_create_mmap(fd, IO_BLOCK_SIZE, 0, 0, TRUE);
+	line = i_stream_read_next_line(input);
+	if (line == NULL ||
+	    strncmp(line, MASTER_CONFIG_SNAPSHOT_HEADER"\t",
+		    strlen(MASTER_CONFIG_SNAPSHOT_HEADER) + 1) != 0 ||
+	    strcmp(line + strlen(MASTER_CONFIG_SNAPSHOT_HEADER) + 1,
+		   service->config_generation) != 0) {
+		/* written for another configuration. the config process
+		   will replace it. */
+		i_stream_unref(&input);
+		return NULL;
+	}
+	*path_r = path;
+	return input;
+}
+
 static int
 config_send_request(struct master_service *service,
 		    const struct master_service_settings_input *input,
-		    int fd, const char *path, const char **error_r)
+		    int fd, const char *path, const char *snapshot_key,
+		    const char **error_r)
 {
 	int ret;
 
@@ -266,7 +332,7 @@ config_send_request(struct master_service *service,
 
 		str = t_str_new(128);
 		str_append(str, CONFIG_HANDSHAKE);
-		config_build_request(service, str, input);
+		config_build_request(service, str, input, snapshot_key);
 		ret = write_full(fd, str_data(str), str_len(str));
 	} T_END;
 	if (ret < 0) {
@@ -305,14 +371,14 @@ config_read_reply_header(struct istream *istream, const char *path, pool_t pool,
 			 const char **error_r)
 {
 	const char *line;
-	ssize_t ret;
+	ssize_t ret = 1;
 
-	while ((ret = i_stream_read(istream)) > 0) {
-		line = i_stream_next_line(istream);
-		if (line != NULL)
+	/* the snapshot header check may have already buffered the line */
+	while ((line = i_stream_next_line(istream)) == NULL) {
+		if ((ret = i_stream_read(istream)) <= 0)
 			break;
 	}
-	if (ret <= 0) {
+	if (line == NULL) {
 		if (ret == 0)
 			return 1;
 		*error_r = istream->stream_errno != 0 ?
@@ -379,8 +445,8 @@ int master_service_settings_read(struct master_service *service,
 	ARRAY(const struct setting_parser_info *) all_roots;
 	const struct setting_parser_info *tmp_root;
 	struct setting_parser_context *parser;
-	struct istream *istream;
-	const char *path = NULL, *error;
+	struct istream *istream = NULL;
+	const char *path = NULL, *snapshot_key = NULL, *error;
 	void **sets;
 	unsigned int i;
 	int ret, fd = -1;
@@ -390,6 +456,15 @@ int master_service_settings_read(struct master_service *service,
 	memset(output_r, 0, sizeof(*output_r));
 
 	if (getenv("DOVECONF_ENV") == NULL &&
+	    (service->flags & MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS) == 0) {
+		/* use the snapshot written by the config process for an
+		   identical earlier request, if it's still up to date */
+		snapshot_key = config_snapshot_get_key(service, input);
+		if (snapshot_key != NULL)
+			istream = config_snapshot_open(service, snapshot_key,
+						       &path);
+	}
+	if (istream == NULL && getenv("DOVECONF_ENV") == NULL &&
 	    (service->flags & MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS) == 0) {
 		retry = service->config_fd != -1;
 		for (;;) {
@@ -402,7 +477,8 @@ int master_service_settings_read(struct master_service *service,
 			}
 
 			if (config_send_request(service, input, fd,
-						path, error_r) == 0)
+						path, snapshot_key,
+						error_r) == 0)
 				break;
 			i_close_fd(&fd);
 			if (!retry) {
@@ -439,8 +515,9 @@ int master_service_settings_read(struct master_service *service,
 			array_idx(&all_roots, 0), array_count(&all_roots),
 			SETTINGS_PARSER_FLAG_IGNORE_UNKNOWN_KEYS);
 
-	if (fd != -1) {
-		istream = i_stream_create_fd(fd, (size_t)-1, FALSE);
+	if (fd != -1 || istream != NULL) {
+		if (istream == NULL)
+			istream = i_stream_create_fd(fd, (size_t)-1, FALSE);
 		now = time(NULL);
 		timeout = now + CONFIG_READ_TIMEOUT_SECS;
 		do {
@@ -470,15 +547,17 @@ int master_service_settings_read(struct master_service *service,
 				*error_r = t_strdup_printf(
 					"Timeout reading config from %s", path);
 			}
-			i_close_fd(&fd);
+			if (fd != -1)
+				i_close_fd(&fd);
 			config_exec_fallback(service, input);
 			return -1;
 		}
 
-		if ((service->flags & MASTER_SERVICE_FLAG_KEEP_CONFIG_OPEN) != 0 &&
+		if (fd != -1 &&
+		    (service->flags & MASTER_SERVICE_FLAG_KEEP_CONFIG_OPEN) != 0 &&
 		    service->config_fd == -1 && input->config_path == NULL)
 			service->config_fd = fd;
-		else
+		else if (fd != -1)
 			i_close_fd(&fd);
 		use_environment = FALSE;
 	} else {
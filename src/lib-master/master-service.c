@@ -210,6 +210,10 @@ master_service_init(const char *name, enum master_service_flags flags,
 		service->config_path = i_strdup(DEFAULT_CONFIG_FILE_PATH);
 	else
 		service->config_path_from_master = TRUE;
+	service->config_snapshot_dir =
+		i_strdup(getenv(MASTER_CONFIG_SNAPSHOT_DIR_ENV));
+	service->config_generation =
+		i_strdup(getenv(MASTER_CONFIG_GENERATION_ENV));
 
 	if ((flags & MASTER_SERVICE_FLAG_STANDALONE) == 0) {
 		service->version_string = getenv(MASTER_DOVECOT_VERSION_ENV);
@@ -880,6 +884,8 @@ void master_service_deinit(struct master_service **_service)
 	i_free(service->getopt_str);
 	i_free(service->name);
 	i_free(service->config_path);
+	i_free(service->config_snapshot_dir);
+	i_free(service->config_generation);
 	i_free(service);
 
 	lib_deinit();
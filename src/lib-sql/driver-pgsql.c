@@ -26,6 +26,8 @@ struct pgsql_db {
 	enum io_condition io_dir;
 
 	struct pgsql_result *cur_result;
+	/* prepared statement IDs that exist in the current connection */
+	ARRAY(unsigned int) prepared_stmt_ids;
 	struct ioloop *ioloop, *orig_ioloop;
 	struct sql_result *sync_result;
 
@@ -55,10 +57,14 @@ struct pgsql_result {
 
 	ARRAY(struct pgsql_binary_value) binary_values;
 
+	/* prepared statement being executed, or NULL for plain queries */
+	struct sql_statement *stmt;
 	sql_query_callback_t *callback;
 	void *context;
 
 	unsigned int timeout:1;
+	/* waiting for the statement to be prepared */
+	unsigned int preparing:1;
 };
 
 struct pgsql_transaction_context {
@@ -78,6 +84,7 @@ extern const struct sql_db driver_pgsql_db;
 extern const struct sql_result driver_pgsql_result;
 
 static void result_finish(struct pgsql_result *result);
+static void prepare_finish(struct pgsql_result *result);
 static void
 transaction_update_callback(struct sql_result *result,
 			    struct sql_transaction_query *query);
@@ -131,6 +138,8 @@ static void driver_pgsql_close(struct pgsql_db *db)
 
 	PQfinish(db->pg);
 	db->pg = NULL;
+	/* prepared statements are per-connection */
+	array_clear(&db->prepared_stmt_ids);
 
 	if (db->to_connect != NULL)
 		timeout_remove(&db->to_connect);
@@ -281,6 +290,7 @@ static struct sql_db *driver_pgsql_init_v(const char *connect_string)
 	db = i_new(struct pgsql_db, 1);
 	db->connect_string = i_strdup(connect_string);
 	db->api = driver_pgsql_db;
+	i_array_init(&db->prepared_stmt_ids, 16);
 
 	T_BEGIN {
 		const char *const *arg = t_strsplit(connect_string, " ");
@@ -301,6 +311,7 @@ static void driver_pgsql_deinit_v(struct sql_db *_db)
 	i_free(db->host);
 	i_free(db->error);
 	i_free(db->connect_string);
+	array_free(&db->prepared_stmt_ids);
 	array_free(&_db->module_contexts);
 	i_free(db);
 }
@@ -436,6 +447,17 @@ static void get_result(struct pgsql_result *result)
 	}
 
 	result->pgres = PQgetResult(db->pg);
+	if (result->preparing && result->pgres != NULL &&
+	    PQresultStatus(result->pgres) == PGRES_COMMAND_OK) {
+		/* statement is prepared, now execute it */
+		PQclear(result->pgres);
+		result->pgres = NULL;
+		result->preparing = FALSE;
+		array_append(&db->prepared_stmt_ids,
+			     &result->stmt->prep_id, 1);
+		prepare_finish(result);
+		return;
+	}
 	result_finish(result);
 }
 
@@ -473,22 +495,58 @@ static void query_timeout(struct pgsql_result *result)
 	result_finish(result);
 }
 
-static void do_query(struct pgsql_result *result, const char *query)
+static bool
+driver_pgsql_is_prepared(struct pgsql_db *db, unsigned int prep_id)
 {
-        struct pgsql_db *db = (struct pgsql_db *)result->api.db;
-	int ret;
+	const unsigned int *idp;
 
-	i_assert(SQL_DB_IS_READY(&db->api));
-	i_assert(db->cur_result == NULL);
-	i_assert(db->io == NULL);
+	array_foreach(&db->prepared_stmt_ids, idp) {
+		if (*idp == prep_id)
+			return TRUE;
+	}
+	return FALSE;
+}
 
-	driver_pgsql_set_state(db, SQL_DB_STATE_BUSY);
-	db->cur_result = result;
-	result->to = timeout_add(SQL_QUERY_TIMEOUT_SECS * 1000,
-				 query_timeout, result);
+static int driver_pgsql_send_command(struct pgsql_result *result,
+				     const char *query)
+{
+        struct pgsql_db *db = (struct pgsql_db *)result->api.db;
+	struct sql_statement *stmt = result->stmt;
+	const struct sql_statement_param *params;
+	const char **values, *name;
+	unsigned int i, count;
+
+	if (stmt == NULL)
+		return PQsendQuery(db->pg, query);
+
+	name = t_strdup_printf("dovecot_stmt_%u", stmt->prep_id);
+	params = array_get(&stmt->params, &count);
+	values = t_new(const char *, count + 1);
+	if (!driver_pgsql_is_prepared(db, stmt->prep_id)) {
+		/* parse the statement first. it's executed after the prepare
+		   has finished. */
+		for (i = 0; i < count; i++)
+			values[i] = t_strdup_printf("$%u", i + 1);
+		result->preparing = TRUE;
+		return PQsendPrepare(db->pg, name,
+				     sql_statement_expand_query(stmt, values),
+				     count, NULL);
+	}
+	for (i = 0; i < count; i++)
+		values[i] = params[i].value;
+	return PQsendQueryPrepared(db->pg, name, count, values,
+				   NULL, NULL, 0);
+}
+
+static void do_send(struct pgsql_result *result, const char *query)
+{
+        struct pgsql_db *db = (struct pgsql_db *)result->api.db;
+	int ret;
 
-	if (!PQsendQuery(db->pg, query) ||
-	    (ret = PQflush(db->pg)) < 0) {
+	T_BEGIN {
+		ret = driver_pgsql_send_command(result, query);
+	} T_END;
+	if (ret == 0 || (ret = PQflush(db->pg)) < 0) {
 		/* failed to send query */
 		result_finish(result);
 		return;
@@ -504,6 +562,49 @@ static void do_query(struct pgsql_result *result, const char *query)
 	}
 }
 
+static void prepare_finish(struct pgsql_result *result)
+{
+        struct pgsql_db *db = (struct pgsql_db *)result->api.db;
+	PGresult *pgres;
+
+	driver_pgsql_stop_io(db);
+
+	/* the prepare command must be finished before the next one can be
+	   sent */
+	for (;;) {
+		if (!PQconsumeInput(db->pg)) {
+			result_finish(result);
+			return;
+		}
+		if (PQisBusy(db->pg)) {
+			db->io = io_add(PQsocket(db->pg), IO_READ,
+					prepare_finish, result);
+			db->io_dir = IO_READ;
+			return;
+		}
+		pgres = PQgetResult(db->pg);
+		if (pgres == NULL)
+			break;
+		PQclear(pgres);
+	}
+	do_send(result, NULL);
+}
+
+static void do_query(struct pgsql_result *result, const char *query)
+{
+        struct pgsql_db *db = (struct pgsql_db *)result->api.db;
+
+	i_assert(SQL_DB_IS_READY(&db->api));
+	i_assert(db->cur_result == NULL);
+	i_assert(db->io == NULL);
+
+	driver_pgsql_set_state(db, SQL_DB_STATE_BUSY);
+	db->cur_result = result;
+	result->to = timeout_add(SQL_QUERY_TIMEOUT_SECS * 1000,
+				 query_timeout, result);
+	do_send(result, query);
+}
+
 static const char *
 driver_pgsql_escape_string(struct sql_db *_db, const char *string)
 {
@@ -551,8 +652,10 @@ static void driver_pgsql_exec(struct sql_db *db, const char *query)
 	do_query(result, query);
 }
 
-static void driver_pgsql_query(struct sql_db *db, const char *query,
-			       sql_query_callback_t *callback, void *context)
+static void
+driver_pgsql_query_full(struct sql_db *db, const char *query,
+			struct sql_statement *stmt,
+			sql_query_callback_t *callback, void *context)
 {
 	struct pgsql_result *result;
 
@@ -560,11 +663,25 @@ static void driver_pgsql_query(struct sql_db *db, const char *query,
 	result->api = driver_pgsql_result;
 	result->api.db = db;
 	result->api.refcount = 1;
+	result->stmt = stmt;
 	result->callback = callback;
 	result->context = context;
 	do_query(result, query);
 }
 
+static void driver_pgsql_query(struct sql_db *db, const char *query,
+			       sql_query_callback_t *callback, void *context)
+{
+	driver_pgsql_query_full(db, query, NULL, callback, context);
+}
+
+static void
+driver_pgsql_statement_query(struct sql_db *db, struct sql_statement *stmt,
+			     sql_query_callback_t *callback, void *context)
+{
+	driver_pgsql_query_full(db, NULL, stmt, callback, context);
+}
+
 static void pgsql_query_s_callback(struct sql_result *result, void *context)
 {
         struct pgsql_db *db = context;
@@ -609,7 +726,8 @@ static void driver_pgsql_sync_deinit(struct pgsql_db *db)
 }
 
 static struct sql_result *
-driver_pgsql_sync_query(struct pgsql_db *db, const char *query)
+driver_pgsql_sync_query(struct pgsql_db *db, const char *query,
+			struct sql_statement *stmt)
 {
 	struct sql_result *result;
 
@@ -626,7 +744,8 @@ driver_pgsql_sync_query(struct pgsql_db *db, const char *query)
 		break;
 	}
 
-	driver_pgsql_query(&db->api, query, pgsql_query_s_callback, db);
+	driver_pgsql_query_full(&db->api, query, stmt,
+				pgsql_query_s_callback, db);
 	if (db->sync_result == NULL)
 		io_loop_run(db->ioloop);
 
@@ -653,7 +772,19 @@ driver_pgsql_query_s(struct sql_db *_db, const char *query)
 	struct sql_result *result;
 
 	driver_pgsql_sync_init(db);
-	result = driver_pgsql_sync_query(db, query);
+	result = driver_pgsql_sync_query(db, query, NULL);
+	driver_pgsql_sync_deinit(db);
+	return result;
+}
+
+static struct sql_result *
+driver_pgsql_statement_query_s(struct sql_db *_db, struct sql_statement *stmt)
+{
+	struct pgsql_db *db = (struct pgsql_db *)_db;
+	struct sql_result *result;
+
+	driver_pgsql_sync_init(db);
+	result = driver_pgsql_sync_query(db, NULL, stmt);
 	driver_pgsql_sync_deinit(db);
 	return result;
 }
@@ -1016,7 +1147,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 	struct sql_result *result;
 	struct sql_transaction_query *query;
 
-	result = driver_pgsql_sync_query(db, "BEGIN");
+	result = driver_pgsql_sync_query(db, "BEGIN", NULL);
 	if (sql_result_next_row(result) < 0) {
 		commit_multi_fail(ctx, result, "BEGIN");
 		return NULL;
@@ -1025,7 +1156,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 
 	/* send queries */
 	for (query = ctx->ctx.head; query != NULL; query = query->next) {
-		result = driver_pgsql_sync_query(db, query->query);
+		result = driver_pgsql_sync_query(db, query->query, NULL);
 		if (sql_result_next_row(result) < 0) {
 			commit_multi_fail(ctx, result, query->query);
 			break;
@@ -1042,7 +1173,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 	}
 
 	return driver_pgsql_sync_query(db, ctx->failed ?
-				       "ROLLBACK" : "COMMIT");
+				       "ROLLBACK" : "COMMIT", NULL);
 }
 
 static void
@@ -1165,7 +1296,10 @@ const struct sql_db driver_pgsql_db = {
 
 		driver_pgsql_update,
 
-		driver_pgsql_escape_blob
+		driver_pgsql_escape_blob,
+
+		driver_pgsql_statement_query,
+		driver_pgsql_statement_query_s
 	}
 };
 
@@ -51,6 +51,8 @@ struct sqlpool_request {
 
 	/* requests are a) queries */
 	char *query;
+	/* or prepared statements (owned by the caller) */
+	struct sql_statement *stmt;
 	sql_query_callback_t *callback;
 	void *context;
 
@@ -165,6 +167,10 @@ sqlpool_request_send_next(struct sqlpool_db *db, struct sql_db *conndb)
 	if (request->query != NULL) {
 		sql_query(conndb, request->query,
 			  driver_sqlpool_query_callback, request);
+	} else if (request->stmt != NULL) {
+		sql_db_statement_query(conndb, request->stmt,
+			(sql_query_callback_t *)driver_sqlpool_query_callback,
+			request);
 	} else if (request->trans != NULL) {
 		sqlpool_request_handle_transaction(conndb, request->trans);
 	} else {
@@ -577,6 +583,7 @@ static void driver_sqlpool_timeout(struct sqlpool_db *db)
 			db->driver->name,
 			(unsigned int)(ioloop_time - request->created),
 			request->query != NULL ? request->query :
+			request->stmt != NULL ? request->stmt->query_template :
 			"<transaction>");
 		sqlpool_request_abort(&request);
 	}
@@ -630,7 +637,8 @@ driver_sqlpool_query_callback(struct sql_result *result,
 	} else {
 		if (result->failed) {
 			i_error("%s: Query failed, aborting: %s",
-				db->driver->name, request->query);
+				db->driver->name, request->query != NULL ?
+				request->query : request->stmt->query_template);
 		}
 		conndb = result->db;
 
@@ -691,6 +699,52 @@ driver_sqlpool_query_s(struct sql_db *_db, const char *query)
 	return result;
 }
 
+static void
+driver_sqlpool_statement_query(struct sql_db *_db, struct sql_statement *stmt,
+			       sql_query_callback_t *callback, void *context)
+{
+        struct sqlpool_db *db = (struct sqlpool_db *)_db;
+	struct sqlpool_request *request;
+	const struct sqlpool_connection *conn;
+
+	request = sqlpool_request_new(db, NULL);
+	request->stmt = stmt;
+	request->callback = callback;
+	request->context = context;
+
+	if (!driver_sqlpool_get_connection(db, UINT_MAX, &conn))
+		driver_sqlpool_append_request(db, request);
+	else {
+		request->host_idx = conn->host_idx;
+		sql_db_statement_query(conn->db, stmt,
+			(sql_query_callback_t *)driver_sqlpool_query_callback,
+			request);
+	}
+}
+
+static struct sql_result *
+driver_sqlpool_statement_query_s(struct sql_db *_db, struct sql_statement *stmt)
+{
+        struct sqlpool_db *db = (struct sqlpool_db *)_db;
+	const struct sqlpool_connection *conn;
+	struct sql_result *result;
+
+	if (!driver_sqlpool_get_sync_connection(db, &conn)) {
+		sql_not_connected_result.refcount++;
+		return &sql_not_connected_result;
+	}
+
+	result = sql_db_statement_query_s(conn->db, stmt);
+	if (result->failed_try_retry) {
+		if (!driver_sqlpool_get_sync_connection(db, &conn))
+			return result;
+
+		sql_result_unref(result);
+		result = sql_db_statement_query_s(conn->db, stmt);
+	}
+	return result;
+}
+
 static struct sql_transaction_context *
 driver_sqlpool_transaction_begin(struct sql_db *_db)
 {
@@ -832,6 +886,9 @@ struct sql_db driver_sqlpool_db = {
 
 		driver_sqlpool_update,
 
-		driver_sqlpool_escape_blob
+		driver_sqlpool_escape_blob,
+
+		driver_sqlpool_statement_query,
+		driver_sqlpool_statement_query_s
 	}
 };
@@ -1,6 +1,7 @@
 #ifndef SQL_API_PRIVATE_H
 #define SQL_API_PRIVATE_H
 
+#include "hash.h"
 #include "sql-api.h"
 #include "module-context.h"
 
@@ -78,6 +79,15 @@ struct sql_db_vfuncs {
 		       unsigned int *affected_rows);
 	const char *(*escape_blob)(struct sql_db *db,
 				   const unsigned char *data, size_t size);
+
+	/* Optional: execute a prepared statement. If NULL, the statement is
+	   sent as an escaped query. The statement stays valid until the
+	   callback is called. */
+	void (*statement_query)(struct sql_db *db, struct sql_statement *stmt,
+				sql_query_callback_t *callback,
+				void *context);
+	struct sql_result *(*statement_query_s)(struct sql_db *db,
+						struct sql_statement *stmt);
 };
 
 struct sql_db {
@@ -100,6 +110,11 @@ struct sql_db {
 	unsigned int connect_failure_count;
 	struct timeout *to_reconnect;
 
+	/* query template => prepared statement. The statements are shared by
+	   all the users of the db and freed only by sql_deinit(), so each
+	   template gets prepared only once per connection. */
+	HASH_TABLE(char *, struct sql_prepared_statement *) prepared_stmt_hash;
+
 	unsigned int no_reconnect:1;
 };
 
@@ -147,6 +162,36 @@ struct sql_result {
 	unsigned int callback:1;
 };
 
+struct sql_prepared_statement {
+	struct sql_db *db;
+	char *query_template;
+	/* Unique within the process, so drivers can use it to name the
+	   statement in server side. */
+	unsigned int id;
+	unsigned int params_count;
+	int refcount;
+};
+
+struct sql_statement_param {
+	const char *value;
+	/* value is a string that needs to be escaped and quoted */
+	bool is_str;
+};
+
+struct sql_statement {
+	pool_t pool;
+	struct sql_db *db;
+
+	/* copied from sql_prepared_statement, so it can be freed while
+	   statements are still running */
+	const char *query_template;
+	unsigned int prep_id;
+	ARRAY(struct sql_statement_param) params;
+
+	sql_query_callback_t *callback;
+	void *context;
+};
+
 struct sql_transaction_context {
 	struct sql_db *db;
 
@@ -164,6 +209,21 @@ driver_sqlpool_init(const char *connect_string, const struct sql_db *driver);
 
 void sql_db_set_state(struct sql_db *db, enum sql_db_state state);
 
+/* Execute the statement using the driver's prepared statement support if
+   it has any. The statement isn't freed. */
+void sql_db_statement_query(struct sql_db *db, struct sql_statement *stmt,
+			    sql_query_callback_t *callback, void *context);
+struct sql_result *
+sql_db_statement_query_s(struct sql_db *db, struct sql_statement *stmt);
+/* Returns the statement's query with each '?' parameter replaced by
+   params[n]. */
+const char *sql_statement_expand_query(struct sql_statement *stmt,
+				       const char *const *params);
+/* Returns the statement's query with the parameters escaped inline using
+   db's escaping rules. */
+const char *sql_statement_get_query(struct sql_db *db,
+				    struct sql_statement *stmt);
+
 void sql_transaction_add_query(struct sql_transaction_context *ctx, pool_t pool,
 			       const char *query, unsigned int *affected_rows);
 
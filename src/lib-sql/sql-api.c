@@ -2,7 +2,9 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "ioloop.h"
+#include "str.h"
 #include "sql-api-private.h"
 
 #include <time.h>
@@ -10,6 +12,8 @@
 struct sql_db_module_register sql_db_module_register = { 0 };
 ARRAY_TYPE(sql_drivers) sql_drivers;
 
+static unsigned int sql_prepared_statement_last_id = 0;
+
 void sql_drivers_init(void)
 {
 	i_array_init(&sql_drivers, 8);
@@ -75,6 +79,22 @@ struct sql_db *sql_init(const char *db_driver, const char *connect_string)
 	return db;
 }
 
+static void sql_prepared_statements_free(struct sql_db *db)
+{
+	struct hash_iterate_context *iter;
+	struct sql_prepared_statement *prep_stmt;
+	char *query;
+
+	iter = hash_table_iterate_init(db->prepared_stmt_hash);
+	while (hash_table_iterate(iter, db->prepared_stmt_hash,
+				  &query, &prep_stmt)) {
+		i_free(prep_stmt->query_template);
+		i_free(prep_stmt);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&db->prepared_stmt_hash);
+}
+
 void sql_deinit(struct sql_db **_db)
 {
 	struct sql_db *db = *_db;
@@ -83,6 +103,8 @@ void sql_deinit(struct sql_db **_db)
 
 	if (db->to_reconnect != NULL)
 		timeout_remove(&db->to_reconnect);
+	if (hash_table_is_created(db->prepared_stmt_hash))
+		sql_prepared_statements_free(db);
 	db->v.deinit(db);
 }
 
@@ -148,6 +170,228 @@ struct sql_result *sql_query_s(struct sql_db *db, const char *query)
 	return db->v.query_s(db, query);
 }
 
+static unsigned int sql_query_template_count_params(const char *query)
+{
+	unsigned int count = 0;
+	bool quoted = FALSE;
+
+	for (; *query != '\0'; query++) {
+		if (*query == '\'')
+			quoted = !quoted;
+		else if (*query == '?' && !quoted)
+			count++;
+	}
+	return count;
+}
+
+struct sql_prepared_statement *
+sql_prepared_statement_init(struct sql_db *db, const char *query_template)
+{
+	struct sql_prepared_statement *prep_stmt;
+
+	if (!hash_table_is_created(db->prepared_stmt_hash)) {
+		hash_table_create(&db->prepared_stmt_hash, default_pool, 0,
+				  str_hash, strcmp);
+	}
+	prep_stmt = hash_table_lookup(db->prepared_stmt_hash, query_template);
+	if (prep_stmt != NULL) {
+		prep_stmt->refcount++;
+		return prep_stmt;
+	}
+
+	prep_stmt = i_new(struct sql_prepared_statement, 1);
+	prep_stmt->db = db;
+	prep_stmt->query_template = i_strdup(query_template);
+	prep_stmt->id = ++sql_prepared_statement_last_id;
+	prep_stmt->params_count =
+		sql_query_template_count_params(query_template);
+	prep_stmt->refcount = 1;
+	hash_table_insert(db->prepared_stmt_hash,
+			  prep_stmt->query_template, prep_stmt);
+	return prep_stmt;
+}
+
+void sql_prepared_statement_deinit(struct sql_prepared_statement **_prep_stmt)
+{
+	struct sql_prepared_statement *prep_stmt = *_prep_stmt;
+
+	*_prep_stmt = NULL;
+	/* keep the statement cached even when it's no longer used. the
+	   connections have already prepared it, and the next user of the
+	   same template can use it without preparing it again. */
+	i_assert(prep_stmt->refcount > 0);
+	prep_stmt->refcount--;
+}
+
+struct sql_statement *
+sql_statement_init_prepared(struct sql_prepared_statement *prep_stmt)
+{
+	struct sql_statement *stmt;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sql statement", 512);
+	stmt = p_new(pool, struct sql_statement, 1);
+	stmt->pool = pool;
+	stmt->db = prep_stmt->db;
+	stmt->query_template = p_strdup(pool, prep_stmt->query_template);
+	stmt->prep_id = prep_stmt->id;
+	p_array_init(&stmt->params, pool, prep_stmt->params_count + 1);
+	if (prep_stmt->params_count > 0)
+		array_idx_clear(&stmt->params, prep_stmt->params_count - 1);
+	return stmt;
+}
+
+void sql_statement_abort(struct sql_statement **_stmt)
+{
+	struct sql_statement *stmt = *_stmt;
+
+	*_stmt = NULL;
+	pool_unref(&stmt->pool);
+}
+
+static void
+sql_statement_bind(struct sql_statement *stmt, unsigned int param_idx,
+		   const char *value, bool is_str)
+{
+	struct sql_statement_param *param;
+
+	i_assert(param_idx < array_count(&stmt->params));
+
+	param = array_idx_modifiable(&stmt->params, param_idx);
+	param->value = p_strdup(stmt->pool, value);
+	param->is_str = is_str;
+}
+
+void sql_statement_bind_str(struct sql_statement *stmt,
+			    unsigned int param_idx, const char *value)
+{
+	sql_statement_bind(stmt, param_idx, value, TRUE);
+}
+
+void sql_statement_bind_int64(struct sql_statement *stmt,
+			      unsigned int param_idx, int64_t value)
+{
+	T_BEGIN {
+		sql_statement_bind(stmt, param_idx,
+				   t_strdup_printf("%lld", (long long)value),
+				   FALSE);
+	} T_END;
+}
+
+const char *sql_statement_expand_query(struct sql_statement *stmt,
+				       const char *const *params)
+{
+	const char *p;
+	string_t *str;
+	unsigned int idx = 0;
+	bool quoted = FALSE;
+
+	str = t_str_new(strlen(stmt->query_template) + 128);
+	for (p = stmt->query_template; *p != '\0'; p++) {
+		if (*p == '\'')
+			quoted = !quoted;
+		else if (*p == '?' && !quoted) {
+			i_assert(idx < array_count(&stmt->params));
+			str_append(str, params[idx++]);
+			continue;
+		}
+		str_append_c(str, *p);
+	}
+	return str_c(str);
+}
+
+const char *sql_statement_get_query(struct sql_db *db,
+				    struct sql_statement *stmt)
+{
+	const struct sql_statement_param *params;
+	const char **values;
+	unsigned int i, count;
+
+	params = array_get(&stmt->params, &count);
+	values = t_new(const char *, count + 1);
+	for (i = 0; i < count; i++) {
+		if (!params[i].is_str)
+			values[i] = params[i].value;
+		else {
+			values[i] = t_strdup_printf("'%s'",
+				sql_escape_string(db, params[i].value));
+		}
+	}
+	return sql_statement_expand_query(stmt, values);
+}
+
+void sql_db_statement_query(struct sql_db *db, struct sql_statement *stmt,
+			    sql_query_callback_t *callback, void *context)
+{
+	if (db->v.statement_query != NULL) {
+		db->v.statement_query(db, stmt, callback, context);
+		return;
+	}
+	T_BEGIN {
+		db->v.query(db, sql_statement_get_query(db, stmt),
+			    callback, context);
+	} T_END;
+}
+
+struct sql_result *
+sql_db_statement_query_s(struct sql_db *db, struct sql_statement *stmt)
+{
+	struct sql_result *result;
+
+	if (db->v.statement_query_s != NULL)
+		return db->v.statement_query_s(db, stmt);
+	T_BEGIN {
+		result = db->v.query_s(db, sql_statement_get_query(db, stmt));
+	} T_END;
+	return result;
+}
+
+static void sql_statement_check_params(struct sql_statement *stmt)
+{
+	const struct sql_statement_param *param;
+
+	array_foreach(&stmt->params, param)
+		i_assert(param->value != NULL);
+}
+
+static void
+sql_statement_query_callback(struct sql_result *result,
+			     struct sql_statement *stmt)
+{
+	if (stmt->callback != NULL)
+		stmt->callback(result, stmt->context);
+	pool_unref(&stmt->pool);
+}
+
+#undef sql_statement_query
+void sql_statement_query(struct sql_statement **_stmt,
+			 sql_query_callback_t *callback, void *context)
+{
+	struct sql_statement *stmt = *_stmt;
+
+	*_stmt = NULL;
+	sql_statement_check_params(stmt);
+
+	stmt->callback = callback;
+	stmt->context = context;
+	sql_db_statement_query(stmt->db, stmt,
+			       (sql_query_callback_t *)sql_statement_query_callback,
+			       stmt);
+}
+
+struct sql_result *sql_statement_query_s(struct sql_statement **_stmt)
+{
+	struct sql_statement *stmt = *_stmt;
+	struct sql_result *result;
+
+	*_stmt = NULL;
+	sql_statement_check_params(stmt);
+
+	result = sql_db_statement_query_s(stmt->db, stmt);
+	pool_unref(&stmt->pool);
+	return result;
+}
+
 void sql_result_ref(struct sql_result *result)
 {
 	result->refcount++;
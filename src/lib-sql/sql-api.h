@@ -40,6 +40,8 @@ struct sql_field_def {
 
 struct sql_db;
 struct sql_result;
+struct sql_prepared_statement;
+struct sql_statement;
 
 typedef void sql_query_callback_t(struct sql_result *result, void *context);
 typedef void sql_commit_callback_t(const char *error, void *context);
@@ -89,6 +91,39 @@ void sql_query(struct sql_db *db, const char *query,
 /* Execute blocking SQL query and return result. */
 struct sql_result *sql_query_s(struct sql_db *db, const char *query);
 
+/* Prepare a query template for repeated use. Parameters are given as '?'
+   characters in the template (outside quoted strings), e.g.
+   "SELECT value FROM dict WHERE name = ?". Drivers that support server-side
+   prepared statements parse the query only once per connection, others
+   fall back to sending escaped queries. The prepared statements are shared
+   by everyone using the same db and query template. */
+struct sql_prepared_statement *
+sql_prepared_statement_init(struct sql_db *db, const char *query_template);
+void sql_prepared_statement_deinit(struct sql_prepared_statement **prep_stmt);
+
+/* Create a new statement for executing the prepared query. All the
+   parameters must be bound before the statement is executed. */
+struct sql_statement *
+sql_statement_init_prepared(struct sql_prepared_statement *prep_stmt);
+/* Free the statement without executing it. */
+void sql_statement_abort(struct sql_statement **stmt);
+/* Bind the parameter to the given value. param_idx starts from 0. */
+void sql_statement_bind_str(struct sql_statement *stmt,
+			    unsigned int param_idx, const char *value);
+void sql_statement_bind_int64(struct sql_statement *stmt,
+			      unsigned int param_idx, int64_t value);
+/* Execute the statement and return the result in callback. The statement
+   is freed afterwards. */
+void sql_statement_query(struct sql_statement **stmt,
+			 sql_query_callback_t *callback, void *context);
+#define sql_statement_query(stmt, callback, context) \
+	sql_statement_query(stmt + \
+		CALLBACK_TYPECHECK(callback, void (*)( \
+			struct sql_result *, typeof(context))), \
+		(sql_query_callback_t *)callback, context)
+/* Execute the statement blocking and return the result. */
+struct sql_result *sql_statement_query_s(struct sql_statement **stmt);
+
 void sql_result_setup_fetch(struct sql_result *result,
 			    const struct sql_field_def *fields,
 			    void *dest, size_t dest_size);
@@ -138,6 +138,7 @@ int mdbox_mail_open(struct dbox_mail *mail, uoff_t *offset_r,
 				return -1;
 			}
 			prev_file_id = mfile->file_id;
+			mdbox_map_lookup_cache_reset(mbox->storage->map);
 			if (mdbox_map_refresh(mbox->storage->map) < 0)
 				return -1;
 			dbox_file_unref(&mail->open_file);
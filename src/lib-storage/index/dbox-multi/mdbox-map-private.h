@@ -9,6 +9,15 @@ struct dbox_mail_lookup_rec {
 	struct mdbox_map_mail_index_record rec;
 };
 
+struct mdbox_map_lookup_cache_rec {
+	uint32_t map_uid;
+	/* the record is valid only if this matches the map's
+	   lookup_cache_generation */
+	uint32_t generation;
+	uint32_t file_id;
+	uint32_t offset;
+};
+
 struct mdbox_map {
 	struct mdbox_storage *storage;
 	const struct mdbox_settings *set;
@@ -19,6 +28,15 @@ struct mdbox_map {
 
 	uint32_t map_ext_id, ref_ext_id;
 
+	/* map_uid -> file_id, offset cache for mdbox_map_lookup(). A message's
+	   file_id and offset change only when purging moves it to another
+	   file, which also unlinks the old file. So the cache can be used
+	   across map refreshes, as long as it's reset whenever a file is
+	   found to be deleted or the storage is rebuilt. */
+	struct mdbox_map_lookup_cache_rec *lookup_cache;
+	uint32_t lookup_cache_generation;
+	uint32_t lookup_cache_rebuild_count;
+
 	struct mailbox_list *root_list;
 
 	unsigned int verify_existing_file_ids:1;
@@ -3,6 +3,8 @@
 #include "lib.h"
 #include "array.h"
 #include "hash.h"
+#include "bsearch-insert-pos.h"
+#include "sort.h"
 #include "ostream.h"
 #include "mkdir-parents.h"
 #include "unlink-old-files.h"
@@ -14,6 +16,8 @@
 #include <dirent.h>
 
 #define MAX_BACKWARDS_LOOKUPS 10
+/* must be a power of 2 */
+#define MDBOX_MAP_LOOKUP_CACHE_SIZE 1024
 
 #define DBOX_FORCE_PURGE_MIN_BYTES (1024*1024*10)
 #define DBOX_FORCE_PURGE_MIN_RATIO 0.5
@@ -73,6 +77,7 @@ mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
 				sizeof(uint32_t));
 	map->ref_ext_id = mail_index_ext_register(map->index, "ref", 0,
 				sizeof(uint16_t), sizeof(uint16_t));
+	map->lookup_cache_generation = 1;
 	return map;
 }
 
@@ -87,6 +92,7 @@ void mdbox_map_deinit(struct mdbox_map **_map)
 		mail_index_close(map->index);
 	}
 	mail_index_free(&map->index);
+	i_free(map->lookup_cache);
 	i_free(map->index_path);
 	i_free(map->path);
 	i_free(map);
@@ -147,7 +153,10 @@ static int mdbox_map_open_internal(struct mdbox_map *map, bool create_missing)
 				   perm.file_create_gid,
 				   perm.file_create_gid_origin);
 
+	/* mailbox indexes refer to the map records, so the map must be on
+	   disk before them */
 	open_flags = MAIL_INDEX_OPEN_FLAG_NEVER_IN_MEMORY |
+		MAIL_INDEX_OPEN_FLAG_NO_FSYNC_BATCH |
 		mail_storage_settings_to_index_flags(MAP_STORAGE(map)->set);
 	if (create_missing) {
 		if ((ret = mdbox_map_mkdir_storage(map)) < 0)
@@ -235,6 +244,12 @@ int mdbox_map_refresh(struct mdbox_map *map)
 	}
 	if (fscked)
 		mdbox_storage_set_corrupted(map->storage);
+	if (mdbox_map_get_rebuild_count(map) != map->lookup_cache_rebuild_count) {
+		/* storage was rebuilt, the map_uids may point to
+		   different files now */
+		map->lookup_cache_rebuild_count = mdbox_map_get_rebuild_count(map);
+		mdbox_map_lookup_cache_reset(map);
+	}
 	return ret;
 }
 
@@ -291,16 +306,49 @@ mdbox_map_get_seq(struct mdbox_map *map, uint32_t map_uid, uint32_t *seq_r)
 	return 1;
 }
 
+void mdbox_map_lookup_cache_reset(struct mdbox_map *map)
+{
+	if (++map->lookup_cache_generation == 0) {
+		/* wrapped - the old records could become valid again */
+		if (map->lookup_cache != NULL) {
+			memset(map->lookup_cache, 0, sizeof(*map->lookup_cache) *
+			       MDBOX_MAP_LOOKUP_CACHE_SIZE);
+		}
+		map->lookup_cache_generation = 1;
+	}
+}
+
+static struct mdbox_map_lookup_cache_rec *
+mdbox_map_lookup_cache_get(struct mdbox_map *map, uint32_t map_uid)
+{
+	if (map->lookup_cache == NULL) {
+		map->lookup_cache = i_new(struct mdbox_map_lookup_cache_rec,
+					  MDBOX_MAP_LOOKUP_CACHE_SIZE);
+	}
+	/* map_uids are allocated sequentially, so the recently saved
+	   messages don't collide with each others */
+	return &map->lookup_cache[map_uid & (MDBOX_MAP_LOOKUP_CACHE_SIZE-1)];
+}
+
 int mdbox_map_lookup(struct mdbox_map *map, uint32_t map_uid,
 		     uint32_t *file_id_r, uoff_t *offset_r)
 {
 	const struct mdbox_map_mail_index_record *rec;
+	struct mdbox_map_lookup_cache_rec *cache_rec;
 	uint32_t seq;
 	int ret;
 
 	if (mdbox_map_open_or_create(map) < 0)
 		return -1;
 
+	cache_rec = mdbox_map_lookup_cache_get(map, map_uid);
+	if (cache_rec->map_uid == map_uid &&
+	    cache_rec->generation == map->lookup_cache_generation) {
+		*file_id_r = cache_rec->file_id;
+		*offset_r = cache_rec->offset;
+		return 1;
+	}
+
 	if ((ret = mdbox_map_get_seq(map, map_uid, &seq)) <= 0)
 		return ret;
 
@@ -308,6 +356,11 @@ int mdbox_map_lookup(struct mdbox_map *map, uint32_t map_uid,
 		return -1;
 	*file_id_r = rec->file_id;
 	*offset_r = rec->offset;
+
+	cache_rec->map_uid = map_uid;
+	cache_rec->generation = map->lookup_cache_generation;
+	cache_rec->file_id = rec->file_id;
+	cache_rec->offset = rec->offset;
 	return 1;
 }
 
@@ -454,6 +507,70 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 	return 0;
 }
 
+static int
+mdbox_map_file_usage_cmp(const uint32_t *file_id,
+			 const struct mdbox_map_file_usage *usage)
+{
+	if (*file_id < usage->file_id)
+		return -1;
+	if (*file_id > usage->file_id)
+		return 1;
+	return 0;
+}
+
+int mdbox_map_get_zero_ref_file_usage(struct mdbox_map *map,
+				      ARRAY_TYPE(mdbox_map_file_usage) *usage_r)
+{
+	ARRAY_TYPE(mdbox_map_file_usage) all_files;
+	const struct mail_index_header *hdr;
+	const struct mdbox_map_mail_index_record *rec;
+	struct mdbox_map_file_usage *usage;
+	const uint16_t *ref16_p;
+	const void *data;
+	unsigned int idx;
+	uint32_t seq;
+	bool expunged, zero_ref;
+	int ret;
+
+	if ((ret = mdbox_map_open(map)) <= 0) {
+		/* no map / internal error */
+		return ret;
+	}
+	if (mdbox_map_refresh(map) < 0)
+		return -1;
+
+	hdr = mail_index_get_header(map->view);
+	t_array_init(&all_files, 128);
+	for (seq = 1; seq <= hdr->messages_count; seq++) {
+		mail_index_lookup_ext(map->view, seq, map->ref_ext_id,
+				      &data, &expunged);
+		ref16_p = data;
+		zero_ref = data == NULL || expunged || *ref16_p == 0;
+
+		mail_index_lookup_ext(map->view, seq, map->map_ext_id,
+				      &data, &expunged);
+		if (data == NULL || expunged)
+			continue;
+		rec = data;
+
+		if (!array_bsearch_insert_pos(&all_files, &rec->file_id,
+					      mdbox_map_file_usage_cmp, &idx)) {
+			usage = array_insert_space(&all_files, idx);
+			usage->file_id = rec->file_id;
+		} else {
+			usage = array_idx_modifiable(&all_files, idx);
+		}
+		usage->total_size += rec->size;
+		if (zero_ref)
+			usage->unused_size += rec->size;
+	}
+	array_foreach_modifiable(&all_files, usage) {
+		if (usage->unused_size > 0)
+			array_append(usage_r, usage, 1);
+	}
+	return 0;
+}
+
 struct mdbox_map_atomic_context *mdbox_map_atomic_begin(struct mdbox_map *map)
 {
 	struct mdbox_map_atomic_context *atomic;
@@ -664,19 +781,29 @@ int mdbox_map_update_refcount(struct mdbox_map_transaction_context *ctx,
 int mdbox_map_update_refcounts(struct mdbox_map_transaction_context *ctx,
 			       const ARRAY_TYPE(uint32_t) *map_uids, int diff)
 {
-	const uint32_t *uidp;
-	unsigned int i, count;
+	ARRAY_TYPE(uint32_t) sorted_uids;
+	const uint32_t *uids;
+	unsigned int i, n, count;
+	int ret = 0;
 
 	if (unlikely(ctx->trans == NULL))
 		return -1;
 
+	/* the same message may be copied or expunged multiple times.
+	   sort the map_uids so each message gets only a single update. */
 	count = array_count(map_uids);
-	for (i = 0; i < count; i++) {
-		uidp = array_idx(map_uids, i);
-		if (mdbox_map_update_refcount(ctx, *uidp, diff) < 0)
-			return -1;
+	if (count == 0)
+		return 0;
+	t_array_init(&sorted_uids, count);
+	array_append_array(&sorted_uids, map_uids);
+	array_sort(&sorted_uids, uint32_cmp);
+
+	uids = array_idx(&sorted_uids, 0);
+	for (i = 0; i < count && ret == 0; i += n) {
+		for (n = 1; i + n < count && uids[i + n] == uids[i]; n++) ;
+		ret = mdbox_map_update_refcount(ctx, uids[i], diff * (int)n);
 	}
-	return 0;
+	return ret;
 }
 
 int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
@@ -692,6 +819,9 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 	/* make sure the map is refreshed, otherwise we might be expunging
 	   messages that have already been moved to other files. */
 
+	/* the file's messages were either expunged or moved elsewhere */
+	mdbox_map_lookup_cache_reset(map);
+
 	/* we need a per-file transaction, otherwise we can't refresh the map */
 	atomic = mdbox_map_atomic_begin(map);
 	map_trans = mdbox_map_transaction_begin(atomic, TRUE);
@@ -30,6 +30,15 @@ struct mdbox_map_file_msg {
 };
 ARRAY_DEFINE_TYPE(mdbox_map_file_msg, struct mdbox_map_file_msg);
 
+struct mdbox_map_file_usage {
+	uint32_t file_id;
+	/* total size of all the messages in the file */
+	uoff_t total_size;
+	/* size of the messages with zero refcount */
+	uoff_t unused_size;
+};
+ARRAY_DEFINE_TYPE(mdbox_map_file_usage, struct mdbox_map_file_usage);
+
 struct mdbox_map *
 mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list);
 void mdbox_map_deinit(struct mdbox_map **map);
@@ -49,6 +58,9 @@ uint32_t mdbox_map_get_rebuild_count(struct mdbox_map *map);
    is already expunged, -1 if error. */
 int mdbox_map_lookup(struct mdbox_map *map, uint32_t map_uid,
 		     uint32_t *file_id_r, uoff_t *offset_r);
+/* Forget all the cached mdbox_map_lookup() results. This must be called if
+   a message's file was found to be deleted. */
+void mdbox_map_lookup_cache_reset(struct mdbox_map *map);
 /* Like mdbox_map_lookup(), but look up everything. */
 int mdbox_map_lookup_full(struct mdbox_map *map, uint32_t map_uid,
 			  struct mdbox_map_mail_index_record *rec_r,
@@ -100,6 +112,11 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id);
 /* Return all files containing messages with zero refcount. */
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 				 ARRAY_TYPE(seq_range) *file_ids_r);
+/* Like mdbox_map_get_zero_ref_files(), but return also how much of each
+   file's space is used by the zero refcount messages. The files are sorted
+   by file_id. */
+int mdbox_map_get_zero_ref_file_usage(struct mdbox_map *map,
+				      ARRAY_TYPE(mdbox_map_file_usage) *usage_r);
 
 struct mdbox_map_append_context *
 mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic);
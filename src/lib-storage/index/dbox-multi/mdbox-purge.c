@@ -6,6 +6,7 @@
 #include "ostream.h"
 #include "str.h"
 #include "hash.h"
+#include "time-util.h"
 #include "dbox-attachment.h"
 #include "mdbox-storage.h"
 #include "mdbox-storage-rebuild.h"
@@ -14,6 +15,9 @@
 #include "mdbox-sync.h"
 
 #include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 /*
    Altmoving works like:
@@ -648,19 +652,59 @@ static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 	return ret;
 }
 
-int mdbox_purge(struct mail_storage *_storage)
+static int
+mdbox_file_usage_id_cmp(const uint32_t *file_id,
+			const struct mdbox_map_file_usage *usage)
 {
-	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
-	struct mdbox_purge_context *ctx;
-	struct dbox_file *file;
+	if (*file_id < usage->file_id)
+		return -1;
+	if (*file_id > usage->file_id)
+		return 1;
+	return 0;
+}
+
+static int
+mdbox_file_usage_purge_cmp(const struct mdbox_map_file_usage *u1,
+			   const struct mdbox_map_file_usage *u2)
+{
+	uint64_t n1, n2;
+
+	/* files with the most reclaimable space relative to their size are
+	   the cheapest to purge, so do them first. compare
+	   u1->unused/u1->total vs. u2->unused/u2->total without division. */
+	n1 = (uint64_t)u1->unused_size * u2->total_size;
+	n2 = (uint64_t)u2->unused_size * u1->total_size;
+	if (n1 > n2)
+		return -1;
+	if (n1 < n2)
+		return 1;
+	if (u1->unused_size > u2->unused_size)
+		return -1;
+	if (u1->unused_size < u2->unused_size)
+		return 1;
+	return u1->file_id < u2->file_id ? -1 :
+		(u1->file_id > u2->file_id ? 1 : 0);
+}
+
+static int
+mdbox_purge_get_file_ids(struct mdbox_purge_context *ctx,
+			 ARRAY_TYPE(uint32_t) *file_ids)
+{
+	struct mdbox_storage *storage = ctx->storage;
+	ARRAY_TYPE(mdbox_map_file_usage) usage;
+	const struct mdbox_map_file_usage *u;
+	ARRAY_TYPE(uint32_t) other_file_ids;
 	struct seq_range_iter iter;
 	unsigned int i = 0;
 	uint32_t file_id;
-	bool deleted;
 	int ret;
 
-	ctx = mdbox_purge_alloc(storage);
-	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->purge_file_ids);
+	i_array_init(&usage, 64);
+	i_array_init(&other_file_ids, 16);
+	ret = mdbox_map_get_zero_ref_file_usage(storage->map, &usage);
+	array_foreach(&usage, u)
+		seq_range_array_add(&ctx->purge_file_ids, u->file_id);
+
 	if (storage->alt_storage_dir != NULL) {
 		if (mdbox_purge_get_primary_files(ctx) < 0)
 			ret = -1;
@@ -671,19 +715,93 @@ int mdbox_purge(struct mail_storage *_storage)
 		}
 	}
 
-	seq_range_array_iter_init(&iter, &ctx->purge_file_ids); i = 0;
-	while (ret == 0 &&
-	       seq_range_array_iter_nth(&iter, i++, &file_id)) T_BEGIN {
-		file = mdbox_file_init(storage, file_id);
-		if (dbox_file_open(file, &deleted) > 0 && !deleted) {
-			if (mdbox_file_purge(ctx, file, file_id) < 0)
-				ret = -1;
-		} else {
-			if (mdbox_map_remove_file_id(storage->map, file_id) < 0)
-				ret = -1;
+	/* the usage array is still sorted by file_id. files that have only
+	   altmoves (no zero refcount messages) are purged last. */
+	seq_range_array_iter_init(&iter, &ctx->purge_file_ids);
+	while (seq_range_array_iter_nth(&iter, i++, &file_id)) {
+		if (array_bsearch(&usage, &file_id,
+				  mdbox_file_usage_id_cmp) == NULL)
+			array_append(&other_file_ids, &file_id, 1);
+	}
+	array_sort(&usage, mdbox_file_usage_purge_cmp);
+	array_foreach(&usage, u)
+		array_append(file_ids, &u->file_id, 1);
+	array_append_array(file_ids, &other_file_ids);
+
+	array_free(&other_file_ids);
+	array_free(&usage);
+	return ret;
+}
+
+static void
+mdbox_purge_throttle(struct mdbox_purge_context *ctx,
+		     const struct timeval *start_time, uoff_t bytes_done)
+{
+	uoff_t rate_limit = ctx->storage->set->mdbox_purge_rate_limit;
+	struct timeval now;
+	long long elapsed_usecs, wanted_usecs;
+
+	if (rate_limit == 0)
+		return;
+
+	/* sleep until the average I/O rate since the start of the purge is
+	   within the limit */
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	elapsed_usecs = timeval_diff_usecs(&now, start_time);
+	wanted_usecs = (long long)(bytes_done * 1000000 / rate_limit);
+	if (wanted_usecs > elapsed_usecs)
+		usleep(wanted_usecs - elapsed_usecs);
+}
+
+static int mdbox_purge_full(struct mdbox_storage *storage, bool throttle)
+{
+	uoff_t max_size = storage->set->mdbox_purge_max_size;
+	struct mdbox_purge_context *ctx;
+	struct dbox_file *file;
+	ARRAY_TYPE(uint32_t) file_ids;
+	const uint32_t *file_idp;
+	struct timeval start_time;
+	struct stat st;
+	uoff_t bytes_done = 0;
+	unsigned int i, count;
+	bool deleted;
+	int ret;
+
+	/* the cached lookups are invalidated only by this process's own
+	   actions. another process may have purged the files since. */
+	mdbox_map_lookup_cache_reset(storage->map);
+
+	ctx = mdbox_purge_alloc(storage);
+	i_array_init(&file_ids, 64);
+	ret = mdbox_purge_get_file_ids(ctx, &file_ids);
+
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	file_idp = array_get(&file_ids, &count);
+	for (i = 0; i < count && ret == 0; i++) {
+		if (max_size != 0 && bytes_done >= max_size) {
+			/* leave the rest of the files for the next purge */
+			break;
 		}
-		dbox_file_unref(&file);
-	} T_END;
+		T_BEGIN {
+			file = mdbox_file_init(storage, file_idp[i]);
+			if (dbox_file_open(file, &deleted) > 0 && !deleted) {
+				if (dbox_file_stat(file, &st) == 0)
+					bytes_done += st.st_size;
+				if (mdbox_file_purge(ctx, file, file_idp[i]) < 0)
+					ret = -1;
+			} else {
+				if (mdbox_map_remove_file_id(storage->map,
+							     file_idp[i]) < 0)
+					ret = -1;
+			}
+			dbox_file_unref(&file);
+		} T_END;
+		if (throttle)
+			mdbox_purge_throttle(ctx, &start_time, bytes_done);
+	}
+	array_free(&file_ids);
 	mdbox_purge_free(&ctx);
 
 	if (storage->corrupted) {
@@ -693,3 +811,15 @@ int mdbox_purge(struct mail_storage *_storage)
 	}
 	return ret;
 }
+
+int mdbox_purge(struct mail_storage *_storage)
+{
+	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
+
+	return mdbox_purge_full(storage, TRUE);
+}
+
+int mdbox_autopurge(struct mdbox_storage *storage)
+{
+	return mdbox_purge_full(storage, FALSE);
+}
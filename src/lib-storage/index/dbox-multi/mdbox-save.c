@@ -2,7 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
-#include "fdatasync-path.h"
+#include "fsync-batch.h"
 #include "hex-binary.h"
 #include "hex-dec.h"
 #include "str.h"
@@ -376,7 +376,7 @@ void mdbox_transaction_save_commit_post(struct mail_save_context *_ctx,
 	if (storage->set->parsed_fsync_mode != FSYNC_MODE_NEVER) {
 		const char *box_path = mailbox_get_path(&ctx->mbox->box);
 
-		if (fdatasync_path(box_path) < 0) {
+		if (fsync_batch_fdatasync_path(box_path) < 0) {
 			mail_storage_set_critical(storage,
 				"fdatasync_path(%s) failed: %m", box_path);
 		}
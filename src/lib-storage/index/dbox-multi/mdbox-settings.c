@@ -7,6 +7,8 @@
 
 #include <stddef.h>
 
+static bool mdbox_settings_check(void *_set, pool_t pool, const char **error_r);
+
 #undef DEF
 #define DEF(type, name) \
 	{ type, #name, offsetof(struct mdbox_settings, name), NULL }
@@ -16,6 +18,9 @@ static const struct setting_define mdbox_setting_defines[] = {
 	DEF(SET_BOOL, mdbox_purge_preserve_alt),
 	DEF(SET_SIZE, mdbox_rotate_size),
 	DEF(SET_TIME, mdbox_rotate_interval),
+	DEF(SET_SIZE, mdbox_purge_max_size),
+	DEF(SET_SIZE, mdbox_purge_rate_limit),
+	DEF(SET_BOOL, mdbox_autopurge),
 
 	SETTING_DEFINE_LIST_END
 };
@@ -24,7 +29,10 @@ static const struct mdbox_settings mdbox_default_settings = {
 	.mdbox_preallocate_space = FALSE,
 	.mdbox_purge_preserve_alt = FALSE,
 	.mdbox_rotate_size = 2*1024*1024,
-	.mdbox_rotate_interval = 0
+	.mdbox_rotate_interval = 0,
+	.mdbox_purge_max_size = 0,
+	.mdbox_purge_rate_limit = 0,
+	.mdbox_autopurge = FALSE
 };
 
 static const struct setting_parser_info mdbox_setting_parser_info = {
@@ -36,9 +44,25 @@ static const struct setting_parser_info mdbox_setting_parser_info = {
 	.struct_size = sizeof(struct mdbox_settings),
 
 	.parent_offset = (size_t)-1,
-	.parent = &mail_user_setting_parser_info
+	.parent = &mail_user_setting_parser_info,
+
+	.check_func = mdbox_settings_check
 };
 
+/* <settings checks> */
+static bool mdbox_settings_check(void *_set, pool_t pool ATTR_UNUSED,
+				 const char **error_r)
+{
+	struct mdbox_settings *set = _set;
+
+	if (set->mdbox_autopurge && set->mdbox_purge_max_size == 0) {
+		*error_r = "mdbox_autopurge requires mdbox_purge_max_size";
+		return FALSE;
+	}
+	return TRUE;
+}
+/* </settings checks> */
+
 const struct setting_parser_info *mdbox_get_setting_parser_info(void)
 {
 	return &mdbox_setting_parser_info;
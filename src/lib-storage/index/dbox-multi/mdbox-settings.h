@@ -6,6 +6,9 @@ struct mdbox_settings {
 	bool mdbox_purge_preserve_alt;
 	uoff_t mdbox_rotate_size;
 	unsigned int mdbox_rotate_interval;
+	uoff_t mdbox_purge_max_size;
+	uoff_t mdbox_purge_rate_limit;
+	bool mdbox_autopurge;
 };
 
 const struct setting_parser_info *mdbox_get_setting_parser_info(void);
@@ -66,6 +66,10 @@ void mdbox_storage_destroy(struct mail_storage *_storage)
 {
 	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
 
+	if (storage->autopurge_wanted && storage->set->mdbox_autopurge) {
+		/* errors are already logged */
+		(void)mdbox_autopurge(storage);
+	}
 	mdbox_files_free(storage);
 	mdbox_map_deinit(&storage->map);
 	if (storage->to_close_unused_files != NULL)
@@ -43,6 +43,9 @@ struct mdbox_storage {
 	unsigned int corrupted:1;
 	unsigned int rebuilding_storage:1;
 	unsigned int preallocate_space:1;
+	/* messages were expunged during this session, so
+	   mdbox_autopurge should purge the storage at deinit */
+	unsigned int autopurge_wanted:1;
 };
 
 struct mdbox_mail_index_record {
@@ -101,6 +104,9 @@ int mdbox_copy(struct mail_save_context *ctx, struct mail *mail);
 
 void mdbox_purge_alt_flag_change(struct mail *mail, bool move_to_alt);
 int mdbox_purge(struct mail_storage *storage);
+/* Purge at the end of the session. mdbox_purge_rate_limit isn't used here,
+   because sleeping would keep the session process alive. */
+int mdbox_autopurge(struct mdbox_storage *storage);
 
 int mdbox_storage_create(struct mail_storage *_storage,
 			 struct mail_namespace *ns, const char **error_r);
@@ -45,6 +45,11 @@ static bool index_attachment_want(const struct istream_attachment_header *hdr,
 	struct mail_save_context *ctx = context;
 	struct mail_attachment_part apart;
 
+	if (ctx->data.body_attachment_min_size > 0) {
+		/* the whole body is wanted, so it can be shared */
+		return TRUE;
+	}
+
 	memset(&apart, 0, sizeof(apart));
 	apart.part = hdr->part;
 	apart.content_type = hdr->content_type;
@@ -170,6 +175,8 @@ void index_attachment_save_begin(struct mail_save_context *ctx,
 
 	memset(&set, 0, sizeof(set));
 	set.min_size = storage->set->mail_attachment_min_size;
+	if (ctx->data.body_attachment_min_size > 0)
+		set.min_size = ctx->data.body_attachment_min_size;
 	if (hash_format_init(storage->set->mail_attachment_hash,
 			     &set.hash_format, &error) < 0) {
 		/* we already checked this when verifying settings */
@@ -11,6 +11,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-keywords.h"
 #include "maildir-sync.h"
+#include "maildir-sync-notify.h"
 #include "index-mail.h"
 
 #include <sys/stat.h>
@@ -569,6 +570,8 @@ static void maildir_mailbox_close(struct mailbox *box)
 		mail_index_view_close(&mbox->flags_view);
 	if (mbox->keywords != NULL)
 		maildir_keywords_deinit(&mbox->keywords);
+	if (mbox->sync_notify != NULL)
+		maildir_sync_notify_deinit(&mbox->sync_notify);
 	maildir_uidlist_deinit(&mbox->uidlist);
 	index_storage_mailbox_close(box);
 }
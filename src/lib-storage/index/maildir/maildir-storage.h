@@ -79,6 +79,7 @@ struct maildir_mailbox {
 	/* maildir sync: */
 	struct maildir_uidlist *uidlist;
 	struct maildir_keywords *keywords;
+	struct maildir_sync_notify *sync_notify;
 
 	struct maildir_index_header maildir_hdr;
 	uint32_t maildir_ext_id;
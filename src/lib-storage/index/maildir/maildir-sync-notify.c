@@ -0,0 +1,219 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "maildir-storage.h"
+#include "maildir-filename.h"
+#include "maildir-sync-notify.h"
+
+#ifdef IOLOOP_NOTIFY_INOTIFY
+
+#include "fd-close-on-exec.h"
+#include "fd-set-nonblock.h"
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define MAILDIR_SYNC_NOTIFY_BUFLEN (32*1024)
+#define MAILDIR_SYNC_NOTIFY_MASK \
+	(IN_CREATE | IN_DELETE | IN_MOVE | IN_DELETE_SELF | IN_MOVE_SELF | \
+	 IN_ONLYDIR)
+
+struct maildir_sync_notify {
+	int fd, new_wd, cur_wd;
+
+	pool_t pool;
+	/* base filename => file */
+	HASH_TABLE(const char *, struct maildir_sync_notify_file *) files;
+	ARRAY_TYPE(maildir_sync_notify_file) cur_files;
+};
+
+static int
+maildir_sync_notify_add_watch(struct maildir_sync_notify *notify,
+			      const char *path)
+{
+	int wd;
+
+	wd = inotify_add_watch(notify->fd, path, MAILDIR_SYNC_NOTIFY_MASK);
+	if (wd < 0) {
+		if (errno == ENOSPC) {
+			i_warning("Inotify watch limit for user exceeded, "
+				  "can't watch %s. Increase "
+				  "/proc/sys/fs/inotify/max_user_watches",
+				  path);
+		} else if (errno != ENOENT) {
+			i_error("inotify_add_watch(%s) failed: %m", path);
+		}
+	}
+	return wd;
+}
+
+struct maildir_sync_notify *
+maildir_sync_notify_init(struct maildir_mailbox *mbox)
+{
+	struct maildir_sync_notify *notify;
+	const char *box_path = mailbox_get_path(&mbox->box);
+	int fd;
+
+	fd = inotify_init();
+	if (fd == -1) {
+		/* probably max_user_instances reached. just fallback to
+		   scanning the directories. */
+		if (errno != EMFILE)
+			i_error("inotify_init() failed: %m");
+		return NULL;
+	}
+	fd_close_on_exec(fd, TRUE);
+	fd_set_nonblock(fd, TRUE);
+
+	notify = i_new(struct maildir_sync_notify, 1);
+	notify->pool = pool_alloconly_create("maildir sync notify", 1024);
+	notify->fd = fd;
+	hash_table_create(&notify->files, default_pool, 0,
+			  maildir_filename_base_hash,
+			  maildir_filename_base_cmp);
+	i_array_init(&notify->cur_files, 32);
+
+	notify->new_wd = maildir_sync_notify_add_watch(notify,
+		t_strconcat(box_path, "/new", NULL));
+	notify->cur_wd = notify->new_wd < 0 ? -1 :
+		maildir_sync_notify_add_watch(notify,
+			t_strconcat(box_path, "/cur", NULL));
+	if (notify->cur_wd < 0)
+		maildir_sync_notify_deinit(&notify);
+	return notify;
+}
+
+void maildir_sync_notify_deinit(struct maildir_sync_notify **_notify)
+{
+	struct maildir_sync_notify *notify = *_notify;
+
+	*_notify = NULL;
+	/* closing the fd removes the watches */
+	if (close(notify->fd) < 0)
+		i_error("close(inotify) failed: %m");
+	hash_table_destroy(&notify->files);
+	array_free(&notify->cur_files);
+	pool_unref(&notify->pool);
+	i_free(notify);
+}
+
+static void
+maildir_sync_notify_cur_file(struct maildir_sync_notify *notify,
+			     const char *filename, bool exists)
+{
+	struct maildir_sync_notify_file *file;
+
+	file = hash_table_lookup(notify->files, filename);
+	if (file == NULL) {
+		file = p_new(notify->pool, struct maildir_sync_notify_file, 1);
+		array_append(&notify->cur_files, &file, 1);
+	} else if (strcmp(file->filename, filename) == 0) {
+		file->exists = exists;
+		return;
+	}
+	/* the events come in order, so the last one tells the current
+	   filename and whether it exists */
+	file->filename = p_strdup(notify->pool, filename);
+	file->exists = exists;
+	hash_table_update(notify->files, file->filename, file);
+}
+
+bool maildir_sync_notify_read(struct maildir_sync_notify *notify,
+			      bool *new_changed_r, bool *cur_changed_r)
+{
+	const struct inotify_event *event;
+	unsigned char event_buf[MAILDIR_SYNC_NOTIFY_BUFLEN];
+	ssize_t ret, pos;
+	bool lost = FALSE;
+
+	*new_changed_r = FALSE;
+	*cur_changed_r = array_count(&notify->cur_files) > 0;
+
+	for (;;) {
+		ret = read(notify->fd, event_buf, sizeof(event_buf));
+		if (ret <= 0) {
+			if (ret == 0 || errno == EAGAIN)
+				break;
+			i_error("read(inotify) failed: %m");
+			return FALSE;
+		}
+
+		for (pos = 0; pos < ret; ) {
+			if ((size_t)(ret - pos) < sizeof(*event))
+				break;
+
+			event = (const void *)(event_buf + pos);
+			pos += sizeof(*event) + event->len;
+
+			if ((event->mask & (IN_Q_OVERFLOW | IN_IGNORED |
+					    IN_DELETE_SELF |
+					    IN_MOVE_SELF)) != 0) {
+				/* the directory itself changed, or there
+				   were too many events to keep track of */
+				lost = TRUE;
+			} else if ((event->mask & IN_ISDIR) != 0 ||
+				   event->len == 0 || event->name[0] == '.') {
+				/* not a mail file */
+			} else if (event->wd == notify->new_wd) {
+				*new_changed_r = TRUE;
+			} else if (event->wd == notify->cur_wd) {
+				maildir_sync_notify_cur_file(notify,
+					event->name,
+					(event->mask & (IN_CREATE |
+							IN_MOVED_TO)) != 0);
+				*cur_changed_r = TRUE;
+			}
+		}
+		if (pos != ret)
+			i_error("read(inotify) returned partial event");
+	}
+	return !lost;
+}
+
+const ARRAY_TYPE(maildir_sync_notify_file) *
+maildir_sync_notify_get_cur_files(struct maildir_sync_notify *notify)
+{
+	return &notify->cur_files;
+}
+
+void maildir_sync_notify_reset(struct maildir_sync_notify *notify)
+{
+	hash_table_clear(notify->files, TRUE);
+	array_clear(&notify->cur_files);
+	p_clear(notify->pool);
+}
+
+#else
+
+struct maildir_sync_notify *
+maildir_sync_notify_init(struct maildir_mailbox *mbox ATTR_UNUSED)
+{
+	return NULL;
+}
+
+void maildir_sync_notify_deinit(struct maildir_sync_notify **notify ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+bool maildir_sync_notify_read(struct maildir_sync_notify *notify ATTR_UNUSED,
+			      bool *new_changed_r ATTR_UNUSED,
+			      bool *cur_changed_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+const ARRAY_TYPE(maildir_sync_notify_file) *
+maildir_sync_notify_get_cur_files(struct maildir_sync_notify *notify ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_notify_reset(struct maildir_sync_notify *notify ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+#endif
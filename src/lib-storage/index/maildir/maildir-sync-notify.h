@@ -0,0 +1,33 @@
+#ifndef MAILDIR_SYNC_NOTIFY_H
+#define MAILDIR_SYNC_NOTIFY_H
+
+struct maildir_mailbox;
+
+struct maildir_sync_notify_file {
+	const char *filename;
+	/* TRUE if the last change was the file being created or moved into
+	   cur/, FALSE if it was deleted or moved away. */
+	bool exists;
+};
+ARRAY_DEFINE_TYPE(maildir_sync_notify_file,
+		  struct maildir_sync_notify_file *);
+
+/* Start watching for changes in the mailbox's new/ and cur/ directories.
+   Returns NULL if this isn't supported by the OS or it failed. */
+struct maildir_sync_notify *
+maildir_sync_notify_init(struct maildir_mailbox *mbox);
+void maildir_sync_notify_deinit(struct maildir_sync_notify **notify);
+
+/* Read the changes that have happened since the previous read. Returns
+   FALSE if some changes may have been lost and the directories need to be
+   fully rescanned. */
+bool maildir_sync_notify_read(struct maildir_sync_notify *notify,
+			      bool *new_changed_r, bool *cur_changed_r);
+/* Returns the files that have changed in cur/ since the previous reset.
+   There's only a single entry for each base filename. */
+const ARRAY_TYPE(maildir_sync_notify_file) *
+maildir_sync_notify_get_cur_files(struct maildir_sync_notify *notify);
+/* Forget about the changes read so far. */
+void maildir_sync_notify_reset(struct maildir_sync_notify *notify);
+
+#endif
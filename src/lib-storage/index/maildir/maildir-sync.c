@@ -168,6 +168,13 @@
    create a completely new base name for it and rename() it to that.
    If the call fails with ENOENT, it only means that it wasn't a
    duplicate after all.
+
+   With maildir_sync_inotify=yes a long-lived process (e.g. IMAP IDLE)
+   keeps an inotify watch on new/ and cur/ after the first full scan.
+   Later syncs then only look at the cur/ files whose names were reported
+   to have changed instead of readdir()ing the whole directory. If the
+   kernel's event queue overflows or anything else unexpected happens,
+   the watch is dropped and we go back to scanning the directories.
 */
 
 #include "lib.h"
@@ -182,6 +189,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-filename.h"
 #include "maildir-sync.h"
+#include "maildir-sync-notify.h"
 
 #include <stdio.h>
 #include <stddef.h>
@@ -229,11 +237,17 @@ struct maildir_sync_context {
 	unsigned int partial:1;
 	unsigned int locked:1;
 	unsigned int racing:1;
+	/* cur/ changes are known from mbox->sync_notify */
+	unsigned int incremental:1;
 };
 
 void maildir_sync_set_racing(struct maildir_sync_context *ctx)
 {
 	ctx->racing = TRUE;
+	if (ctx->mbox->sync_notify != NULL) {
+		/* we can't trust what we've seen so far */
+		maildir_sync_notify_deinit(&ctx->mbox->sync_notify);
+	}
 }
 
 void maildir_sync_notify(struct maildir_sync_context *ctx)
@@ -591,6 +605,72 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		(move_count <= MAILDIR_RENAME_RESCAN_COUNT || final ? 0 : 1);
 }
 
+static int maildir_scan_cur_changes(struct maildir_sync_context *ctx)
+{
+	struct maildir_mailbox *mbox = ctx->mbox;
+	const ARRAY_TYPE(maildir_sync_notify_file) *files;
+	struct maildir_sync_notify_file *const *filep;
+	enum maildir_uidlist_rec_flag flags;
+	const char *fname;
+	struct stat st;
+	uint32_t uid;
+	unsigned int count = 0;
+	int ret = 0;
+
+	files = maildir_sync_notify_get_cur_files(mbox->sync_notify);
+	array_foreach(files, filep) {
+		const struct maildir_sync_notify_file *file = *filep;
+
+		if ((++count % MAILDIR_SLOW_CHECK_COUNT) == 0)
+			maildir_sync_notify(ctx);
+
+		if (file->exists) {
+			if (file->filename[0] == MAILDIR_INFO_SEP) {
+				ret = maildir_rename_empty_basename(ctx,
+					ctx->cur_dir, file->filename);
+				if (ret < 0)
+					break;
+				continue;
+			}
+			/* a file that isn't in uidlist yet is recent, the
+			   same as with a full scan */
+			flags = maildir_uidlist_get_uid(mbox->uidlist,
+							file->filename, &uid) ? 0 :
+				MAILDIR_UIDLIST_REC_FLAG_RECENT;
+			ret = maildir_uidlist_sync_next(ctx->uidlist_sync_ctx,
+							file->filename, flags);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		/* the file was deleted or renamed away from cur/. the
+		   uidlist may still have an older name for it (e.g. flags
+		   were changed before the unlink), so check that the name
+		   uidlist knows is really gone before expunging. */
+		if (!maildir_uidlist_get_uid(mbox->uidlist, file->filename,
+					     &uid) || uid == (uint32_t)-1)
+			continue;
+		fname = maildir_uidlist_get_full_filename(mbox->uidlist,
+							  file->filename);
+		T_BEGIN {
+			ret = stat(t_strconcat(ctx->cur_dir, "/", fname,
+					       NULL), &st);
+		} T_END;
+		if (ret == 0)
+			continue;
+		if (errno != ENOENT) {
+			mail_storage_set_critical(&mbox->storage->storage,
+				"stat(%s/%s) failed: %m", ctx->cur_dir, fname);
+			break;
+		}
+		ret = 0;
+		maildir_uidlist_sync_remove(ctx->uidlist_sync_ctx, fname);
+	}
+	maildir_sync_notify_reset(mbox->sync_notify);
+	return ret < 0 ? -1 : 0;
+}
+
 static void maildir_sync_get_header(struct maildir_mailbox *mbox)
 {
 	const void *data;
@@ -754,8 +834,18 @@ static int maildir_sync_get_changes(struct maildir_sync_context *ctx,
 
 	*why_r = 0;
 
-	if (maildir_sync_quick_check(mbox, undirty, ctx->new_dir, ctx->cur_dir,
-				     new_changed_r, cur_changed_r, why_r) < 0)
+	if (mbox->sync_notify != NULL && !undirty) {
+		if (maildir_sync_notify_read(mbox->sync_notify,
+					     new_changed_r, cur_changed_r))
+			ctx->incremental = TRUE;
+		else
+			maildir_sync_notify_deinit(&mbox->sync_notify);
+	}
+	if (ctx->incremental) {
+		/* we know exactly what changed */
+	} else if (maildir_sync_quick_check(mbox, undirty, ctx->new_dir,
+					    ctx->cur_dir, new_changed_r,
+					    cur_changed_r, why_r) < 0)
 		return -1;
 
 	/* if there are files in new/, we'll need to move them. we'll check
@@ -857,7 +947,7 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 	   problem rarely happens except under high amount of modifications.
 	*/
 
-	if (!cur_changed) {
+	if (!cur_changed || ctx->incremental) {
 		ctx->partial = TRUE;
 		sync_flags = MAILDIR_UIDLIST_SYNC_PARTIAL;
 	} else {
@@ -876,6 +966,11 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 
 		if (ret == 0) {
 			/* timeout */
+			if (ctx->incremental) {
+				/* the changes we just read would be lost */
+				maildir_sync_notify_deinit(
+					&ctx->mbox->sync_notify);
+			}
 			return 0;
 		}
 		/* locking failed. sync anyway without locking so that it's
@@ -902,8 +997,22 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		}
 	}
 	ctx->locked = maildir_uidlist_is_locked(ctx->mbox->uidlist);
-	if (!ctx->locked)
+	if (!ctx->locked) {
 		ctx->partial = TRUE;
+		if (ctx->incremental) {
+			/* the changes can't be applied to uidlist without
+			   the lock. go back to full scans. */
+			maildir_sync_notify_deinit(&ctx->mbox->sync_notify);
+			ctx->incremental = FALSE;
+			cur_changed = FALSE;
+		}
+	} else if (!ctx->partial && ctx->mbox->sync_notify == NULL &&
+		   ctx->mbox->storage->set->maildir_sync_inotify &&
+		   !ctx->mbox->storage->storage.set->mail_nfs_storage) {
+		/* start watching before the full scan, so nothing gets
+		   missed between the scan and the next sync */
+		ctx->mbox->sync_notify = maildir_sync_notify_init(ctx->mbox);
+	}
 
 	if (!ctx->mbox->syncing_commit && (ctx->locked || lock_failure)) {
 		if (maildir_sync_index_begin(ctx->mbox, ctx,
@@ -927,7 +1036,10 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		if (ret < 0)
 			return -1;
 
-		if (cur_changed) {
+		if (ctx->incremental) {
+			if (cur_changed && maildir_scan_cur_changes(ctx) < 0)
+				return -1;
+		} else if (cur_changed) {
 			if (maildir_scan_dir(ctx, FALSE, TRUE, why) < 0)
 				return -1;
 		}
@@ -948,7 +1060,12 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		/* NOTE: index syncing here might cause a re-sync due to
 		   files getting lost, so this function might be called
 		   re-entrantly. */
-		ret = maildir_sync_index(ctx->index_sync_ctx, ctx->partial);
+		/* an incremental sync keeps all the uidlist records that
+		   weren't explicitly removed, so messages missing from the
+		   end of uidlist were expunged and must be removed from
+		   index as well. */
+		ret = maildir_sync_index(ctx->index_sync_ctx,
+					 ctx->partial && !ctx->incremental);
 		if (ret < 0)
 			maildir_sync_index_rollback(&ctx->index_sync_ctx);
 		else if (maildir_sync_index_commit(&ctx->index_sync_ctx) < 0)
@@ -1025,6 +1142,11 @@ static int maildir_sync_run(struct maildir_mailbox *mbox,
 		maildir_sync_deinit(ctx);
 	} T_END;
 
+	if (ret < 0 && mbox->sync_notify != NULL) {
+		/* some of the read changes may not have been applied */
+		maildir_sync_notify_deinit(&mbox->sync_notify);
+	}
+
 	if (retry) T_BEGIN {
 		/* we're racing some file. retry the sync again to see if the
 		   file is really gone or not. if it is, this is a bit of
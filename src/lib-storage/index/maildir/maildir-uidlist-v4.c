@@ -0,0 +1,138 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "maildir-uidlist.h"
+#include "maildir-uidlist-v4.h"
+
+uint32_t maildir_uidlist_v4_be32(uint32_t value)
+{
+	const unsigned char *p = (const unsigned char *)&value;
+
+	/* converts both from and to big endian */
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+void maildir_uidlist_v4_add_record(buffer_t *records, buffer_t *strings,
+				   uint32_t uid, const char *filename,
+				   const unsigned char *extensions)
+{
+	struct maildir_uidlist_v4_record vrec;
+	const unsigned char *p;
+	const char *strp;
+
+	vrec.uid = maildir_uidlist_v4_be32(uid);
+	vrec.str_offset = maildir_uidlist_v4_be32(strings->used);
+	buffer_append(records, &vrec, sizeof(vrec));
+
+	strp = strchr(filename, ':');
+	if (strp == NULL)
+		buffer_append(strings, filename, strlen(filename));
+	else
+		buffer_append(strings, filename, strp - filename);
+	buffer_append_c(strings, '\0');
+	if (extensions != NULL) {
+		for (p = extensions; *p != '\0'; ) {
+			i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
+			p += strlen((const char *)p) + 1;
+		}
+		buffer_append(strings, extensions, p - extensions);
+	}
+	buffer_append_c(strings, '\0');
+}
+
+void maildir_uidlist_v4_append_block(buffer_t *dest, const buffer_t *records,
+				     buffer_t *strings)
+{
+	struct maildir_uidlist_v4_block_header bhdr;
+
+	i_assert(records->used % sizeof(struct maildir_uidlist_v4_record) == 0);
+
+	while ((strings->used % 4) != 0)
+		buffer_append_c(strings, '\0');
+
+	bhdr.records_count = maildir_uidlist_v4_be32(records->used /
+		sizeof(struct maildir_uidlist_v4_record));
+	bhdr.strings_size = maildir_uidlist_v4_be32(strings->used);
+	buffer_append(dest, &bhdr, sizeof(bhdr));
+	buffer_append_buf(dest, records, 0, (size_t)-1);
+	buffer_append_buf(dest, strings, 0, (size_t)-1);
+}
+
+bool maildir_uidlist_v4_get_block(const unsigned char *data, size_t size,
+				  uint32_t *count_r, uint32_t *strings_size_r,
+				  size_t *block_size_r)
+{
+	struct maildir_uidlist_v4_block_header bhdr;
+	uint32_t count, strings_size;
+	size_t block_size;
+
+	if (size < sizeof(bhdr))
+		return FALSE;
+	memcpy(&bhdr, data, sizeof(bhdr));
+	count = maildir_uidlist_v4_be32(bhdr.records_count);
+	strings_size = maildir_uidlist_v4_be32(bhdr.strings_size);
+	if (count > size / sizeof(struct maildir_uidlist_v4_record) ||
+	    strings_size > size) {
+		/* the block is still being appended */
+		return FALSE;
+	}
+	block_size = sizeof(bhdr) +
+		count * sizeof(struct maildir_uidlist_v4_record) +
+		strings_size;
+	if (block_size > size)
+		return FALSE;
+
+	*count_r = count;
+	*strings_size_r = strings_size;
+	*block_size_r = block_size;
+	return TRUE;
+}
+
+int maildir_uidlist_v4_get_record(const unsigned char *block, uint32_t count,
+				  uint32_t strings_size, uint32_t idx,
+				  struct maildir_uidlist_v4_rec *rec_r,
+				  const char **error_r)
+{
+	const struct maildir_uidlist_v4_record *vrecs = (const void *)block;
+	const char *strings = (const char *)(vrecs + count);
+	const char *filename, *p, *end = strings + strings_size;
+	struct maildir_uidlist_v4_record vrec;
+	uint32_t uid, str_offset;
+
+	i_assert(idx < count);
+
+	memcpy(&vrec, &vrecs[idx], sizeof(vrec));
+	uid = maildir_uidlist_v4_be32(vrec.uid);
+	str_offset = maildir_uidlist_v4_be32(vrec.str_offset);
+	if (uid == 0 || str_offset >= strings_size) {
+		*error_r = t_strdup_printf("Invalid record (uid=%u, offset=%u)",
+					   uid, str_offset);
+		return -1;
+	}
+	filename = strings + str_offset;
+	p = memchr(filename, '\0', end - filename);
+	/* the extensions end with an empty string */
+	while (p != NULL && ++p < end && *p != '\0') {
+		if (!MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p))
+			p = NULL;
+		else
+			p = memchr(p, '\0', end - p);
+	}
+	if (p == NULL || p == end) {
+		*error_r = t_strdup_printf(
+			"Invalid string table entry for uid %u", uid);
+		return -1;
+	}
+
+	memset(rec_r, 0, sizeof(*rec_r));
+	rec_r->uid = uid;
+	rec_r->filename = filename;
+	filename += strlen(filename) + 1;
+	if (*filename != '\0') {
+		rec_r->extensions = (const unsigned char *)filename;
+		rec_r->extensions_size = p + 1 - filename;
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef MAILDIR_UIDLIST_V4_H
+#define MAILDIR_UIDLIST_V4_H
+
+#include "guid.h"
+
+/* Encoding and decoding of the binary version 4 dovecot-uidlist format.
+   See maildir-uidlist.c for the file layout. */
+
+#define MAILDIR_UIDLIST_V4_VERSION_STR "4 \n\0"
+
+struct maildir_uidlist_v4_header {
+	unsigned char version[4];
+	uint32_t uid_validity;
+	uint32_t next_uid;
+	guid_128_t mailbox_guid;
+	/* size of the header extensions following this header */
+	uint32_t hdr_extensions_size;
+};
+
+struct maildir_uidlist_v4_block_header {
+	uint32_t records_count;
+	/* size of the string table following the records */
+	uint32_t strings_size;
+};
+
+struct maildir_uidlist_v4_record {
+	uint32_t uid;
+	/* offset to the filename in the block's string table */
+	uint32_t str_offset;
+};
+
+/* Decoded record. The pointers point to the block's data. */
+struct maildir_uidlist_v4_rec {
+	uint32_t uid;
+	const char *filename;
+	/* <data>\0[<data>\0 ...]\0 or NULL if there are no extensions */
+	const unsigned char *extensions;
+	size_t extensions_size;
+};
+
+/* Convert a 32bit integer from or to big endian. */
+uint32_t maildir_uidlist_v4_be32(uint32_t value);
+
+/* Add a record to the block being built. The filename's :<flags> part
+   isn't stored. extensions may be NULL. */
+void maildir_uidlist_v4_add_record(buffer_t *records, buffer_t *strings,
+				   uint32_t uid, const char *filename,
+				   const unsigned char *extensions);
+/* Append the block containing the added records to dest. */
+void maildir_uidlist_v4_append_block(buffer_t *dest, const buffer_t *records,
+				     buffer_t *strings);
+
+/* Returns TRUE if data begins with a complete block. The returned
+   block_size includes the block header. */
+bool maildir_uidlist_v4_get_block(const unsigned char *data, size_t size,
+				  uint32_t *count_r, uint32_t *strings_size_r,
+				  size_t *block_size_r);
+/* Decode the idx'th record of the block, which begins after its header.
+   Returns 0 if ok, -1 if the record is corrupted. */
+int maildir_uidlist_v4_get_record(const unsigned char *block, uint32_t count,
+				  uint32_t strings_size, uint32_t idx,
+				  struct maildir_uidlist_v4_rec *rec_r,
+				  const char **error_r);
+
+#endif
@@ -22,6 +22,23 @@
    entry: <uid> [<key><value> ...] :<filename>
 
    See enum maildir_uidlist_*_ext_key for used keys.
+
+   --
+
+   Version 4 format is a binary format written when maildir_uidlist_binary
+   is enabled. It begins with "4 \n\0", so older Dovecot versions see it as
+   an unsupported version. All integers are in big endian. The format is:
+
+   header: struct maildir_uidlist_v4_header
+           <v3 header extensions string, NUL-padded to 32bit alignment>
+   block:  struct maildir_uidlist_v4_block_header
+           struct maildir_uidlist_v4_record[records_count]
+           <string table, NUL-padded to 32bit alignment>
+
+   The file contains one or more blocks. New records are appended as a new
+   block, so refreshing only needs to look at the blocks after the
+   previously read offset. Each string table entry is the filename followed
+   by the extensions in <data>\0[<data>\0 ...]\0 format.
 */
 
 #include "lib.h"
@@ -31,11 +48,13 @@
 #include "ostream.h"
 #include "str.h"
 #include "file-dotlock.h"
+#include "mmap-util.h"
 #include "nfs-workarounds.h"
 #include "eacces-error.h"
 #include "maildir-storage.h"
 #include "maildir-filename.h"
 #include "maildir-uidlist.h"
+#include "maildir-uidlist-v4.h"
 
 #include <stdio.h>
 #include <sys/stat.h>
@@ -45,6 +64,7 @@
 #define UIDLIST_ESTALE_RETRY_COUNT NFS_ESTALE_RETRY_COUNT
 
 #define UIDLIST_VERSION 3
+#define UIDLIST_VERSION_BINARY 4
 #define UIDLIST_COMPRESS_PERCENTAGE 75
 
 #define UIDLIST_IS_LOCKED(uidlist) \
@@ -99,6 +119,7 @@ struct maildir_uidlist {
 	unsigned int unsorted:1;
 	unsigned int have_mailbox_guid:1;
 	unsigned int opened_readonly:1;
+	unsigned int binary:1;
 };
 
 struct maildir_uidlist_sync_ctx {
@@ -275,6 +296,7 @@ struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 			  maildir_filename_base_cmp);
 	uidlist->next_uid = 1;
 	uidlist->hdr_extensions = str_new(default_pool, 128);
+	uidlist->binary = mbox->storage->set->maildir_uidlist_binary;
 
 	uidlist->dotlock_settings.use_io_notify = TRUE;
 	uidlist->dotlock_settings.use_excl_lock =
@@ -448,25 +470,12 @@ maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 	return TRUE;
 }
 
-static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
-				 const char *line)
+static bool
+maildir_uidlist_next_uid(struct maildir_uidlist *uidlist, uint32_t uid,
+			 bool *seen_r)
 {
-	struct maildir_uidlist_rec *rec, *old_rec, *const *recs;
-	unsigned int count;
-	uint32_t uid;
-
-	uid = 0;
-	while (*line >= '0' && *line <= '9') {
-		uid = uid*10 + (*line - '0');
-		line++;
-	}
+	*seen_r = FALSE;
 
-	if (uid == 0 || *line != ' ') {
-		/* invalid file */
-		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
-					      line);
-		return FALSE;
-	}
 	if (uid <= uidlist->prev_read_uid) {
 		maildir_uidlist_set_corrupted(uidlist, 
 					      "UIDs not ordered (%u >= %u)",
@@ -482,9 +491,10 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 
 	if (uid <= uidlist->last_seen_uid) {
 		/* we already have this */
+		*seen_r = TRUE;
 		return TRUE;
 	}
-        uidlist->last_seen_uid = uid;
+	uidlist->last_seen_uid = uid;
 
 	if (uid >= uidlist->next_uid && uidlist->version == 1) {
 		maildir_uidlist_set_corrupted(uidlist, 
@@ -492,39 +502,27 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 			uid, uidlist->next_uid);
 		return FALSE;
 	}
+	return TRUE;
+}
 
-	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
-	rec->uid = uid;
-	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
-
-	while (*line == ' ') line++;
-
-	if (uidlist->version == UIDLIST_VERSION) {
-		/* read extended fields */
-		bool ret;
-
-		T_BEGIN {
-			ret = maildir_uidlist_read_extended(uidlist, &line,
-							    rec);
-		} T_END;
-		if (!ret) {
-			maildir_uidlist_set_corrupted(uidlist, 
-				"Invalid extended fields: %s", line);
-			return FALSE;
-		}
-	}
+static bool
+maildir_uidlist_next_rec(struct maildir_uidlist *uidlist,
+			 struct maildir_uidlist_rec *rec, const char *filename)
+{
+	struct maildir_uidlist_rec *old_rec, *const *recs;
+	unsigned int count;
 
-	if (strchr(line, '/') != NULL) {
+	if (strchr(filename, '/') != NULL) {
 		maildir_uidlist_set_corrupted(uidlist, 
 			"%s: Broken filename at line %u: %s",
-			uidlist->path, uidlist->read_line_count, line);
+			uidlist->path, uidlist->read_line_count, filename);
 		return FALSE;
 	}
 
-	old_rec = hash_table_lookup(uidlist->files, line);
+	old_rec = hash_table_lookup(uidlist->files, filename);
 	if (old_rec == NULL) {
 		/* no conflicts */
-	} else if (old_rec->uid == uid) {
+	} else if (old_rec->uid == rec->uid) {
 		/* most likely this is a record we saved ourself, but couldn't
 		   update last_seen_uid because uidlist wasn't refreshed while
 		   it was locked.
@@ -545,8 +543,8 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		   was appended to uidlist. */
 		i_warning("%s: Duplicate file entry at line %u: "
 			  "%s (uid %u -> %u)%s",
-			  uidlist->path, uidlist->read_line_count, line,
-			  old_rec->uid, uid, uidlist->retry_rewind ?
+			  uidlist->path, uidlist->read_line_count, filename,
+			  old_rec->uid, rec->uid, uidlist->retry_rewind ?
 			  " - retrying by re-reading from beginning" : "");
 		if (uidlist->retry_rewind)
 			return FALSE;
@@ -559,18 +557,66 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 	}
 
 	recs = array_get(&uidlist->records, &count);
-	if (count > 0 && recs[count-1]->uid > uid) {
+	if (count > 0 && recs[count-1]->uid > rec->uid) {
 		/* we most likely have some records in the array that we saved
 		   ourself without refreshing uidlist */
 		uidlist->unsorted = TRUE;
 	}
 
-	rec->filename = p_strdup(uidlist->record_pool, line);
+	rec->filename = p_strdup(uidlist->record_pool, filename);
 	hash_table_insert(uidlist->files, rec->filename, rec);
 	array_append(&uidlist->records, &rec, 1);
 	return TRUE;
 }
 
+static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
+				 const char *line)
+{
+	struct maildir_uidlist_rec *rec;
+	uint32_t uid;
+	bool seen;
+
+	uid = 0;
+	while (*line >= '0' && *line <= '9') {
+		uid = uid*10 + (*line - '0');
+		line++;
+	}
+
+	if (uid == 0 || *line != ' ') {
+		/* invalid file */
+		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
+					      line);
+		return FALSE;
+	}
+	if (!maildir_uidlist_next_uid(uidlist, uid, &seen))
+		return FALSE;
+	if (seen)
+		return TRUE;
+
+	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+	rec->uid = uid;
+	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+	while (*line == ' ') line++;
+
+	if (uidlist->version == UIDLIST_VERSION) {
+		/* read extended fields */
+		bool ret;
+
+		T_BEGIN {
+			ret = maildir_uidlist_read_extended(uidlist, &line,
+							    rec);
+		} T_END;
+		if (!ret) {
+			maildir_uidlist_set_corrupted(uidlist, 
+				"Invalid extended fields: %s", line);
+			return FALSE;
+		}
+	}
+
+	return maildir_uidlist_next_rec(uidlist, rec, line);
+}
+
 static int
 maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 			       const char *line,
@@ -625,6 +671,30 @@ maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 	return 0;
 }
 
+static int maildir_uidlist_set_header(struct maildir_uidlist *uidlist,
+				      uint32_t uid_validity, uint32_t next_uid)
+{
+	if (uid_validity == 0 || next_uid == 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken header (uidvalidity = %u, next_uid=%u)",
+			uid_validity, next_uid);
+		return 0;
+	}
+
+	if (uid_validity == uidlist->uid_validity &&
+	    next_uid < uidlist->hdr_next_uid) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"next_uid header was lowered (%u -> %u)",
+			uidlist->hdr_next_uid, next_uid);
+		return 0;
+	}
+
+	uidlist->uid_validity = uid_validity;
+	uidlist->next_uid = next_uid;
+	uidlist->hdr_next_uid = next_uid;
+	return 1;
+}
+
 static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 				       struct istream *input)
 {
@@ -671,25 +741,170 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 		return 0;
 	}
 
-	if (uid_validity == 0 || next_uid == 0) {
+	return maildir_uidlist_set_header(uidlist, uid_validity, next_uid);
+}
+
+static int
+maildir_uidlist_is_v4(int fd, bool *v4_r)
+{
+	unsigned char version[4];
+	ssize_t ret;
+
+	ret = pread(fd, version, sizeof(version), 0);
+	if (ret < 0)
+		return -1;
+	*v4_r = ret == sizeof(version) &&
+		memcmp(version, MAILDIR_UIDLIST_V4_VERSION_STR, sizeof(version)) == 0;
+	return 0;
+}
+
+static int maildir_uidlist_read_v4_header(struct maildir_uidlist *uidlist,
+					  int fd, uoff_t *offset_r)
+{
+	struct maildir_uidlist_v4_header hdr;
+	uint32_t ext_size;
+	char *ext;
+	ssize_t ret;
+
+	ret = pread(fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return -1;
+	if ((size_t)ret < sizeof(hdr)) {
 		maildir_uidlist_set_corrupted(uidlist,
-			"Broken header (uidvalidity = %u, next_uid=%u)",
-			uid_validity, next_uid);
+			"Corrupted header (truncated)");
 		return 0;
 	}
+	uidlist->version = UIDLIST_VERSION_BINARY;
+	uidlist->read_line_count = 1;
 
-	if (uid_validity == uidlist->uid_validity &&
-	    next_uid < uidlist->hdr_next_uid) {
+	ext_size = maildir_uidlist_v4_be32(hdr.hdr_extensions_size);
+	ext = i_malloc(ext_size + 1);
+	ret = pread(fd, ext, ext_size, sizeof(hdr));
+	if (ret < 0) {
+		i_free(ext);
+		return -1;
+	}
+	if ((size_t)ret < ext_size || (ext_size % 4) != 0) {
+		i_free(ext);
 		maildir_uidlist_set_corrupted(uidlist,
-			"next_uid header was lowered (%u -> %u)",
-			uidlist->hdr_next_uid, next_uid);
+			"Corrupted header (invalid extensions size %u)",
+			ext_size);
 		return 0;
 	}
+	str_truncate(uidlist->hdr_extensions, 0);
+	str_append(uidlist->hdr_extensions, ext);
+	i_free(ext);
 
-	uidlist->uid_validity = uid_validity;
-	uidlist->next_uid = next_uid;
-	uidlist->hdr_next_uid = next_uid;
-	return 1;
+	memcpy(uidlist->mailbox_guid, hdr.mailbox_guid,
+	       sizeof(uidlist->mailbox_guid));
+	uidlist->have_mailbox_guid = !guid_128_is_empty(hdr.mailbox_guid);
+
+	*offset_r = sizeof(hdr) + ext_size;
+	return maildir_uidlist_set_header(uidlist,
+					  maildir_uidlist_v4_be32(hdr.uid_validity),
+					  maildir_uidlist_v4_be32(hdr.next_uid));
+}
+
+static bool
+maildir_uidlist_read_v4_block(struct maildir_uidlist *uidlist,
+			      const unsigned char *data, uint32_t count,
+			      uint32_t strings_size)
+{
+	struct maildir_uidlist_v4_rec vrec;
+	struct maildir_uidlist_rec *rec;
+	const char *error;
+	uint32_t i;
+	bool seen;
+
+	for (i = 0; i < count; i++) {
+		uidlist->read_records_count++;
+		uidlist->read_line_count++;
+
+		if (maildir_uidlist_v4_get_record(data, count, strings_size,
+						  i, &vrec, &error) < 0) {
+			maildir_uidlist_set_corrupted(uidlist, "%s", error);
+			return FALSE;
+		}
+		if (!maildir_uidlist_next_uid(uidlist, vrec.uid, &seen))
+			return FALSE;
+		if (seen)
+			continue;
+
+		rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+		rec->uid = vrec.uid;
+		rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+		if (vrec.extensions != NULL) {
+			rec->extensions = p_malloc(uidlist->record_pool,
+						   vrec.extensions_size);
+			memcpy(rec->extensions, vrec.extensions,
+			       vrec.extensions_size);
+		}
+		if (!maildir_uidlist_next_rec(uidlist, rec, vrec.filename))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int maildir_uidlist_read_v4_records(struct maildir_uidlist *uidlist,
+					   int fd, uoff_t *offset)
+{
+	const unsigned char *data = NULL;
+	void *mmap_base = NULL;
+	buffer_t *buf = NULL;
+	size_t size, mmap_size, pos, block_size;
+	uint32_t count, strings_size;
+	ssize_t ret;
+	bool success = TRUE;
+
+	if (!uidlist->box->storage->set->mmap_disable) {
+		/* only the pages after the offset are actually read */
+		mmap_base = mmap_ro_file(fd, &mmap_size);
+		if (mmap_base == MAP_FAILED)
+			return -1;
+		if (mmap_base == NULL || mmap_size <= *offset)
+			size = 0;
+		else {
+			data = CONST_PTR_OFFSET(mmap_base, *offset);
+			size = mmap_size - *offset;
+		}
+	} else {
+		struct stat st;
+
+		if (fstat(fd, &st) < 0)
+			return -1;
+		size = st.st_size <= (off_t)*offset ? 0 :
+			st.st_size - *offset;
+		buf = buffer_create_dynamic(default_pool, size + 1);
+		ret = pread(fd, buffer_append_space_unsafe(buf, size),
+			    size, *offset);
+		if (ret < 0) {
+			buffer_free(&buf);
+			return -1;
+		}
+		size = ret;
+		data = buf->data;
+	}
+
+	for (pos = 0; success; pos += block_size) {
+		if (!maildir_uidlist_v4_get_block(data + pos, size - pos,
+						  &count, &strings_size,
+						  &block_size)) {
+			/* the block is still being appended */
+			break;
+		}
+		success = maildir_uidlist_read_v4_block(uidlist,
+			data + pos + sizeof(struct maildir_uidlist_v4_block_header),
+			count, strings_size);
+	}
+	*offset += pos;
+
+	if (mmap_base != NULL) {
+		if (munmap(mmap_base, mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", uidlist->path);
+	}
+	if (buf != NULL)
+		buffer_free(&buf);
+	return success ? 1 : 0;
 }
 
 static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
@@ -707,9 +922,9 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 	uint32_t orig_next_uid, orig_uid_validity;
 	struct istream *input;
 	struct stat st;
-	uoff_t last_read_offset;
-	int fd, ret;
-	bool readonly = FALSE;
+	uoff_t last_read_offset, read_offset;
+	int fd, ret, read_errno = 0;
+	bool readonly = FALSE, v4 = FALSE;
 
 	*retry_r = FALSE;
 
@@ -770,15 +985,37 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 
 	orig_uid_validity = uidlist->uid_validity;
 	orig_next_uid = uidlist->next_uid;
-	ret = input->v_offset != 0 ? 1 :
-		maildir_uidlist_read_header(uidlist, input);
+	read_offset = last_read_offset;
+	if (last_read_offset != 0) {
+		v4 = uidlist->version == UIDLIST_VERSION_BINARY;
+		ret = 1;
+	} else if (maildir_uidlist_is_v4(fd, &v4) < 0) {
+		read_errno = errno;
+		ret = -1;
+	} else if (v4) {
+		ret = maildir_uidlist_read_v4_header(uidlist, fd, &read_offset);
+		if (ret < 0)
+			read_errno = errno;
+	} else {
+		ret = maildir_uidlist_read_header(uidlist, input);
+	}
 	if (ret > 0) {
 		uidlist->prev_read_uid = 0;
 		uidlist->change_counter++;
 		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
 
 		ret = 1;
-		while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (v4) {
+			ret = maildir_uidlist_read_v4_records(uidlist, fd,
+							      &read_offset);
+			if (ret < 0)
+				read_errno = errno;
+			else if (ret == 0 && uidlist->retry_rewind) {
+				ret = -1;
+				*retry_r = TRUE;
+			}
+		}
+		while (!v4 && (line = i_stream_read_next_line(input)) != NULL) {
 			uidlist->read_records_count++;
 			uidlist->read_line_count++;
 			if (!maildir_uidlist_next(uidlist, line)) {
@@ -794,6 +1031,8 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 		uidlist->retry_rewind = FALSE;
 		if (input->stream_errno != 0)
                         ret = -1;
+		if (!v4)
+			read_offset = input->v_offset;
 
 		if (uidlist->unsorted) {
 			uidlist->recreate_on_change = TRUE;
@@ -825,14 +1064,16 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 		uidlist->fd_dev = st.st_dev;
 		uidlist->fd_ino = st.st_ino;
 		uidlist->fd_size = st.st_size;
-		uidlist->last_read_offset = input->v_offset;
+		uidlist->last_read_offset = read_offset;
 		maildir_uidlist_update_hdr(uidlist, &st);
         } else if (!*retry_r) {
                 /* I/O error */
-                if (input->stream_errno == ESTALE && try_retry)
+		if (read_errno == 0)
+			read_errno = input->stream_errno;
+                if (read_errno == ESTALE && try_retry)
 			*retry_r = TRUE;
 		else {
-			errno = input->stream_errno;
+			errno = read_errno;
 			mail_storage_set_critical(storage,
 				"read(%s) failed: %m", uidlist->path);
 		}
@@ -1239,35 +1480,68 @@ maildir_uidlist_generate_uid_validity(struct maildir_uidlist *uidlist)
 		maildir_get_uidvalidity_next(uidlist->box->list);
 }
 
-static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
-				    const char *path, unsigned int first_idx,
-				    uoff_t *file_size_r)
+static void
+maildir_uidlist_write_v4(struct maildir_uidlist *uidlist,
+			 struct ostream *output, unsigned int first_idx)
+{
+	struct maildir_uidlist_v4_header hdr;
+	struct maildir_uidlist_iter_ctx *iter;
+	struct maildir_uidlist_rec *rec;
+	buffer_t *records, *strings, *block;
+	unsigned int len, ext_size;
+
+	if (output->offset == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.version, MAILDIR_UIDLIST_V4_VERSION_STR,
+		       sizeof(hdr.version));
+		hdr.uid_validity = maildir_uidlist_v4_be32(uidlist->uid_validity);
+		hdr.next_uid = maildir_uidlist_v4_be32(uidlist->next_uid);
+		memcpy(hdr.mailbox_guid, uidlist->mailbox_guid,
+		       sizeof(hdr.mailbox_guid));
+		/* pad with NULs, including at least one terminating NUL */
+		len = str_len(uidlist->hdr_extensions);
+		ext_size = len == 0 ? 0 : (len + 4) & ~3U;
+		hdr.hdr_extensions_size = maildir_uidlist_v4_be32(ext_size);
+		o_stream_nsend(output, &hdr, sizeof(hdr));
+		o_stream_nsend(output, str_data(uidlist->hdr_extensions), len);
+		o_stream_nsend(output, "\0\0\0\0", ext_size - len);
+	}
+
+	records = buffer_create_dynamic(pool_datastack_create(), 1024);
+	strings = buffer_create_dynamic(pool_datastack_create(), 4096);
+
+	iter = maildir_uidlist_iter_init(uidlist);
+	i_assert(first_idx <= array_count(&uidlist->records));
+	iter->next += first_idx;
+	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
+		uidlist->read_records_count++;
+		maildir_uidlist_v4_add_record(records, strings, rec->uid,
+					      rec->filename, rec->extensions);
+	}
+	maildir_uidlist_iter_deinit(&iter);
+
+	if (records->used == 0)
+		return;
+	block = buffer_create_dynamic(pool_datastack_create(),
+				      sizeof(struct maildir_uidlist_v4_block_header) +
+				      records->used + strings->used + 4);
+	maildir_uidlist_v4_append_block(block, records, strings);
+	o_stream_nsend(output, block->data, block->used);
+}
+
+static void
+maildir_uidlist_write_v3(struct maildir_uidlist *uidlist,
+			 struct ostream *output, unsigned int first_idx)
 {
-	struct mail_storage *storage = uidlist->box->storage;
 	struct maildir_uidlist_iter_ctx *iter;
-	struct ostream *output;
 	struct maildir_uidlist_rec *rec;
 	string_t *str;
 	const unsigned char *p;
 	const char *strp;
 	unsigned int len;
 
-	i_assert(fd != -1);
-
-	output = o_stream_create_fd_file(fd, (uoff_t)-1, FALSE);
-	o_stream_cork(output);
 	str = t_str_new(512);
-
 	if (output->offset == 0) {
-		i_assert(first_idx == 0);
-		uidlist->version = UIDLIST_VERSION;
-
-		if (uidlist->uid_validity == 0)
-			maildir_uidlist_generate_uid_validity(uidlist);
-		if (!uidlist->have_mailbox_guid)
-			guid_128_generate(uidlist->mailbox_guid);
-
-		i_assert(uidlist->next_uid > 0);
 		str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
 			    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
 			    uidlist->uid_validity,
@@ -1310,6 +1584,36 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 		o_stream_nsend(output, str_data(str), str_len(str));
 	}
 	maildir_uidlist_iter_deinit(&iter);
+}
+
+static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
+				    const char *path, unsigned int first_idx,
+				    uoff_t *file_size_r)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+	struct ostream *output;
+
+	i_assert(fd != -1);
+
+	output = o_stream_create_fd_file(fd, (uoff_t)-1, FALSE);
+	o_stream_cork(output);
+
+	if (output->offset == 0) {
+		i_assert(first_idx == 0);
+		uidlist->version = uidlist->binary ?
+			UIDLIST_VERSION_BINARY : UIDLIST_VERSION;
+
+		if (uidlist->uid_validity == 0)
+			maildir_uidlist_generate_uid_validity(uidlist);
+		if (!uidlist->have_mailbox_guid)
+			guid_128_generate(uidlist->mailbox_guid);
+
+		i_assert(uidlist->next_uid > 0);
+	}
+	if (uidlist->version == UIDLIST_VERSION_BINARY)
+		maildir_uidlist_write_v4(uidlist, output, first_idx);
+	else
+		maildir_uidlist_write_v3(uidlist, output, first_idx);
 
 	if (o_stream_nfinish(output) < 0) {
 		mail_storage_set_critical(storage, "write(%s) failed: %m", path);
@@ -1519,9 +1823,17 @@ static bool maildir_uidlist_want_recreate(struct maildir_uidlist_sync_ctx *ctx)
 
 	if (ctx->finish_change_counter != uidlist->change_counter)
 		return TRUE;
-	if (uidlist->fd == -1 || uidlist->version != UIDLIST_VERSION ||
-	    !uidlist->have_mailbox_guid)
+	if (uidlist->fd == -1 || !uidlist->have_mailbox_guid)
 		return TRUE;
+	if (uidlist->version != (uidlist->binary ?
+				 UIDLIST_VERSION_BINARY : UIDLIST_VERSION))
+		return TRUE;
+	if (uidlist->version == UIDLIST_VERSION_BINARY &&
+	    uidlist->last_read_offset != (uoff_t)uidlist->fd_size) {
+		/* a partially written block was left behind by a crashed
+		   writer. appending after it would corrupt the file. */
+		return TRUE;
+	}
 	return maildir_uidlist_want_compress(ctx);
 }
 
@@ -0,0 +1,143 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "maildir-uidlist-v4.h"
+#include "test-common.h"
+
+static const unsigned char test_ext[] = "S1234\0W1300\0";
+
+static buffer_t *test_build_block(void)
+{
+	buffer_t *records, *strings, *block;
+
+	records = buffer_create_dynamic(pool_datastack_create(), 64);
+	strings = buffer_create_dynamic(pool_datastack_create(), 256);
+	maildir_uidlist_v4_add_record(records, strings, 1,
+				      "1443000000.M1P2.host", NULL);
+	maildir_uidlist_v4_add_record(records, strings, 5,
+				      "1443000001.M2P2.host:2,S", test_ext);
+	maildir_uidlist_v4_add_record(records, strings, 123456789,
+				      "x", NULL);
+
+	block = buffer_create_dynamic(pool_datastack_create(), 256);
+	maildir_uidlist_v4_append_block(block, records, strings);
+	return block;
+}
+
+static void test_maildir_uidlist_v4_records(void)
+{
+	struct maildir_uidlist_v4_rec rec;
+	const unsigned char *data;
+	buffer_t *block;
+	uint32_t count, strings_size;
+	size_t block_size;
+	const char *error;
+
+	test_begin("maildir uidlist v4 records");
+	block = test_build_block();
+	data = block->data;
+	/* the string table is padded to 32bit alignment */
+	test_assert(block->used % 4 == 0);
+
+	test_assert(maildir_uidlist_v4_get_block(data, block->used, &count,
+						 &strings_size, &block_size));
+	test_assert(count == 3);
+	test_assert(block_size == block->used);
+	data += sizeof(struct maildir_uidlist_v4_block_header);
+
+	test_assert(maildir_uidlist_v4_get_record(data, count, strings_size,
+						  0, &rec, &error) == 0);
+	test_assert(rec.uid == 1);
+	test_assert(strcmp(rec.filename, "1443000000.M1P2.host") == 0);
+	test_assert(rec.extensions == NULL);
+
+	/* flags aren't stored */
+	test_assert(maildir_uidlist_v4_get_record(data, count, strings_size,
+						  1, &rec, &error) == 0);
+	test_assert(rec.uid == 5);
+	test_assert(strcmp(rec.filename, "1443000001.M2P2.host") == 0);
+	test_assert(rec.extensions_size == sizeof(test_ext) &&
+		    memcmp(rec.extensions, test_ext, sizeof(test_ext)) == 0);
+
+	test_assert(maildir_uidlist_v4_get_record(data, count, strings_size,
+						  2, &rec, &error) == 0);
+	test_assert(rec.uid == 123456789);
+	test_assert(strcmp(rec.filename, "x") == 0);
+	test_assert(rec.extensions == NULL);
+	test_end();
+}
+
+static void test_maildir_uidlist_v4_partial(void)
+{
+	buffer_t *block;
+	uint32_t count, strings_size;
+	size_t i, block_size;
+
+	test_begin("maildir uidlist v4 partial block");
+	block = test_build_block();
+	/* a block that is still being appended is never returned */
+	for (i = 0; i < block->used; i++) {
+		test_assert_idx(!maildir_uidlist_v4_get_block(block->data, i,
+				&count, &strings_size, &block_size), i);
+	}
+	/* the next block's data is ignored */
+	buffer_append_zero(block, 5);
+	test_assert(maildir_uidlist_v4_get_block(block->data, block->used,
+						 &count, &strings_size,
+						 &block_size));
+	test_assert(block_size == block->used - 5);
+	test_end();
+}
+
+static void test_maildir_uidlist_v4_corrupted(void)
+{
+	struct maildir_uidlist_v4_record *vrecs;
+	struct maildir_uidlist_v4_rec rec;
+	unsigned char *data;
+	buffer_t *block;
+	uint32_t count, strings_size;
+	size_t block_size;
+	const char *error;
+
+	test_begin("maildir uidlist v4 corrupted");
+	block = test_build_block();
+	data = buffer_get_modifiable_data(block, NULL);
+	test_assert(maildir_uidlist_v4_get_block(data, block->used, &count,
+						 &strings_size, &block_size));
+	data += sizeof(struct maildir_uidlist_v4_block_header);
+	vrecs = (void *)data;
+
+	/* string offset outside the string table */
+	vrecs[0].str_offset = maildir_uidlist_v4_be32(strings_size);
+	test_assert(maildir_uidlist_v4_get_record(data, count, strings_size,
+						  0, &rec, &error) < 0);
+	/* uid 0 */
+	vrecs[2].uid = 0;
+	test_assert(maildir_uidlist_v4_get_record(data, count, strings_size,
+						  2, &rec, &error) < 0);
+	/* invalid extension key */
+	data[count * sizeof(*vrecs) +
+	     maildir_uidlist_v4_be32(vrecs[1].str_offset) +
+	     strlen("1443000001.M2P2.host") + 1] = 'a';
+	test_assert(maildir_uidlist_v4_get_record(data, count, strings_size,
+						  1, &rec, &error) < 0);
+	/* the filename isn't terminated within the string table */
+	vrecs[0].str_offset = 0;
+	test_assert(maildir_uidlist_v4_get_record(data, count, strings_size,
+						  0, &rec, &error) == 0);
+	test_assert(maildir_uidlist_v4_get_record(data, count, 8,
+						  0, &rec, &error) < 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_maildir_uidlist_v4_records,
+		test_maildir_uidlist_v4_partial,
+		test_maildir_uidlist_v4_corrupted,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -136,6 +136,10 @@ struct mbox_sync_context {
 	uint32_t last_nonrecent_uid;
 	off_t expunged_space, space_diff;
 
+	/* buffer used by mbox_move() */
+	unsigned char *move_buf;
+	size_t move_buf_size;
+
 	unsigned int dest_first_mail:1;
 	unsigned int first_mail_crlf_expunged:1;
 
@@ -148,6 +152,8 @@ struct mbox_sync_context {
 	unsigned int ext_modified:1;
 	unsigned int index_reset:1;
 	unsigned int errors:1;
+	/* mails were only appended after the last sync */
+	unsigned int appends_only:1;
 };
 
 int mbox_sync_header_refresh(struct mbox_mailbox *mbox);
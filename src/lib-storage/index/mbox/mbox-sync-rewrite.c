@@ -4,20 +4,26 @@
 #include "array.h"
 #include "buffer.h"
 #include "istream.h"
-#include "ostream.h"
 #include "str.h"
+#include "read-full.h"
 #include "write-full.h"
 #include "message-parser.h"
 #include "mbox-storage.h"
 #include "mbox-sync-private.h"
 #include "istream-raw-mbox.h"
 
+/* Move data within the mbox file in blocks of this size. Expunging from
+   the beginning of a large mbox moves everything after it, so this is
+   done directly with pread() + pwrite() instead of going through the
+   streams' small buffers. */
+#define MBOX_MOVE_BLOCK_SIZE (1024*1024)
+
 int mbox_move(struct mbox_sync_context *sync_ctx,
 	      uoff_t dest, uoff_t source, uoff_t size)
 {
-	struct istream *input;
-	struct ostream *output;
-	off_t ret;
+	uoff_t moved, pos;
+	size_t block_size;
+	int ret = 0;
 
 	i_assert(source > 0 || (dest != 1 && dest != 2));
 	i_assert(size < OFF_T_MAX);
@@ -27,36 +33,44 @@ int mbox_move(struct mbox_sync_context *sync_ctx,
 
 	i_stream_sync(sync_ctx->input);
 
-	output = o_stream_create_fd_file(sync_ctx->write_fd, (uoff_t)-1, FALSE);
-	i_stream_seek(sync_ctx->file_input, source);
-	if (o_stream_seek(output, dest) < 0) {
-		mbox_set_syscall_error(sync_ctx->mbox,
-				       "o_stream_seek()");
-		o_stream_unref(&output);
-		return -1;
+	if (sync_ctx->move_buf_size < MBOX_MOVE_BLOCK_SIZE &&
+	    sync_ctx->move_buf_size < size) {
+		sync_ctx->move_buf_size = I_MIN(size, MBOX_MOVE_BLOCK_SIZE);
+		sync_ctx->move_buf = i_realloc(sync_ctx->move_buf, 0,
+					       sync_ctx->move_buf_size);
 	}
 
-	input = i_stream_create_limit(sync_ctx->file_input, size);
-	ret = o_stream_send_istream(output, input);
-	i_stream_unref(&input);
+	/* when moving data forward, copy it starting from the end so that
+	   the overlapping part isn't overwritten before it's read */
+	for (moved = 0; moved < size; moved += block_size) {
+		block_size = I_MIN(size - moved, sync_ctx->move_buf_size);
+		pos = dest > source ? size - moved - block_size : moved;
 
-        if (ret == (off_t)size)
+		ret = pread_full(sync_ctx->write_fd, sync_ctx->move_buf,
+				 block_size, source + pos);
+		if (ret < 0) {
+			mbox_set_syscall_error(sync_ctx->mbox, "pread_full()");
+			break;
+		}
+		if (ret == 0) {
+			mbox_sync_set_critical(sync_ctx,
+				"mbox_move(%"PRIuUOFF_T", %"PRIuUOFF_T", %"PRIuUOFF_T
+				") moved only %"PRIuUOFF_T" bytes",
+				dest, source, size, moved);
+			ret = -1;
+			break;
+		}
+		if (pwrite_full(sync_ctx->write_fd, sync_ctx->move_buf,
+				block_size, dest + pos) < 0) {
+			mbox_set_syscall_error(sync_ctx->mbox, "pwrite_full()");
+			ret = -1;
+			break;
+		}
 		ret = 0;
-	else if (ret >= 0) {
-		mbox_sync_set_critical(sync_ctx,
-			"mbox_move(%"PRIuUOFF_T", %"PRIuUOFF_T", %"PRIuUOFF_T
-			") moved only %"PRIuUOFF_T" bytes",
-			dest, source, size, (uoff_t)ret);
-		ret = -1;
-	} else if (ret < 0) {
-		errno = output->stream_errno;
-		mbox_set_syscall_error(sync_ctx->mbox,
-				       "o_stream_send_istream()");
 	}
 
 	mbox_sync_file_updated(sync_ctx, FALSE);
-	o_stream_destroy(&output);
-	return (int)ret;
+	return ret;
 }
 
 static int mbox_fill_space(struct mbox_sync_context *sync_ctx,
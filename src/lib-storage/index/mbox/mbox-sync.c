@@ -55,6 +55,10 @@
 #include <utime.h>
 #include <sys/stat.h>
 
+/* How many existing mails to check when trying to find out if the mbox file
+   was only appended to */
+#define MBOX_SYNC_APPEND_CHECK_COUNT 8
+
 /* The text below was taken exactly as c-client wrote it to my mailbox,
    so it's probably copyrighted by University of Washington. */
 #define PSEUDO_MESSAGE_BODY \
@@ -965,7 +969,8 @@ static int mbox_sync_partial_seek_next(struct mbox_sync_context *sync_ctx,
 	} else {
 		/* if there's no sync records left, we can stop. except if
 		   this is a dirty sync, check if there are new messages. */
-		if (!sync_ctx->mbox->mbox_hdr.dirty_flag)
+		if (!sync_ctx->mbox->mbox_hdr.dirty_flag &&
+		    !sync_ctx->appends_only)
 			return 0;
 
 		messages_count =
@@ -1592,6 +1597,52 @@ static void mbox_sync_restart(struct mbox_sync_context *sync_ctx)
 	sync_ctx->errors = FALSE;
 }
 
+static bool mbox_sync_is_append_only(struct mbox_sync_context *sync_ctx)
+{
+	struct mbox_mailbox *mbox = sync_ctx->mbox;
+	const unsigned char *data;
+	size_t size;
+	uint32_t seq, prev_seq = 0, messages_count;
+	uoff_t offset;
+	unsigned int i;
+
+	/* the file has grown and its mtime has changed since the last sync.
+	   if this was only because new mails were appended, a new mail begins
+	   where the file used to end and the existing mails are still where
+	   the index says they are. check the latter from a sample of mails by
+	   their X-UID header or header MD5 sum. */
+	messages_count =
+		mail_index_view_get_messages_count(sync_ctx->sync_view);
+	if (mbox->mbox_hdr.dirty_flag || messages_count == 0 ||
+	    mbox->mbox_hdr.sync_size == 0)
+		return FALSE;
+
+	/* the previous mail's last line ends the file, so the new mail's
+	   From_-line begins right after it */
+	i_stream_seek(sync_ctx->file_input, mbox->mbox_hdr.sync_size - 1);
+	if (i_stream_read_data(sync_ctx->file_input, &data, &size, 5) <= 0 ||
+	    memcmp(data, "\nFrom ", 6) != 0)
+		return FALSE;
+
+	for (i = 0; i < MBOX_SYNC_APPEND_CHECK_COUNT; i++) {
+		/* the first and the last mail, and evenly between them */
+		seq = 1 + (uint64_t)(messages_count - 1) * i /
+			(MBOX_SYNC_APPEND_CHECK_COUNT - 1);
+		if (seq == prev_seq)
+			continue;
+		prev_seq = seq;
+
+		if (mbox_file_lookup_offset(mbox, sync_ctx->sync_view,
+					    seq, &offset) <= 0)
+			return FALSE;
+		if (istream_raw_mbox_seek(mbox->mbox_stream, offset) < 0)
+			return FALSE;
+		if (!mbox_sync_parse_match_mail(mbox, sync_ctx->sync_view, seq))
+			return FALSE;
+	}
+	return TRUE;
+}
+
 static int mbox_sync_do(struct mbox_sync_context *sync_ctx,
 			enum mbox_sync_flags flags)
 {
@@ -1629,6 +1680,11 @@ static int mbox_sync_do(struct mbox_sync_context *sync_ctx,
 		   and we probably want to know about it */
 		partial = FALSE;
 		sync_ctx->mbox->mbox_hdr.dirty_flag = TRUE;
+	} else if ((uint64_t)st->st_size > mbox_hdr->sync_size &&
+		   mbox_sync_is_append_only(sync_ctx)) {
+		/* new mails were appended. read only them. */
+		partial = TRUE;
+		sync_ctx->appends_only = TRUE;
 	} else {
 		/* see if we can delay syncing the whole file.
 		   normally we only notice expunges and appends
@@ -1796,6 +1852,7 @@ static void mbox_sync_context_free(struct mbox_sync_context *sync_ctx)
 	str_free(&sync_ctx->header);
 	str_free(&sync_ctx->from_line);
 	array_free(&sync_ctx->mails);
+	i_free(sync_ctx->move_buf);
 }
 
 static int mbox_sync_int(struct mbox_mailbox *mbox, enum mbox_sync_flags flags,
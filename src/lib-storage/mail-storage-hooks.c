@@ -378,3 +378,14 @@ void hook_mail_allocated(struct mail *mail)
 	}
 	pool_unref(&ctx->pool);
 }
+
+void hook_mail_user_reused(struct mail_user *user)
+{
+	const struct mail_storage_hooks *const *hooks;
+
+	array_foreach(&user->hooks, hooks) {
+		if ((*hooks)->mail_user_reused != NULL) T_BEGIN {
+			(*hooks)->mail_user_reused(user);
+		} T_END;
+	}
+}
@@ -24,6 +24,10 @@ struct mail_storage_hooks {
 	void (*mailbox_allocated)(struct mailbox *box);
 	void (*mailbox_opened)(struct mailbox *box);
 	void (*mail_allocated)(struct mail *mail);
+	/* called when an idle user is reused for a new session instead of
+	   creating it again (mail_user_reuse_timeout). mail_user_created()
+	   isn't called then, so any per-session state must be reset here. */
+	void (*mail_user_reused)(struct mail_user *user);
 };
 
 void mail_storage_hooks_init(void);
@@ -49,5 +53,6 @@ void hook_mailbox_list_created(struct mailbox_list *list);
 void hook_mailbox_allocated(struct mailbox *box);
 void hook_mailbox_opened(struct mailbox *box);
 void hook_mail_allocated(struct mail *mail);
+void hook_mail_user_reused(struct mail_user *user);
 
 #endif
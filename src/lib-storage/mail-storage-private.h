@@ -582,6 +582,9 @@ struct mail_save_data {
 	uint32_t uid;
 	char *guid, *pop3_uidl, *from_envelope;
 	unsigned int pop3_order;
+	/* if non-zero, save all body parts at least this large to
+	   mail_attachment_dir, see mailbox_save_set_body_attachment_min_size() */
+	uoff_t body_attachment_min_size;
 
 	struct ostream *output;
 	struct mail_save_attachment *attach;
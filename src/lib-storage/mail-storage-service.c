@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "array.h"
+#include "llist.h"
 #include "base64.h"
 #include "hostpid.h"
 #include "module-dir.h"
@@ -20,6 +21,7 @@
 #include "mail-user.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
+#include "mail-storage-hooks.h"
 #include "mail-storage-service.h"
 
 #include <sys/stat.h>
@@ -34,6 +36,11 @@
 /* If time moves backwards more than this, kill ourself instead of sleeping. */
 #define MAX_TIME_BACKWARDS_SLEEP 5
 #define MAX_NOWARN_FORWARD_SECS 10
+/* Maximum number of idle users to keep for reuse */
+#define MAX_IDLE_USERS 16
+/* Each reuse allocates a bit more memory from the user's pool, so don't
+   reuse the same user forever. */
+#define MAX_USER_REUSE_COUNT 100
 
 #define ERRSTR_INVALID_USER_SETTINGS \
 	"Invalid user settings. Refer to server log for more information."
@@ -63,6 +70,11 @@ struct mail_storage_service_ctx {
 	pool_t userdb_next_pool;
 	const char *const **userdb_next_fieldsp;
 
+	/* users whose session has ended, kept for reuse. oldest first. */
+	struct mail_storage_service_user *idle_users_head, *idle_users_tail;
+	unsigned int idle_users_count;
+	struct timeout *to_idle_users;
+
 	unsigned int debug:1;
 	unsigned int log_initialized:1;
 	unsigned int config_permission_denied:1;
@@ -82,6 +94,13 @@ struct mail_storage_service_user {
 	const struct setting_parser_info *user_info;
 	struct setting_parser_context *set_parser;
 
+	/* linked list of idle users */
+	struct mail_storage_service_user *prev, *next;
+	/* the mail_user is kept alive while the user is idle */
+	struct mail_user *idle_mail_user;
+	time_t idle_expire;
+	unsigned int reuse_count;
+
 	unsigned int anonymous:1;
 	unsigned int admin:1;
 };
@@ -760,11 +779,10 @@ mail_storage_service_var_expand(struct mail_storage_service_ctx *ctx,
 }
 
 static void
-mail_storage_service_init_log(struct mail_storage_service_ctx *ctx,
-			      struct mail_storage_service_user *user,
-			      struct mail_storage_service_privileges *priv)
+mail_storage_service_update_log_prefix(struct mail_storage_service_ctx *ctx,
+				       struct mail_storage_service_user *user,
+				       struct mail_storage_service_privileges *priv)
 {
-	ctx->log_initialized = TRUE;
 	T_BEGIN {
 		string_t *str;
 
@@ -774,6 +792,15 @@ mail_storage_service_init_log(struct mail_storage_service_ctx *ctx,
 			user, &user->input, priv);
 		user->log_prefix = p_strdup(user->pool, str_c(str));
 	} T_END;
+}
+
+static void
+mail_storage_service_init_log(struct mail_storage_service_ctx *ctx,
+			      struct mail_storage_service_user *user,
+			      struct mail_storage_service_privileges *priv)
+{
+	ctx->log_initialized = TRUE;
+	mail_storage_service_update_log_prefix(ctx, user, priv);
 
 	master_service_init_log(ctx->service, user->log_prefix);
 
@@ -1411,6 +1438,162 @@ void mail_storage_service_restrict_setenv(struct mail_storage_service_ctx *ctx,
 		i_fatal("user %s: %s", user->input.username, error);
 }
 
+static void
+mail_storage_service_idle_user_unlink(struct mail_storage_service_ctx *ctx,
+				      struct mail_storage_service_user *user)
+{
+	DLLIST2_REMOVE(&ctx->idle_users_head, &ctx->idle_users_tail, user);
+	i_assert(ctx->idle_users_count > 0);
+	if (--ctx->idle_users_count == 0 && ctx->to_idle_users != NULL)
+		timeout_remove(&ctx->to_idle_users);
+}
+
+static void
+mail_storage_service_idle_user_free(struct mail_storage_service_ctx *ctx,
+				    struct mail_storage_service_user *user)
+{
+	struct ioloop_context *cur_ctx;
+
+	mail_storage_service_idle_user_unlink(ctx, user);
+
+	/* deinitializing the mail_user may still log or do some background
+	   work (e.g. autoexpunging), so do it within the user's context */
+	cur_ctx = io_loop_get_current_context(current_ioloop);
+	if (cur_ctx == NULL && user->ioloop_ctx != NULL)
+		io_loop_context_activate(user->ioloop_ctx);
+	mail_user_unref(&user->idle_mail_user);
+	if (cur_ctx == NULL && user->ioloop_ctx != NULL)
+		io_loop_context_deactivate(user->ioloop_ctx);
+	mail_storage_service_user_free(&user);
+}
+
+static void mail_storage_service_idle_users_timeout(struct mail_storage_service_ctx *ctx);
+
+static void
+mail_storage_service_idle_users_set_timeout(struct mail_storage_service_ctx *ctx)
+{
+	struct ioloop_context *cur_ctx;
+	unsigned int secs;
+
+	if (ctx->to_idle_users != NULL)
+		timeout_remove(&ctx->to_idle_users);
+	if (ctx->idle_users_head == NULL)
+		return;
+
+	secs = ctx->idle_users_head->idle_expire <= ioloop_time ? 0 :
+		ctx->idle_users_head->idle_expire - ioloop_time;
+	/* the timeout is shared by all the users, so it mustn't be
+	   attached to any single user's ioloop context */
+	cur_ctx = io_loop_get_current_context(current_ioloop);
+	if (cur_ctx != NULL) {
+		io_loop_context_ref(cur_ctx);
+		io_loop_context_deactivate(cur_ctx);
+	}
+	ctx->to_idle_users = timeout_add(secs * 1000,
+					 mail_storage_service_idle_users_timeout,
+					 ctx);
+	if (cur_ctx != NULL) {
+		io_loop_context_activate(cur_ctx);
+		io_loop_context_unref(&cur_ctx);
+	}
+}
+
+static void mail_storage_service_idle_users_timeout(struct mail_storage_service_ctx *ctx)
+{
+	while (ctx->idle_users_head != NULL &&
+	       ctx->idle_users_head->idle_expire <= ioloop_time) {
+		mail_storage_service_idle_user_free(ctx,
+						    ctx->idle_users_head);
+	}
+	mail_storage_service_idle_users_set_timeout(ctx);
+}
+
+static bool
+mail_storage_service_idle_user_match(struct mail_storage_service_ctx *ctx,
+				     struct mail_storage_service_user *user,
+				     const struct mail_storage_service_input *input)
+{
+	const char *const *fields1 = user->input.userdb_fields;
+	const char *const *fields2 = input->userdb_fields;
+	unsigned int i;
+
+	if (strcmp(user->input.username, input->username) != 0 ||
+	    null_strcmp(user->input.module, input->module) != 0 ||
+	    null_strcmp(user->input.service, input->service) != 0 ||
+	    !net_ip_compare(&user->input.local_ip, &input->local_ip) ||
+	    !net_ip_compare(&user->input.remote_ip, &input->remote_ip) ||
+	    user->flags != mail_storage_service_input_get_flags(ctx, input))
+		return FALSE;
+
+	/* the userdb fields were given by the caller, so they must be
+	   exactly the same as before. otherwise the user's settings may
+	   have changed. */
+	if (fields1 == NULL || fields2 == NULL)
+		return fields1 == fields2;
+	for (i = 0; fields1[i] != NULL && fields2[i] != NULL; i++) {
+		if (strcmp(fields1[i], fields2[i]) != 0)
+			return FALSE;
+	}
+	return fields1[i] == NULL && fields2[i] == NULL;
+}
+
+static struct mail_storage_service_user *
+mail_storage_service_idle_user_find(struct mail_storage_service_ctx *ctx,
+				    const struct mail_storage_service_input *input)
+{
+	struct mail_storage_service_user *user;
+
+	for (user = ctx->idle_users_tail; user != NULL; user = user->prev) {
+		if (mail_storage_service_idle_user_match(ctx, user, input))
+			return user;
+	}
+	return NULL;
+}
+
+static void
+mail_storage_service_idle_user_reuse(struct mail_storage_service_ctx *ctx,
+				     struct mail_storage_service_user *user,
+				     const struct mail_storage_service_input *input,
+				     struct mail_user **mail_user_r)
+{
+	struct mail_storage_service_privileges priv;
+	struct ioloop_context *cur_ctx;
+	struct mail_user *mail_user = user->idle_mail_user;
+	const char *error;
+
+	mail_storage_service_idle_user_unlink(ctx, user);
+	user->idle_mail_user = NULL;
+	user->reuse_count++;
+
+	/* only the session ID changes between the sessions */
+	user->input.session_id = input->session_id != NULL ?
+		p_strdup(user->pool, input->session_id) :
+		mail_storage_service_generate_session_id(user->pool,
+			input->session_id_prefix);
+	mail_user->session_id =
+		p_strdup(mail_user->pool, user->input.session_id);
+	/* drop the cached table containing the old session ID */
+	mail_user->var_expand_table = NULL;
+
+	if (user->log_prefix != NULL &&
+	    service_parse_privileges(ctx, user, &priv, &error) == 0)
+		mail_storage_service_update_log_prefix(ctx, user, &priv);
+
+	/* continue as if the user was just created */
+	cur_ctx = io_loop_get_current_context(current_ioloop);
+	if (cur_ctx != user->ioloop_ctx) {
+		if (cur_ctx != NULL)
+			io_loop_context_deactivate(cur_ctx);
+		io_loop_context_activate(user->ioloop_ctx);
+	}
+	if (mail_user->mail_debug) {
+		i_debug("Reusing idle user (reused %u times)",
+			user->reuse_count);
+	}
+	hook_mail_user_reused(mail_user);
+	*mail_user_r = mail_user;
+}
+
 int mail_storage_service_lookup_next(struct mail_storage_service_ctx *ctx,
 				     const struct mail_storage_service_input *input,
 				     struct mail_storage_service_user **user_r,
@@ -1420,6 +1603,14 @@ int mail_storage_service_lookup_next(struct mail_storage_service_ctx *ctx,
 	struct mail_storage_service_user *user;
 	int ret;
 
+	user = mail_storage_service_idle_user_find(ctx, input);
+	if (user != NULL) {
+		mail_storage_service_idle_user_reuse(ctx, user, input,
+						     mail_user_r);
+		*user_r = user;
+		return 1;
+	}
+
 	ret = mail_storage_service_lookup(ctx, input, &user, error_r);
 	if (ret <= 0)
 		return ret;
@@ -1455,6 +1646,54 @@ void mail_storage_service_user_free(struct mail_storage_service_user **_user)
 	pool_unref(&user->pool);
 }
 
+static bool
+mail_storage_service_user_can_idle(struct mail_storage_service_user *user,
+				   struct mail_user *mail_user)
+{
+	struct mail_storage_service_ctx *ctx = user->service_ctx;
+
+	if (user->user_set->mail_user_reuse_timeout == 0 ||
+	    ctx->idle_users_count >= MAX_IDLE_USERS ||
+	    user->reuse_count >= MAX_USER_REUSE_COUNT)
+		return FALSE;
+	/* the process is going to die after this session */
+	if (ctx->service->service_count_left == 1 ||
+	    ctx->service->stopping)
+		return FALSE;
+	/* the user must have been created by lookup_next() for userdb fields
+	   given by the caller, and nothing else may be using it anymore */
+	if ((user->flags & (MAIL_STORAGE_SERVICE_FLAG_USERDB_LOOKUP |
+			    MAIL_STORAGE_SERVICE_FLAG_TEMP_PRIV_DROP)) != 0 ||
+	    user->ioloop_ctx == NULL || mail_user->refcount != 1)
+		return FALSE;
+	return TRUE;
+}
+
+void mail_storage_service_user_release(struct mail_storage_service_user **_user,
+				       struct mail_user **_mail_user)
+{
+	struct mail_storage_service_user *user = *_user;
+	struct mail_user *mail_user = *_mail_user;
+	struct mail_storage_service_ctx *ctx = user->service_ctx;
+
+	*_user = NULL;
+	*_mail_user = NULL;
+
+	if (!mail_storage_service_user_can_idle(user, mail_user)) {
+		mail_user_unref(&mail_user);
+		mail_storage_service_user_free(&user);
+		return;
+	}
+
+	user->idle_mail_user = mail_user;
+	user->idle_expire = ioloop_time +
+		user->user_set->mail_user_reuse_timeout;
+	DLLIST2_APPEND(&ctx->idle_users_head, &ctx->idle_users_tail, user);
+	ctx->idle_users_count++;
+	if (ctx->to_idle_users == NULL)
+		mail_storage_service_idle_users_set_timeout(ctx);
+}
+
 void mail_storage_service_init_settings(struct mail_storage_service_ctx *ctx,
 					const struct mail_storage_service_input *input)
 {
@@ -1526,6 +1765,10 @@ void mail_storage_service_deinit(struct mail_storage_service_ctx **_ctx)
 	struct mail_storage_service_ctx *ctx = *_ctx;
 
 	*_ctx = NULL;
+	while (ctx->idle_users_head != NULL) {
+		mail_storage_service_idle_user_free(ctx,
+						    ctx->idle_users_head);
+	}
 	(void)mail_storage_service_all_iter_deinit(ctx);
 	if (ctx->conn != NULL) {
 		if (mail_user_auth_master_conn == ctx->conn)
@@ -105,6 +105,12 @@ int mail_storage_service_lookup_next(struct mail_storage_service_ctx *ctx,
 				     struct mail_user **mail_user_r,
 				     const char **error_r);
 void mail_storage_service_user_free(struct mail_storage_service_user **user);
+/* Free the user and its mail_user after the session has ended. If
+   mail_user_reuse_timeout is set, they're instead kept idle for that long,
+   so that lookup_next() can reuse them for the same user's next session
+   from the same IP with the same userdb fields. */
+void mail_storage_service_user_release(struct mail_storage_service_user **user,
+				       struct mail_user **mail_user);
 /* Initialize iterating through all users. */
 void mail_storage_service_all_init(struct mail_storage_service_ctx *ctx);
 /* Iterate through all usernames. Returns 1 if username was returned, 0 if
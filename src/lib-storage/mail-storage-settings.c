@@ -248,6 +248,7 @@ static const struct setting_define mail_user_setting_defines[] = {
 	DEF(SET_STR, mail_plugin_dir),
 
 	DEF(SET_STR, mail_log_prefix),
+	DEF(SET_TIME, mail_user_reuse_timeout),
 
 	DEFLIST_UNIQUE(namespaces, "namespace", &mail_namespace_setting_parser_info),
 	{ SET_STRLIST, "plugin", offsetof(struct mail_user_settings, plugin_envs), NULL },
@@ -277,6 +278,7 @@ static const struct mail_user_settings mail_user_default_settings = {
 	.mail_plugin_dir = MODULEDIR,
 
 	.mail_log_prefix = "%s(%u): ",
+	.mail_user_reuse_timeout = 0,
 
 	.namespaces = ARRAY_INIT,
 	.plugin_envs = ARRAY_INIT
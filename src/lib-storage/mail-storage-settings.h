@@ -104,6 +104,7 @@ struct mail_user_settings {
 	const char *mail_plugin_dir;
 
 	const char *mail_log_prefix;
+	unsigned int mail_user_reuse_timeout;
 
 	ARRAY(struct mail_namespace_settings *) namespaces;
 	ARRAY(const char *) plugin_envs;
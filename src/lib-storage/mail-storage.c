@@ -1993,6 +1993,14 @@ void mailbox_save_set_pop3_order(struct mail_save_context *ctx,
 	ctx->data.pop3_order = order;
 }
 
+void mailbox_save_set_body_attachment_min_size(struct mail_save_context *ctx,
+					       uoff_t min_size)
+{
+	i_assert(min_size > 0);
+
+	ctx->data.body_attachment_min_size = min_size;
+}
+
 void mailbox_save_set_dest_mail(struct mail_save_context *ctx,
 				struct mail *mail)
 {
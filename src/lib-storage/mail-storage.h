@@ -734,6 +734,13 @@ void mailbox_save_set_pop3_uidl(struct mail_save_context *ctx,
    of the mailbox. Not all backends support this. */
 void mailbox_save_set_pop3_order(struct mail_save_context *ctx,
 				 unsigned int order);
+/* Save all the message's body parts that are at least min_size bytes to
+   mail_attachment_dir, including text parts. min_size is used instead of
+   mail_attachment_min_size. With the sis attachment fs this allows a body
+   that is delivered to multiple users to be stored only once. Does nothing
+   if the backend doesn't support mail_attachment_dir or it isn't set. */
+void mailbox_save_set_body_attachment_min_size(struct mail_save_context *ctx,
+					       uoff_t min_size);
 /* If dest_mail is set, the saved message can be accessed using it. Note that
    setting it may require mailbox syncing, so don't set it unless you need
    it. Also you shouldn't try to access it before mailbox_save_finish() is
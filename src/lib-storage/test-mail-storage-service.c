@@ -0,0 +1,134 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "abspath.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "mail-user.h"
+#include "mail-storage-hooks.h"
+#include "mail-storage-service.h"
+#include "test-common.h"
+
+#include <unistd.h>
+
+#define TEST_MAIL_DIR ".test-mail-storage-service"
+
+static struct mail_storage_service_ctx *storage_service;
+static unsigned int test_reused_count;
+static char *test_reused_session_id;
+
+static void test_mail_user_reused(struct mail_user *user)
+{
+	test_reused_count++;
+	i_free(test_reused_session_id);
+	test_reused_session_id = i_strdup(user->session_id);
+}
+
+static struct mail_storage_hooks test_mail_storage_hooks = {
+	.mail_user_reused = test_mail_user_reused
+};
+
+static void
+test_lookup(const char *session_id, const char *remote_ip,
+	    struct mail_storage_service_user **user_r,
+	    struct mail_user **mail_user_r)
+{
+	struct mail_storage_service_input input;
+	const char *userdb_fields[3], *error;
+
+	userdb_fields[0] = t_strconcat("mail=maildir:",
+				       t_abspath(TEST_MAIL_DIR), NULL);
+	userdb_fields[1] = "mail_user_reuse_timeout=60";
+	userdb_fields[2] = NULL;
+
+	memset(&input, 0, sizeof(input));
+	input.module = input.service = "imap";
+	input.username = "testuser";
+	input.session_id = session_id;
+	input.userdb_fields = userdb_fields;
+	if (net_addr2ip(remote_ip, &input.remote_ip) < 0)
+		i_unreached();
+
+	if (mail_storage_service_lookup_next(storage_service, &input,
+					     user_r, mail_user_r, &error) <= 0)
+		i_fatal("mail_storage_service_lookup_next() failed: %s", error);
+}
+
+static void test_release(struct mail_storage_service_user **user,
+			 struct mail_user **mail_user)
+{
+	struct ioloop_context *cur_ctx;
+
+	mail_storage_service_user_release(user, mail_user);
+	/* the session has ended. the ioloop would normally do this. */
+	cur_ctx = io_loop_get_current_context(current_ioloop);
+	if (cur_ctx != NULL)
+		io_loop_context_deactivate(cur_ctx);
+}
+
+static void test_mail_storage_service_reuse(void)
+{
+	enum mail_storage_service_flags storage_service_flags =
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR;
+	struct mail_storage_service_user *user;
+	struct mail_user *mail_user, *first_mail_user;
+
+	test_begin("mail storage service user reuse");
+	(void)unlink_directory(TEST_MAIL_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	storage_service = mail_storage_service_init(master_service, NULL,
+						    storage_service_flags);
+	mail_storage_hooks_add_internal(&test_mail_storage_hooks);
+
+	test_lookup("session1", "10.0.0.1", &user, &mail_user);
+	test_assert(strcmp(mail_user->session_id, "session1") == 0);
+	first_mail_user = mail_user;
+	test_release(&user, &mail_user);
+	test_assert(test_reused_count == 0);
+
+	/* the same user's next session reuses the idle user, and the
+	   plugins get to know about the new session */
+	test_lookup("session2", "10.0.0.1", &user, &mail_user);
+	test_assert(mail_user == first_mail_user);
+	test_assert(strcmp(mail_user->session_id, "session2") == 0);
+	test_assert(test_reused_count == 1);
+	test_assert(null_strcmp(test_reused_session_id, "session2") == 0);
+	test_release(&user, &mail_user);
+
+	/* a session from another IP creates a new user */
+	test_lookup("session3", "10.0.0.2", &user, &mail_user);
+	test_assert(mail_user != first_mail_user);
+	test_assert(strcmp(mail_user->session_id, "session3") == 0);
+	test_assert(test_reused_count == 1);
+	test_release(&user, &mail_user);
+
+	mail_storage_hooks_remove_internal(&test_mail_storage_hooks);
+	mail_storage_service_deinit(&storage_service);
+	(void)unlink_directory(TEST_MAIL_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	i_free(test_reused_session_id);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_mail_storage_service_reuse,
+		NULL
+	};
+
+	master_service = master_service_init("test-mail-storage-service",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS,
+					     &argc, &argv, "");
+	/* standalone processes serve only one client by default, which
+	   disables the reuse */
+	master_service_set_client_limit(master_service, 10);
+	master_service_set_service_count(master_service, 10);
+	master_service_init_finish(master_service);
+	/* test_run() deinitializes the lib, so master_service_deinit()
+	   can't be called after it. */
+	return test_run(test_functions);
+}
@@ -0,0 +1,221 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "abspath.h"
+#include "unlink-directory.h"
+#include "write-full.h"
+#include "master-service.h"
+#include "mail-namespace.h"
+#include "mail-storage-service.h"
+#include "maildir-storage.h"
+#include "test-common.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TEST_MAIL_DIR ".test-maildir-sync"
+#define TEST_CUR_DIR TEST_MAIL_DIR"/cur"
+
+static struct mail_storage_service_ctx *storage_service;
+
+static void test_file_create(const char *fname)
+{
+	const char *path = t_strconcat(TEST_CUR_DIR"/", fname, NULL);
+	const char *data = "Subject: test\n\nbody\n";
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, data, strlen(data)) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_file_rename(const char *old_fname, const char *new_fname)
+{
+	const char *old_path = t_strconcat(TEST_CUR_DIR"/", old_fname, NULL);
+	const char *new_path = t_strconcat(TEST_CUR_DIR"/", new_fname, NULL);
+
+	if (rename(old_path, new_path) < 0)
+		i_fatal("rename(%s, %s) failed: %m", old_path, new_path);
+}
+
+static void test_file_unlink(const char *fname)
+{
+	const char *path = t_strconcat(TEST_CUR_DIR"/", fname, NULL);
+
+	if (unlink(path) < 0)
+		i_fatal("unlink(%s) failed: %m", path);
+}
+
+static void test_sync(struct mailbox *box)
+{
+	if (mailbox_sync(box, 0) < 0) {
+		i_fatal("mailbox_sync() failed: %s",
+			mailbox_get_last_error(box, NULL));
+	}
+}
+
+static unsigned int test_get_messages(struct mailbox *box)
+{
+	struct mailbox_status status;
+
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	return status.messages;
+}
+
+static enum mail_flags test_get_flags(struct mailbox *box, uint32_t seq)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	enum mail_flags flags;
+
+	trans = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	flags = mail_get_flags(mail) & MAIL_FLAGS_NONRECENT;
+	mail_free(&mail);
+	(void)mailbox_transaction_commit(&trans);
+	return flags;
+}
+
+#ifdef IOLOOP_NOTIFY_INOTIFY
+static unsigned int test_get_max_queued_events(void)
+{
+	unsigned int value = 16384;
+	FILE *f;
+
+	f = fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%u", &value) != 1)
+			value = 16384;
+		fclose(f);
+	}
+	return value;
+}
+#endif
+
+static void test_maildir_sync_incremental(void)
+{
+	enum mail_storage_service_flags storage_service_flags =
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR;
+	struct mail_storage_service_input input;
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+	struct maildir_mailbox *mbox;
+	struct mailbox *box;
+	const char *userdb_fields[3], *error;
+#ifdef IOLOOP_NOTIFY_INOTIFY
+	struct maildir_sync_notify *notify;
+	unsigned int i, max_events;
+#endif
+
+	test_begin("maildir incremental sync");
+	(void)unlink_directory(TEST_MAIL_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	storage_service = mail_storage_service_init(master_service, NULL,
+						    storage_service_flags);
+
+	userdb_fields[0] = t_strconcat("mail=maildir:",
+				       t_abspath(TEST_MAIL_DIR), NULL);
+	userdb_fields[1] = "maildir_sync_inotify=yes";
+	userdb_fields[2] = NULL;
+
+	memset(&input, 0, sizeof(input));
+	input.module = input.service = "imap";
+	input.username = "testuser";
+	input.userdb_fields = userdb_fields;
+	if (mail_storage_service_lookup_next(storage_service, &input,
+					     &service_user, &user, &error) <= 0)
+		i_fatal("mail_storage_service_lookup_next() failed: %s", error);
+
+	box = mailbox_alloc(mail_namespace_find_inbox(user->namespaces)->list,
+			    "INBOX", 0);
+	if (mailbox_open(box) < 0) {
+		i_fatal("mailbox_open() failed: %s",
+			mailbox_get_last_error(box, NULL));
+	}
+	mbox = (struct maildir_mailbox *)box;
+
+	/* the first sync scans the directories and starts watching them */
+	test_file_create("1.M1.test:2,");
+	test_sync(box);
+	test_assert(test_get_messages(box) == 1);
+#ifdef IOLOOP_NOTIFY_INOTIFY
+	notify = mbox->sync_notify;
+	test_assert(notify != NULL);
+#endif
+
+	/* new file */
+	test_file_create("2.M2.test:2,");
+	test_sync(box);
+	test_assert(test_get_messages(box) == 2);
+
+	/* flag change */
+	test_file_rename("1.M1.test:2,", "1.M1.test:2,S");
+	test_sync(box);
+	test_assert(test_get_messages(box) == 2);
+	test_assert(test_get_flags(box, 1) == MAIL_SEEN);
+	test_assert(test_get_flags(box, 2) == 0);
+
+	/* flag change followed by expunge */
+	test_file_rename("2.M2.test:2,", "2.M2.test:2,F");
+	test_file_unlink("2.M2.test:2,F");
+	test_sync(box);
+	test_assert(test_get_messages(box) == 1);
+	test_assert(test_get_flags(box, 1) == MAIL_SEEN);
+#ifdef IOLOOP_NOTIFY_INOTIFY
+	/* all of the above were synced from the inotify events */
+	test_assert(mbox->sync_notify == notify);
+
+	/* overflow the event queue. the sync must notice it and fall back
+	   to scanning the directories. the final name isn't in the events
+	   that fit into the queue. */
+	test_file_create("3.M3.test:2,");
+	test_file_unlink("1.M1.test:2,S");
+	max_events = test_get_max_queued_events();
+	for (i = 0; i < max_events; i++) {
+		test_file_rename("3.M3.test:2,", "3.M3.test:2,D");
+		test_file_rename("3.M3.test:2,D", "3.M3.test:2,");
+	}
+	test_file_rename("3.M3.test:2,", "3.M3.test:2,R");
+	test_sync(box);
+	test_assert(test_get_messages(box) == 1);
+	test_assert(test_get_flags(box, 1) == MAIL_ANSWERED);
+	/* the full scan started watching again */
+	test_assert(mbox->sync_notify != NULL);
+
+	/* and the new watch is used again */
+	test_file_create("4.M4.test:2,");
+	test_sync(box);
+	test_assert(test_get_messages(box) == 2);
+#endif
+
+	mailbox_free(&box);
+	mail_user_unref(&user);
+	mail_storage_service_user_free(&service_user);
+	mail_storage_service_deinit(&storage_service);
+	(void)unlink_directory(TEST_MAIL_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_maildir_sync_incremental,
+		NULL
+	};
+
+	master_service = master_service_init("test-maildir-sync",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS,
+					     &argc, &argv, "");
+	master_service_init_finish(master_service);
+	/* test_run() deinitializes the lib, so master_service_deinit()
+	   can't be called after it. */
+	return test_run(test_functions);
+}
@@ -0,0 +1,142 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "fdatasync-path.h"
+#include "fsync-batch.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Sync the files already when this many of them are waiting, so that the
+   batch doesn't keep too many fds open. */
+#define FSYNC_BATCH_MAX_FILES 128
+
+struct fsync_batch_file {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	char *path;
+	bool dir;
+};
+
+static ARRAY(struct fsync_batch_file) fsync_batch_files;
+static bool fsync_batch_failed;
+
+static void fsync_batch_flush(void)
+{
+	struct fsync_batch_file *file;
+
+	array_foreach_modifiable(&fsync_batch_files, file) {
+		if (fdatasync(file->fd) < 0) {
+			if (file->dir && (errno == EBADF || errno == EINVAL)) {
+				/* fdatasync_path() ignores these too */
+			} else {
+				i_error("fdatasync(%s) failed: %m", file->path);
+				fsync_batch_failed = TRUE;
+			}
+		}
+		if (close(file->fd) < 0)
+			i_error("close(%s) failed: %m", file->path);
+		i_free(file->path);
+	}
+	array_clear(&fsync_batch_files);
+}
+
+static bool fsync_batch_find(const struct stat *st)
+{
+	const struct fsync_batch_file *file;
+
+	array_foreach(&fsync_batch_files, file) {
+		if (file->ino == st->st_ino && CMP_DEV_T(file->dev, st->st_dev))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void fsync_batch_add(int fd, const struct stat *st,
+			    const char *path, bool dir)
+{
+	struct fsync_batch_file *file;
+
+	if (array_count(&fsync_batch_files) >= FSYNC_BATCH_MAX_FILES)
+		fsync_batch_flush();
+
+	file = array_append_space(&fsync_batch_files);
+	file->fd = fd;
+	file->dev = st->st_dev;
+	file->ino = st->st_ino;
+	file->path = i_strdup(path);
+	file->dir = dir;
+}
+
+void fsync_batch_begin(void)
+{
+	i_assert(!array_is_created(&fsync_batch_files));
+
+	i_array_init(&fsync_batch_files, 16);
+	fsync_batch_failed = FALSE;
+}
+
+bool fsync_batch_is_open(void)
+{
+	return array_is_created(&fsync_batch_files);
+}
+
+unsigned int fsync_batch_get_count(void)
+{
+	return array_count(&fsync_batch_files);
+}
+
+int fsync_batch_fdatasync(int fd, const char *path)
+{
+	struct stat st;
+	int dup_fd;
+
+	if (!fsync_batch_is_open())
+		return fdatasync(fd);
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (fsync_batch_find(&st))
+		return 0;
+
+	/* the caller may close its fd before the batch is committed */
+	dup_fd = dup(fd);
+	if (dup_fd == -1)
+		return -1;
+	fsync_batch_add(dup_fd, &st, path, FALSE);
+	return 0;
+}
+
+int fsync_batch_fdatasync_path(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if (!fsync_batch_is_open())
+		return fdatasync_path(path);
+
+	/* open it now, since we may not have access to it anymore when
+	   the batch is committed */
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (fsync_batch_find(&st))
+		i_close_fd(&fd);
+	else
+		fsync_batch_add(fd, &st, path, S_ISDIR(st.st_mode));
+	return 0;
+}
+
+int fsync_batch_commit(void)
+{
+	fsync_batch_flush();
+	array_free(&fsync_batch_files);
+	return fsync_batch_failed ? -1 : 0;
+}
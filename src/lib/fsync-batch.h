@@ -0,0 +1,32 @@
+#ifndef FSYNC_BATCH_H
+#define FSYNC_BATCH_H
+
+/* Group commit for fdatasync()s. While a batch is open, the syncs requested
+   with fsync_batch_fdatasync*() are only done by fsync_batch_commit(). Each
+   file is synced only once per batch, and syncing many files back to back
+   allows a journaling filesystem to commit them together. The caller must
+   not tell anyone that the data is safely written before the batch has been
+   successfully committed. The batch doesn't preserve ordering, so a file
+   that must be on disk before other files refer to it (e.g. mail data
+   before the index log) must be synced with plain fdatasync(). */
+
+/* Open a new batch. Batches can't be nested. */
+void fsync_batch_begin(void);
+/* Returns TRUE if a batch is open. */
+bool fsync_batch_is_open(void);
+/* Returns the number of files waiting to be synced in the open batch. */
+unsigned int fsync_batch_get_count(void);
+
+/* fdatasync() the fd now, or when the open batch is committed. The path is
+   used only for error messages. Returns 0 if ok, -1 with errno set if
+   failed. */
+int fsync_batch_fdatasync(int fd, const char *path);
+/* Like fdatasync_path(), but the sync is done only when the open batch is
+   committed. */
+int fsync_batch_fdatasync_path(const char *path);
+
+/* fdatasync() all the files in the batch and close it. Returns 0 if ok,
+   -1 if some of the syncs failed. The errors are logged. */
+int fsync_batch_commit(void);
+
+#endif
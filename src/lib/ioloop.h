@@ -164,6 +164,10 @@ void io_loop_context_remove_callbacks(struct ioloop_context *ctx,
 		CALLBACK_TYPECHECK(activate, void (*)(typeof(context))) + \
 		CALLBACK_TYPECHECK(deactivate, void (*)(typeof(context))), \
 		(io_callback_t *)deactivate, context)
+/* Explicitly activate/deactivate the context. Only one context can be
+   active at a time, so any existing context must be deactivated first. */
+void io_loop_context_activate(struct ioloop_context *ctx);
+void io_loop_context_deactivate(struct ioloop_context *ctx);
 /* Returns the current context set to ioloop. */
 struct ioloop_context *io_loop_get_current_context(struct ioloop *ioloop);
 
@@ -39,6 +39,20 @@ bool str_table_is_empty(struct str_table *table)
 	return hash_table_count(table->hash) == 0;
 }
 
+const char *str_table_lookup(struct str_table *table, const char *str,
+			     unsigned int *refcount_r)
+{
+	char *key;
+	void *value;
+
+	if (!hash_table_lookup_full(table->hash, str, &key, &value)) {
+		*refcount_r = 0;
+		return NULL;
+	}
+	*refcount_r = POINTER_CAST_TO(value, unsigned int);
+	return key;
+}
+
 const char *str_table_ref(struct str_table *table, const char *str)
 {
 	char *key;
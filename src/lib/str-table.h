@@ -9,6 +9,10 @@ void str_table_deinit(struct str_table **table);
 /* Returns TRUE if there are no referenced strings in the table. */
 bool str_table_is_empty(struct str_table *table);
 
+/* Returns the string allocated from the strtable and its reference count
+   without changing it, or NULL and 0 if the string isn't in the table. */
+const char *str_table_lookup(struct str_table *table, const char *str,
+			     unsigned int *refcount_r);
 /* Return string allocated from the strtable and increase its reference
    count. */
 const char *str_table_ref(struct str_table *table, const char *str);
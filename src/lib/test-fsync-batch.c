@@ -0,0 +1,48 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "fsync-batch.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+void test_fsync_batch(void)
+{
+	const char *path = ".test-fsync-batch";
+	int fd, fd2;
+
+	test_begin("fsync batch");
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	fd2 = open(path, O_RDONLY);
+	if (fd2 == -1)
+		i_fatal("open(%s) failed: %m", path);
+
+	/* without a batch the syncs are done immediately */
+	test_assert(!fsync_batch_is_open());
+	test_assert(fsync_batch_fdatasync(fd, path) == 0);
+	test_assert(fsync_batch_fdatasync(-1, "bad") < 0 && errno == EBADF);
+
+	fsync_batch_begin();
+	test_assert(fsync_batch_is_open());
+	test_assert(fsync_batch_fdatasync(fd, path) == 0);
+	test_assert(fsync_batch_get_count() == 1);
+	/* the same file is synced only once */
+	test_assert(fsync_batch_fdatasync(fd2, path) == 0);
+	test_assert(fsync_batch_fdatasync_path(path) == 0);
+	test_assert(fsync_batch_get_count() == 1);
+	test_assert(fsync_batch_fdatasync_path(".") == 0);
+	test_assert(fsync_batch_get_count() == 2);
+	test_assert(fsync_batch_fdatasync(-1, "bad") < 0 && errno == EBADF);
+	test_assert(fsync_batch_get_count() == 2);
+
+	/* the batch keeps its own fds */
+	i_close_fd(&fd);
+	i_close_fd(&fd2);
+	test_assert(fsync_batch_commit() == 0);
+	test_assert(!fsync_batch_is_open());
+
+	i_unlink(path);
+	test_end();
+}
@@ -7,6 +7,7 @@ void test_str_table(void)
 {
 	struct str_table *table;
 	const char *key1, *key2, *key1_copy, *key2_copy;
+	unsigned int refcount;
 
 	test_begin("str_table");
 	table = str_table_init();
@@ -19,9 +20,15 @@ void test_str_table(void)
 	key2_copy = str_table_ref(table, "str2");
 	test_assert(key2_copy == key2);
 
+	test_assert(str_table_lookup(table, "str1", &refcount) == key1);
+	test_assert(refcount == 2);
+	test_assert(str_table_lookup(table, "str3", &refcount) == NULL);
+	test_assert(refcount == 0);
+
 	str_table_unref(table, &key1);
 	test_assert(key1 == NULL);
 	str_table_unref(table, &key1_copy);
+	test_assert(str_table_lookup(table, "str1", &refcount) == NULL);
 
 	str_table_unref(table, &key2);
 	str_table_unref(table, &key2_copy);
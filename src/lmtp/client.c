@@ -396,7 +396,14 @@ void client_send_line(struct client *client, const char *fmt, ...)
 		str = t_str_new(256);
 		str_vprintfa(str, fmt, args);
 		str_append(str, "\r\n");
-		o_stream_nsend(client->output, str_data(str), str_len(str));
+		if (client->state.delay_replies) {
+			const char *line = p_strdup(client->state_pool,
+						    str_c(str));
+			array_append(&client->state.delayed_replies, &line, 1);
+		} else {
+			o_stream_nsend(client->output, str_data(str),
+				       str_len(str));
+		}
 	} T_END;
 	va_end(args);
 }
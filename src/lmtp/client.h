@@ -43,9 +43,17 @@ struct client_state {
 
 	struct mail_user *dest_user;
 	struct mail *first_saved_mail;
+	/* mail_attachment_dir where the first recipient's mail body was
+	   stored with lmtp_single_instance_min_size */
+	const char *single_instance_dir;
+
+	/* With lmtp_fsync_batch the replies to DATA are sent only after
+	   the mails have been fsynced. */
+	ARRAY_TYPE(const_string) delayed_replies;
 
 	unsigned int mail_body_7bit:1;
 	unsigned int mail_body_8bitmime:1;
+	unsigned int delay_replies:1;
 };
 
 struct client {
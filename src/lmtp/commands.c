@@ -12,6 +12,7 @@
 #include "istream-dot.h"
 #include "safe-mkstemp.h"
 #include "hex-dec.h"
+#include "fsync-batch.h"
 #include "time-util.h"
 #include "var-expand.h"
 #include "restrict-access.h"
@@ -755,6 +756,32 @@ static bool orcpt_get_valid_rfc822(const char *orcpt, const char **addr_r)
 	return TRUE;
 }
 
+static bool client_deliver_can_share_body(struct client *client)
+{
+	struct mail_user *user = client->state.dest_user;
+	const struct mail_storage_settings *mail_set;
+	const char *dir;
+
+	if (client->lmtp_set->lmtp_single_instance_min_size == 0 ||
+	    array_count(&client->state.rcpt_to) < 2)
+		return FALSE;
+
+	/* the body can be shared only if the fs deduplicates the attachment
+	   files and all the recipients use the same directory for them */
+	mail_set = mail_user_set_get_storage_set(user);
+	if (*mail_set->mail_attachment_dir == '\0' ||
+	    strncmp(mail_set->mail_attachment_fs, "sis", 3) != 0)
+		return FALSE;
+
+	dir = mail_user_home_expand(user, mail_set->mail_attachment_dir);
+	if (client->state.single_instance_dir == NULL) {
+		client->state.single_instance_dir =
+			p_strdup(client->state_pool, dir);
+		return TRUE;
+	}
+	return strcmp(client->state.single_instance_dir, dir) == 0;
+}
+
 static int
 client_deliver(struct client *client, const struct mail_recipient *rcpt,
 	       struct mail *src_mail, struct mail_deliver_session *session)
@@ -858,6 +885,10 @@ client_deliver(struct client *client, const struct mail_recipient *rcpt,
 
 	dctx.save_dest_mail = array_count(&client->state.rcpt_to) > 1 &&
 		client->state.first_saved_mail == NULL;
+	if (client_deliver_can_share_body(client)) {
+		dctx.body_attachment_min_size =
+			client->lmtp_set->lmtp_single_instance_min_size;
+	}
 
 	if (client->lmtp_set->lmtp_user_concurrency_limit > 0) {
 		master_service_anvil_send(master_service, t_strconcat(
@@ -992,6 +1023,39 @@ static int client_open_raw_mail(struct client *client, struct istream *input)
 	return 0;
 }
 
+static void client_fsync_batch_begin(struct client *client)
+{
+	p_array_init(&client->state.delayed_replies, client->state_pool,
+		     array_count(&client->state.rcpt_to));
+	client->state.delay_replies = TRUE;
+	fsync_batch_begin();
+}
+
+static void client_fsync_batch_commit(struct client *client)
+{
+	struct mail_recipient *const *rcpts;
+	const char *const *replies;
+	unsigned int i, rcpt_count, reply_count;
+	bool failed;
+
+	failed = fsync_batch_commit() < 0;
+	client->state.delay_replies = FALSE;
+
+	/* there's one reply for each recipient */
+	rcpts = array_get(&client->state.rcpt_to, &rcpt_count);
+	replies = array_get(&client->state.delayed_replies, &reply_count);
+	i_assert(reply_count <= rcpt_count);
+	for (i = 0; i < reply_count; i++) {
+		if (failed && strncmp(replies[i], "250 ", 4) == 0) {
+			/* the mail may not have been safely written */
+			client_send_line(client, ERRSTR_TEMP_MAILBOX_FAIL,
+					 rcpts[i]->address);
+		} else {
+			o_stream_nsend_str(client->output, replies[i]);
+		}
+	}
+}
+
 static void
 client_input_data_write_local(struct client *client, struct istream *input)
 {
@@ -1002,6 +1066,9 @@ client_input_data_write_local(struct client *client, struct istream *input)
 	if (client_open_raw_mail(client, input) < 0)
 		return;
 
+	if (client->lmtp_set->lmtp_fsync_batch)
+		client_fsync_batch_begin(client);
+
 	session = mail_deliver_session_init();
 	old_uid = geteuid();
 	src_mail = client->state.raw_mail;
@@ -1040,6 +1107,8 @@ client_input_data_write_local(struct client *client, struct istream *input)
 		mailbox_free(&box);
 		mail_user_unref(&user);
 	}
+	if (client->state.delay_replies)
+		client_fsync_batch_commit(client);
 
 	if (old_uid == 0) {
 		/* switch back to running as root, since that's what we're
@@ -0,0 +1,46 @@
+#!/bin/sh
+
+# Compare delivery times with lmtp_fsync_batch=no and yes. The lmtp binary
+# is run directly with the LMTP session in stdin, so the config's userdb must
+# return users user1..userN and mail_fsync shouldn't be "never".
+#
+# Usage: lmtp-fsync-test.sh <dovecot.conf> [<rcpts per mail> [<mail count>]]
+
+config=$1
+rcpt_count=${2:-20}
+mail_count=${3:-10}
+lmtp=${LMTP:-/usr/local/libexec/dovecot/lmtp}
+
+if [ "$config" = "" ]; then
+  echo "Usage: $0 <dovecot.conf> [<rcpts per mail> [<mail count>]]"
+  exit 1
+fi
+
+input=`mktemp`
+output=`mktemp`
+log=`mktemp`
+trap "rm -f $input $output $log" 0
+
+printf "LHLO localhost\r\n" > $input
+i=0
+while [ $i != $mail_count ]; do
+  i=`expr $i + 1`
+  printf "MAIL FROM:<sender@example.com>\r\n" >> $input
+  j=0
+  while [ $j != $rcpt_count ]; do
+    j=`expr $j + 1`
+    printf "RCPT TO:<user$j>\r\n" >> $input
+  done
+  printf "DATA\r\nSubject: test $i\r\n\r\nbody $i\r\n.\r\n" >> $input
+done
+printf "QUIT\r\n" >> $input
+
+for batch in no yes; do
+  start=`date +%s%N`
+  cat $input | $lmtp -c $config -o lmtp_fsync_batch=$batch > $output 2> $log
+  end=`date +%s%N`
+  grep -v "Info: " $log
+  usecs=`expr \( $end - $start \) / 1000`
+  saved=`grep -c "^250 2.0.0 <user.*> .* Saved" $output`
+  echo "lmtp_fsync_batch=$batch: $saved deliveries in ${usecs}us, `expr $usecs / \( $rcpt_count \* $mail_count \)`us per delivery"
+done
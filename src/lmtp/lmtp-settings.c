@@ -62,6 +62,8 @@ static const struct setting_define lmtp_setting_defines[] = {
 	DEF(SET_BOOL, lmtp_proxy),
 	DEF(SET_BOOL, lmtp_save_to_detail_mailbox),
 	DEF(SET_BOOL, lmtp_rcpt_check_quota),
+	DEF(SET_BOOL, lmtp_fsync_batch),
+	DEF(SET_SIZE, lmtp_single_instance_min_size),
 	DEF(SET_UINT, lmtp_user_concurrency_limit),
 	DEF(SET_STR, lmtp_address_translate),
 	DEF(SET_ENUM, lmtp_hdr_delivery_address),
@@ -75,6 +77,8 @@ static const struct lmtp_settings lmtp_default_settings = {
 	.lmtp_proxy = FALSE,
 	.lmtp_save_to_detail_mailbox = FALSE,
 	.lmtp_rcpt_check_quota = FALSE,
+	.lmtp_fsync_batch = FALSE,
+	.lmtp_single_instance_min_size = 0,
 	.lmtp_user_concurrency_limit = 0,
 	.lmtp_address_translate = "",
 	.lmtp_hdr_delivery_address = "final:none:original",
@@ -16,6 +16,8 @@ struct lmtp_settings {
 	bool lmtp_proxy;
 	bool lmtp_save_to_detail_mailbox;
 	bool lmtp_rcpt_check_quota;
+	bool lmtp_fsync_batch;
+	uoff_t lmtp_single_instance_min_size;
 	unsigned int lmtp_user_concurrency_limit;
 	const char *lmtp_address_translate;
 	const char *lmtp_hdr_delivery_address;
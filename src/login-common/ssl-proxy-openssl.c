@@ -7,12 +7,15 @@
 #include "ostream.h"
 #include "read-full.h"
 #include "safe-memset.h"
+#include "buffer.h"
 #include "hash.h"
 #include "llist.h"
+#include "sha1.h"
 #include "master-interface.h"
 #include "master-service-ssl-settings.h"
 #include "client-common.h"
 #include "ssl-proxy.h"
+#include "ssl-session-cache-client.h"
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -28,6 +31,7 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
 
 #if !defined(OPENSSL_NO_ECDH) && OPENSSL_VERSION_NUMBER >= 0x10000000L
 #  define HAVE_ECDH
@@ -37,6 +41,9 @@
 #define SSL_PARAMFILE_CHECK_INTERVAL (60*30)
 
 #define SSL_PARAMETERS_PATH "ssl-params"
+#define SSL_SESSION_CACHE_PATH "ssl-session-cache"
+/* Check this often if the session ticket keys have been rotated */
+#define SSL_TICKET_KEYS_REFRESH_SECS 60
 
 #ifndef SSL_CTRL_SET_TLSEXT_HOSTNAME /* FIXME: this may be unnecessary.. */
 #  undef HAVE_SSL_GET_SERVERNAME
@@ -91,6 +98,13 @@ struct ssl_parameters {
 	DH *dh_512, *dh_default;
 };
 
+struct ssl_ticket_keys {
+	/* [0] is the current key, [1] the previous one. Each key contains
+	   the key name, HMAC secret and AES key, 16 bytes each. */
+	unsigned char keys[2][SSL_SESSION_TICKET_KEY_SIZE];
+	time_t last_refresh;
+};
+
 struct ssl_server_context {
 	SSL_CTX *ctx;
 	pool_t pool;
@@ -115,6 +129,8 @@ static struct ssl_proxy *ssl_proxies;
 static struct ssl_parameters ssl_params;
 static int ssl_username_nid;
 static ENGINE *ssl_engine;
+static struct ssl_session_cache_client *ssl_session_cache;
+static struct ssl_ticket_keys ssl_ticket_keys;
 
 static void plain_read(struct ssl_proxy *proxy);
 static void ssl_read(struct ssl_proxy *proxy);
@@ -1218,6 +1234,152 @@ static void ssl_servername_callback(SSL *ssl, int *al ATTR_UNUSED,
 }
 #endif
 
+static int ssl_session_new_callback(SSL *ssl ATTR_UNUSED, SSL_SESSION *session)
+{
+	const unsigned char *id;
+	unsigned char *data, *p;
+	unsigned int id_len;
+	time_t expires;
+	int size;
+
+	id = SSL_SESSION_get_id(session, &id_len);
+	size = i2d_SSL_SESSION(session, NULL);
+	if (size <= 0)
+		return 0;
+
+	expires = SSL_SESSION_get_time(session) +
+		SSL_SESSION_get_timeout(session);
+	T_BEGIN {
+		data = p = t_malloc(size);
+		(void)i2d_SSL_SESSION(session, &p);
+		ssl_session_cache_client_add(ssl_session_cache, id, id_len,
+					     data, size, expires);
+	} T_END;
+	/* we didn't keep a reference to the session */
+	return 0;
+}
+
+static SSL_SESSION *
+ssl_session_get_callback(SSL *ssl ATTR_UNUSED, unsigned char *id, int id_len,
+			 int *copy_r)
+{
+	SSL_SESSION *session = NULL;
+	const unsigned char *p;
+	buffer_t *data;
+
+	*copy_r = 0;
+	T_BEGIN {
+		data = buffer_create_dynamic(pool_datastack_create(), 1024);
+		if (ssl_session_cache_client_lookup(ssl_session_cache,
+						    id, id_len, data) > 0) {
+			p = data->data;
+			session = d2i_SSL_SESSION(NULL, &p, data->used);
+		}
+	} T_END;
+	return session;
+}
+
+static void
+ssl_session_remove_callback(SSL_CTX *ctx ATTR_UNUSED, SSL_SESSION *session)
+{
+	const unsigned char *id;
+	unsigned int id_len;
+
+	id = SSL_SESSION_get_id(session, &id_len);
+	ssl_session_cache_client_remove(ssl_session_cache, id, id_len);
+}
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+static void ssl_ticket_keys_refresh(void)
+{
+	buffer_t *keys;
+
+	if (ssl_ticket_keys.last_refresh +
+	    SSL_TICKET_KEYS_REFRESH_SECS > ioloop_time)
+		return;
+	ssl_ticket_keys.last_refresh = ioloop_time;
+
+	/* if the lookup fails, keep using the old keys */
+	T_BEGIN {
+		keys = buffer_create_dynamic(pool_datastack_create(),
+					     sizeof(ssl_ticket_keys.keys));
+		if (ssl_session_cache_client_get_ticket_keys(ssl_session_cache,
+							     keys) == 0) {
+			i_assert(keys->used == sizeof(ssl_ticket_keys.keys));
+			memcpy(ssl_ticket_keys.keys, keys->data, keys->used);
+		}
+		safe_memset(buffer_get_modifiable_data(keys, NULL), 0,
+			    keys->used);
+	} T_END;
+}
+
+static int
+ssl_ticket_key_callback(SSL *ssl ATTR_UNUSED, unsigned char *key_name,
+			unsigned char *iv, EVP_CIPHER_CTX *ectx,
+			HMAC_CTX *hctx, int enc)
+{
+	const unsigned char *key;
+	unsigned int i;
+
+	ssl_ticket_keys_refresh();
+	if (enc != 0) {
+		key = ssl_ticket_keys.keys[0];
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+			return -1;
+		memcpy(key_name, key, 16);
+		EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key + 32, iv);
+		HMAC_Init_ex(hctx, key + 16, 16, EVP_sha256(), NULL);
+		return 1;
+	}
+
+	for (i = 0; i < N_ELEMENTS(ssl_ticket_keys.keys); i++) {
+		if (memcmp(key_name, ssl_ticket_keys.keys[i], 16) == 0)
+			break;
+	}
+	if (i == N_ELEMENTS(ssl_ticket_keys.keys)) {
+		/* unknown or expired key - do a full handshake */
+		return 0;
+	}
+	key = ssl_ticket_keys.keys[i];
+	HMAC_Init_ex(hctx, key + 16, 16, EVP_sha256(), NULL);
+	EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key + 32, iv);
+	/* tickets encrypted with the previous key get renewed */
+	return i == 0 ? 1 : 2;
+}
+#endif
+
+static void ssl_server_context_set_session_cache(struct ssl_server_context *ctx)
+{
+	unsigned char sid_ctx[SHA1_RESULTLEN];
+	struct sha1_ctxt sha1;
+
+	/* sessions are shared by all the login processes, so make sure
+	   they're resumed only with a context using the same certificate
+	   and client certificate verification. */
+	sha1_init(&sha1);
+	sha1_loop(&sha1, ctx->cert, strlen(ctx->cert) + 1);
+	sha1_loop(&sha1, ctx->ca, strlen(ctx->ca) + 1);
+	sha1_loop(&sha1, &ctx->verify_client_cert,
+		  sizeof(ctx->verify_client_cert));
+	sha1_result(&sha1, sid_ctx);
+	if (SSL_CTX_set_session_id_context(ctx->ctx, sid_ctx,
+					   sizeof(sid_ctx)) != 1) {
+		i_fatal("SSL_CTX_set_session_id_context() failed: %s",
+			openssl_iostream_error());
+	}
+
+	SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_new_cb(ctx->ctx, ssl_session_new_callback);
+	SSL_CTX_sess_set_get_cb(ctx->ctx, ssl_session_get_callback);
+	SSL_CTX_sess_set_remove_cb(ctx->ctx, ssl_session_remove_callback);
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+	if (ctx->tickets) {
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx->ctx,
+						 ssl_ticket_key_callback);
+	}
+#endif
+}
+
 static struct ssl_server_context *
 ssl_server_context_init(const struct login_settings *login_set,
 			const struct master_service_ssl_settings *ssl_set)
@@ -1272,6 +1434,8 @@ ssl_server_context_init(const struct login_settings *login_set,
 
 	if (ctx->verify_client_cert)
 		ssl_proxy_ctx_verify_client(ctx->ctx, xnames);
+	if (ssl_session_cache != NULL)
+		ssl_server_context_set_session_cache(ctx);
 
 	i_assert(hash_table_lookup(ssl_servers, ctx) == NULL);
 	hash_table_insert(ssl_servers, ctx, ctx);
@@ -1352,6 +1516,19 @@ void ssl_proxy_init(void)
 
 	extdata_index = SSL_get_ex_new_index(0, dovecot, NULL, NULL, NULL);
 
+	if (login_set->ssl_session_cache) {
+		ssl_session_cache =
+			ssl_session_cache_client_init(SSL_SESSION_CACHE_PATH);
+		/* use per-process ticket keys until we can get the shared
+		   ones from the ssl-session-cache service */
+		if (RAND_bytes(ssl_ticket_keys.keys[0],
+			       sizeof(ssl_ticket_keys.keys[0])) <= 0)
+			i_fatal("RAND_bytes() failed: %s",
+				openssl_iostream_error());
+		memcpy(ssl_ticket_keys.keys[1], ssl_ticket_keys.keys[0],
+		       sizeof(ssl_ticket_keys.keys[1]));
+	}
+
 	hash_table_create(&ssl_servers, default_pool, 0,
 			  ssl_server_context_hash, ssl_server_context_cmp);
 	(void)ssl_server_context_init(login_set, ssl_set);
@@ -1395,6 +1572,9 @@ void ssl_proxy_deinit(void)
 	hash_table_destroy(&ssl_servers);
 
 	ssl_free_parameters(&ssl_params);
+	if (ssl_session_cache != NULL)
+		ssl_session_cache_client_deinit(&ssl_session_cache);
+	safe_memset(&ssl_ticket_keys, 0, sizeof(ssl_ticket_keys));
 	SSL_CTX_free(ssl_client_ctx);
 	if (ssl_engine != NULL) {
 		ENGINE_finish(ssl_engine);
@@ -0,0 +1,257 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hex-binary.h"
+#include "net.h"
+#include "istream.h"
+#include "ostream.h"
+#include "ssl-session-cache-client.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define SSL_SESSION_CACHE_HANDSHAKE "VERSION\tssl-session-cache\t1\t0\n"
+#define SSL_SESSION_CACHE_MAX_INBUF_SIZE (1024*64)
+/* Don't retry connecting more often than this after a failure */
+#define SSL_SESSION_CACHE_RECONNECT_SECS 10
+/* The socket is blocking, so don't wait for the server longer than this */
+#define SSL_SESSION_CACHE_IO_TIMEOUT_MSECS 500
+
+struct ssl_session_cache_client {
+	char *path;
+	int fd;
+	struct istream *input;
+	struct ostream *output;
+
+	time_t last_connect_failure;
+};
+
+struct ssl_session_cache_client *ssl_session_cache_client_init(const char *path)
+{
+	struct ssl_session_cache_client *client;
+
+	client = i_new(struct ssl_session_cache_client, 1);
+	client->path = i_strdup(path);
+	client->fd = -1;
+	return client;
+}
+
+static void
+ssl_session_cache_client_disconnect(struct ssl_session_cache_client *client)
+{
+	if (client->fd == -1)
+		return;
+
+	i_stream_destroy(&client->input);
+	o_stream_destroy(&client->output);
+	if (close(client->fd) < 0)
+		i_error("close(%s) failed: %m", client->path);
+	client->fd = -1;
+}
+
+void ssl_session_cache_client_deinit(struct ssl_session_cache_client **_client)
+{
+	struct ssl_session_cache_client *client = *_client;
+
+	*_client = NULL;
+
+	ssl_session_cache_client_disconnect(client);
+	i_free(client->path);
+	i_free(client);
+}
+
+static void
+ssl_session_cache_client_timeout(struct ssl_session_cache_client *client,
+				 const char *func)
+{
+	i_error("%s(%s) failed: Timed out after %u msecs", func, client->path,
+		SSL_SESSION_CACHE_IO_TIMEOUT_MSECS);
+	ssl_session_cache_client_disconnect(client);
+	/* continue without the cache for a while instead of blocking the
+	   next handshakes as well */
+	client->last_connect_failure = ioloop_time;
+}
+
+static int
+ssl_session_cache_client_set_timeout(struct ssl_session_cache_client *client)
+{
+	struct timeval tv;
+
+	tv.tv_sec = SSL_SESSION_CACHE_IO_TIMEOUT_MSECS / 1000;
+	tv.tv_usec = (SSL_SESSION_CACHE_IO_TIMEOUT_MSECS % 1000) * 1000;
+	if (setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO,
+		       &tv, sizeof(tv)) < 0 ||
+	    setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO,
+		       &tv, sizeof(tv)) < 0) {
+		i_error("setsockopt(%s, SO_RCVTIMEO/SO_SNDTIMEO) failed: %m",
+			client->path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+ssl_session_cache_client_connect(struct ssl_session_cache_client *client)
+{
+	if (client->fd != -1)
+		return 0;
+	if (client->last_connect_failure +
+	    SSL_SESSION_CACHE_RECONNECT_SECS > ioloop_time)
+		return -1;
+
+	client->fd = net_connect_unix(client->path);
+	if (client->fd == -1) {
+		i_error("net_connect_unix(%s) failed: %m", client->path);
+		client->last_connect_failure = ioloop_time;
+		return -1;
+	}
+	net_set_nonblock(client->fd, FALSE);
+	if (ssl_session_cache_client_set_timeout(client) < 0) {
+		i_close_fd(&client->fd);
+		client->last_connect_failure = ioloop_time;
+		return -1;
+	}
+
+	client->input = i_stream_create_fd(client->fd,
+					   SSL_SESSION_CACHE_MAX_INBUF_SIZE,
+					   FALSE);
+	client->output = o_stream_create_fd(client->fd, (size_t)-1, FALSE);
+	o_stream_nsend_str(client->output, SSL_SESSION_CACHE_HANDSHAKE);
+	return 0;
+}
+
+static int
+ssl_session_cache_client_send(struct ssl_session_cache_client *client,
+			      const char *cmd)
+{
+	if (ssl_session_cache_client_connect(client) < 0)
+		return -1;
+
+	o_stream_nsend_str(client->output, cmd);
+	if (o_stream_nfinish(client->output) < 0) {
+		i_error("write(%s) failed: %s", client->path,
+			o_stream_get_error(client->output));
+		ssl_session_cache_client_disconnect(client);
+		return -1;
+	}
+	if (o_stream_get_buffer_used_size(client->output) > 0) {
+		ssl_session_cache_client_timeout(client, "write");
+		return -1;
+	}
+	return 0;
+}
+
+static const char *
+ssl_session_cache_client_query(struct ssl_session_cache_client *client,
+			       const char *cmd)
+{
+	const char *line;
+	ssize_t ret;
+
+	if (ssl_session_cache_client_send(client, cmd) < 0)
+		return NULL;
+
+	/* the socket is blocking with a timeout */
+	while ((line = i_stream_next_line(client->input)) == NULL) {
+		if ((ret = i_stream_read(client->input)) > 0)
+			continue;
+		if (ret == 0) {
+			ssl_session_cache_client_timeout(client, "read");
+			return NULL;
+		}
+		if (ret == -2) {
+			i_error("%s: Too large reply from server",
+				client->path);
+		} else if (client->input->stream_errno != 0) {
+			i_error("read(%s) failed: %s", client->path,
+				i_stream_get_error(client->input));
+		} else {
+			i_error("read(%s) failed: Unexpected disconnection",
+				client->path);
+		}
+		ssl_session_cache_client_disconnect(client);
+		return NULL;
+	}
+	return line;
+}
+
+void ssl_session_cache_client_add(struct ssl_session_cache_client *client,
+				  const unsigned char *id, size_t id_size,
+				  const void *data, size_t size,
+				  time_t expires)
+{
+	if ((id_size + size) * 2 + 64 > SSL_SESSION_CACHE_MAX_INBUF_SIZE) {
+		/* too large for the server to accept */
+		return;
+	}
+
+	T_BEGIN {
+		(void)ssl_session_cache_client_send(client,
+			t_strdup_printf("ADD\t%s\t%ld\t%s\n",
+					binary_to_hex(id, id_size),
+					(long)expires,
+					binary_to_hex(data, size)));
+	} T_END;
+}
+
+int ssl_session_cache_client_lookup(struct ssl_session_cache_client *client,
+				    const unsigned char *id, size_t id_size,
+				    buffer_t *data)
+{
+	const char *reply;
+	int ret;
+
+	T_BEGIN {
+		reply = ssl_session_cache_client_query(client,
+			t_strdup_printf("LOOKUP\t%s\n",
+					binary_to_hex(id, id_size)));
+		if (reply == NULL)
+			ret = -1;
+		else if (reply[0] == '\0')
+			ret = 0;
+		else if (hex_to_binary(reply, data) < 0) {
+			i_error("%s: Invalid LOOKUP reply", client->path);
+			ret = -1;
+		} else {
+			ret = 1;
+		}
+	} T_END;
+	return ret;
+}
+
+void ssl_session_cache_client_remove(struct ssl_session_cache_client *client,
+				     const unsigned char *id, size_t id_size)
+{
+	T_BEGIN {
+		(void)ssl_session_cache_client_send(client,
+			t_strdup_printf("REMOVE\t%s\n",
+					binary_to_hex(id, id_size)));
+	} T_END;
+}
+
+int ssl_session_cache_client_get_ticket_keys(struct ssl_session_cache_client *client,
+					     buffer_t *keys)
+{
+	const char *reply, *const *args;
+	size_t orig_used = keys->used;
+	int ret = 0;
+
+	T_BEGIN {
+		reply = ssl_session_cache_client_query(client,
+						       "TICKET-KEYS\n");
+		args = reply == NULL ? NULL : t_strsplit_tab(reply);
+		if (args == NULL)
+			ret = -1;
+		else if (str_array_length(args) != 2 ||
+			 hex_to_binary(args[0], keys) < 0 ||
+			 hex_to_binary(args[1], keys) < 0 ||
+			 keys->used - orig_used != SSL_SESSION_TICKET_KEY_SIZE*2) {
+			i_error("%s: Invalid TICKET-KEYS reply", client->path);
+			buffer_set_used_size(keys, orig_used);
+			ret = -1;
+		}
+	} T_END;
+	return ret;
+}
@@ -0,0 +1,29 @@
+#ifndef SSL_SESSION_CACHE_CLIENT_H
+#define SSL_SESSION_CACHE_CLIENT_H
+
+/* Client for the ssl-session-cache service, which shares SSL sessions and
+   session ticket keys between all the login processes. The requests are
+   blocking, but they're all simple local lookups. */
+struct ssl_session_cache_client *ssl_session_cache_client_init(const char *path);
+void ssl_session_cache_client_deinit(struct ssl_session_cache_client **client);
+
+void ssl_session_cache_client_add(struct ssl_session_cache_client *client,
+				  const unsigned char *id, size_t id_size,
+				  const void *data, size_t size,
+				  time_t expires);
+/* Returns 1 and the serialized session in data if found, 0 if not found,
+   -1 if the lookup failed. */
+int ssl_session_cache_client_lookup(struct ssl_session_cache_client *client,
+				    const unsigned char *id, size_t id_size,
+				    buffer_t *data);
+void ssl_session_cache_client_remove(struct ssl_session_cache_client *client,
+				     const unsigned char *id, size_t id_size);
+/* Get the current and the previous session ticket keys. They're appended
+   to keys, each SSL_SESSION_TICKET_KEY_SIZE bytes. Returns 0 if ok,
+   -1 if failed. */
+int ssl_session_cache_client_get_ticket_keys(struct ssl_session_cache_client *client,
+					     buffer_t *keys);
+
+#define SSL_SESSION_TICKET_KEY_SIZE 48
+
+#endif
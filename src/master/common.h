@@ -5,6 +5,9 @@
 #include "master-interface.h"
 #include "master-settings.h"
 
+/* Directory under base_dir for the config process's reply snapshots */
+#define CONFIG_SNAPSHOT_DIR_NAME "config-snapshot"
+
 extern uid_t master_uid;
 extern gid_t master_gid;
 extern bool core_dumps_disabled;
@@ -9,6 +9,7 @@
 #include "ipwd.h"
 #include "mkdir-parents.h"
 #include "safe-mkdir.h"
+#include "unlink-directory.h"
 #include "restrict-process-size.h"
 #include "settings-parser.h"
 #include "master-settings.h"
@@ -114,6 +115,7 @@ static const struct setting_define service_setting_defines[] = {
 	DEF(SET_BOOL, drop_priv_before_exec),
 
 	DEF(SET_UINT, process_min_avail),
+	DEF(SET_UINT, process_prespawn_max),
 	DEF(SET_UINT, process_limit),
 	DEF(SET_UINT, client_limit),
 	DEF(SET_UINT, service_count),
@@ -144,6 +146,7 @@ static const struct service_settings service_default_settings = {
 	.drop_priv_before_exec = FALSE,
 
 	.process_min_avail = 0,
+	.process_prespawn_max = 0,
 	.process_limit = 0,
 	.client_limit = 0,
 	.service_count = 0,
@@ -744,7 +747,7 @@ mkdir_login_dir(const struct master_settings *set, const char *login_dir)
 
 void master_settings_do_fixes(const struct master_settings *set)
 {
-	const char *empty_dir;
+	const char *empty_dir, *snapshot_dir;
 	struct stat st;
 
 	/* since base dir is under /var/run by default, it may have been
@@ -775,4 +778,14 @@ void master_settings_do_fixes(const struct master_settings *set)
 		i_warning("Corrected permissions for empty directory "
 			  "%s", empty_dir);
 	}
+
+	/* the config snapshots from previous runs are useless, since their
+	   generation can never match again. */
+	snapshot_dir = t_strconcat(set->base_dir, "/"CONFIG_SNAPSHOT_DIR_NAME,
+				   NULL);
+	if (unlink_directory(snapshot_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0 &&
+	    errno != ENOENT)
+		i_error("unlink_directory(%s) failed: %m", snapshot_dir);
+	if (mkdir(snapshot_dir, 0700) < 0 && errno != EEXIST)
+		i_error("mkdir(%s) failed: %m", snapshot_dir);
 }
@@ -6,6 +6,7 @@
 #include "fd-close-on-exec.h"
 #include "hash.h"
 #include "str.h"
+#include "time-util.h"
 #include "safe-mkstemp.h"
 #include "service.h"
 #include "service-process.h"
@@ -24,12 +25,101 @@
 #define MAX_DIE_WAIT_SECS 5
 #define SERVICE_MAX_EXIT_FAILURES_IN_SEC 10
 #define SERVICE_PREFORK_MAX_AT_ONCE 10
+/* Weight of the newest sample in the arrival rate and startup latency
+   moving averages is 1/N */
+#define SERVICE_AVG_WEIGHT 4
+/* How many msecs of arrivals to prepare for in addition to the average
+   process startup latency */
+#define SERVICE_PRESPAWN_MARGIN_MSECS 100
+#define SERVICE_SPAWN_WARN_MSECS 1000
+#define SERVICE_SPAWN_WARN_INTERVAL_SECS 60
 
 static void service_monitor_start_extra_avail(struct service *service);
 static void service_status_more(struct service_process *process,
 				const struct master_status *status);
 static void service_monitor_listen_start_force(struct service *service);
 
+static void service_arrival_rate_update(struct service *service)
+{
+	unsigned int rate, secs;
+
+	if (service->arrival_sec == ioloop_time)
+		return;
+	if (service->arrival_sec == 0 || service->arrival_sec > ioloop_time) {
+		service->arrival_sec = ioloop_time;
+		service->arrivals = 0;
+		return;
+	}
+
+	/* add the finished second and then decay for each second after it
+	   that had no arrivals */
+	rate = (service->arrival_rate_milli * (SERVICE_AVG_WEIGHT-1) +
+		service->arrivals * 1000) / SERVICE_AVG_WEIGHT;
+	secs = ioloop_time - service->arrival_sec;
+	for (; secs > 1 && rate > 0; secs--)
+		rate = rate * (SERVICE_AVG_WEIGHT-1) / SERVICE_AVG_WEIGHT;
+	service->arrival_rate_milli = rate;
+	service->arrival_sec = ioloop_time;
+	service->arrivals = 0;
+}
+
+static unsigned int service_get_min_avail(struct service *service)
+{
+	unsigned int min_avail = service->set->process_min_avail;
+	unsigned int extra, msecs;
+	uint64_t clients;
+
+	if (service->set->process_prespawn_max == 0)
+		return min_avail;
+
+	/* prepare for the clients that are expected to arrive while a new
+	   process is being started */
+	service_arrival_rate_update(service);
+	msecs = service->spawn_latency_avg_msecs +
+		SERVICE_PRESPAWN_MARGIN_MSECS;
+	clients = ((uint64_t)service->arrival_rate_milli * msecs +
+		   999999) / 1000000;
+	extra = (clients + service->client_limit - 1) / service->client_limit;
+	if (extra > service->set->process_prespawn_max)
+		extra = service->set->process_prespawn_max;
+
+	if (min_avail + extra > service->process_limit)
+		return service->process_limit;
+	return min_avail + extra;
+}
+
+static void service_process_spawn_finished(struct service_process *process)
+{
+	struct service *service = process->service;
+	int diff;
+	unsigned int msecs;
+
+	diff = timeval_diff_msecs(&ioloop_timeval, &process->create_time);
+	msecs = diff < 0 ? 0 : diff;
+
+	if (service->spawn_count++ == 0)
+		service->spawn_latency_avg_msecs = msecs;
+	else {
+		service->spawn_latency_avg_msecs =
+			(service->spawn_latency_avg_msecs *
+			 (SERVICE_AVG_WEIGHT-1) + msecs) / SERVICE_AVG_WEIGHT;
+	}
+	if (service->spawn_latency_max_msecs < msecs)
+		service->spawn_latency_max_msecs = msecs;
+
+	if (msecs >= SERVICE_SPAWN_WARN_MSECS &&
+	    service->last_spawn_warning +
+	    SERVICE_SPAWN_WARN_INTERVAL_SECS < ioloop_time) {
+		service->last_spawn_warning = ioloop_time;
+		i_warning("service(%s): Process startup took %u msecs "
+			  "(average %u msecs, max %u msecs, %u processes)",
+			  service->set->name, msecs,
+			  service->spawn_latency_avg_msecs,
+			  service->spawn_latency_max_msecs,
+			  service->spawn_count);
+	}
+}
+
 static void service_process_kill_idle(struct service_process *process)
 {
 	struct service *service = process->service;
@@ -37,7 +127,7 @@ static void service_process_kill_idle(struct service_process *process)
 
 	i_assert(process->available_count == service->client_limit);
 
-	if (service->process_avail <= service->set->process_min_avail) {
+	if (service->process_avail <= service_get_min_avail(service)) {
 		/* we don't have any extra idling processes anymore. */
 		timeout_remove(&process->to_idle);
 	} else if (process->last_kill_sent > process->last_status_update+1) {
@@ -61,11 +151,15 @@ static void service_status_more(struct service_process *process,
 				const struct master_status *status)
 {
 	struct service *service = process->service;
-
-	process->total_count +=
+	unsigned int new_clients =
 		process->available_count - status->available_count;
+
+	process->total_count += new_clients;
 	process->idle_start = 0;
 
+	service_arrival_rate_update(service);
+	service->arrivals += new_clients;
+
 	if (process->to_idle != NULL)
 		timeout_remove(&process->to_idle);
 
@@ -99,7 +193,7 @@ static void service_status_less(struct service_process *process,
 	}
 	if (status->available_count == service->client_limit) {
 		process->idle_start = ioloop_time;
-		if (service->process_avail > service->set->process_min_avail &&
+		if (service->process_avail > service_get_min_avail(service) &&
 		    process->to_idle == NULL &&
 		    service->idle_kill != UINT_MAX) {
 			/* we have more processes than we really need.
@@ -147,6 +241,7 @@ service_status_input_one(struct service *service,
 	if (process->to_status != NULL) {
 		/* first status notification */
 		timeout_remove(&process->to_status);
+		service_process_spawn_finished(process);
 	}
 
 	if (process->available_count == status->available_count)
@@ -255,9 +350,15 @@ static void service_drop_connections(struct service_listener *l)
 			limit_name = "client_limit";
 			limit = service->client_limit;
 		}
+		service_arrival_rate_update(service);
 		i_warning("service(%s): %s (%u) reached, "
-			  "client connections are being dropped",
-			  service->set->name, limit_name, limit);
+			  "client connections are being dropped "
+			  "(%u.%03u new clients/sec, "
+			  "average process startup %u msecs)",
+			  service->set->name, limit_name, limit,
+			  service->arrival_rate_milli / 1000,
+			  service->arrival_rate_milli % 1000,
+			  service->spawn_latency_avg_msecs);
 	}
 
 	if (service->type == SERVICE_TYPE_LOGIN) {
@@ -305,11 +406,12 @@ static void service_accept(struct service_listener *l)
 static bool
 service_monitor_start_count(struct service *service, unsigned int limit)
 {
-	unsigned int i, count;
+	unsigned int i, count, min_avail = service_get_min_avail(service);
 
-	i_assert(service->set->process_min_avail >= service->process_avail);
+	if (min_avail <= service->process_avail)
+		return TRUE;
 
-	count = service->set->process_min_avail - service->process_avail;
+	count = min_avail - service->process_avail;
 	if (service->process_count + count > service->process_limit)
 		count = service->process_limit - service->process_count;
 	if (count > limit)
@@ -337,9 +439,9 @@ static void service_monitor_prefork_timeout(struct service *service)
 		service->prefork_counter = service->list->fork_counter;
 		return;
 	}
-	if (service->process_avail < service->set->process_min_avail) {
+	if (service->process_avail < service_get_min_avail(service)) {
 		if (service_monitor_start_count(service, SERVICE_PREFORK_MAX_AT_ONCE) &&
-		    service->process_avail < service->set->process_min_avail)
+		    service->process_avail < service_get_min_avail(service))
 			return;
 	}
 	timeout_remove(&service->to_prefork);
@@ -347,7 +449,7 @@ static void service_monitor_prefork_timeout(struct service *service)
 
 static void service_monitor_start_extra_avail(struct service *service)
 {
-	if (service->process_avail >= service->set->process_min_avail ||
+	if (service->process_avail >= service_get_min_avail(service) ||
 	    service->list->destroying)
 		return;
 
@@ -355,7 +457,7 @@ static void service_monitor_start_extra_avail(struct service *service)
 		/* quickly start one process now */
 		if (!service_monitor_start_count(service, 1))
 			return;
-		if (service->process_avail >= service->set->process_min_avail)
+		if (service->process_avail >= service_get_min_avail(service))
 			return;
 	}
 	if (service->to_prefork == NULL) {
@@ -225,6 +225,13 @@ static void service_process_setup_config_environment(struct service *service)
 			services_get_config_socket_path(service->list), NULL));
 		break;
 	}
+	if (service->type != SERVICE_TYPE_LOG) {
+		env_put(t_strconcat(MASTER_CONFIG_SNAPSHOT_DIR_ENV"=",
+				    service->list->set->base_dir,
+				    "/"CONFIG_SNAPSHOT_DIR_NAME, NULL));
+		env_put(t_strconcat(MASTER_CONFIG_GENERATION_ENV"=",
+				    service->list->config_generation, NULL));
+	}
 }
 
 static void
@@ -332,6 +339,7 @@ struct service_process *service_process_create(struct service *service)
 	process->refcount = 1;
 	process->pid = pid;
 	process->uid = uid;
+	process->create_time = ioloop_timeval;
 	if (process_forked) {
 		process->to_status =
 			timeout_add(SERVICE_FIRST_STATUS_TIMEOUT_SECS * 1000,
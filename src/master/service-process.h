@@ -14,6 +14,8 @@ struct service_process {
 	unsigned int available_count;
 	/* number of connections process has ever accepted */
 	unsigned int total_count;
+	/* time when the process was created */
+	struct timeval create_time;
 
 	/* time when process started idling, or 0 if we're not idling */
 	time_t idle_start;
@@ -7,6 +7,7 @@
 #include "hash.h"
 #include "str.h"
 #include "net.h"
+#include "hostpid.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "service.h"
@@ -410,6 +411,7 @@ static int
 services_create_real(const struct master_settings *set, pool_t pool,
 		     struct service_list **services_r, const char **error_r)
 {
+	static unsigned int generation_counter = 0;
 	struct service_list *service_list;
 	struct service *service;
 	struct service_settings *const *service_settings;
@@ -426,6 +428,9 @@ services_create_real(const struct master_settings *set, pool_t pool,
 	service_list->master_log_fd[1] = -1;
 	service_list->master_dead_pipe_fd[0] = -1;
 	service_list->master_dead_pipe_fd[1] = -1;
+	service_list->config_generation =
+		p_strdup_printf(pool, "%ld.%s.%u", (long)ioloop_time, my_pid,
+				++generation_counter);
 
 	service_settings = array_get(&set->services, &count);
 	p_array_init(&service_list->services, pool, count);
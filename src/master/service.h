@@ -109,6 +109,19 @@ struct service {
 	/* Last time a "dropping client connections" warning was logged */
 	time_t last_drop_warning;
 
+	/* number of new clients accepted by processes during arrival_sec */
+	unsigned int arrivals;
+	time_t arrival_sec;
+	/* moving average of new clients per second, in 1/1000 units */
+	unsigned int arrival_rate_milli;
+
+	/* number of processes that have finished their startup, and the
+	   moving average and maximum of how long the startup took */
+	unsigned int spawn_count;
+	unsigned int spawn_latency_avg_msecs, spawn_latency_max_msecs;
+	/* Last time a "slow process startup" warning was logged */
+	time_t last_spawn_warning;
+
 	/* all processes are in use and new connections are coming */
 	unsigned int listen_pending:1;
 	/* service is currently listening for new connections */
@@ -127,6 +140,9 @@ struct service_list {
 	int refcount;
 	struct timeout *to_kill;
 	unsigned int fork_counter;
+	/* unique for each configuration (re)load. processes use this to
+	   notice whether their config snapshot is still valid. */
+	const char *config_generation;
 
 	const struct master_settings *set;
 	const struct master_service_settings *service_set;
@@ -75,6 +75,8 @@ struct fts_backend {
 
 	struct fts_backend_vfuncs v;
 	struct mail_namespace *ns;
+	/* cached lookup results, NULL if caching is disabled */
+	struct fts_search_cache *search_cache;
 
 	unsigned int updating:1;
 };
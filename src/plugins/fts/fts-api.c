@@ -10,6 +10,7 @@
 #include "mail-search.h"
 #include "../virtual/virtual-storage.h"
 #include "fts-api-private.h"
+#include "fts-search-cache.h"
 
 static ARRAY(const struct fts_backend *) backends;
 
@@ -82,6 +83,8 @@ void fts_backend_deinit(struct fts_backend **_backend)
 	struct fts_backend *backend = *_backend;
 
 	*_backend = NULL;
+	if (backend->search_cache != NULL)
+		fts_search_cache_deinit(&backend->search_cache);
 	backend->v.deinit(backend);
 }
 
@@ -131,6 +134,12 @@ static void fts_backend_set_cur_mailbox(struct fts_backend_update_context *ctx)
 	}
 }
 
+static void fts_backend_search_cache_clear(struct fts_backend *backend)
+{
+	if (backend->search_cache != NULL)
+		fts_search_cache_clear(backend->search_cache);
+}
+
 int fts_backend_update_deinit(struct fts_backend_update_context **_ctx)
 {
 	struct fts_backend_update_context *ctx = *_ctx;
@@ -144,6 +153,7 @@ int fts_backend_update_deinit(struct fts_backend_update_context **_ctx)
 
 	ret = backend->v.update_deinit(ctx);
 	backend->updating = FALSE;
+	fts_backend_search_cache_clear(backend);
 	return ret;
 }
 
@@ -206,6 +216,7 @@ int fts_backend_reset_last_uids(struct fts_backend *backend)
 	struct mailbox *box;
 	int ret = 0;
 
+	fts_backend_search_cache_clear(backend);
 	iter = mailbox_list_iter_init(backend->ns->list, "*",
 				      MAILBOX_LIST_ITER_SKIP_ALIASES |
 				      MAILBOX_LIST_ITER_NO_AUTO_BOXES);
@@ -228,6 +239,7 @@ int fts_backend_reset_last_uids(struct fts_backend *backend)
 
 int fts_backend_rescan(struct fts_backend *backend)
 {
+	fts_backend_search_cache_clear(backend);
 	if (strcmp(backend->ns->storage->name, VIRTUAL_STORAGE_NAME) == 0) {
 		/* just reset the last-uids for a virtual storage. */
 		return fts_backend_reset_last_uids(backend);
@@ -25,14 +25,32 @@
 #define MAX_WORD_SIZE 1024
 
 struct fts_mail_build_context {
+	/* NULL when building from a stream that is being saved */
 	struct mail *mail;
+	struct mail_user *user;
+	uint32_t uid;
 	struct fts_backend_update_context *update_ctx;
 
+	struct istream *input;
+	struct message_parser_ctx *parser;
+	struct message_decoder_context *decoder;
+	struct message_part *prev_part;
+
 	char *content_type, *content_disposition;
+	/* From address of the mail, used for caching language detection */
+	char *sender;
 	struct fts_parser *body_parser;
 
 	buffer_t *word_buf, *pending_input;
 	struct fts_user_language *cur_user_lang;
+
+	unsigned int skip_body:1;
+	unsigned int body_part:1;
+	unsigned int body_added:1;
+	/* don't use parsers that talk to external processes/services */
+	unsigned int no_external_parsers:1;
+	/* a body part would have required an external parser */
+	unsigned int external_parser_needed:1;
 };
 
 static int fts_build_data(struct fts_mail_build_context *ctx,
@@ -179,7 +197,7 @@ static int fts_build_mail_header(struct fts_mail_build_context *ctx,
 	/* hdr->full_value is always set because we get the block from
 	   message_decoder */
 	memset(&key, 0, sizeof(key));
-	key.uid = ctx->mail->uid;
+	key.uid = ctx->uid;
 	key.type = block->part->physical_pos == 0 ?
 		FTS_BACKEND_BUILD_KEY_HDR : FTS_BACKEND_BUILD_KEY_MIME_HDR;
 	key.part = block->part;
@@ -205,6 +223,13 @@ static int fts_build_mail_header(struct fts_mail_build_context *ctx,
 					     hdr->full_value,
 					     hdr->full_value_len,
 					     UINT_MAX, FALSE);
+		if (key.type == FTS_BACKEND_BUILD_KEY_HDR &&
+		    ctx->sender == NULL && addr != NULL &&
+		    addr->mailbox != NULL && addr->domain != NULL &&
+		    strcasecmp(hdr->name, "From") == 0) {
+			ctx->sender = i_strdup_printf("%s@%s", addr->mailbox,
+						      addr->domain);
+		}
 		str = t_str_new(hdr->full_value_len);
 		message_address_write(str, addr);
 
@@ -233,7 +258,6 @@ static bool
 fts_build_body_begin(struct fts_mail_build_context *ctx,
 		     struct message_part *part, bool *binary_body_r)
 {
-	struct mail_storage *storage;
 	const char *content_type;
 	struct fts_backend_build_key key;
 
@@ -241,7 +265,7 @@ fts_build_body_begin(struct fts_mail_build_context *ctx,
 
 	*binary_body_r = FALSE;
 	memset(&key, 0, sizeof(key));
-	key.uid = ctx->mail->uid;
+	key.uid = ctx->uid;
 	key.part = part;
 
 	content_type = ctx->content_type != NULL ?
@@ -251,11 +275,14 @@ fts_build_body_begin(struct fts_mail_build_context *ctx,
 		return FALSE;
 	}
 
-	
-	storage = mailbox_get_storage(ctx->mail->box);
-	if (fts_parser_init(mail_storage_get_user(storage),
-			    content_type, ctx->content_disposition,
+	if (fts_parser_init(ctx->user, content_type, ctx->content_disposition,
 			    &ctx->body_parser)) {
+		if (ctx->no_external_parsers &&
+		    fts_parser_is_external(ctx->body_parser)) {
+			(void)fts_parser_deinit(&ctx->body_parser);
+			ctx->external_parser_needed = TRUE;
+			return FALSE;
+		}
 		/* extract text using the the returned parser */
 		*binary_body_r = TRUE;
 		key.type = FTS_BACKEND_BUILD_KEY_BODY_PART;
@@ -332,6 +359,8 @@ fts_detect_language(struct fts_mail_build_context *ctx,
 		*lang_r = fts_language_list_get_first(lang_list);
 		return 1;
 	case FTS_LANGUAGE_RESULT_OK:
+		if (ctx->sender != NULL)
+			fts_user_sender_language_add(user, ctx->sender, lang);
 		*lang_r = lang;
 		return 1;
 	case FTS_LANGUAGE_RESULT_ERROR:
@@ -343,6 +372,18 @@ fts_detect_language(struct fts_mail_build_context *ctx,
 	}
 }
 
+static const struct fts_language *
+fts_build_get_sender_lang(struct fts_mail_build_context *ctx)
+{
+	struct mail_user *user = ctx->update_ctx->backend->ns->user;
+
+	if (ctx->sender == NULL || ctx->pending_input->used > 0) {
+		/* unknown sender or we already started detecting */
+		return NULL;
+	}
+	return fts_user_sender_language_lookup(user, ctx->sender);
+}
+
 static int
 fts_build_tokenized(struct fts_mail_build_context *ctx,
 		    const unsigned char *data, size_t size, bool last)
@@ -353,6 +394,9 @@ fts_build_tokenized(struct fts_mail_build_context *ctx,
 
 	if (ctx->cur_user_lang != NULL) {
 		/* we already have a language */
+	} else if ((lang = fts_build_get_sender_lang(ctx)) != NULL) {
+		/* use the language detected earlier for the same sender */
+		fts_mail_build_ctx_set_lang(ctx, fts_user_language_find(user, lang));
 	} else if ((ret = fts_detect_language(ctx, data, size, last, &lang)) < 0) {
 		return -1;
 	} else if (ret == 0) {
@@ -471,74 +515,66 @@ static int fts_body_parser_finish(struct fts_mail_build_context *ctx)
 	return ret;
 }
 
-static int
-fts_build_mail_real(struct fts_backend_update_context *update_ctx,
-		    struct mail *mail)
+static void
+fts_build_mail_init(struct fts_mail_build_context *ctx,
+		    struct fts_backend_update_context *update_ctx,
+		    struct mail_user *user, struct istream *input,
+		    pool_t parts_pool)
 {
-	struct fts_mail_build_context ctx;
-	struct istream *input;
-	struct message_parser_ctx *parser;
-	struct message_decoder_context *decoder;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->update_ctx = update_ctx;
+	ctx->user = user;
+	ctx->input = input;
+	i_stream_ref(input);
+	if ((update_ctx->backend->flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0)
+		ctx->pending_input = buffer_create_dynamic(default_pool, 128);
+
+	ctx->parser = message_parser_init(parts_pool, input,
+					  MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE,
+					  0);
+	ctx->decoder = message_decoder_init(update_ctx->normalizer, 0);
+}
+
+static int fts_build_mail_more(struct fts_mail_build_context *ctx)
+{
+	struct fts_backend_update_context *update_ctx = ctx->update_ctx;
 	struct message_block raw_block, block;
-	struct message_part *prev_part, *parts;
-	bool skip_body = FALSE, body_part = FALSE, body_added = FALSE;
 	bool binary_body;
 	int ret;
 
-	if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
-		if (mail->expunged)
-			return 0;
-		i_error("Failed to read mailbox %s mail UID=%u stream: %s",
-			mailbox_get_vname(mail->box), mail->uid,
-			mailbox_get_last_error(mail->box, NULL));
-		return -1;
-	}
-
-	memset(&ctx, 0, sizeof(ctx));
-	ctx.update_ctx = update_ctx;
-	ctx.mail = mail;
-	if ((update_ctx->backend->flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0)
-		ctx.pending_input = buffer_create_dynamic(default_pool, 128);
-
-	prev_part = NULL;
-	parser = message_parser_init(pool_datastack_create(), input,
-				     MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE,
-				     0);
-
-	decoder = message_decoder_init(update_ctx->normalizer, 0);
 	for (;;) {
-		ret = message_parser_parse_next_block(parser, &raw_block);
-		i_assert(ret != 0);
+		ret = message_parser_parse_next_block(ctx->parser, &raw_block);
+		if (ret == 0) {
+			/* non-blocking input needs more data */
+			i_assert(ctx->mail == NULL);
+			return 0;
+		}
 		if (ret < 0) {
-			if (input->stream_errno == 0)
-				ret = 0;
-			else {
-				i_error("read(%s) failed: %s",
-					i_stream_get_name(input),
-					i_stream_get_error(input));
-			}
-			break;
+			if (ctx->input->stream_errno == 0)
+				return 1;
+			i_error("read(%s) failed: %s",
+				i_stream_get_name(ctx->input),
+				i_stream_get_error(ctx->input));
+			return -1;
 		}
 
-		if (raw_block.part != prev_part) {
+		if (raw_block.part != ctx->prev_part) {
 			/* body part changed. we're now parsing the end of
 			   boundary, possibly followed by message epilogue */
-			if (ctx.body_parser != NULL) {
-				if (fts_body_parser_finish(&ctx) < 0) {
-					ret = -1;
-					break;
-				}
+			if (ctx->body_parser != NULL) {
+				if (fts_body_parser_finish(ctx) < 0)
+					return -1;
 			}
-			message_decoder_set_return_binary(decoder, FALSE);
+			message_decoder_set_return_binary(ctx->decoder, FALSE);
 			fts_backend_update_unset_build_key(update_ctx);
-			prev_part = raw_block.part;
-			i_free_and_null(ctx.content_type);
-			i_free_and_null(ctx.content_disposition);
+			ctx->prev_part = raw_block.part;
+			i_free_and_null(ctx->content_type);
+			i_free_and_null(ctx->content_disposition);
 
 			if (raw_block.size != 0) {
 				/* multipart. skip until beginning of next
 				   part's headers */
-				skip_body = TRUE;
+				ctx->skip_body = TRUE;
 			}
 		}
 
@@ -546,62 +582,99 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 			/* always handle headers */
 		} else if (raw_block.size == 0) {
 			/* end of headers */
-			skip_body = !fts_build_body_begin(&ctx, raw_block.part,
-							  &binary_body);
-			if (binary_body)
-				message_decoder_set_return_binary(decoder, TRUE);
-			body_part = TRUE;
+			ctx->skip_body = !fts_build_body_begin(ctx,
+							       raw_block.part,
+							       &binary_body);
+			if (binary_body) {
+				message_decoder_set_return_binary(ctx->decoder,
+								  TRUE);
+			}
+			ctx->body_part = TRUE;
 		} else {
-			if (skip_body)
+			if (ctx->skip_body)
 				continue;
 		}
 
-		if (!message_decoder_decode_next_block(decoder, &raw_block,
+		if (!message_decoder_decode_next_block(ctx->decoder, &raw_block,
 						       &block))
 			continue;
 
 		if (block.hdr != NULL) {
-			fts_parse_mail_header(&ctx, &raw_block);
-			if (fts_build_mail_header(&ctx, &block) < 0) {
-				ret = -1;
-				break;
-			}
+			fts_parse_mail_header(ctx, &raw_block);
+			if (fts_build_mail_header(ctx, &block) < 0)
+				return -1;
 		} else if (block.size == 0) {
 			/* end of headers */
 		} else {
-			i_assert(body_part);
-			if (ctx.body_parser != NULL)
-				fts_parser_more(ctx.body_parser, &block);
-			if (fts_build_body_block(&ctx, &block, FALSE) < 0) {
-				ret = -1;
-				break;
-			}
-			body_added = TRUE;
+			i_assert(ctx->body_part);
+			if (ctx->body_parser != NULL)
+				fts_parser_more(ctx->body_parser, &block);
+			if (fts_build_body_block(ctx, &block, FALSE) < 0)
+				return -1;
+			ctx->body_added = TRUE;
 		}
 	}
-	if (ctx.body_parser != NULL) {
-		if (ret == 0)
-			ret = fts_body_parser_finish(&ctx);
+}
+
+static int fts_build_mail_deinit(struct fts_mail_build_context *ctx, int ret)
+{
+	struct message_block block;
+	struct message_part *parts;
+
+	if (ctx->body_parser != NULL) {
+		if (ret >= 0)
+			ret = fts_body_parser_finish(ctx);
 		else
-			(void)fts_parser_deinit(&ctx.body_parser);
+			(void)fts_parser_deinit(&ctx->body_parser);
 	}
-	if (ret == 0 && body_part && !skip_body && !body_added) {
+	if (ret >= 0 && ctx->body_part && !ctx->skip_body && !ctx->body_added) {
 		/* make sure body is added even when it doesn't exist */
-		block.data = NULL; block.size = 0;
-		ret = fts_build_body_block(&ctx, &block, TRUE);
+		memset(&block, 0, sizeof(block));
+		ret = fts_build_body_block(ctx, &block, TRUE);
 	}
-	if (message_parser_deinit(&parser, &parts) < 0)
-		mail_set_cache_corrupted(mail, MAIL_FETCH_MESSAGE_PARTS);
-	message_decoder_deinit(&decoder);
-	i_free(ctx.content_type);
-	i_free(ctx.content_disposition);
-	if (ctx.word_buf != NULL)
-		buffer_free(&ctx.word_buf);
-	if (ctx.pending_input != NULL)
-		buffer_free(&ctx.pending_input);
+	if (message_parser_deinit(&ctx->parser, &parts) < 0 &&
+	    ctx->mail != NULL)
+		mail_set_cache_corrupted(ctx->mail, MAIL_FETCH_MESSAGE_PARTS);
+	message_decoder_deinit(&ctx->decoder);
+	i_stream_unref(&ctx->input);
+	i_free(ctx->content_type);
+	i_free(ctx->content_disposition);
+	i_free(ctx->sender);
+	if (ctx->word_buf != NULL)
+		buffer_free(&ctx->word_buf);
+	if (ctx->pending_input != NULL)
+		buffer_free(&ctx->pending_input);
 	return ret < 0 ? -1 : 1;
 }
 
+static int
+fts_build_mail_real(struct fts_backend_update_context *update_ctx,
+		    struct mail *mail)
+{
+	struct fts_mail_build_context ctx;
+	struct mail_user *user;
+	struct istream *input;
+	int ret;
+
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
+		if (mail->expunged)
+			return 0;
+		i_error("Failed to read mailbox %s mail UID=%u stream: %s",
+			mailbox_get_vname(mail->box), mail->uid,
+			mailbox_get_last_error(mail->box, NULL));
+		return -1;
+	}
+
+	user = mail_storage_get_user(mailbox_get_storage(mail->box));
+	fts_build_mail_init(&ctx, update_ctx, user, input,
+			    pool_datastack_create());
+	ctx.mail = mail;
+	ctx.uid = mail->uid;
+
+	ret = fts_build_mail_more(&ctx);
+	return fts_build_mail_deinit(&ctx, ret);
+}
+
 int fts_build_mail(struct fts_backend_update_context *update_ctx,
 		   struct mail *mail)
 {
@@ -612,3 +685,45 @@ int fts_build_mail(struct fts_backend_update_context *update_ctx,
 	} T_END;
 	return ret;
 }
+
+struct fts_mail_build_context *
+fts_build_mail_stream_init(struct fts_backend_update_context *update_ctx,
+			   struct mail_user *user, struct istream *input,
+			   pool_t parts_pool)
+{
+	struct fts_mail_build_context *ctx;
+
+	ctx = i_new(struct fts_mail_build_context, 1);
+	fts_build_mail_init(ctx, update_ctx, user, input, parts_pool);
+	ctx->no_external_parsers = TRUE;
+	return ctx;
+}
+
+int fts_build_mail_stream_more(struct fts_mail_build_context *ctx)
+{
+	int ret;
+
+	T_BEGIN {
+		ret = fts_build_mail_more(ctx);
+	} T_END;
+	if (ret > 0 && ctx->external_parser_needed)
+		ret = -1;
+	return ret;
+}
+
+int fts_build_mail_stream_deinit(struct fts_mail_build_context **_ctx,
+				 bool success)
+{
+	struct fts_mail_build_context *ctx = *_ctx;
+	int ret;
+
+	*_ctx = NULL;
+
+	T_BEGIN {
+		ret = fts_build_mail_deinit(ctx, success ? 0 : -1);
+	} T_END;
+	if (ctx->external_parser_needed)
+		ret = -1;
+	i_free(ctx);
+	return ret;
+}
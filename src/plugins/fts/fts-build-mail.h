@@ -1,7 +1,25 @@
 #ifndef FTS_BUILD_MAIL_H
 #define FTS_BUILD_MAIL_H
 
+struct fts_mail_build_context;
+
 int fts_build_mail(struct fts_backend_update_context *update_ctx,
 		   struct mail *mail);
 
+/* Build the mail incrementally from a (possibly non-blocking) input stream,
+   such as a message that is being saved. The build keys have uid=0.
+   Body parts that would need an external parser (fts_decoder, fts_tika)
+   aren't handled - the build fails instead. message_parts are allocated
+   from parts_pool, which must stay valid as long as the keys are used. */
+struct fts_mail_build_context *
+fts_build_mail_stream_init(struct fts_backend_update_context *update_ctx,
+			   struct mail_user *user, struct istream *input,
+			   pool_t parts_pool);
+/* Returns 1 if the whole mail was built, 0 if more input is needed,
+   -1 if the mail couldn't be built. */
+int fts_build_mail_stream_more(struct fts_mail_build_context *ctx);
+/* Returns 1 if the mail was successfully built, -1 if not. */
+int fts_build_mail_stream_deinit(struct fts_mail_build_context **ctx,
+				 bool success);
+
 #endif
@@ -113,10 +113,13 @@ int fts_indexer_init(struct fts_backend *backend, struct mailbox *box,
 		return 0;
 	}
 
-	cmd = t_strdup_printf("PREPEND\t1\t%s\t%s\t0\t%s\n",
+	/* the number of unindexed messages is used by indexer as the
+	   estimated cost of the request */
+	cmd = t_strdup_printf("PREPEND\t1\t%s\t%s\t0\t%s\t%u\n",
 			      str_tabescape(box->storage->user->username),
 			      str_tabescape(box->vname),
-			      str_tabescape(box->storage->user->session_id));
+			      str_tabescape(box->storage->user->session_id),
+			      seq2 - seq1 + 1);
 	fd = fts_indexer_cmd(box->storage->user, cmd, &path);
 	if (fd == -1)
 		return -1;
@@ -0,0 +1,258 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "hash.h"
+#include "hex-binary.h"
+#include "llist.h"
+#include "sha1.h"
+#include "settings-parser.h"
+#include "message-parser.h"
+#include "mail-user.h"
+#include "fts-parser.h"
+
+#define FTS_PARSER_CACHE_DEFAULT_SIZE (1024*1024)
+
+struct fts_parser_cache_entry {
+	struct fts_parser_cache_entry *prev, *next;
+
+	char *key;
+	/* Total number of bytes used by this entry */
+	size_t alloc_size;
+	size_t text_size;
+	unsigned char *text;
+};
+
+struct fts_parser_cache {
+	HASH_TABLE(char *, struct fts_parser_cache_entry *) hash;
+	/* head is the most recently used entry */
+	struct fts_parser_cache_entry *head, *tail;
+
+	size_t max_size, size_left;
+};
+
+struct cache_fts_parser {
+	struct fts_parser parser;
+	/* the actual external parser */
+	struct fts_parser *ext_parser;
+	struct sha1_ctxt key_ctx;
+	char *key;
+
+	/* extracted text to be added to cache, NULL if not caching */
+	buffer_t *output;
+	/* cached text for the attachment, if it was found */
+	struct fts_parser_cache_entry *hit;
+	bool hit_returned;
+
+	bool eof;
+	bool ext_eof;
+};
+
+/* The cache is shared by all the users in the process, since the same
+   attachments are often sent to many users. The key contains the parser
+   settings, so the users' settings don't need to be the same. */
+static struct fts_parser_cache *parser_cache = NULL;
+
+static struct fts_parser_cache *fts_parser_cache_get(struct mail_user *user)
+{
+	const char *value, *error;
+	uoff_t max_size;
+
+	if (parser_cache != NULL)
+		return parser_cache->max_size == 0 ? NULL : parser_cache;
+
+	value = mail_user_plugin_getenv(user, "fts_parser_cache_size");
+	if (value == NULL)
+		max_size = FTS_PARSER_CACHE_DEFAULT_SIZE;
+	else if (settings_get_size(value, &max_size, &error) < 0) {
+		i_error("Invalid fts_parser_cache_size setting: %s", error);
+		max_size = 0;
+	}
+
+	parser_cache = i_new(struct fts_parser_cache, 1);
+	hash_table_create(&parser_cache->hash, default_pool, 0,
+			  str_hash, strcmp);
+	parser_cache->max_size = max_size;
+	parser_cache->size_left = max_size;
+	return max_size == 0 ? NULL : parser_cache;
+}
+
+static void
+fts_parser_cache_entry_destroy(struct fts_parser_cache *cache,
+			       struct fts_parser_cache_entry *entry)
+{
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	hash_table_remove(cache->hash, entry->key);
+	cache->size_left += entry->alloc_size;
+
+	i_free(entry->key);
+	i_free(entry->text);
+	i_free(entry);
+}
+
+static void
+fts_parser_cache_add(struct fts_parser_cache *cache, const char *key,
+		     const buffer_t *text)
+{
+	struct fts_parser_cache_entry *entry;
+	size_t alloc_size;
+
+	alloc_size = sizeof(*entry) + strlen(key) + 1 + text->used;
+	if (alloc_size > cache->max_size / 4 ||
+	    hash_table_lookup(cache->hash, key) != NULL)
+		return;
+
+	while (cache->size_left < alloc_size && cache->tail != NULL)
+		fts_parser_cache_entry_destroy(cache, cache->tail);
+
+	entry = i_new(struct fts_parser_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->alloc_size = alloc_size;
+	entry->text_size = text->used;
+	if (text->used > 0) {
+		entry->text = i_malloc(text->used);
+		memcpy(entry->text, text->data, text->used);
+	}
+
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	hash_table_insert(cache->hash, entry->key, entry);
+	cache->size_left -= alloc_size;
+}
+
+static void
+key_add_str(struct sha1_ctxt *ctx, const char *str)
+{
+	if (str == NULL)
+		str = "";
+	sha1_loop(ctx, str, strlen(str) + 1);
+}
+
+struct fts_parser *
+fts_parser_cache_init(struct mail_user *user, struct fts_parser *ext_parser,
+		      unsigned int parser_idx, const char *content_type,
+		      const char *content_disposition)
+{
+	struct cache_fts_parser *parser;
+
+	if (fts_parser_cache_get(user) == NULL)
+		return ext_parser;
+
+	parser = i_new(struct cache_fts_parser, 1);
+	parser->parser.v = fts_parser_cache;
+	parser->ext_parser = ext_parser;
+
+	sha1_init(&parser->key_ctx);
+	sha1_loop(&parser->key_ctx, &parser_idx, sizeof(parser_idx));
+	key_add_str(&parser->key_ctx,
+		    mail_user_plugin_getenv(user, "fts_decoder"));
+	key_add_str(&parser->key_ctx,
+		    mail_user_plugin_getenv(user, "fts_tika"));
+	key_add_str(&parser->key_ctx, content_type);
+	/* the parsers may look at the filename */
+	key_add_str(&parser->key_ctx, content_disposition);
+	return &parser->parser;
+}
+
+static void fts_parser_cache_more(struct fts_parser *_parser,
+				  struct message_block *block)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+	unsigned char digest[SHA1_RESULTLEN];
+	const char *key;
+
+	if (block->size > 0) {
+		i_assert(!parser->eof);
+
+		/* the hash is known only after all of the input has been
+		   seen, so don't delay the parser by buffering it */
+		sha1_loop(&parser->key_ctx, block->data, block->size);
+		parser->ext_parser->v.more(parser->ext_parser, block);
+		block->size = 0;
+		return;
+	}
+
+	if (!parser->eof) {
+		parser->eof = TRUE;
+		sha1_result(&parser->key_ctx, digest);
+		key = binary_to_hex(digest, sizeof(digest));
+		parser->hit = hash_table_lookup(parser_cache->hash, key);
+		if (parser->hit != NULL) {
+			DLLIST2_REMOVE(&parser_cache->head,
+				       &parser_cache->tail, parser->hit);
+			DLLIST2_PREPEND(&parser_cache->head,
+					&parser_cache->tail, parser->hit);
+		} else {
+			parser->key = i_strdup(key);
+			parser->output = buffer_create_dynamic(default_pool, 1024);
+		}
+	}
+
+	if (parser->hit != NULL) {
+		/* the ext_parser's output isn't needed. its deinit aborts
+		   it (or drains it, if the parser can't be aborted). the
+		   entry can't be freed before we're finished, since adding
+		   to cache happens only in deinit. */
+		if (!parser->hit_returned) {
+			block->data = parser->hit->text;
+			block->size = parser->hit->text_size;
+			parser->hit_returned = TRUE;
+		}
+		return;
+	}
+
+	parser->ext_parser->v.more(parser->ext_parser, block);
+	if (block->size == 0)
+		parser->ext_eof = TRUE;
+	else if (parser->output != NULL) {
+		buffer_append(parser->output, block->data, block->size);
+		if (parser->output->used > parser_cache->max_size / 4) {
+			/* too large to be cached */
+			buffer_free(&parser->output);
+		}
+	}
+}
+
+static int fts_parser_cache_deinit(struct fts_parser *_parser)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+	bool skipped;
+	int ret;
+
+	skipped = parser->ext_parser->skipped;
+	ret = fts_parser_deinit(&parser->ext_parser);
+	if (parser->hit != NULL) {
+		/* the ext_parser's result isn't needed */
+		ret = 0;
+	}
+	if (parser->output != NULL) {
+		if (ret == 0 && parser->ext_eof && !skipped &&
+		    parser_cache != NULL) {
+			fts_parser_cache_add(parser_cache, parser->key,
+					     parser->output);
+		}
+		buffer_free(&parser->output);
+	}
+	i_free(parser->key);
+	i_free(parser);
+	return ret;
+}
+
+static void fts_parser_cache_unload(void)
+{
+	if (parser_cache == NULL)
+		return;
+
+	while (parser_cache->tail != NULL) {
+		fts_parser_cache_entry_destroy(parser_cache,
+					       parser_cache->tail);
+	}
+	hash_table_destroy(&parser_cache->hash);
+	i_free_and_null(parser_cache);
+}
+
+struct fts_parser_vfuncs fts_parser_cache = {
+	NULL,
+	fts_parser_cache_more,
+	fts_parser_cache_deinit,
+	fts_parser_cache_unload
+};
@@ -30,13 +30,16 @@ struct fts_parser_script_user {
 
 struct script_fts_parser {
 	struct fts_parser parser;
+	struct mail_user *user;
 
 	int fd;
 	char *path;
+	char *content_type;
 
 	unsigned char outbuf[IO_BLOCK_SIZE];
 	bool failed;
 	bool shutdown;
+	bool eof;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(fts_parser_script_user_module,
@@ -199,28 +202,40 @@ fts_parser_script_try_init(struct mail_user *user,
 			   const char *content_disposition)
 {
 	struct script_fts_parser *parser;
-	const char *filename, *path, *cmd;
-	int fd;
+	const char *filename;
 
 	parse_content_disposition(content_disposition, &filename);
 	if (script_support_content(user, &content_type, filename) <= 0)
 		return NULL;
 
-	fd = script_connect(user, &path);
+	/* the script is started only once there's some input for it, so
+	   that the parser can be dropped cheaply (e.g. when index-on-save
+	   leaves the external parsers to the indexer) */
+	parser = i_new(struct script_fts_parser, 1);
+	parser->parser.v = fts_parser_script;
+	parser->user = user;
+	parser->content_type = i_strdup(content_type);
+	parser->fd = -1;
+	return &parser->parser;
+}
+
+static int fts_parser_script_start(struct script_fts_parser *parser)
+{
+	const char *path, *cmd;
+	int fd;
+
+	fd = script_connect(parser->user, &path);
 	if (fd == -1)
-		return NULL;
-	cmd = t_strdup_printf(SCRIPT_HANDSHAKE"%s\n\n", content_type);
+		return -1;
+	parser->path = i_strdup(path);
+	cmd = t_strdup_printf(SCRIPT_HANDSHAKE"%s\n\n", parser->content_type);
 	if (write_full(fd, cmd, strlen(cmd)) < 0) {
 		i_error("write(%s) failed: %m", path);
 		i_close_fd(&fd);
-		return NULL;
+		return -1;
 	}
-
-	parser = i_new(struct script_fts_parser, 1);
-	parser->parser.v = fts_parser_script;
-	parser->path = i_strdup(path);
 	parser->fd = fd;
-	return &parser->parser;
+	return 0;
 }
 
 static void fts_parser_script_more(struct fts_parser *_parser,
@@ -229,10 +244,20 @@ static void fts_parser_script_more(struct fts_parser *_parser,
 	struct script_fts_parser *parser = (struct script_fts_parser *)_parser;
 	ssize_t ret;
 
+	if (parser->fd == -1 && !parser->failed && !parser->parser.skipped) {
+		/* the script can't be reached. skip this part like we would
+		   have if it had been found out before the part began. */
+		if (fts_parser_script_start(parser) < 0)
+			parser->parser.skipped = TRUE;
+	}
+	if (parser->failed || parser->parser.skipped) {
+		block->size = 0;
+		return;
+	}
+
 	if (block->size > 0) {
 		/* first we'll send everything to the script */
-		if (!parser->failed &&
-		    write_full(parser->fd, block->data, block->size) < 0) {
+		if (write_full(parser->fd, block->data, block->size) < 0) {
 			i_error("write(%s) failed: %m", parser->path);
 			parser->failed = TRUE;
 		}
@@ -245,11 +270,14 @@ static void fts_parser_script_more(struct fts_parser *_parser,
 		}
 		/* read the result from the script */
 		ret = read(parser->fd, parser->outbuf, sizeof(parser->outbuf));
-		if (ret < 0)
+		if (ret < 0) {
 			i_error("read(%s) failed: %m", parser->path);
-		else {
+			parser->failed = TRUE;
+		} else {
 			block->data = parser->outbuf;
 			block->size = ret;
+			if (ret == 0)
+				parser->eof = TRUE;
 		}
 	}
 }
@@ -258,10 +286,23 @@ static int fts_parser_script_deinit(struct fts_parser *_parser)
 {
 	struct script_fts_parser *parser = (struct script_fts_parser *)_parser;
 	int ret = parser->failed ? -1 : 0;
-
-	if (close(parser->fd) < 0)
+	ssize_t rret;
+
+	if (parser->fd != -1 && !parser->eof && !parser->failed) {
+		/* the caller didn't want the rest of the output (e.g. it was
+		   found from fts-parser-cache). read it anyway so the script
+		   doesn't fail writing it. */
+		if (!parser->shutdown && shutdown(parser->fd, SHUT_WR) < 0)
+			i_error("shutdown(%s) failed: %m", parser->path);
+		while ((rret = read(parser->fd, parser->outbuf,
+				    sizeof(parser->outbuf))) > 0) ;
+		if (rret < 0)
+			i_error("read(%s) failed: %m", parser->path);
+	}
+	if (parser->fd != -1 && close(parser->fd) < 0)
 		i_error("close(%s) failed: %m", parser->path);
 	i_free(parser->path);
+	i_free(parser->content_type);
 	i_free(parser);
 	return ret;
 }
@@ -115,6 +115,8 @@ fts_tika_parser_response(const struct http_response *response,
 		i_info("fts_tika: PUT %s failed: %u %s - ignoring",
 		       mail_user_plugin_getenv(parser->user, "fts_tika"),
 		       response->status, response->reason);
+		/* it might work next time */
+		parser->parser.skipped = TRUE;
 		parser->payload = i_stream_create_from_data("", 0);
 		break;
 
@@ -34,8 +34,14 @@ bool fts_parser_init(struct mail_user *user,
 	for (i = 0; i < N_ELEMENTS(parsers); i++) {
 		*parser_r = parsers[i]->try_init(user, content_type,
 						 content_disposition);
-		if (*parser_r != NULL)
+		if (*parser_r != NULL) {
+			if (fts_parser_is_external(*parser_r)) {
+				*parser_r = fts_parser_cache_init(user,
+						*parser_r, i, content_type,
+						content_disposition);
+			}
 			return TRUE;
+		}
 	}
 	return FALSE;
 }
@@ -45,6 +51,13 @@ struct fts_parser *fts_parser_text_init(void)
 	return i_new(struct fts_parser, 1);
 }
 
+bool fts_parser_is_external(const struct fts_parser *parser)
+{
+	return parser->v.try_init == fts_parser_script.try_init ||
+		parser->v.try_init == fts_parser_tika.try_init ||
+		parser->v.more == fts_parser_cache.more;
+}
+
 static bool data_has_nuls(const unsigned char *data, size_t size)
 {
 	size_t i;
@@ -114,4 +127,5 @@ void fts_parsers_unload(void)
 		if (parsers[i]->unload != NULL)
 			parsers[i]->unload();
 	}
+	fts_parser_cache.unload();
 }
@@ -16,16 +16,33 @@ struct fts_parser_vfuncs {
 struct fts_parser {
 	struct fts_parser_vfuncs v;
 	buffer_t *utf8_output;
+
+	/* The parser couldn't handle the input (e.g. the external parser
+	   couldn't be reached or it returned an error that was ignored), so
+	   the part is indexed without its text. The output must not be
+	   cached. */
+	unsigned int skipped:1;
 };
 
 extern struct fts_parser_vfuncs fts_parser_html;
 extern struct fts_parser_vfuncs fts_parser_script;
 extern struct fts_parser_vfuncs fts_parser_tika;
+extern struct fts_parser_vfuncs fts_parser_cache;
 
 bool fts_parser_init(struct mail_user *user,
 		     const char *content_type, const char *content_disposition,
 		     struct fts_parser **parser_r);
 struct fts_parser *fts_parser_text_init(void);
+/* Wrap an external parser so that its output is cached by the attachment's
+   content hash. The input is streamed to ext_parser while it's hashed. If
+   the text is found from the cache, ext_parser's output isn't waited for.
+   Returns ext_parser itself if caching is disabled. */
+struct fts_parser *
+fts_parser_cache_init(struct mail_user *user, struct fts_parser *ext_parser,
+		      unsigned int parser_idx, const char *content_type,
+		      const char *content_disposition);
+/* Returns TRUE if the parser talks to an external process or service. */
+bool fts_parser_is_external(const struct fts_parser *parser);
 
 /* The parser is initially called with message body blocks. Once message is
    finished, it's still called with incoming size=0 while the parser increases
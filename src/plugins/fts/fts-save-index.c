@@ -0,0 +1,464 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "istream.h"
+#include "istream-tee.h"
+#include "message-part.h"
+#include "message-part-serialize.h"
+#include "mail-storage-private.h"
+#include "fts-api-private.h"
+#include "fts-build-mail.h"
+#include "fts-save-spool.h"
+#include "fts-save-index.h"
+
+struct fts_save_index_mail {
+	/* the mail's ops and serialized message_parts in the buffers */
+	size_t ops_offset, ops_end;
+	size_t parts_offset, parts_end;
+
+	/* the whole mail was built successfully */
+	unsigned int complete:1;
+};
+
+struct fts_save_index_update_context {
+	struct fts_backend_update_context ctx;
+	struct fts_save_index *sindex;
+};
+
+struct fts_save_index {
+	struct fts_backend *backend;
+	struct mailbox *box;
+	size_t max_size;
+
+	/* fts_save_spool_add_op()-encoded ops and message_part_serialize()d
+	   parts of all the mails */
+	buffer_t *ops, *parts;
+	ARRAY(struct fts_save_index_mail) mails;
+
+	/* backend that records the update calls instead of indexing */
+	struct fts_backend record_backend;
+	struct fts_save_index_update_context record_ctx;
+
+	/* the current mail's message_parts */
+	pool_t parts_pool;
+	struct message_part *root_part;
+	struct istream *storage_input, *build_input;
+	struct fts_mail_build_context *build_ctx;
+
+	/* max_size was reached - don't try to build more mails */
+	unsigned int full:1;
+	/* between fts_save_index_mail_begin() and _finish() */
+	unsigned int mail_open:1;
+};
+
+static void
+fts_save_index_update_set_mailbox(struct fts_backend_update_context *ctx
+				  ATTR_UNUSED,
+				  struct mailbox *box ATTR_UNUSED)
+{
+}
+
+static bool
+fts_save_index_update_set_build_key(struct fts_backend_update_context *_ctx,
+				    const struct fts_backend_build_key *key)
+{
+	struct fts_save_index_update_context *ctx =
+		(struct fts_save_index_update_context *)_ctx;
+	struct fts_save_index *sindex = ctx->sindex;
+	struct fts_save_spool_op op;
+	struct message_part *root;
+
+	if (sindex->root_part == NULL) {
+		for (root = key->part; root->parent != NULL; )
+			root = root->parent;
+		sindex->root_part = root;
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.type = FTS_SAVE_SPOOL_OP_SET_KEY;
+	op.key_type = key->type;
+	op.part_idx = message_part_to_idx(key->part);
+	op.hdr_name = key->hdr_name;
+	op.body_content_type = key->body_content_type;
+	op.body_content_disposition = key->body_content_disposition;
+	/* we don't know yet if the backend wants this key. that's decided
+	   when the ops are replayed. */
+	fts_save_spool_add_op(sindex->ops, &op);
+	return TRUE;
+}
+
+static void
+fts_save_index_update_unset_build_key(struct fts_backend_update_context *_ctx)
+{
+	struct fts_save_index_update_context *ctx =
+		(struct fts_save_index_update_context *)_ctx;
+	struct fts_save_spool_op op;
+
+	memset(&op, 0, sizeof(op));
+	op.type = FTS_SAVE_SPOOL_OP_UNSET_KEY;
+	fts_save_spool_add_op(ctx->sindex->ops, &op);
+}
+
+static int
+fts_save_index_update_build_more(struct fts_backend_update_context *_ctx,
+				 const unsigned char *data, size_t size)
+{
+	struct fts_save_index_update_context *ctx =
+		(struct fts_save_index_update_context *)_ctx;
+	struct fts_save_index *sindex = ctx->sindex;
+	struct fts_save_spool_op op;
+
+	if (sindex->ops->used + sindex->parts->used + size > sindex->max_size) {
+		/* this mail doesn't fit anymore. leave it and the rest of
+		   the mails to the indexer. */
+		sindex->full = TRUE;
+		return -1;
+	}
+
+	/* keep the data boundaries, since tokenized backends expect to get
+	   one token per call */
+	memset(&op, 0, sizeof(op));
+	op.type = FTS_SAVE_SPOOL_OP_DATA;
+	op.data = data;
+	op.size = size;
+	fts_save_spool_add_op(sindex->ops, &op);
+	return 0;
+}
+
+struct fts_save_index *
+fts_save_index_init(struct fts_backend *backend, struct mailbox *box,
+		    size_t max_size)
+{
+	struct fts_save_index *sindex;
+
+	sindex = i_new(struct fts_save_index, 1);
+	sindex->backend = backend;
+	sindex->box = box;
+	sindex->max_size = max_size;
+	sindex->ops = buffer_create_dynamic(default_pool, 1024);
+	sindex->parts = buffer_create_dynamic(default_pool, 256);
+	i_array_init(&sindex->mails, 8);
+
+	sindex->record_backend.name = backend->name;
+	sindex->record_backend.flags = backend->flags;
+	sindex->record_backend.ns = backend->ns;
+	sindex->record_backend.v.update_set_mailbox =
+		fts_save_index_update_set_mailbox;
+	sindex->record_backend.v.update_set_build_key =
+		fts_save_index_update_set_build_key;
+	sindex->record_backend.v.update_unset_build_key =
+		fts_save_index_update_unset_build_key;
+	sindex->record_backend.v.update_build_more =
+		fts_save_index_update_build_more;
+
+	sindex->record_ctx.sindex = sindex;
+	sindex->record_ctx.ctx.backend = &sindex->record_backend;
+	if ((backend->flags & FTS_BACKEND_FLAG_NORMALIZE_INPUT) != 0) {
+		sindex->record_ctx.ctx.normalizer =
+			backend->ns->user->default_normalizer;
+	}
+	sindex->record_ctx.ctx.cur_box = box;
+	sindex->record_ctx.ctx.backend_box = box;
+	return sindex;
+}
+
+void fts_save_index_deinit(struct fts_save_index **_sindex)
+{
+	struct fts_save_index *sindex = *_sindex;
+
+	*_sindex = NULL;
+
+	if (sindex->mail_open)
+		fts_save_index_mail_finish(sindex, FALSE);
+	array_free(&sindex->mails);
+	buffer_free(&sindex->ops);
+	buffer_free(&sindex->parts);
+	i_free(sindex);
+}
+
+struct istream *
+fts_save_index_mail_begin(struct fts_save_index *sindex,
+			  struct istream *input)
+{
+	struct fts_save_index_mail *mail;
+	struct tee_istream *tee;
+
+	i_assert(!sindex->mail_open);
+
+	mail = array_append_space(&sindex->mails);
+	mail->ops_offset = mail->ops_end = sindex->ops->used;
+	mail->parts_offset = mail->parts_end = sindex->parts->used;
+	sindex->mail_open = TRUE;
+
+	if (sindex->full) {
+		i_stream_ref(input);
+		return input;
+	}
+
+	tee = tee_i_stream_create(input);
+	sindex->storage_input = tee_i_stream_create_child(tee);
+	sindex->build_input = tee_i_stream_create_child(tee);
+	sindex->parts_pool = pool_alloconly_create("fts save index parts", 1024);
+	sindex->root_part = NULL;
+	sindex->build_ctx =
+		fts_build_mail_stream_init(&sindex->record_ctx.ctx,
+					   sindex->backend->ns->user,
+					   sindex->build_input, sindex->parts_pool);
+
+	i_stream_ref(sindex->storage_input);
+	return sindex->storage_input;
+}
+
+static void fts_save_index_mail_drop(struct fts_save_index *sindex)
+{
+	struct fts_save_index_mail *mail;
+
+	mail = array_idx_modifiable(&sindex->mails,
+				    array_count(&sindex->mails) - 1);
+	buffer_set_used_size(sindex->ops, mail->ops_offset);
+	buffer_set_used_size(sindex->parts, mail->parts_offset);
+	mail->ops_end = mail->ops_offset;
+	mail->parts_end = mail->parts_offset;
+	mail->complete = FALSE;
+}
+
+static void fts_save_index_mail_build_end(struct fts_save_index *sindex,
+					  bool success)
+{
+	struct fts_save_index_mail *mail;
+
+	if (fts_build_mail_stream_deinit(&sindex->build_ctx, success) < 0)
+		success = FALSE;
+	/* with the build input gone, the tee no longer waits for it */
+	i_stream_unref(&sindex->build_input);
+
+	if (!success)
+		fts_save_index_mail_drop(sindex);
+	else {
+		mail = array_idx_modifiable(&sindex->mails,
+					    array_count(&sindex->mails) - 1);
+		if (sindex->root_part != NULL)
+			message_part_serialize(sindex->root_part, sindex->parts);
+		mail->ops_end = sindex->ops->used;
+		mail->parts_end = sindex->parts->used;
+		mail->complete = TRUE;
+	}
+	sindex->root_part = NULL;
+	pool_unref(&sindex->parts_pool);
+}
+
+bool fts_save_index_mail_continue(struct fts_save_index *sindex)
+{
+	uoff_t old_offset;
+	int ret;
+
+	if (sindex->build_ctx == NULL)
+		return FALSE;
+
+	/* the build reads only its own tee child. the storage reads the other
+	   one through its own stream chain, so it's up to the caller to give
+	   it another chance once the build has consumed some input. */
+	old_offset = sindex->build_input->v_offset;
+	ret = fts_build_mail_stream_more(sindex->build_ctx);
+	if (ret < 0) {
+		/* the storage may have been waiting for the build */
+		fts_save_index_mail_build_end(sindex, FALSE);
+		return TRUE;
+	}
+	return sindex->build_input->v_offset != old_offset;
+}
+
+void fts_save_index_mail_finish(struct fts_save_index *sindex, bool success)
+{
+	int ret;
+
+	if (!sindex->mail_open) {
+		/* saving was cancelled before it began */
+		i_assert(!success);
+		return;
+	}
+	sindex->mail_open = FALSE;
+
+	if (sindex->build_ctx != NULL) {
+		/* the storage has read all of the input by now, so the rest
+		   of it should be available */
+		ret = !success ? -1 :
+			fts_build_mail_stream_more(sindex->build_ctx);
+		fts_save_index_mail_build_end(sindex, ret > 0);
+	}
+	if (sindex->storage_input != NULL)
+		i_stream_unref(&sindex->storage_input);
+	if (!success) {
+		/* the mail isn't part of the transaction */
+		fts_save_index_mail_drop(sindex);
+		array_delete(&sindex->mails, array_count(&sindex->mails) - 1, 1);
+	}
+}
+
+void fts_save_index_mail_skipped(struct fts_save_index *sindex)
+{
+	struct fts_save_index_mail *mail;
+
+	i_assert(!sindex->mail_open);
+
+	mail = array_append_space(&sindex->mails);
+	mail->ops_offset = mail->ops_end = sindex->ops->used;
+	mail->parts_offset = mail->parts_end = sindex->parts->used;
+}
+
+unsigned int fts_save_index_get_mail_count(struct fts_save_index *sindex)
+{
+	return array_count(&sindex->mails);
+}
+
+int fts_save_index_commit(struct fts_save_index *sindex,
+			  const ARRAY_TYPE(seq_range) *saved_uids)
+{
+	const struct mailbox_permissions *perm;
+	const struct fts_save_index_mail *mails;
+	struct fts_save_spool_mail smail;
+	struct seq_range_iter iter;
+	buffer_t *buf;
+	const char *dir;
+	unsigned int i, count, spooled = 0;
+	uint32_t uid, first_uid = 0, last_uid = 0;
+	int ret;
+
+	i_assert(!sindex->mail_open);
+
+	mails = array_get(&sindex->mails, &count);
+	if (count == 0 || seq_range_count(saved_uids) != count)
+		return 0;
+	if ((ret = mailbox_get_path_to(sindex->box,
+				       MAILBOX_LIST_PATH_TYPE_INDEX,
+				       &dir)) <= 0)
+		return ret;
+
+	buf = buffer_create_dynamic(default_pool,
+				    sindex->ops->used + sindex->parts->used +
+				    count * 16);
+	seq_range_array_iter_init(&iter, saved_uids);
+	for (i = 0; i < count; i++) {
+		if (!seq_range_array_iter_nth(&iter, i, &uid))
+			i_unreached();
+		if (!mails[i].complete)
+			continue;
+
+		memset(&smail, 0, sizeof(smail));
+		smail.uid = uid;
+		smail.parts = CONST_PTR_OFFSET(sindex->parts->data,
+					       mails[i].parts_offset);
+		smail.parts_size = mails[i].parts_end - mails[i].parts_offset;
+		smail.ops = CONST_PTR_OFFSET(sindex->ops->data,
+					     mails[i].ops_offset);
+		smail.ops_size = mails[i].ops_end - mails[i].ops_offset;
+		fts_save_spool_add_mail(buf, &smail);
+
+		if (first_uid == 0)
+			first_uid = uid;
+		last_uid = uid;
+		spooled++;
+	}
+	if (spooled > 0) {
+		perm = mailbox_get_permissions(sindex->box);
+		if (fts_save_spool_write(dir, perm->file_create_mode,
+					 perm->file_create_gid,
+					 first_uid, last_uid, buf) < 0)
+			ret = -1;
+	}
+	buffer_free(&buf);
+	return ret < 0 ? -1 : (int)spooled;
+}
+
+static int
+fts_save_index_replay_ops(struct fts_backend_update_context *update_ctx,
+			  const struct fts_save_spool_mail *mail,
+			  struct message_part *parts, bool validate)
+{
+	const unsigned char *p = mail->ops, *end = p + mail->ops_size;
+	struct fts_save_spool_op op;
+	struct fts_backend_build_key key;
+	bool key_open = FALSE;
+	int ret;
+
+	while ((ret = fts_save_spool_read_op(&p, end, &op)) > 0) {
+		switch (op.type) {
+		case FTS_SAVE_SPOOL_OP_SET_KEY:
+			memset(&key, 0, sizeof(key));
+			key.uid = mail->uid;
+			key.type = op.key_type;
+			key.part = message_part_by_idx(parts, op.part_idx);
+			key.hdr_name = op.hdr_name;
+			key.body_content_type = op.body_content_type;
+			key.body_content_disposition =
+				op.body_content_disposition;
+			if (key.part == NULL ||
+			    (key.type == FTS_BACKEND_BUILD_KEY_HDR ||
+			     key.type == FTS_BACKEND_BUILD_KEY_MIME_HDR) !=
+			    (key.hdr_name != NULL))
+				return -1;
+			if (!validate) {
+				key_open = fts_backend_update_set_build_key(
+					update_ctx, &key);
+			}
+			break;
+		case FTS_SAVE_SPOOL_OP_UNSET_KEY:
+			if (!validate)
+				fts_backend_update_unset_build_key(update_ctx);
+			key_open = FALSE;
+			break;
+		case FTS_SAVE_SPOOL_OP_DATA:
+			if (!key_open)
+				break;
+			if (fts_backend_update_build_more(update_ctx, op.data,
+							  op.size) < 0)
+				return -2;
+			break;
+		}
+	}
+	if (!validate)
+		fts_backend_update_unset_build_key(update_ctx);
+	return ret;
+}
+
+int fts_save_index_replay(struct fts_backend_update_context *update_ctx,
+			  struct mailbox *box,
+			  const struct fts_save_spool_mail *mail)
+{
+	struct message_part *parts = NULL;
+	const char *error;
+	int ret;
+
+	T_BEGIN {
+		if (mail->parts_size > 0) {
+			parts = message_part_deserialize(
+				pool_datastack_create(), mail->parts,
+				mail->parts_size, &error);
+		} else {
+			error = "No message parts";
+		}
+		if (parts == NULL)
+			ret = -1;
+		else {
+			/* don't send anything to the backend before the whole
+			   mail is known to be valid */
+			ret = fts_save_index_replay_ops(update_ctx, mail,
+							parts, TRUE);
+			if (ret < 0)
+				error = "Invalid data";
+			else {
+				ret = fts_save_index_replay_ops(update_ctx,
+								mail, parts,
+								FALSE);
+			}
+		}
+		if (ret == -1) {
+			i_error("fts: Corrupted spooled data for mailbox %s "
+				"UID %u: %s", mailbox_get_vname(box),
+				mail->uid, error);
+		}
+	} T_END;
+	return ret == -1 ? 0 : (ret < 0 ? -1 : 1);
+}
@@ -0,0 +1,52 @@
+#ifndef FTS_SAVE_INDEX_H
+#define FTS_SAVE_INDEX_H
+
+#include "seq-range-array.h"
+
+struct fts_backend;
+struct fts_backend_update_context;
+struct fts_save_spool_mail;
+struct mailbox;
+
+/* Build FTS documents for mails while they're being saved, so they don't
+   need to be read and parsed again by the indexer. The message stream is
+   tee'd to the FTS build, and the output is kept in memory (up to max_size
+   bytes per transaction) until the transaction is committed and the mails
+   have UIDs. The output is then written to a spool file, which the indexer
+   sends to the backend. Mails that couldn't be handled are left for the
+   regular indexing. */
+struct fts_save_index *
+fts_save_index_init(struct fts_backend *backend, struct mailbox *box,
+		    size_t max_size);
+void fts_save_index_deinit(struct fts_save_index **sindex);
+
+/* Start saving a new mail. Returns the input stream that should be given
+   to the storage instead of the original input. */
+struct istream *
+fts_save_index_mail_begin(struct fts_save_index *sindex,
+			  struct istream *input);
+/* Build as much of the mail as possible from the data that the storage has
+   read so far. Returns TRUE if the build made progress, so the storage
+   should be allowed to read more input before returning to the caller. */
+bool fts_save_index_mail_continue(struct fts_save_index *sindex);
+/* Finish building the current mail. */
+void fts_save_index_mail_finish(struct fts_save_index *sindex, bool success);
+/* A mail was saved without going through fts_save_index_mail_begin()
+   (e.g. a hardlink copy). */
+void fts_save_index_mail_skipped(struct fts_save_index *sindex);
+/* Returns the number of mails saved so far. */
+unsigned int fts_save_index_get_mail_count(struct fts_save_index *sindex);
+
+/* Write the built mails to a spool file using the UIDs they were saved with.
+   Returns the number of mails written, -1 on error. */
+int fts_save_index_commit(struct fts_save_index *sindex,
+			  const ARRAY_TYPE(seq_range) *saved_uids);
+
+/* Send a spooled mail to the backend. The mailbox must have already been
+   set for update_ctx. Returns 1 if ok, 0 if the spooled data was corrupted
+   and the mail needs to be built normally, -1 if the backend failed. */
+int fts_save_index_replay(struct fts_backend_update_context *update_ctx,
+			  struct mailbox *box,
+			  const struct fts_save_spool_mail *mail);
+
+#endif
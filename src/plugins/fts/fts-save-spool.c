@@ -0,0 +1,429 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "strnum.h"
+#include "numpack.h"
+#include "safe-mkstemp.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "fts-save-spool.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define FTS_SAVE_SPOOL_HEADER "FTS-SAVE\t1\n"
+/* don't load anything unexpectedly large into memory */
+#define FTS_SAVE_SPOOL_MAX_FILE_SIZE (64*1024*1024)
+
+struct fts_save_spool_file {
+	const char *fname;
+	uint32_t first_uid, last_uid;
+};
+
+struct fts_save_spool {
+	pool_t pool;
+	const char *dir;
+
+	ARRAY(struct fts_save_spool_file) files;
+	/* files before this index have been deleted */
+	unsigned int file_idx;
+	uint32_t last_lookup_uid;
+
+	/* contents of files[file_idx], if loaded */
+	buffer_t *data;
+	size_t data_pos;
+
+	unsigned int listed:1;
+	unsigned int loaded:1;
+};
+
+static void fts_save_spool_add_str(buffer_t *buf, const char *str)
+{
+	size_t len;
+
+	if (str == NULL) {
+		numpack_encode(buf, 0);
+		return;
+	}
+	len = strlen(str);
+	numpack_encode(buf, len + 1);
+	buffer_append(buf, str, len);
+}
+
+static int
+fts_save_spool_read_str(const unsigned char **p, const unsigned char *end,
+			const char **str_r)
+{
+	uint64_t len;
+
+	if (numpack_decode(p, end, &len) < 0)
+		return -1;
+	if (len == 0) {
+		*str_r = NULL;
+		return 0;
+	}
+	len--;
+	if (len > (size_t)(end - *p))
+		return -1;
+	*str_r = t_strndup(*p, len);
+	*p += len;
+	return 0;
+}
+
+static int
+fts_save_spool_read_blob(const unsigned char **p, const unsigned char *end,
+			 const unsigned char **data_r, size_t *size_r)
+{
+	uint64_t size;
+
+	if (numpack_decode(p, end, &size) < 0 ||
+	    size > (size_t)(end - *p))
+		return -1;
+	*data_r = *p;
+	*size_r = size;
+	*p += size;
+	return 0;
+}
+
+void fts_save_spool_add_op(buffer_t *buf, const struct fts_save_spool_op *op)
+{
+	buffer_append_c(buf, op->type);
+	switch (op->type) {
+	case FTS_SAVE_SPOOL_OP_SET_KEY:
+		numpack_encode(buf, op->key_type);
+		numpack_encode(buf, op->part_idx);
+		fts_save_spool_add_str(buf, op->hdr_name);
+		fts_save_spool_add_str(buf, op->body_content_type);
+		fts_save_spool_add_str(buf, op->body_content_disposition);
+		break;
+	case FTS_SAVE_SPOOL_OP_UNSET_KEY:
+		break;
+	case FTS_SAVE_SPOOL_OP_DATA:
+		numpack_encode(buf, op->size);
+		buffer_append(buf, op->data, op->size);
+		break;
+	}
+}
+
+void fts_save_spool_add_mail(buffer_t *buf,
+			     const struct fts_save_spool_mail *mail)
+{
+	numpack_encode(buf, mail->uid);
+	numpack_encode(buf, mail->parts_size);
+	buffer_append(buf, mail->parts, mail->parts_size);
+	numpack_encode(buf, mail->ops_size);
+	buffer_append(buf, mail->ops, mail->ops_size);
+}
+
+int fts_save_spool_read_op(const unsigned char **p, const unsigned char *end,
+			   struct fts_save_spool_op *op_r)
+{
+	uint32_t num;
+
+	memset(op_r, 0, sizeof(*op_r));
+	if (*p == end)
+		return 0;
+
+	op_r->type = **p;
+	*p += 1;
+	switch (op_r->type) {
+	case FTS_SAVE_SPOOL_OP_SET_KEY:
+		if (numpack_decode32(p, end, &num) < 0 ||
+		    num > FTS_BACKEND_BUILD_KEY_BODY_PART_BINARY)
+			return -1;
+		op_r->key_type = num;
+		if (numpack_decode32(p, end, &op_r->part_idx) < 0 ||
+		    fts_save_spool_read_str(p, end, &op_r->hdr_name) < 0 ||
+		    fts_save_spool_read_str(p, end,
+					    &op_r->body_content_type) < 0 ||
+		    fts_save_spool_read_str(p, end,
+					    &op_r->body_content_disposition) < 0)
+			return -1;
+		break;
+	case FTS_SAVE_SPOOL_OP_UNSET_KEY:
+		break;
+	case FTS_SAVE_SPOOL_OP_DATA:
+		if (fts_save_spool_read_blob(p, end, &op_r->data,
+					     &op_r->size) < 0)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	return 1;
+}
+
+int fts_save_spool_read_mail(const unsigned char **p, const unsigned char *end,
+			     struct fts_save_spool_mail *mail_r)
+{
+	memset(mail_r, 0, sizeof(*mail_r));
+	if (*p == end)
+		return 0;
+
+	if (numpack_decode32(p, end, &mail_r->uid) < 0 || mail_r->uid == 0 ||
+	    fts_save_spool_read_blob(p, end, &mail_r->parts,
+				     &mail_r->parts_size) < 0 ||
+	    fts_save_spool_read_blob(p, end, &mail_r->ops,
+				     &mail_r->ops_size) < 0)
+		return -1;
+	return 1;
+}
+
+int fts_save_spool_write(const char *dir, mode_t mode, gid_t gid,
+			 uint32_t first_uid, uint32_t last_uid,
+			 const buffer_t *mails)
+{
+	string_t *temp_path;
+	const char *path;
+	int fd, ret = 0;
+
+	i_assert(first_uid <= last_uid);
+
+	temp_path = t_str_new(256);
+	str_printfa(temp_path, "%s/.%stmp.", dir, FTS_SAVE_SPOOL_FNAME_PREFIX);
+	fd = safe_mkstemp_hostpid(temp_path, mode, (uid_t)-1, gid);
+	if (fd == -1) {
+		i_error("safe_mkstemp(%s) failed: %m", str_c(temp_path));
+		return -1;
+	}
+	if (write_full(fd, FTS_SAVE_SPOOL_HEADER,
+		       strlen(FTS_SAVE_SPOOL_HEADER)) < 0 ||
+	    write_full(fd, mails->data, mails->used) < 0) {
+		i_error("write(%s) failed: %m", str_c(temp_path));
+		ret = -1;
+	}
+	if (close(fd) < 0) {
+		i_error("close(%s) failed: %m", str_c(temp_path));
+		ret = -1;
+	}
+
+	path = t_strdup_printf("%s/%s%u-%u", dir, FTS_SAVE_SPOOL_FNAME_PREFIX,
+			       first_uid, last_uid);
+	if (ret == 0 && rename(str_c(temp_path), path) < 0) {
+		i_error("rename(%s, %s) failed: %m", str_c(temp_path), path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink_if_exists(str_c(temp_path));
+	return ret;
+}
+
+struct fts_save_spool *fts_save_spool_open(const char *dir)
+{
+	struct fts_save_spool *spool;
+	pool_t pool;
+
+	pool = pool_alloconly_create("fts save spool", 512);
+	spool = p_new(pool, struct fts_save_spool, 1);
+	spool->pool = pool;
+	spool->dir = p_strdup(pool, dir);
+	p_array_init(&spool->files, pool, 4);
+	return spool;
+}
+
+static void
+fts_save_spool_delete(struct fts_save_spool *spool,
+		      const struct fts_save_spool_file *file)
+{
+	const char *path = t_strconcat(spool->dir, "/", file->fname, NULL);
+
+	if (unlink(path) < 0 && errno != ENOENT)
+		i_error("unlink(%s) failed: %m", path);
+}
+
+void fts_save_spool_close(struct fts_save_spool **_spool)
+{
+	struct fts_save_spool *spool = *_spool;
+	const struct fts_save_spool_file *file;
+
+	*_spool = NULL;
+
+	if (spool->file_idx < array_count(&spool->files)) {
+		file = array_idx(&spool->files, spool->file_idx);
+		if (file->last_uid <= spool->last_lookup_uid)
+			fts_save_spool_delete(spool, file);
+	}
+	if (spool->data != NULL)
+		buffer_free(&spool->data);
+	pool_unref(&spool->pool);
+}
+
+static int
+fts_save_spool_file_cmp(const struct fts_save_spool_file *f1,
+			const struct fts_save_spool_file *f2)
+{
+	if (f1->first_uid < f2->first_uid)
+		return -1;
+	if (f1->first_uid > f2->first_uid)
+		return 1;
+	return 0;
+}
+
+static bool
+fts_save_spool_parse_fname(const char *fname,
+			   struct fts_save_spool_file *file_r)
+{
+	const char *p, *end;
+
+	if (strncmp(fname, FTS_SAVE_SPOOL_FNAME_PREFIX,
+		    strlen(FTS_SAVE_SPOOL_FNAME_PREFIX)) != 0)
+		return FALSE;
+	p = fname + strlen(FTS_SAVE_SPOOL_FNAME_PREFIX);
+
+	if (str_parse_uint32(p, &file_r->first_uid, &end) < 0 || *end != '-')
+		return FALSE;
+	if (str_to_uint32(end + 1, &file_r->last_uid) < 0 ||
+	    file_r->first_uid == 0 || file_r->first_uid > file_r->last_uid)
+		return FALSE;
+	return TRUE;
+}
+
+static void fts_save_spool_list(struct fts_save_spool *spool)
+{
+	struct fts_save_spool_file file;
+	struct dirent *d;
+	DIR *dir;
+
+	spool->listed = TRUE;
+
+	dir = opendir(spool->dir);
+	if (dir == NULL) {
+		if (errno != ENOENT)
+			i_error("opendir(%s) failed: %m", spool->dir);
+		return;
+	}
+	errno = 0;
+	while ((d = readdir(dir)) != NULL) {
+		if (fts_save_spool_parse_fname(d->d_name, &file)) {
+			file.fname = p_strdup(spool->pool, d->d_name);
+			array_append(&spool->files, &file, 1);
+		}
+		errno = 0;
+	}
+	if (errno != 0)
+		i_error("readdir(%s) failed: %m", spool->dir);
+	if (closedir(dir) < 0)
+		i_error("closedir(%s) failed: %m", spool->dir);
+	array_sort(&spool->files, fts_save_spool_file_cmp);
+}
+
+static int
+fts_save_spool_load(struct fts_save_spool *spool,
+		    const struct fts_save_spool_file *file)
+{
+	const char *path = t_strconcat(spool->dir, "/", file->fname, NULL);
+	struct stat st;
+	int ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			/* someone else just used it */
+			return 0;
+		}
+		i_error("open(%s) failed: %m", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (st.st_size > FTS_SAVE_SPOOL_MAX_FILE_SIZE) {
+		i_error("fts: Spool file %s is too large", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	if (spool->data == NULL)
+		spool->data = buffer_create_dynamic(default_pool, st.st_size);
+	buffer_set_used_size(spool->data, 0);
+	ret = read_full(fd, buffer_append_space_unsafe(spool->data,
+						       st.st_size),
+			st.st_size);
+	if (ret < 0)
+		i_error("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	if (ret < 0)
+		return -1;
+	if (ret == 0 ||
+	    st.st_size < (off_t)strlen(FTS_SAVE_SPOOL_HEADER) ||
+	    memcmp(spool->data->data, FTS_SAVE_SPOOL_HEADER,
+		   strlen(FTS_SAVE_SPOOL_HEADER)) != 0) {
+		i_error("fts: Spool file %s is corrupted", path);
+		return -1;
+	}
+	spool->data_pos = strlen(FTS_SAVE_SPOOL_HEADER);
+	spool->loaded = TRUE;
+	return 1;
+}
+
+static void fts_save_spool_next_file(struct fts_save_spool *spool)
+{
+	const struct fts_save_spool_file *file;
+
+	file = array_idx(&spool->files, spool->file_idx);
+	fts_save_spool_delete(spool, file);
+	spool->file_idx++;
+	spool->loaded = FALSE;
+}
+
+int fts_save_spool_find(struct fts_save_spool *spool, uint32_t uid,
+			struct fts_save_spool_mail *mail_r)
+{
+	const struct fts_save_spool_file *files;
+	const unsigned char *p, *end;
+	unsigned int count;
+	int ret;
+
+	i_assert(uid > spool->last_lookup_uid);
+	spool->last_lookup_uid = uid;
+
+	if (!spool->listed)
+		fts_save_spool_list(spool);
+
+	files = array_get(&spool->files, &count);
+	while (spool->file_idx < count &&
+	       files[spool->file_idx].last_uid < uid) {
+		/* all the mails in this file have been indexed already */
+		fts_save_spool_next_file(spool);
+	}
+	if (spool->file_idx == count || files[spool->file_idx].first_uid > uid)
+		return 0;
+
+	if (!spool->loaded) {
+		if ((ret = fts_save_spool_load(spool,
+					       &files[spool->file_idx])) <= 0) {
+			fts_save_spool_next_file(spool);
+			return ret;
+		}
+	}
+
+	end = CONST_PTR_OFFSET(spool->data->data, spool->data->used);
+	for (;;) {
+		p = CONST_PTR_OFFSET(spool->data->data, spool->data_pos);
+		if ((ret = fts_save_spool_read_mail(&p, end, mail_r)) <= 0)
+			break;
+		if (mail_r->uid > uid) {
+			/* keep it for the next lookup */
+			return 0;
+		}
+		spool->data_pos = p - (const unsigned char *)spool->data->data;
+		if (mail_r->uid == uid)
+			return 1;
+	}
+	if (ret < 0) {
+		i_error("fts: Spool file %s/%s is corrupted", spool->dir,
+			files[spool->file_idx].fname);
+		fts_save_spool_next_file(spool);
+		return -1;
+	}
+	return 0;
+}
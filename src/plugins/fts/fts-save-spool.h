@@ -0,0 +1,75 @@
+#ifndef FTS_SAVE_SPOOL_H
+#define FTS_SAVE_SPOOL_H
+
+#include "fts-api.h"
+
+/* fts_index_on_save writes the FTS data built while saving mails into spool
+   files in the mailbox's index directory. The indexer then sends the data
+   to the backend without having to read and parse the mails again. */
+
+#define FTS_SAVE_SPOOL_FNAME_PREFIX "dovecot-fts-save."
+
+enum fts_save_spool_op_type {
+	FTS_SAVE_SPOOL_OP_SET_KEY = 1,
+	FTS_SAVE_SPOOL_OP_UNSET_KEY,
+	FTS_SAVE_SPOOL_OP_DATA
+};
+
+/* One fts_backend_update_*() call */
+struct fts_save_spool_op {
+	enum fts_save_spool_op_type type;
+
+	/* for SET_KEY: */
+	enum fts_backend_build_key_type key_type;
+	/* message_part_to_idx() of the key's part */
+	unsigned int part_idx;
+	const char *hdr_name;
+	const char *body_content_type;
+	const char *body_content_disposition;
+
+	/* for DATA: */
+	const unsigned char *data;
+	size_t size;
+};
+
+struct fts_save_spool_mail {
+	uint32_t uid;
+	/* message_part_serialize()d parts */
+	const unsigned char *parts;
+	size_t parts_size;
+	/* encoded ops, which can be read with fts_save_spool_read_op() */
+	const unsigned char *ops;
+	size_t ops_size;
+};
+
+/* Append an encoded op to buf. */
+void fts_save_spool_add_op(buffer_t *buf, const struct fts_save_spool_op *op);
+/* Append a mail record to buf. */
+void fts_save_spool_add_mail(buffer_t *buf,
+			     const struct fts_save_spool_mail *mail);
+
+/* Read the next op/mail. Returns 1 if found, 0 if there's no more data,
+   -1 if the data is corrupted. The returned strings are allocated from
+   data stack, the data points to the input. */
+int fts_save_spool_read_op(const unsigned char **p, const unsigned char *end,
+			   struct fts_save_spool_op *op_r);
+int fts_save_spool_read_mail(const unsigned char **p, const unsigned char *end,
+			     struct fts_save_spool_mail *mail_r);
+
+/* Write the encoded mails for UIDs first_uid..last_uid to a new spool file
+   in the directory. Returns 0 if ok, -1 if failed. */
+int fts_save_spool_write(const char *dir, mode_t mode, gid_t gid,
+			 uint32_t first_uid, uint32_t last_uid,
+			 const buffer_t *mails);
+
+/* Open the spool files in the directory for reading. The mails must be
+   looked up in ascending UID order. The spool files whose mails have all
+   been looked up (or skipped) are deleted. */
+struct fts_save_spool *fts_save_spool_open(const char *dir);
+void fts_save_spool_close(struct fts_save_spool **spool);
+/* Find the mail with the given UID. Returns 1 if found, 0 if not, -1 if the
+   spool file was corrupted. The mail is valid until the next call. */
+int fts_save_spool_find(struct fts_save_spool *spool, uint32_t uid,
+			struct fts_save_spool_mail *mail_r);
+
+#endif
@@ -0,0 +1,163 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "llist.h"
+#include "fts-api.h"
+#include "fts-search-cache.h"
+
+struct fts_search_cache_entry {
+	struct fts_search_cache_entry *prev, *next;
+
+	char *key;
+	unsigned char *args_matches;
+	struct seq_range *definite_uids, *maybe_uids;
+	struct fts_score_map *scores;
+
+	unsigned int args_matches_size;
+	unsigned int definite_count, maybe_count, score_count;
+	/* Total number of bytes used by this entry */
+	size_t alloc_size;
+	bool scores_sorted;
+};
+
+struct fts_search_cache {
+	HASH_TABLE(char *, struct fts_search_cache_entry *) hash;
+	/* head is the most recently used entry */
+	struct fts_search_cache_entry *head, *tail;
+
+	size_t max_size, size_left;
+};
+
+struct fts_search_cache *fts_search_cache_init(size_t max_size)
+{
+	struct fts_search_cache *cache;
+
+	cache = i_new(struct fts_search_cache, 1);
+	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	cache->max_size = max_size;
+	cache->size_left = max_size;
+	return cache;
+}
+
+static void
+fts_search_cache_entry_destroy(struct fts_search_cache *cache,
+			       struct fts_search_cache_entry *entry)
+{
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	hash_table_remove(cache->hash, entry->key);
+	cache->size_left += entry->alloc_size;
+
+	i_free(entry->key);
+	i_free(entry->args_matches);
+	i_free(entry->definite_uids);
+	i_free(entry->maybe_uids);
+	i_free(entry->scores);
+	i_free(entry);
+}
+
+void fts_search_cache_deinit(struct fts_search_cache **_cache)
+{
+	struct fts_search_cache *cache = *_cache;
+
+	*_cache = NULL;
+
+	fts_search_cache_clear(cache);
+	hash_table_destroy(&cache->hash);
+	i_free(cache);
+}
+
+void fts_search_cache_clear(struct fts_search_cache *cache)
+{
+	while (cache->tail != NULL)
+		fts_search_cache_entry_destroy(cache, cache->tail);
+	i_assert(cache->size_left == cache->max_size);
+}
+
+static void *cache_memdup(const void *data, size_t size)
+{
+	return size == 0 ? NULL : p_memdup(default_pool, data, size);
+}
+
+bool fts_search_cache_lookup(struct fts_search_cache *cache, const char *key,
+			     pool_t pool, struct fts_result *result,
+			     buffer_t *args_matches)
+{
+	struct fts_search_cache_entry *entry;
+
+	entry = hash_table_lookup(cache->hash, key);
+	if (entry == NULL)
+		return FALSE;
+
+	/* move to the head of the LRU list */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+
+	buffer_append(args_matches, entry->args_matches,
+		      entry->args_matches_size);
+	p_array_init(&result->definite_uids, pool, entry->definite_count + 1);
+	array_append(&result->definite_uids, entry->definite_uids,
+		     entry->definite_count);
+	p_array_init(&result->maybe_uids, pool, entry->maybe_count + 1);
+	array_append(&result->maybe_uids, entry->maybe_uids,
+		     entry->maybe_count);
+	p_array_init(&result->scores, pool, entry->score_count + 1);
+	array_append(&result->scores, entry->scores, entry->score_count);
+	result->scores_sorted = entry->scores_sorted;
+	return TRUE;
+}
+
+void fts_search_cache_add(struct fts_search_cache *cache, const char *key,
+			  const struct fts_result *result,
+			  const buffer_t *args_matches)
+{
+	struct fts_search_cache_entry *entry;
+	const struct seq_range *definite, *maybe;
+	const struct fts_score_map *scores;
+	unsigned int definite_count, maybe_count, score_count;
+	size_t alloc_size;
+
+	definite = array_get(&result->definite_uids, &definite_count);
+	maybe = array_get(&result->maybe_uids, &maybe_count);
+	if (array_is_created(&result->scores))
+		scores = array_get(&result->scores, &score_count);
+	else {
+		scores = NULL;
+		score_count = 0;
+	}
+
+	alloc_size = sizeof(*entry) + strlen(key) + 1 + args_matches->used +
+		(definite_count + maybe_count) * sizeof(struct seq_range) +
+		score_count * sizeof(struct fts_score_map);
+	if (alloc_size > cache->max_size / 2) {
+		/* don't let a single large result flush everything else */
+		return;
+	}
+
+	entry = hash_table_lookup(cache->hash, key);
+	if (entry != NULL)
+		fts_search_cache_entry_destroy(cache, entry);
+	while (cache->size_left < alloc_size && cache->tail != NULL)
+		fts_search_cache_entry_destroy(cache, cache->tail);
+
+	entry = i_new(struct fts_search_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->args_matches_size = args_matches->used;
+	entry->args_matches = cache_memdup(args_matches->data,
+					   args_matches->used);
+	entry->definite_count = definite_count;
+	entry->definite_uids = cache_memdup(definite,
+					    definite_count * sizeof(*definite));
+	entry->maybe_count = maybe_count;
+	entry->maybe_uids = cache_memdup(maybe, maybe_count * sizeof(*maybe));
+	entry->score_count = score_count;
+	entry->scores = cache_memdup(scores, score_count * sizeof(*scores));
+	entry->scores_sorted = result->scores_sorted;
+	entry->alloc_size = alloc_size;
+
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	hash_table_insert(cache->hash, entry->key, entry);
+	cache->size_left -= alloc_size;
+}
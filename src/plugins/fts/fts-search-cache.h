@@ -0,0 +1,29 @@
+#ifndef FTS_SEARCH_CACHE_H
+#define FTS_SEARCH_CACHE_H
+
+struct fts_result;
+
+/* Cache of backend lookup results, so that clients repeating the same
+   SEARCH (e.g. webmails while paging) don't need to query the backend each
+   time. The cache key must contain everything that affects the lookup
+   result, including the backend's last indexed UID. max_size specifies the
+   (approximate) maximum amount of memory in bytes to use for the cache. */
+struct fts_search_cache *fts_search_cache_init(size_t max_size);
+void fts_search_cache_deinit(struct fts_search_cache **cache);
+
+/* Drop all cached results. This is called whenever the backend's index
+   is updated. */
+void fts_search_cache_clear(struct fts_search_cache *cache);
+
+/* Look up the key from the cache. If found, returns TRUE and fills the
+   result's arrays (allocated from pool) and the serialized search args
+   matches to args_matches. */
+bool fts_search_cache_lookup(struct fts_search_cache *cache, const char *key,
+			     pool_t pool, struct fts_result *result,
+			     buffer_t *args_matches);
+/* Add the lookup result to the cache, replacing any existing entry. */
+void fts_search_cache_add(struct fts_search_cache *cache, const char *key,
+			  const struct fts_result *result,
+			  const buffer_t *args_matches);
+
+#endif
@@ -3,11 +3,13 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "strescape.h"
 #include "seq-range-array.h"
 #include "mail-search.h"
 #include "../virtual/virtual-storage.h"
 #include "fts-api-private.h"
 #include "fts-search-args.h"
+#include "fts-search-cache.h"
 #include "fts-search-serialize.h"
 #include "fts-storage.h"
 
@@ -33,6 +35,45 @@ uid_range_to_seqs(struct fts_search_context *fctx,
 	}
 }
 
+static void
+fts_search_cache_key_append_fuzzy(string_t *key,
+				  const struct mail_search_arg *args)
+{
+	/* fuzzy isn't part of the IMAP SEARCH syntax */
+	for (; args != NULL; args = args->next) {
+		str_append_c(key, args->fuzzy ? '1' : '0');
+		if (args->type == SEARCH_SUB || args->type == SEARCH_OR) {
+			fts_search_cache_key_append_fuzzy(key,
+							  args->value.subargs);
+		}
+	}
+}
+
+static const char *
+fts_search_get_cache_key(struct fts_search_context *fctx,
+			 const struct mail_search_arg *args,
+			 enum fts_lookup_flags flags)
+{
+	struct mailbox_status status;
+	string_t *key;
+	const char *error;
+
+	if (fctx->backend->search_cache == NULL)
+		return NULL;
+
+	mailbox_get_open_status(fctx->box, STATUS_UIDVALIDITY, &status);
+	key = t_str_new(128);
+	str_printfa(key, "%u\t%u\t%x\t", status.uidvalidity,
+		    fctx->last_indexed_uid, flags);
+	str_append_tabescaped(key, fctx->box->vname);
+	str_append_c(key, '\t');
+	fts_search_cache_key_append_fuzzy(key, args);
+	str_append_c(key, '\t');
+	if (!mail_search_args_to_imap(key, args, &error))
+		return NULL;
+	return str_c(key);
+}
+
 static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 					  struct mail_search_arg *args,
 					  bool and_args)
@@ -41,20 +82,36 @@ static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 		(and_args ? FTS_LOOKUP_FLAG_AND_ARGS : 0);
 	struct fts_search_level *level;
 	struct fts_result result;
+	buffer_t *args_matches;
+	const char *cache_key;
 
 	memset(&result, 0, sizeof(result));
-	p_array_init(&result.definite_uids, fctx->result_pool, 32);
-	p_array_init(&result.maybe_uids, fctx->result_pool, 32);
-	p_array_init(&result.scores, fctx->result_pool, 32);
+	args_matches = buffer_create_dynamic(fctx->result_pool, 16);
 
 	mail_search_args_reset(args, TRUE);
-	if (fts_backend_lookup(fctx->backend, fctx->box, args, flags,
-			       &result) < 0)
-		return -1;
+	cache_key = fts_search_get_cache_key(fctx, args, flags);
+	if (cache_key != NULL &&
+	    fts_search_cache_lookup(fctx->backend->search_cache, cache_key,
+				    fctx->result_pool, &result,
+				    args_matches)) {
+		/* same lookup was already done with the same index state */
+		fts_search_deserialize(args, args_matches);
+	} else {
+		p_array_init(&result.definite_uids, fctx->result_pool, 32);
+		p_array_init(&result.maybe_uids, fctx->result_pool, 32);
+		p_array_init(&result.scores, fctx->result_pool, 32);
+		if (fts_backend_lookup(fctx->backend, fctx->box, args, flags,
+				       &result) < 0)
+			return -1;
+		fts_search_serialize(args_matches, args);
+		if (cache_key != NULL) {
+			fts_search_cache_add(fctx->backend->search_cache,
+					     cache_key, &result, args_matches);
+		}
+	}
 
 	level = array_append_space(&fctx->levels);
-	level->args_matches = buffer_create_dynamic(fctx->result_pool, 16);
-	fts_search_serialize(level->args_matches, args);
+	level->args_matches = args_matches;
 
 	uid_range_to_seqs(fctx, &result.definite_uids, &level->definite_seqs);
 	uid_range_to_seqs(fctx, &result.maybe_uids, &level->maybe_seqs);
@@ -350,6 +407,7 @@ void fts_search_lookup(struct fts_search_context *fctx)
 		return;
 	if (fts_backend_get_last_uid(fctx->backend, fctx->box, &last_uid) < 0)
 		return;
+	fctx->last_indexed_uid = last_uid;
 	mailbox_get_seq_range(fctx->box, last_uid+1, (uint32_t)-1,
 			      &seq1, &seq2);
 	fctx->first_unindexed_seq = seq1 != 0 ? seq1 : (uint32_t)-1;
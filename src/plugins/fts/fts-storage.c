@@ -2,10 +2,13 @@
 
 #include "lib.h"
 #include "array.h"
+#include "istream.h"
 #include "net.h"
 #include "str.h"
 #include "strescape.h"
 #include "write-full.h"
+#include "seq-range-array.h"
+#include "settings-parser.h"
 #include "mail-search-build.h"
 #include "mail-storage-private.h"
 #include "mailbox-list-private.h"
@@ -14,6 +17,9 @@
 #include "fts-tokenizer.h"
 #include "fts-indexer.h"
 #include "fts-build-mail.h"
+#include "fts-save-index.h"
+#include "fts-save-spool.h"
+#include "fts-search-cache.h"
 #include "fts-search-serialize.h"
 #include "fts-plugin.h"
 #include "fts-storage.h"
@@ -26,6 +32,9 @@
 #define FTS_LIST_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_mailbox_list_module)
 
+#define FTS_INDEX_ON_SAVE_DEFAULT_MAX_SIZE (1024*1024)
+#define FTS_SEARCH_CACHE_DEFAULT_MAX_SIZE (256*1024)
+
 #define INDEXER_SOCKET_NAME "indexer"
 #define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
 
@@ -48,8 +57,14 @@ struct fts_transaction_context {
 	struct fts_scores *scores;
 	uint32_t next_index_seq;
 	uint32_t highest_virtual_uid;
+	/* fts_index_on_save: mails built while saving them */
+	struct fts_save_index *save_index;
+	/* fts_index_on_save: mails built by earlier saves */
+	struct fts_save_spool *save_spool;
 
 	unsigned int precached:1;
+	unsigned int save_spool_checked:1;
+	unsigned int save_index_checked:1;
 	unsigned int mails_saved:1;
 	unsigned int failed:1;
 };
@@ -422,6 +437,34 @@ static int fts_mail_get_special(struct mail *_mail, enum mail_fetch_field field,
 	return fmail->module_ctx.super.get_special(_mail, field, value_r);
 }
 
+static int
+fts_build_mail_spooled(struct fts_backend_update_context *update_ctx,
+		       struct mail *mail)
+{
+	struct fts_transaction_context *ft = FTS_CONTEXT(mail->transaction);
+	struct fts_save_spool_mail smail;
+	const char *dir;
+	int ret = 0;
+
+	if (!ft->save_spool_checked) {
+		ft->save_spool_checked = TRUE;
+		if (mailbox_get_path_to(mail->box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					&dir) > 0)
+			ft->save_spool = fts_save_spool_open(dir);
+	}
+	if (ft->save_spool != NULL) T_BEGIN {
+		if (fts_save_spool_find(ft->save_spool, mail->uid,
+					&smail) > 0) {
+			ret = fts_save_index_replay(update_ctx, mail->box,
+						    &smail);
+		}
+	} T_END;
+	if (ret != 0)
+		return ret;
+	/* not spooled or the spool was corrupted */
+	return fts_build_mail(update_ctx, mail);
+}
+
 static int
 fts_mail_precache_range(struct mailbox_transaction_context *trans,
 			struct fts_backend_update_context *update_ctx,
@@ -440,7 +483,7 @@ fts_mail_precache_range(struct mailbox_transaction_context *trans,
 	mail_search_args_unref(&search_args);
 
 	while (mailbox_search_next(ctx, &mail)) {
-		if (fts_build_mail(update_ctx, mail) < 0) {
+		if (fts_build_mail_spooled(update_ctx, mail) < 0) {
 			mail_storage_set_internal_error(trans->box->storage);
 			ret = -1;
 			break;
@@ -498,7 +541,7 @@ static void fts_mail_index(struct mail *_mail)
 
 	if (ft->next_index_seq == _mail->seq) {
 		fts_backend_update_set_mailbox(flist->update_ctx, _mail->box);
-		if (fts_build_mail(flist->update_ctx, _mail) < 0) {
+		if (fts_build_mail_spooled(flist->update_ctx, _mail) < 0) {
 			mail_storage_set_internal_error(_mail->box->storage);
 			ft->failed = TRUE;
 		}
@@ -542,6 +585,28 @@ void fts_mail_allocated(struct mail *_mail)
 	MODULE_CONTEXT_SET(mail, fts_mail_module, fmail);
 }
 
+static bool fts_want_index_on_save(struct mailbox *box, size_t *max_size_r)
+{
+	struct mail_user *user = box->storage->user;
+	const char *value, *error;
+	uoff_t max_size;
+
+	if (mail_user_plugin_getenv(user, "fts_index_on_save") == NULL ||
+	    strcmp(box->storage->name, VIRTUAL_STORAGE_NAME) == 0)
+		return FALSE;
+
+	value = mail_user_plugin_getenv(user, "fts_index_on_save_max_size");
+	if (value == NULL)
+		max_size = FTS_INDEX_ON_SAVE_DEFAULT_MAX_SIZE;
+	else if (settings_get_size(value, &max_size, &error) < 0) {
+		i_error("Invalid fts_index_on_save_max_size setting: %s",
+			error);
+		return FALSE;
+	}
+	*max_size_r = max_size;
+	return TRUE;
+}
+
 static struct mailbox_transaction_context *
 fts_transaction_begin(struct mailbox *box,
 		      enum mailbox_transaction_flags flags)
@@ -575,6 +640,10 @@ static int fts_transaction_end(struct mailbox_transaction_context *t)
 	}
 	if (ft->scores != NULL)
 		fts_scores_unref(&ft->scores);
+	if (ft->save_index != NULL)
+		fts_save_index_deinit(&ft->save_index);
+	if (ft->save_spool != NULL)
+		fts_save_spool_close(&ft->save_spool);
 	i_free(ft);
 	return ret;
 }
@@ -587,7 +656,7 @@ static void fts_transaction_rollback(struct mailbox_transaction_context *t)
 	fbox->module_ctx.super.transaction_rollback(t);
 }
 
-static void fts_queue_index(struct mailbox *box)
+static void fts_queue_index(struct mailbox *box, unsigned int cost)
 {
 	struct mail_user *user = box->storage->user;
 	string_t *str = t_str_new(256);
@@ -614,7 +683,8 @@ static void fts_queue_index(struct mailbox *box)
 	str_printfa(str, "\t%u", max_recent_msgs);
 	str_append_c(str, '\t');
 	str_append_tabescaped(str, box->storage->user->session_id);
-	str_append_c(str, '\n');
+	/* the number of saved mails is the estimated cost */
+	str_printfa(str, "\t%u\n", cost);
 	if (write_full(fd, str_data(str), str_len(str)) < 0)
 		i_error("write(%s) failed: %m", path);
 	i_close_fd(&fd);
@@ -627,12 +697,15 @@ fts_transaction_commit(struct mailbox_transaction_context *t,
 	struct fts_transaction_context *ft = FTS_CONTEXT(t);
 	struct fts_mailbox *fbox = FTS_CONTEXT(t->box);
 	struct mailbox *box = t->box;
+	struct fts_save_index *save_index;
 	bool autoindex;
 	int ret = 0;
 
 	autoindex = ft->mails_saved &&
 		mail_user_plugin_getenv(box->storage->user,
 					"fts_autoindex") != NULL;
+	save_index = ft->save_index;
+	ft->save_index = NULL;
 
 	if (fts_transaction_end(t) < 0) {
 		mail_storage_set_error(t->box->storage, MAIL_ERROR_TEMP,
@@ -641,11 +714,28 @@ fts_transaction_commit(struct mailbox_transaction_context *t,
 	}
 	if (fbox->module_ctx.super.transaction_commit(t, changes_r) < 0)
 		ret = -1;
-	if (ret < 0)
+	if (ret < 0) {
+		if (save_index != NULL)
+			fts_save_index_deinit(&save_index);
 		return -1;
+	}
+
+	if (save_index != NULL) {
+		ret = fts_save_index_commit(save_index, &changes_r->saved_uids);
+		if (ret > 0) {
+			/* the indexer sends the spooled mails to the backend */
+			autoindex = TRUE;
+		} else if (ret < 0) {
+			/* the mails are saved anyway. let the indexer
+			   handle them. */
+			i_error("fts: Failed to spool mailbox %s mails' "
+				"index data while saving them", box->vname);
+		}
+		fts_save_index_deinit(&save_index);
+	}
 
 	if (autoindex)
-		fts_queue_index(box);
+		fts_queue_index(box, seq_range_count(&changes_r->saved_uids));
 	return 0;
 }
 
@@ -705,24 +795,105 @@ static int fts_sync_deinit(struct mailbox_sync_context *ctx,
 	return ret;
 }
 
+static void fts_transaction_save_index_init(struct mail_save_context *ctx)
+{
+	struct mailbox_transaction_context *t = ctx->transaction;
+	struct fts_transaction_context *ft = FTS_CONTEXT(t);
+	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(t->box->list);
+	size_t max_size;
+
+	/* done only when the transaction saves mails, so read-only
+	   transactions don't pay for it */
+	if (ft->save_index_checked)
+		return;
+	ft->save_index_checked = TRUE;
+
+	if (fts_want_index_on_save(t->box, &max_size)) {
+		/* the saved mails' UIDs are needed for indexing them. the
+		   backends check this flag only when saving or committing. */
+		t->flags |= MAILBOX_TRANSACTION_FLAG_ASSIGN_UIDS;
+		ft->save_index = fts_save_index_init(flist->backend, t->box,
+						     max_size);
+	}
+}
+
+static int fts_save_begin(struct mail_save_context *ctx, struct istream *input)
+{
+	struct fts_transaction_context *ft = FTS_CONTEXT(ctx->transaction);
+	struct fts_mailbox *fbox = FTS_CONTEXT(ctx->transaction->box);
+	struct istream *save_input;
+	int ret;
+
+	fts_transaction_save_index_init(ctx);
+	if (ft->save_index == NULL)
+		return fbox->module_ctx.super.save_begin(ctx, input);
+
+	save_input = fts_save_index_mail_begin(ft->save_index, input);
+	ret = fbox->module_ctx.super.save_begin(ctx, save_input);
+	i_stream_unref(&save_input);
+	return ret;
+}
+
+static int fts_save_continue(struct mail_save_context *ctx)
+{
+	struct fts_transaction_context *ft = FTS_CONTEXT(ctx->transaction);
+	struct fts_mailbox *fbox = FTS_CONTEXT(ctx->transaction->box);
+
+	if (ft->save_index == NULL)
+		return fbox->module_ctx.super.save_continue(ctx);
+
+	/* the storage and the FTS build read the same input through a tee,
+	   so the storage can't get ahead of the build by more than the tee
+	   buffer. keep going as long as either of them makes progress. */
+	do {
+		if (fbox->module_ctx.super.save_continue(ctx) < 0)
+			return -1;
+	} while (fts_save_index_mail_continue(ft->save_index));
+	return 0;
+}
+
 static int fts_save_finish(struct mail_save_context *ctx)
 {
 	struct fts_transaction_context *ft = FTS_CONTEXT(ctx->transaction);
 	struct fts_mailbox *fbox = FTS_CONTEXT(ctx->transaction->box);
 
-	if (fbox->module_ctx.super.save_finish(ctx) < 0)
+	if (fbox->module_ctx.super.save_finish(ctx) < 0) {
+		if (ft->save_index != NULL)
+			fts_save_index_mail_finish(ft->save_index, FALSE);
 		return -1;
+	}
+	if (ft->save_index != NULL)
+		fts_save_index_mail_finish(ft->save_index, TRUE);
 	ft->mails_saved = TRUE;
 	return 0;
 }
 
+static void fts_save_cancel(struct mail_save_context *ctx)
+{
+	struct fts_transaction_context *ft = FTS_CONTEXT(ctx->transaction);
+	struct fts_mailbox *fbox = FTS_CONTEXT(ctx->transaction->box);
+
+	if (ft->save_index != NULL)
+		fts_save_index_mail_finish(ft->save_index, FALSE);
+	fbox->module_ctx.super.save_cancel(ctx);
+}
+
 static int fts_copy(struct mail_save_context *ctx, struct mail *mail)
 {
 	struct fts_transaction_context *ft = FTS_CONTEXT(ctx->transaction);
 	struct fts_mailbox *fbox = FTS_CONTEXT(ctx->transaction->box);
+	unsigned int mail_count = 0;
 
+	fts_transaction_save_index_init(ctx);
+	if (ft->save_index != NULL)
+		mail_count = fts_save_index_get_mail_count(ft->save_index);
 	if (fbox->module_ctx.super.copy(ctx, mail) < 0)
 		return -1;
+	if (ft->save_index != NULL &&
+	    fts_save_index_get_mail_count(ft->save_index) == mail_count) {
+		/* e.g. hardlinked - the mail wasn't seen by us */
+		fts_save_index_mail_skipped(ft->save_index);
+	}
 	ft->mails_saved = TRUE;
 	return 0;
 }
@@ -750,7 +921,10 @@ void fts_mailbox_allocated(struct mailbox *box)
 	v->transaction_commit = fts_transaction_commit;
 	v->sync_notify = fts_mailbox_sync_notify;
 	v->sync_deinit = fts_sync_deinit;
+	v->save_begin = fts_save_begin;
+	v->save_continue = fts_save_continue;
 	v->save_finish = fts_save_finish;
+	v->save_cancel = fts_save_cancel;
 	v->copy = fts_copy;
 
 	MODULE_CONTEXT_SET(box, fts_storage_module, fbox);
@@ -766,6 +940,23 @@ static void fts_mailbox_list_deinit(struct mailbox_list *list)
 
 
 
+static void fts_backend_init_search_cache(struct fts_backend *backend)
+{
+	const char *value, *error;
+	uoff_t max_size;
+
+	value = mail_user_plugin_getenv(backend->ns->user,
+					"fts_search_cache_size");
+	if (value == NULL)
+		max_size = FTS_SEARCH_CACHE_DEFAULT_MAX_SIZE;
+	else if (settings_get_size(value, &max_size, &error) < 0) {
+		i_error("Invalid fts_search_cache_size setting: %s", error);
+		return;
+	}
+	if (max_size > 0)
+		backend->search_cache = fts_search_cache_init(max_size);
+}
+
 static void
 fts_mailbox_list_init(struct mailbox_list *list, const char *name)
 {
@@ -789,6 +980,7 @@ fts_mailbox_list_init(struct mailbox_list *list, const char *name)
 
 		if ((backend->flags & FTS_BACKEND_FLAG_FUZZY_SEARCH) != 0)
 			list->ns->user->fuzzy_search = TRUE;
+		fts_backend_init_search_cache(backend);
 
 		flist = p_new(list->pool, struct fts_mailbox_list, 1);
 		flist->module_ctx.super = *v;
@@ -29,6 +29,7 @@ struct fts_search_context {
 	buffer_t *orig_matches;
 
 	uint32_t first_unindexed_seq;
+	uint32_t last_indexed_uid;
 
 	/* final scores, combined from all levels */
 	struct fts_scores *scores;
@@ -1,6 +1,7 @@
 /* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "hash.h"
 #include "module-context.h"
 #include "mail-user.h"
 #include "fts-language.h"
@@ -11,6 +12,10 @@
 #define FTS_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_user_module)
 
+#define FTS_USER_FILTER_CACHE_DEFAULT_SIZE 10000
+/* when the sender language cache becomes this large, it's cleared */
+#define FTS_USER_SENDER_LANG_CACHE_MAX_COUNT 1000
+
 struct fts_user {
 	union mail_user_module_context module_ctx;
 	int refcount;
@@ -18,6 +23,13 @@ struct fts_user {
 	struct fts_language_list *lang_list;
 	struct fts_user_language *data_lang;
 	ARRAY_TYPE(fts_user_language) languages;
+
+	/* sender address => language detected from the sender's mails */
+	pool_t sender_lang_pool;
+	HASH_TABLE(char *, const struct fts_language *) sender_langs;
+	unsigned int sender_lang_hits, sender_lang_misses;
+
+	unsigned int filter_cache_size;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(fts_user_module,
@@ -259,6 +271,8 @@ static int fts_user_language_create(struct mail_user *user,
 		return -1;
 	if (fts_user_create_filters(user, lang, &user_lang->filter, error_r) < 0)
 		return -1;
+	if (user_lang->filter != NULL)
+		fts_filter_set_cache_size(user_lang->filter, fuser->filter_cache_size);
 	return 0;
 }
 
@@ -318,6 +332,54 @@ struct fts_user_language *fts_user_get_data_lang(struct mail_user *user)
 	return fuser->data_lang;
 }
 
+const struct fts_language *
+fts_user_sender_language_lookup(struct mail_user *user, const char *sender)
+{
+	struct fts_user *fuser = FTS_USER_CONTEXT(user);
+	const struct fts_language *lang;
+
+	lang = hash_table_lookup(fuser->sender_langs, sender);
+	if (lang != NULL)
+		fuser->sender_lang_hits++;
+	else
+		fuser->sender_lang_misses++;
+	return lang;
+}
+
+void fts_user_sender_language_add(struct mail_user *user, const char *sender,
+				  const struct fts_language *lang)
+{
+	struct fts_user *fuser = FTS_USER_CONTEXT(user);
+	char *key;
+
+	if (hash_table_count(fuser->sender_langs) >=
+	    FTS_USER_SENDER_LANG_CACHE_MAX_COUNT) {
+		hash_table_clear(fuser->sender_langs, TRUE);
+		p_clear(fuser->sender_lang_pool);
+	}
+	key = p_strdup(fuser->sender_lang_pool, sender);
+	hash_table_update(fuser->sender_langs, key, lang);
+}
+
+static void fts_user_log_cache_stats(struct fts_user *fuser)
+{
+	struct fts_user_language *const *user_langp;
+	struct fts_filter_cache_stats stats;
+	unsigned int hits = 0, misses = 0;
+
+	array_foreach(&fuser->languages, user_langp) {
+		if ((*user_langp)->filter == NULL)
+			continue;
+		fts_filter_get_cache_stats((*user_langp)->filter, &stats);
+		hits += stats.hits;
+		misses += stats.misses;
+	}
+	i_debug("fts: Filter cache: %u hits, %u misses - "
+		"Sender language cache: %u hits, %u misses",
+		hits, misses, fuser->sender_lang_hits,
+		fuser->sender_lang_misses);
+}
+
 static void fts_user_language_free(struct fts_user_language *user_lang)
 {
 	if (user_lang->filter != NULL)
@@ -339,11 +401,14 @@ static void fts_user_free(struct fts_user *fuser)
 		fts_user_language_free(*user_langp);
 	if (fuser->data_lang != NULL)
 		fts_user_language_free(fuser->data_lang);
+	hash_table_destroy(&fuser->sender_langs);
+	pool_unref(&fuser->sender_lang_pool);
 }
 
 int fts_mail_user_init(struct mail_user *user, const char **error_r)
 {
 	struct fts_user *fuser = FTS_USER_CONTEXT(user);
+	const char *value;
 
 	if (fuser != NULL) {
 		/* multiple fts plugins are loaded */
@@ -354,6 +419,20 @@ int fts_mail_user_init(struct mail_user *user, const char **error_r)
 	fuser = p_new(user->pool, struct fts_user, 1);
 	fuser->refcount = 1;
 	p_array_init(&fuser->languages, user->pool, 4);
+	fuser->sender_lang_pool =
+		pool_alloconly_create("fts sender languages", 1024);
+	hash_table_create(&fuser->sender_langs, default_pool, 0,
+			  strcase_hash, strcasecmp);
+
+	value = mail_user_plugin_getenv(user, "fts_filter_cache_size");
+	if (value == NULL)
+		fuser->filter_cache_size = FTS_USER_FILTER_CACHE_DEFAULT_SIZE;
+	else if (str_to_uint(value, &fuser->filter_cache_size) < 0) {
+		*error_r = t_strdup_printf(
+			"Invalid fts_filter_cache_size: %s", value);
+		fts_user_free(fuser);
+		return -1;
+	}
 
 	if (fts_user_init_languages(user, fuser, error_r) < 0 ||
 	    fts_user_init_data_language(user, fuser, error_r)) {
@@ -375,7 +454,10 @@ void fts_mail_user_deinit(struct mail_user *user)
 
 	if (fuser != NULL) {
 		i_assert(fuser->refcount > 0);
-		if (--fuser->refcount == 0)
+		if (--fuser->refcount == 0) {
+			if (user->mail_debug)
+				fts_user_log_cache_stats(fuser);
 			fts_user_free(fuser);
+		}
 	}
 }
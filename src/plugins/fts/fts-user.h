@@ -16,6 +16,15 @@ const ARRAY_TYPE(fts_user_language) *
 fts_user_get_all_languages(struct mail_user *user);
 struct fts_user_language *fts_user_get_data_lang(struct mail_user *user);
 
+/* Returns the language that was earlier detected for a mail from the
+   sender, or NULL if it's not known. People usually keep writing in the
+   same language, so this avoids running the language detection for
+   each mail. */
+const struct fts_language *
+fts_user_sender_language_lookup(struct mail_user *user, const char *sender);
+void fts_user_sender_language_add(struct mail_user *user, const char *sender,
+				  const struct fts_language *lang);
+
 int fts_mail_user_init(struct mail_user *user, const char **error_r);
 void fts_mail_user_deinit(struct mail_user *user);
 
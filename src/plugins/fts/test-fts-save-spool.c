@@ -0,0 +1,192 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "unlink-directory.h"
+#include "fts-save-spool.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_SPOOL_DIR ".test-fts-save-spool"
+
+static void test_add_mail(buffer_t *dest, uint32_t uid, const char *text)
+{
+	struct fts_save_spool_mail mail;
+	struct fts_save_spool_op op;
+	buffer_t *ops = buffer_create_dynamic(pool_datastack_create(), 64);
+
+	memset(&op, 0, sizeof(op));
+	op.type = FTS_SAVE_SPOOL_OP_SET_KEY;
+	op.key_type = FTS_BACKEND_BUILD_KEY_HDR;
+	op.hdr_name = "Subject";
+	fts_save_spool_add_op(ops, &op);
+
+	memset(&op, 0, sizeof(op));
+	op.type = FTS_SAVE_SPOOL_OP_DATA;
+	op.data = (const void *)text;
+	op.size = strlen(text);
+	fts_save_spool_add_op(ops, &op);
+
+	memset(&op, 0, sizeof(op));
+	op.type = FTS_SAVE_SPOOL_OP_UNSET_KEY;
+	fts_save_spool_add_op(ops, &op);
+
+	memset(&mail, 0, sizeof(mail));
+	mail.uid = uid;
+	mail.parts = (const void *)"parts";
+	mail.parts_size = 5;
+	mail.ops = ops->data;
+	mail.ops_size = ops->used;
+	fts_save_spool_add_mail(dest, &mail);
+}
+
+static bool test_mail_has_text(const struct fts_save_spool_mail *mail,
+			       const char *text)
+{
+	const unsigned char *p = mail->ops, *end = p + mail->ops_size;
+	struct fts_save_spool_op op;
+
+	if (fts_save_spool_read_op(&p, end, &op) <= 0 ||
+	    op.type != FTS_SAVE_SPOOL_OP_SET_KEY ||
+	    op.key_type != FTS_BACKEND_BUILD_KEY_HDR ||
+	    null_strcmp(op.hdr_name, "Subject") != 0 ||
+	    op.body_content_type != NULL)
+		return FALSE;
+	if (fts_save_spool_read_op(&p, end, &op) <= 0 ||
+	    op.type != FTS_SAVE_SPOOL_OP_DATA ||
+	    op.size != strlen(text) || memcmp(op.data, text, op.size) != 0)
+		return FALSE;
+	if (fts_save_spool_read_op(&p, end, &op) <= 0 ||
+	    op.type != FTS_SAVE_SPOOL_OP_UNSET_KEY)
+		return FALSE;
+	return fts_save_spool_read_op(&p, end, &op) == 0;
+}
+
+static void test_fts_save_spool_encoding(void)
+{
+	struct fts_save_spool_mail mail;
+	struct fts_save_spool_op op;
+	const unsigned char *p, *end;
+	buffer_t *buf;
+	size_t i, first_size;
+	int ret;
+
+	test_begin("fts save spool encoding");
+	buf = buffer_create_dynamic(pool_datastack_create(), 256);
+	test_add_mail(buf, 5, "hello");
+	test_add_mail(buf, 123456, "");
+
+	p = buf->data; end = p + buf->used;
+	test_assert(fts_save_spool_read_mail(&p, end, &mail) == 1);
+	test_assert(mail.uid == 5 && mail.parts_size == 5 &&
+		    memcmp(mail.parts, "parts", 5) == 0);
+	test_assert(test_mail_has_text(&mail, "hello"));
+	test_assert(fts_save_spool_read_mail(&p, end, &mail) == 1);
+	test_assert(mail.uid == 123456);
+	test_assert(test_mail_has_text(&mail, ""));
+	test_assert(fts_save_spool_read_mail(&p, end, &mail) == 0);
+
+	/* truncated data is never accepted */
+	p = buf->data;
+	(void)fts_save_spool_read_mail(&p, end, &mail);
+	first_size = p - (const unsigned char *)buf->data;
+	for (i = 1; i < buf->used; i++) {
+		if (i == first_size)
+			continue;
+		p = buf->data; end = p + i;
+		ret = fts_save_spool_read_mail(&p, end, &mail);
+		if (ret > 0)
+			ret = fts_save_spool_read_mail(&p, end, &mail);
+		test_assert_idx(ret < 0, i);
+	}
+
+	/* unknown op */
+	p = (const void *)"\x09"; end = p + 1;
+	test_assert(fts_save_spool_read_op(&p, end, &op) < 0);
+	test_end();
+}
+
+static unsigned int test_spool_file_count(void)
+{
+	struct stat st;
+	unsigned int count = 0;
+
+	if (stat(TEST_SPOOL_DIR"/"FTS_SAVE_SPOOL_FNAME_PREFIX"1-2", &st) == 0)
+		count++;
+	if (stat(TEST_SPOOL_DIR"/"FTS_SAVE_SPOOL_FNAME_PREFIX"5-6", &st) == 0)
+		count++;
+	return count;
+}
+
+static void test_fts_save_spool_files(void)
+{
+	struct fts_save_spool *spool;
+	struct fts_save_spool_mail mail;
+	buffer_t *buf;
+
+	test_begin("fts save spool files");
+	(void)unlink_directory(TEST_SPOOL_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_SPOOL_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_SPOOL_DIR);
+
+	buf = buffer_create_dynamic(pool_datastack_create(), 256);
+	test_add_mail(buf, 1, "one");
+	test_add_mail(buf, 2, "two");
+	test_assert(fts_save_spool_write(TEST_SPOOL_DIR, 0600, (gid_t)-1,
+					 1, 2, buf) == 0);
+	buffer_set_used_size(buf, 0);
+	test_add_mail(buf, 5, "five");
+	test_add_mail(buf, 6, "six");
+	test_assert(fts_save_spool_write(TEST_SPOOL_DIR, 0600, (gid_t)-1,
+					 5, 6, buf) == 0);
+	test_assert(test_spool_file_count() == 2);
+
+	/* UID 1 was already indexed elsewhere. the file stays until all of
+	   its mails have been looked up. */
+	spool = fts_save_spool_open(TEST_SPOOL_DIR);
+	test_assert(fts_save_spool_find(spool, 2, &mail) == 1);
+	test_assert(mail.uid == 2 && test_mail_has_text(&mail, "two"));
+	test_assert(test_spool_file_count() == 2);
+	test_assert(fts_save_spool_find(spool, 3, &mail) == 0);
+	test_assert(test_spool_file_count() == 1);
+	test_assert(fts_save_spool_find(spool, 5, &mail) == 1);
+	test_assert(mail.uid == 5 && test_mail_has_text(&mail, "five"));
+	fts_save_spool_close(&spool);
+	/* UID 6 is still unused */
+	test_assert(test_spool_file_count() == 1);
+
+	spool = fts_save_spool_open(TEST_SPOOL_DIR);
+	test_assert(fts_save_spool_find(spool, 6, &mail) == 1);
+	test_assert(mail.uid == 6 && test_mail_has_text(&mail, "six"));
+	fts_save_spool_close(&spool);
+	test_assert(test_spool_file_count() == 0);
+
+	/* corrupted files are deleted */
+	buffer_set_used_size(buf, 0);
+	test_add_mail(buf, 1, "one");
+	buffer_set_used_size(buf, buf->used - 1);
+	test_assert(fts_save_spool_write(TEST_SPOOL_DIR, 0600, (gid_t)-1,
+					 1, 2, buf) == 0);
+	spool = fts_save_spool_open(TEST_SPOOL_DIR);
+	test_expect_errors(1);
+	test_assert(fts_save_spool_find(spool, 1, &mail) == -1);
+	test_expect_no_more_errors();
+	test_assert(test_spool_file_count() == 0);
+	test_assert(fts_save_spool_find(spool, 2, &mail) == 0);
+	fts_save_spool_close(&spool);
+
+	(void)unlink_directory(TEST_SPOOL_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_save_spool_encoding,
+		test_fts_save_spool_files,
+		NULL
+	};
+	return test_run(test_functions);
+}
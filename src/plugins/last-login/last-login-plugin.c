@@ -56,24 +56,15 @@ static void last_login_dict_commit(int ret ATTR_UNUSED, void *context)
 	luser->to = timeout_add(0, last_login_dict_deinit, user);
 }
 
-static void last_login_mail_user_created(struct mail_user *user)
+static struct dict *last_login_dict_init(struct mail_user *user)
 {
-	struct mail_user_vfuncs *v = user->vlast;
-	struct last_login_user *luser;
 	struct dict *dict;
 	struct dict_settings set;
-	struct dict_transaction_context *trans;
-	const char *dict_value, *key_name, *error;
-
-	if (user->autocreated) {
-		/* we want to handle only logged in users,
-		   not lda's raw user or accessed shared users */
-		return;
-	}
+	const char *dict_value, *error;
 
 	dict_value = mail_user_plugin_getenv(user, "last_login_dict");
 	if (dict_value == NULL)
-		return;
+		return NULL;
 
 	memset(&set, 0, sizeof(set));
 	set.username = user->username;
@@ -83,16 +74,16 @@ static void last_login_mail_user_created(struct mail_user *user)
 	if (dict_init_full(dict_value, &set, &dict, &error) < 0) {
 		i_error("last_login_dict: dict_init(%s) failed: %s",
 			dict_value, error);
-		return;
+		return NULL;
 	}
+	return dict;
+}
 
-	luser = p_new(user->pool, struct last_login_user, 1);
-	luser->module_ctx.super = *v;
-	user->vlast = &luser->module_ctx.super;
-	v->deinit = last_login_user_deinit;
-
-	luser->dict = dict;
-	MODULE_CONTEXT_SET(user, last_login_user_module, luser);
+static void last_login_dict_update(struct mail_user *user)
+{
+	struct last_login_user *luser = LAST_LOGIN_USER_CONTEXT(user);
+	struct dict_transaction_context *trans;
+	const char *key_name;
 
 	key_name = mail_user_plugin_getenv(user, "last_login_key");
 	if (key_name == NULL) {
@@ -101,13 +92,55 @@ static void last_login_mail_user_created(struct mail_user *user)
 	}
 	key_name = t_strconcat(DICT_PATH_SHARED, key_name, NULL);
 
-	trans = dict_transaction_begin(dict);
+	trans = dict_transaction_begin(luser->dict);
 	dict_set(trans, key_name, dec2str(ioloop_time));
 	dict_transaction_commit_async(&trans, last_login_dict_commit, user);
 }
 
+static void last_login_mail_user_created(struct mail_user *user)
+{
+	struct mail_user_vfuncs *v = user->vlast;
+	struct last_login_user *luser;
+	struct dict *dict;
+
+	if (user->autocreated) {
+		/* we want to handle only logged in users,
+		   not lda's raw user or accessed shared users */
+		return;
+	}
+
+	dict = last_login_dict_init(user);
+	if (dict == NULL)
+		return;
+
+	luser = p_new(user->pool, struct last_login_user, 1);
+	luser->module_ctx.super = *v;
+	user->vlast = &luser->module_ctx.super;
+	v->deinit = last_login_user_deinit;
+
+	luser->dict = dict;
+	MODULE_CONTEXT_SET(user, last_login_user_module, luser);
+	last_login_dict_update(user);
+}
+
+static void last_login_mail_user_reused(struct mail_user *user)
+{
+	struct last_login_user *luser = LAST_LOGIN_USER_CONTEXT(user);
+
+	if (luser == NULL)
+		return;
+
+	/* the dict was already deinitialized after the previous login's
+	   update was committed (unless it's still unfinished) */
+	last_login_dict_deinit(user);
+	luser->dict = last_login_dict_init(user);
+	if (luser->dict != NULL)
+		last_login_dict_update(user);
+}
+
 static struct mail_storage_hooks last_login_mail_storage_hooks = {
-	.mail_user_created = last_login_mail_user_created
+	.mail_user_created = last_login_mail_user_created,
+	.mail_user_reused = last_login_mail_user_reused
 };
 
 void last_login_plugin_init(struct module *module)
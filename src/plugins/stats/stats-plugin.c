@@ -342,6 +342,20 @@ static void stats_user_deinit(struct mail_user *user)
 	stats_connection_unref(&stats_conn);
 }
 
+static void
+stats_user_set_session_id(struct mail_user *user, struct stats_user *suser)
+{
+	if (user->session_id != NULL && user->session_id[0] != '\0')
+		suser->stats_session_id = user->session_id;
+	else {
+		guid_128_t guid;
+
+		guid_128_generate(guid);
+		suser->stats_session_id =
+			p_strdup(user->pool, guid_128_to_string(guid));
+	}
+}
+
 static void stats_user_created(struct mail_user *user)
 {
 	struct ioloop_context *ioloop_ctx =
@@ -412,15 +426,7 @@ static void stats_user_created(struct mail_user *user)
 		suser->track_commands = TRUE;
 
 	suser->stats_conn = global_stats_conn;
-	if (user->session_id != NULL && user->session_id[0] != '\0')
-		suser->stats_session_id = user->session_id;
-	else {
-		guid_128_t guid;
-
-		guid_128_generate(guid);
-		suser->stats_session_id =
-			p_strdup(user->pool, guid_128_to_string(guid));
-	}
+	stats_user_set_session_id(user, suser);
 	suser->last_session_update = time(NULL);
 	user->stats_enabled = TRUE;
 
@@ -445,9 +451,32 @@ static void stats_user_created(struct mail_user *user)
 	mail_user_stats_fill(user, suser->pre_io_stats);
 }
 
+static void stats_user_reused(struct mail_user *user)
+{
+	struct stats_user *suser = STATS_USER_CONTEXT(user);
+
+	if (suser == NULL)
+		return;
+
+	/* finish the previous session */
+	if (stats_global_user == user)
+		stats_add_session(user);
+	session_stats_refresh(user);
+	stats_connection_disconnect(suser->stats_conn, user);
+
+	/* and start a new one with the new session ID */
+	stats_user_set_session_id(user, suser);
+	memset(suser->session_stats, 0, stats_alloc_size());
+	memset(suser->last_sent_session_stats, 0, stats_alloc_size());
+	suser->session_sent_duplicate = FALSE;
+	suser->last_session_update = time(NULL);
+	stats_connection_connect(suser->stats_conn, user);
+}
+
 static struct mail_storage_hooks stats_mail_storage_hooks = {
 	.mailbox_allocated = stats_mailbox_allocated,
-	.mail_user_created = stats_user_created
+	.mail_user_created = stats_user_created,
+	.mail_user_reused = stats_user_reused
 };
 
 void stats_plugin_init(struct module *module)
@@ -8,6 +8,7 @@
 #include "abspath.h"
 #include "base64.h"
 #include "str.h"
+#include "time-util.h"
 #include "process-title.h"
 #include "restrict-access.h"
 #include "master-service.h"
@@ -90,9 +91,23 @@ static void client_add_input(struct client *client, const buffer_t *buf)
 	o_stream_unref(&output);
 }
 
+static void
+login_client_log_latency(const struct master_login_client *login_client)
+{
+	io_loop_time_refresh();
+	i_debug("Login handoff took %d msecs "
+		"(auth lookup %d msecs, user initialization %d msecs)",
+		timeval_diff_msecs(&ioloop_timeval, &login_client->create_time),
+		timeval_diff_msecs(&login_client->auth_finished_time,
+				   &login_client->create_time),
+		timeval_diff_msecs(&ioloop_timeval,
+				   &login_client->auth_finished_time));
+}
+
 static int
 client_create_from_input(const struct mail_storage_service_input *input,
 			 int fd_in, int fd_out, const buffer_t *input_buf,
+			 const struct master_login_client *login_client,
 			 const char **error_r)
 {
 	const char *lookup_error_str =
@@ -119,6 +134,8 @@ client_create_from_input(const struct mail_storage_service_input *input,
 	if (client_create(fd_in, fd_out, input->session_id,
 			  mail_user, user, set, &client) < 0)
 		return 0;
+	if (login_client != NULL && mail_user->mail_debug)
+		login_client_log_latency(login_client);
 	if (!IS_STANDALONE())
 		client_send_line(client, "+OK Logged in.");
 	if (client_init_mailbox(client, &error) == 0)
@@ -153,7 +170,7 @@ static void main_stdio_run(const char *username)
 		t_base64_decode_str(input_base64);
 
 	if (client_create_from_input(&input, STDIN_FILENO, STDOUT_FILENO,
-				     input_buf, &error) < 0)
+				     input_buf, NULL, &error) < 0)
 		i_fatal("%s", error);
 }
 
@@ -176,7 +193,7 @@ login_client_connected(const struct master_login_client *client,
 	buffer_create_from_const_data(&input_buf, client->data,
 				      client->auth_req.data_size);
 	if (client_create_from_input(&input, client->fd, client->fd,
-				     &input_buf, &error) < 0) {
+				     &input_buf, client, &error) < 0) {
 		int fd = client->fd;
 
 		i_error("%s", error);
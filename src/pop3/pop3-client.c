@@ -604,7 +604,6 @@ static void client_default_destroy(struct client *client, const char *reason)
 			mail_user_get_anvil_userip_ident(client->user),
 			"\n", NULL));
 	}
-	mail_user_unref(&client->user);
 
 	if (client->session_dotlock != NULL)
 		file_dotlock_delete(&client->session_dotlock);
@@ -630,7 +629,8 @@ static void client_default_destroy(struct client *client, const char *reason)
 	net_disconnect(client->fd_in);
 	if (client->fd_in != client->fd_out)
 		net_disconnect(client->fd_out);
-	mail_storage_service_user_free(&client->service_user);
+	mail_storage_service_user_release(&client->service_user,
+					  &client->user);
 
 	pop3_client_count--;
 	DLLIST_REMOVE(&pop3_clients, client);
@@ -0,0 +1,9 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+#include "lib.h"
+
+extern struct session_cache *session_cache;
+extern struct ticket_keys *ticket_keys;
+
+#endif
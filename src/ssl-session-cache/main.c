@@ -0,0 +1,82 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "common.h"
+#include "ioloop.h"
+#include "randgen.h"
+#include "str.h"
+#include "process-title.h"
+#include "restrict-access.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "ssl-session-cache-settings.h"
+#include "session-cache.h"
+#include "ticket-keys.h"
+#include "session-cache-connection.h"
+
+struct session_cache *session_cache;
+struct ticket_keys *ticket_keys;
+static struct timeout *to_proctitle_refresh;
+
+static void session_cache_refresh_proctitle(void *context ATTR_UNUSED)
+{
+	static unsigned int prev_hits = 0, prev_misses = 0;
+	struct session_cache_stats stats;
+	string_t *str;
+
+	session_cache_get_stats(session_cache, &stats);
+
+	str = t_str_new(64);
+	str_printfa(str, "[%u sessions, %"PRIuSIZE_T" kB", stats.count,
+		    stats.size / 1024);
+	str_printfa(str, ", %u hits/s, %u misses/s]",
+		    stats.hits - prev_hits, stats.misses - prev_misses);
+	prev_hits = stats.hits;
+	prev_misses = stats.misses;
+
+	process_title_set(str_c(str));
+}
+
+static void client_connected(struct master_service_connection *conn)
+{
+	master_service_client_connection_accept(conn);
+	(void)session_cache_connection_create(conn->fd);
+}
+
+int main(int argc, char *argv[])
+{
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_UPDATE_PROCTITLE;
+	const struct ssl_session_cache_settings *set;
+
+	master_service = master_service_init("ssl-session-cache",
+					     service_flags, &argc, &argv, "");
+	if (master_getopt(master_service) > 0)
+		return FATAL_DEFAULT;
+	set = ssl_session_cache_settings_read(master_service);
+	master_service_init_log(master_service, "ssl-session-cache: ");
+
+	/* open /dev/urandom before chrooting */
+	random_init();
+	restrict_access_by_env(NULL, FALSE);
+	restrict_access_allow_coredumps(TRUE);
+
+	session_cache = session_cache_init(set->ssl_session_cache_size);
+	ticket_keys = ticket_keys_init(set->ssl_session_ticket_key_rotate);
+	if (master_service_settings_get(master_service)->verbose_proctitle) {
+		to_proctitle_refresh =
+			timeout_add(1000, session_cache_refresh_proctitle,
+				    (void *)NULL);
+	}
+	master_service_init_finish(master_service);
+
+	master_service_run(master_service, client_connected);
+
+	if (to_proctitle_refresh != NULL)
+		timeout_remove(&to_proctitle_refresh);
+	session_cache_connections_destroy_all();
+	ticket_keys_deinit(&ticket_keys);
+	session_cache_deinit(&session_cache);
+	random_deinit();
+	master_service_deinit(&master_service);
+        return 0;
+}
@@ -0,0 +1,191 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "common.h"
+#include "llist.h"
+#include "buffer.h"
+#include "hex-binary.h"
+#include "istream.h"
+#include "ostream.h"
+#include "master-service.h"
+#include "session-cache.h"
+#include "ticket-keys.h"
+#include "session-cache-connection.h"
+
+#include <unistd.h>
+
+/* sessions containing client certificates can be a few kB, and they're
+   sent hex-encoded */
+#define MAX_INBUF_SIZE (1024*64)
+
+#define SESSION_CACHE_CLIENT_PROTOCOL_MAJOR_VERSION 1
+#define SESSION_CACHE_CLIENT_PROTOCOL_MINOR_VERSION 0
+
+struct session_cache_connection {
+	struct session_cache_connection *prev, *next;
+
+	int fd;
+	struct istream *input;
+	struct ostream *output;
+	struct io *io;
+
+	unsigned int version_received:1;
+};
+
+static struct session_cache_connection *session_cache_connections = NULL;
+
+static int
+session_cache_connection_add(const char *const *args, const char **error_r)
+{
+	buffer_t *data;
+	time_t expires;
+
+	/* <session id> <expire timestamp> <session data> */
+	if (str_array_length(args) < 3) {
+		*error_r = "ADD: Not enough parameters";
+		return -1;
+	}
+	if (str_to_time(args[1], &expires) < 0) {
+		*error_r = "ADD: Invalid expire timestamp";
+		return -1;
+	}
+	data = buffer_create_dynamic(pool_datastack_create(),
+				     strlen(args[2]) / 2);
+	if (hex_to_binary(args[2], data) < 0) {
+		*error_r = "ADD: Invalid session data";
+		return -1;
+	}
+	session_cache_add(session_cache, args[0], data->data, data->used,
+			  expires);
+	return 0;
+}
+
+static int
+session_cache_connection_request(struct session_cache_connection *conn,
+				 const char *const *args, const char **error_r)
+{
+	struct session_cache_stats stats;
+	const char *cmd = args[0];
+	const unsigned char *data;
+	size_t size;
+
+	args++;
+	if (strcmp(cmd, "ADD") == 0) {
+		return session_cache_connection_add(args, error_r);
+	} else if (strcmp(cmd, "LOOKUP") == 0) {
+		if (args[0] == NULL) {
+			*error_r = "LOOKUP: Not enough parameters";
+			return -1;
+		}
+		if (!session_cache_lookup(session_cache, args[0],
+					  &data, &size))
+			o_stream_nsend_str(conn->output, "\n");
+		else {
+			o_stream_nsend_str(conn->output, t_strconcat(
+				binary_to_hex(data, size), "\n", NULL));
+		}
+	} else if (strcmp(cmd, "REMOVE") == 0) {
+		if (args[0] == NULL) {
+			*error_r = "REMOVE: Not enough parameters";
+			return -1;
+		}
+		session_cache_remove(session_cache, args[0]);
+	} else if (strcmp(cmd, "TICKET-KEYS") == 0) {
+		o_stream_nsend_str(conn->output, t_strconcat(
+			ticket_keys_get(ticket_keys), "\n", NULL));
+	} else if (strcmp(cmd, "STATS") == 0) {
+		session_cache_get_stats(session_cache, &stats);
+		o_stream_nsend_str(conn->output, t_strdup_printf(
+			"%u\t%u\t%u\t%u\t%"PRIuSIZE_T"\n", stats.hits,
+			stats.misses, stats.adds, stats.count, stats.size));
+	} else {
+		*error_r = t_strconcat("Unknown command: ", cmd, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+session_cache_connection_input(struct session_cache_connection *conn)
+{
+	const char *line, *error;
+	int ret = 0;
+
+	switch (i_stream_read(conn->input)) {
+	case -2:
+		i_error("BUG: SSL session cache client connection "
+			"sent too much data");
+		session_cache_connection_destroy(conn);
+		return;
+	case -1:
+		session_cache_connection_destroy(conn);
+		return;
+	}
+
+	if (!conn->version_received) {
+		if ((line = i_stream_next_line(conn->input)) == NULL)
+			return;
+
+		if (!version_string_verify(line, "ssl-session-cache",
+				SESSION_CACHE_CLIENT_PROTOCOL_MAJOR_VERSION)) {
+			i_error("SSL session cache client not compatible "
+				"with this server (mixed old and new binaries?) "
+				"%s", line);
+			session_cache_connection_destroy(conn);
+			return;
+		}
+		conn->version_received = TRUE;
+	}
+
+	while ((line = i_stream_next_line(conn->input)) != NULL) {
+		T_BEGIN {
+			const char *const *args = t_strsplit_tab(line);
+
+			if (args[0] != NULL) {
+				ret = session_cache_connection_request(conn,
+							args, &error);
+				if (ret < 0) {
+					i_error("SSL session cache client "
+						"input error: %s", error);
+				}
+			}
+		} T_END;
+		if (ret < 0) {
+			session_cache_connection_destroy(conn);
+			break;
+		}
+	}
+}
+
+struct session_cache_connection *session_cache_connection_create(int fd)
+{
+	struct session_cache_connection *conn;
+
+	conn = i_new(struct session_cache_connection, 1);
+	conn->fd = fd;
+	conn->input = i_stream_create_fd(fd, MAX_INBUF_SIZE, FALSE);
+	conn->output = o_stream_create_fd(fd, (size_t)-1, FALSE);
+	o_stream_set_no_error_handling(conn->output, TRUE);
+	conn->io = io_add(fd, IO_READ, session_cache_connection_input, conn);
+	DLLIST_PREPEND(&session_cache_connections, conn);
+	return conn;
+}
+
+void session_cache_connection_destroy(struct session_cache_connection *conn)
+{
+	DLLIST_REMOVE(&session_cache_connections, conn);
+
+	io_remove(&conn->io);
+	i_stream_destroy(&conn->input);
+	o_stream_destroy(&conn->output);
+	if (close(conn->fd) < 0)
+		i_error("close(ssl-session-cache conn) failed: %m");
+	i_free(conn);
+
+	master_service_client_connection_destroyed(master_service);
+}
+
+void session_cache_connections_destroy_all(void)
+{
+	while (session_cache_connections != NULL)
+		session_cache_connection_destroy(session_cache_connections);
+}
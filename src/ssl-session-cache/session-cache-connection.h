@@ -0,0 +1,9 @@
+#ifndef SESSION_CACHE_CONNECTION_H
+#define SESSION_CACHE_CONNECTION_H
+
+struct session_cache_connection *session_cache_connection_create(int fd);
+void session_cache_connection_destroy(struct session_cache_connection *conn);
+
+void session_cache_connections_destroy_all(void);
+
+#endif
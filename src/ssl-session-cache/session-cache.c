@@ -0,0 +1,144 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hash.h"
+#include "llist.h"
+#include "session-cache.h"
+
+struct session_cache_entry {
+	/* head is the most recently used entry */
+	struct session_cache_entry *prev, *next;
+
+	char *id;
+	time_t expires;
+	/* Total number of bytes used by this entry */
+	size_t alloc_size;
+	size_t data_size;
+	unsigned char *data;
+};
+
+struct session_cache {
+	/* session ID => entry */
+	HASH_TABLE(char *, struct session_cache_entry *) hash;
+	struct session_cache_entry *head, *tail;
+
+	size_t max_size, size_left;
+	struct session_cache_stats stats;
+};
+
+struct session_cache *session_cache_init(size_t max_size)
+{
+	struct session_cache *cache;
+
+	cache = i_new(struct session_cache, 1);
+	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	cache->max_size = max_size;
+	cache->size_left = max_size;
+	return cache;
+}
+
+static void
+session_cache_entry_destroy(struct session_cache *cache,
+			    struct session_cache_entry *entry)
+{
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	hash_table_remove(cache->hash, entry->id);
+	cache->size_left += entry->alloc_size;
+	cache->stats.count--;
+
+	i_free(entry->id);
+	i_free(entry->data);
+	i_free(entry);
+}
+
+void session_cache_deinit(struct session_cache **_cache)
+{
+	struct session_cache *cache = *_cache;
+
+	*_cache = NULL;
+
+	while (cache->tail != NULL)
+		session_cache_entry_destroy(cache, cache->tail);
+	hash_table_destroy(&cache->hash);
+	i_free(cache);
+}
+
+void session_cache_add(struct session_cache *cache, const char *id,
+		       const void *data, size_t size, time_t expires)
+{
+	struct session_cache_entry *entry;
+	size_t alloc_size;
+
+	alloc_size = sizeof(*entry) + strlen(id) + 1 + size;
+	if (alloc_size > cache->max_size / 16) {
+		/* sessions are normally small, don't let a huge one
+		   flush everything else */
+		return;
+	}
+
+	entry = hash_table_lookup(cache->hash, id);
+	if (entry != NULL)
+		session_cache_entry_destroy(cache, entry);
+	/* drop expired sessions from the LRU tail first, and then as many
+	   of the least recently used ones as needed */
+	while (cache->tail != NULL && cache->tail->expires <= ioloop_time)
+		session_cache_entry_destroy(cache, cache->tail);
+	while (cache->size_left < alloc_size && cache->tail != NULL)
+		session_cache_entry_destroy(cache, cache->tail);
+
+	entry = i_new(struct session_cache_entry, 1);
+	entry->id = i_strdup(id);
+	entry->expires = expires;
+	entry->alloc_size = alloc_size;
+	entry->data_size = size;
+	entry->data = i_malloc(I_MAX(size, 1));
+	memcpy(entry->data, data, size);
+
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	hash_table_insert(cache->hash, entry->id, entry);
+	cache->size_left -= alloc_size;
+	cache->stats.count++;
+	cache->stats.adds++;
+}
+
+bool session_cache_lookup(struct session_cache *cache, const char *id,
+			  const unsigned char **data_r, size_t *size_r)
+{
+	struct session_cache_entry *entry;
+
+	entry = hash_table_lookup(cache->hash, id);
+	if (entry != NULL && entry->expires <= ioloop_time) {
+		session_cache_entry_destroy(cache, entry);
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		cache->stats.misses++;
+		return FALSE;
+	}
+	cache->stats.hits++;
+
+	/* move to the head of the LRU list */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+
+	*data_r = entry->data;
+	*size_r = entry->data_size;
+	return TRUE;
+}
+
+void session_cache_remove(struct session_cache *cache, const char *id)
+{
+	struct session_cache_entry *entry;
+
+	entry = hash_table_lookup(cache->hash, id);
+	if (entry != NULL)
+		session_cache_entry_destroy(cache, entry);
+}
+
+void session_cache_get_stats(struct session_cache *cache,
+			     struct session_cache_stats *stats_r)
+{
+	*stats_r = cache->stats;
+	stats_r->size = cache->max_size - cache->size_left;
+}
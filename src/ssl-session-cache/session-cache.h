@@ -0,0 +1,27 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+struct session_cache_stats {
+	unsigned int hits, misses, adds;
+	unsigned int count;
+	size_t size;
+};
+
+/* max_size specifies the (approximate) maximum amount of memory in bytes
+   used for the cached sessions. */
+struct session_cache *session_cache_init(size_t max_size);
+void session_cache_deinit(struct session_cache **cache);
+
+/* Add a serialized SSL session with the given (hex-encoded) session ID.
+   The session is forgotten after the expire time. */
+void session_cache_add(struct session_cache *cache, const char *id,
+		       const void *data, size_t size, time_t expires);
+/* Returns TRUE and the serialized session if found and not expired. */
+bool session_cache_lookup(struct session_cache *cache, const char *id,
+			  const unsigned char **data_r, size_t *size_r);
+void session_cache_remove(struct session_cache *cache, const char *id);
+
+void session_cache_get_stats(struct session_cache *cache,
+			     struct session_cache_stats *stats_r);
+
+#endif
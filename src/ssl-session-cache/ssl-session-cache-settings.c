@@ -0,0 +1,114 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "settings-parser.h"
+#include "service-settings.h"
+#include "master-service-settings.h"
+#include "ssl-session-cache-settings.h"
+
+#include <stddef.h>
+
+static bool ssl_session_cache_settings_check(void *_set, pool_t pool,
+					     const char **error_r);
+
+/* <settings checks> */
+static struct file_listener_settings ssl_session_cache_unix_listeners_array[] = {
+	{ "login/ssl-session-cache", 0666, "", "" }
+};
+static struct file_listener_settings *ssl_session_cache_unix_listeners[] = {
+	&ssl_session_cache_unix_listeners_array[0]
+};
+static buffer_t ssl_session_cache_unix_listeners_buf = {
+	ssl_session_cache_unix_listeners,
+	sizeof(ssl_session_cache_unix_listeners), { NULL, }
+};
+/* </settings checks> */
+
+struct service_settings ssl_session_cache_service_settings = {
+	.name = "ssl-session-cache",
+	.protocol = "",
+	.type = "",
+	.executable = "ssl-session-cache",
+	.user = "$default_internal_user",
+	.group = "",
+	.privileged_group = "",
+	.extra_groups = "",
+	.chroot = "empty",
+
+	.drop_priv_before_exec = FALSE,
+
+	.process_min_avail = 0,
+	.process_limit = 1,
+	.client_limit = 0,
+	.service_count = 0,
+	.idle_kill = UINT_MAX,
+	.vsz_limit = (uoff_t)-1,
+
+	.unix_listeners = { { &ssl_session_cache_unix_listeners_buf,
+			      sizeof(ssl_session_cache_unix_listeners[0]) } },
+	.fifo_listeners = ARRAY_INIT,
+	.inet_listeners = ARRAY_INIT,
+
+	.process_limit_1 = TRUE
+};
+
+#undef DEF
+#define DEF(type, name) \
+	{ type, #name, offsetof(struct ssl_session_cache_settings, name), NULL }
+
+static const struct setting_define ssl_session_cache_setting_defines[] = {
+	DEF(SET_SIZE, ssl_session_cache_size),
+	DEF(SET_TIME, ssl_session_ticket_key_rotate),
+
+	SETTING_DEFINE_LIST_END
+};
+
+static const struct ssl_session_cache_settings ssl_session_cache_default_settings = {
+	.ssl_session_cache_size = 4*1024*1024,
+	.ssl_session_ticket_key_rotate = 12*60*60
+};
+
+const struct setting_parser_info ssl_session_cache_setting_parser_info = {
+	.module_name = "ssl-session-cache",
+	.defines = ssl_session_cache_setting_defines,
+	.defaults = &ssl_session_cache_default_settings,
+
+	.type_offset = (size_t)-1,
+	.struct_size = sizeof(struct ssl_session_cache_settings),
+
+	.parent_offset = (size_t)-1,
+
+	.check_func = ssl_session_cache_settings_check
+};
+
+/* <settings checks> */
+static bool ssl_session_cache_settings_check(void *_set, pool_t pool ATTR_UNUSED,
+					     const char **error_r)
+{
+	struct ssl_session_cache_settings *set = _set;
+
+	if (set->ssl_session_ticket_key_rotate == 0) {
+		*error_r = "ssl_session_ticket_key_rotate must not be 0";
+		return FALSE;
+	}
+	return TRUE;
+}
+/* </settings checks> */
+
+struct ssl_session_cache_settings *
+ssl_session_cache_settings_read(struct master_service *service)
+{
+	static const struct setting_parser_info *set_roots[] = {
+		&ssl_session_cache_setting_parser_info,
+		NULL
+	};
+	const char *error;
+	void **sets;
+
+	if (master_service_settings_read_simple(service, set_roots, &error) < 0)
+		i_fatal("Error reading configuration: %s", error);
+
+	sets = master_service_settings_get_others(service);
+	return sets[0];
+}
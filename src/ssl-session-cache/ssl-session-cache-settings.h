@@ -0,0 +1,14 @@
+#ifndef SSL_SESSION_CACHE_SETTINGS_H
+#define SSL_SESSION_CACHE_SETTINGS_H
+
+struct master_service;
+
+struct ssl_session_cache_settings {
+	uoff_t ssl_session_cache_size;
+	unsigned int ssl_session_ticket_key_rotate;
+};
+
+struct ssl_session_cache_settings *
+ssl_session_cache_settings_read(struct master_service *service);
+
+#endif
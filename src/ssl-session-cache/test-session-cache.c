@@ -0,0 +1,90 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "session-cache.h"
+#include "test-common.h"
+
+static void test_session_cache_lookup(void)
+{
+	struct session_cache *cache;
+	struct session_cache_stats stats;
+	const unsigned char *data;
+	size_t size;
+
+	test_begin("session cache lookup");
+	ioloop_time = 1000;
+	cache = session_cache_init(64*1024);
+
+	test_assert(!session_cache_lookup(cache, "0102", &data, &size));
+	session_cache_add(cache, "0102", "foo", 3, 1100);
+	test_assert(session_cache_lookup(cache, "0102", &data, &size));
+	test_assert(size == 3 && memcmp(data, "foo", 3) == 0);
+
+	/* replace */
+	session_cache_add(cache, "0102", "barbaz", 6, 1100);
+	test_assert(session_cache_lookup(cache, "0102", &data, &size));
+	test_assert(size == 6 && memcmp(data, "barbaz", 6) == 0);
+
+	session_cache_remove(cache, "0102");
+	test_assert(!session_cache_lookup(cache, "0102", &data, &size));
+
+	/* expire */
+	session_cache_add(cache, "0304", "foo", 3, 1100);
+	ioloop_time = 1100;
+	test_assert(!session_cache_lookup(cache, "0304", &data, &size));
+
+	session_cache_get_stats(cache, &stats);
+	test_assert(stats.hits == 2);
+	test_assert(stats.misses == 3);
+	test_assert(stats.adds == 3);
+	test_assert(stats.count == 0);
+	test_assert(stats.size == 0);
+
+	session_cache_deinit(&cache);
+	test_end();
+}
+
+static void test_session_cache_lru(void)
+{
+	struct session_cache *cache;
+	struct session_cache_stats stats;
+	const unsigned char *data;
+	unsigned char buf[100], large[1024];
+	size_t size;
+	unsigned int i;
+
+	test_begin("session cache lru");
+	ioloop_time = 1000;
+	cache = session_cache_init(16*1024);
+	memset(buf, 'x', sizeof(buf));
+	memset(large, 'y', sizeof(large));
+
+	for (i = 0; i < 1000; i++) {
+		session_cache_add(cache, dec2str(i), buf, sizeof(buf), 2000);
+		/* keep the first one used */
+		test_assert(session_cache_lookup(cache, "0", &data, &size));
+	}
+	session_cache_get_stats(cache, &stats);
+	test_assert(stats.count < 1000);
+	test_assert(stats.size <= 16*1024);
+	test_assert(!session_cache_lookup(cache, "1", &data, &size));
+	test_assert(session_cache_lookup(cache, "999", &data, &size));
+
+	/* too large */
+	session_cache_add(cache, "large", large, sizeof(large), 2000);
+	test_assert(!session_cache_lookup(cache, "large", &data, &size));
+
+	session_cache_deinit(&cache);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_session_cache_lookup,
+		test_session_cache_lru,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hex-binary.h"
+#include "randgen.h"
+#include "safe-memset.h"
+#include "ticket-keys.h"
+
+struct ticket_keys {
+	/* [0] is the current key, [1] the previous one */
+	unsigned char keys[2][TICKET_KEY_SIZE];
+	time_t rotated;
+	unsigned int rotate_interval;
+};
+
+static void ticket_keys_rotate(struct ticket_keys *keys)
+{
+	memcpy(keys->keys[1], keys->keys[0], TICKET_KEY_SIZE);
+	random_fill(keys->keys[0], TICKET_KEY_SIZE);
+	keys->rotated = ioloop_time;
+}
+
+struct ticket_keys *ticket_keys_init(unsigned int rotate_interval)
+{
+	struct ticket_keys *keys;
+
+	keys = i_new(struct ticket_keys, 1);
+	keys->rotate_interval = rotate_interval;
+	/* there's no previous key at startup, so just make it random as
+	   well */
+	random_fill(keys->keys[0], TICKET_KEY_SIZE);
+	ticket_keys_rotate(keys);
+	return keys;
+}
+
+void ticket_keys_deinit(struct ticket_keys **_keys)
+{
+	struct ticket_keys *keys = *_keys;
+
+	*_keys = NULL;
+	safe_memset(keys->keys, 0, sizeof(keys->keys));
+	i_free(keys);
+}
+
+const char *ticket_keys_get(struct ticket_keys *keys)
+{
+	if (keys->rotated + (time_t)keys->rotate_interval <= ioloop_time)
+		ticket_keys_rotate(keys);
+	return t_strconcat(binary_to_hex(keys->keys[0], TICKET_KEY_SIZE), "\t",
+			   binary_to_hex(keys->keys[1], TICKET_KEY_SIZE), NULL);
+}
@@ -0,0 +1,18 @@
+#ifndef TICKET_KEYS_H
+#define TICKET_KEYS_H
+
+/* key name (16) + HMAC secret (16) + AES key (16), as used by OpenSSL's
+   session ticket key callback */
+#define TICKET_KEY_SIZE 48
+
+/* Session ticket encryption keys shared by all the login processes. A new
+   key is generated every rotate_interval seconds. The previous key is still
+   used for decrypting tickets issued before the rotation. */
+struct ticket_keys *ticket_keys_init(unsigned int rotate_interval);
+void ticket_keys_deinit(struct ticket_keys **keys);
+
+/* Returns the current and previous keys hex-encoded and separated by TAB.
+   The keys are rotated first if needed. */
+const char *ticket_keys_get(struct ticket_keys *keys);
+
+#endif